@@ -0,0 +1,377 @@
+// © 2024 Alec Fessler
+// MIT License
+// See LICENSE file in the project root for full license information.
+
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <sstream>
+#include <string>
+#include <sys/resource.h>
+#include <time.h>
+#include <vector>
+
+#include "config.h"
+#include "videnc.h"
+extern "C" {
+#include "viddec.h"
+}
+
+/**
+ * Codec benchmark for the picam encoder and the server's software decoder
+ *
+ * Runs videnc (x264) and viddec's software H.264 path over deterministic
+ * synthetic sequences and sweeps presets, CRF, encoder threads and
+ * resolutions. For every combination it reports:
+ *
+ * - enc/dec fps: wall clock throughput
+ * - enc/dec fps/core: frames per second of consumed cpu time (user + sys),
+ *   which is what sizes a Pi core budget or a server's decoder threads
+ * - kbps: encoded bitrate at the configured fps
+ * - psnr_y / psnr: luma and combined PSNR of the decoded NV12 output
+ *   against the source, so quality is measured through the real decode path
+ *
+ * The sequences approximate what the rig records:
+ * - static: textured background, no motion
+ * - blobs:  static background with moving hand-like blobs (palm + fingers)
+ * - motion: the whole frame pans and changes every frame
+ *
+ * Nothing depends on a camera or GPU, so it runs on any Linux box.
+ */
+
+struct result {
+  double enc_fps;
+  double enc_fps_core;
+  double dec_fps;
+  double dec_fps_core;
+  double kbps;
+  double psnr_y;
+  double psnr;
+};
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t cpu_ns() {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ((uint64_t)ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ULL +
+         ((uint64_t)ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL;
+}
+
+static uint32_t lcg(uint32_t& state) {
+  state = state * 1664525u + 1013904223u;
+  return state >> 8;
+}
+
+static void render_background(std::vector<uint8_t>& bg, int width, int height, int shift) {
+  // blocky texture, deterministic for a given shift
+  for (int row = 0; row < height; row++) {
+    for (int col = 0; col < width; col++) {
+      uint32_t cell = (uint32_t)(((col + shift) / 16) * 7919 + (row / 16) * 104729);
+      uint32_t state = cell;
+      bg[row * width + col] = (uint8_t)(64 + lcg(state) % 96 + ((col + row) & 7));
+    }
+  }
+}
+
+static void draw_ellipse(uint8_t* y, int width, int height, int cx, int cy, int rx, int ry, uint8_t val) {
+  for (int row = cy - ry; row <= cy + ry; row++) {
+    if (row < 0 || row >= height)
+      continue;
+    for (int col = cx - rx; col <= cx + rx; col++) {
+      if (col < 0 || col >= width)
+        continue;
+      double dx = (double)(col - cx) / rx;
+      double dy = (double)(row - cy) / ry;
+      if (dx * dx + dy * dy <= 1.0)
+        y[row * width + col] = val;
+    }
+  }
+}
+
+static void render_sequence(
+  const std::string& kind,
+  int width,
+  int height,
+  int frames,
+  std::vector<uint8_t>& seq
+) {
+  /**
+   * Renders the whole sequence as YUV420P up front so generation
+   * cost never shows up in the encoder timing
+   */
+  size_t y_size = width * height;
+  size_t frame_bytes = y_size * 3 / 2;
+  seq.assign(frame_bytes * frames, 0);
+
+  std::vector<uint8_t> bg(y_size);
+  render_background(bg, width, height, 0);
+
+  for (int n = 0; n < frames; n++) {
+    uint8_t* y = seq.data() + n * frame_bytes;
+    uint8_t* u = y + y_size;
+    uint8_t* v = u + y_size / 4;
+
+    if (kind == "motion")
+      render_background(bg, width, height, n * 4);
+    memcpy(y, bg.data(), y_size);
+
+    if (kind == "blobs") {
+      for (int hand = 0; hand < 2; hand++) {
+        double t = n / 30.0 + hand * 1.7;
+        int cx = (int)(width * (0.3 + 0.4 * hand) + width * 0.1 * sin(t));
+        int cy = (int)(height * 0.5 + height * 0.15 * cos(t * 1.3));
+        int palm = height / 10;
+        draw_ellipse(y, width, height, cx, cy, palm, palm * 6 / 5, 200);
+        for (int finger = 0; finger < 5; finger++) {
+          double angle = -2.4 + finger * 0.4 + 0.3 * sin(t * 3 + finger);
+          int fx = cx + (int)(palm * 1.7 * cos(angle));
+          int fy = cy + (int)(palm * 1.7 * sin(angle));
+          draw_ellipse(y, width, height, fx, fy, palm / 4, palm / 2, 190);
+        }
+      }
+    }
+
+    memset(u, 128, y_size / 4);
+    memset(v, 128, y_size / 4);
+    if (kind == "motion") {
+      memset(u, 128 + (n % 32) - 16, y_size / 4);
+      memset(v, 128 - (n % 32) + 16, y_size / 4);
+    }
+  }
+}
+
+static double psnr(double mse) {
+  if (mse <= 0.0)
+    return 99.0;
+  return 10.0 * log10(255.0 * 255.0 / mse);
+}
+
+static void accumulate_error(
+  const uint8_t* src,
+  const uint8_t* nv12,
+  int width,
+  int height,
+  double& y_err,
+  double& c_err
+) {
+  size_t y_size = width * height;
+  for (size_t i = 0; i < y_size; i++) {
+    double d = (double)src[i] - nv12[i];
+    y_err += d * d;
+  }
+
+  const uint8_t* u = src + y_size;
+  const uint8_t* v = u + y_size / 4;
+  const uint8_t* uv = nv12 + y_size;
+  for (size_t i = 0; i < y_size / 4; i++) {
+    double du = (double)u[i] - uv[i * 2];
+    double dv = (double)v[i] - uv[i * 2 + 1];
+    c_err += du * du + dv * dv;
+  }
+}
+
+static result run(
+  const std::string& kind,
+  const std::vector<uint8_t>& seq,
+  int frames,
+  config& conf
+) {
+  result res;
+  int width = conf.frame_width;
+  int height = conf.frame_height;
+  size_t frame_bytes = width * height * 3 / 2;
+
+  // encode, keeping every packet for the decode pass
+  std::vector<std::vector<uint8_t>> pkts;
+  pkts.reserve(frames);
+  {
+    videnc encoder(conf);
+    uint64_t wall = now_ns();
+    uint64_t cpu = cpu_ns();
+
+    int pkt_size = 0;
+    uint8_t* pkt;
+    for (int i = 0; i < frames; i++) {
+      encoder.encode_frame(const_cast<uint8_t*>(seq.data() + i * frame_bytes));
+      while ((pkt = encoder.recv_frame(pkt_size)) != nullptr)
+        pkts.emplace_back(pkt, pkt + pkt_size);
+    }
+    encoder.flush();
+    while ((pkt = encoder.recv_frame(pkt_size)) != nullptr)
+      pkts.emplace_back(pkt, pkt + pkt_size);
+
+    res.enc_fps = frames * 1e9 / (now_ns() - wall);
+    res.enc_fps_core = frames * 1e9 / (cpu_ns() - cpu);
+  }
+
+  size_t total_bytes = 0;
+  for (const auto& p : pkts)
+    total_bytes += p.size();
+  res.kbps = total_bytes * 8.0 * conf.fps / frames / 1000.0;
+
+  // decode through the server's software path into NV12
+  decoder dec;
+  if (init_sw_decoder(&dec, width, height, 1) < 0) {
+    fprintf(stderr, "Failed to initialize software decoder\n");
+    exit(EXIT_FAILURE);
+  }
+
+  std::vector<uint8_t> out(frame_bytes);
+  double y_err = 0.0;
+  double c_err = 0.0;
+  int decoded = 0;
+
+  uint64_t wall = now_ns();
+  uint64_t cpu = cpu_ns();
+  auto drain = [&]() {
+    while (recv_frame(&dec, out.data()) == 0) {
+      if (decoded < frames)
+        accumulate_error(seq.data() + decoded * frame_bytes, out.data(), width, height, y_err, c_err);
+      decoded++;
+    }
+  };
+  uint64_t metric_ns = 0;
+  for (auto& p : pkts) {
+    decode_packet(&dec, p.data(), p.size());
+    uint64_t t0 = now_ns();
+    drain();
+    metric_ns += now_ns() - t0; // PSNR isn't decode time, subtract it
+  }
+  flush_decoder(&dec);
+  drain();
+  uint64_t dec_wall = now_ns() - wall;
+  uint64_t dec_cpu = cpu_ns() - cpu;
+  cleanup_decoder(&dec);
+
+  // the metric loop is single threaded, so it costs equally in wall and cpu time
+  res.dec_fps = decoded * 1e9 / (dec_wall > metric_ns ? dec_wall - metric_ns : 1);
+  res.dec_fps_core = decoded * 1e9 / (dec_cpu > metric_ns ? dec_cpu - metric_ns : 1);
+
+  int compared = decoded < frames ? decoded : frames;
+  size_t y_size = (size_t)width * height;
+  double y_mse = y_err / ((double)y_size * compared);
+  double all_mse = (y_err + c_err) / ((double)y_size * 3 / 2 * compared);
+  res.psnr_y = psnr(y_mse);
+  res.psnr = psnr(all_mse);
+
+  if (decoded != frames)
+    fprintf(stderr, "%s: decoded %d of %d frames\n", kind.c_str(), decoded, frames);
+
+  return res;
+}
+
+static std::vector<std::string> split(const std::string& list) {
+  std::vector<std::string> out;
+  std::stringstream ss(list);
+  std::string item;
+  while (std::getline(ss, item, ','))
+    if (!item.empty())
+      out.push_back(item);
+  return out;
+}
+
+int main(int argc, char** argv) {
+  int frames = 150;
+  int fps = 30;
+  std::string seqs = "static,blobs,motion";
+  std::string presets = "ultrafast,superfast,veryfast,medium";
+  std::string crfs = "23";
+  std::string threads = "1,3";
+  std::string resolutions = "1280x720";
+
+  static struct option long_opts[] = {
+    {"frames", required_argument, nullptr, 'n'},
+    {"fps", required_argument, nullptr, 'f'},
+    {"seqs", required_argument, nullptr, 's'},
+    {"presets", required_argument, nullptr, 'p'},
+    {"crfs", required_argument, nullptr, 'q'},
+    {"threads", required_argument, nullptr, 't'},
+    {"resolutions", required_argument, nullptr, 'r'},
+    {nullptr, 0, nullptr, 0}
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "n:f:s:p:q:t:r:", long_opts, nullptr)) != -1) {
+    switch (opt) {
+      case 'n': frames = std::stoi(optarg); break;
+      case 'f': fps = std::stoi(optarg); break;
+      case 's': seqs = optarg; break;
+      case 'p': presets = optarg; break;
+      case 'q': crfs = optarg; break;
+      case 't': threads = optarg; break;
+      case 'r': resolutions = optarg; break;
+      default:
+        fprintf(
+          stderr,
+          "usage: %s [--frames N] [--fps F] [--seqs static,blobs,motion] "
+          "[--presets LIST] [--crfs LIST] [--threads LIST] [--resolutions WxH,...]\n",
+          argv[0]
+        );
+        return EXIT_FAILURE;
+    }
+  }
+
+  printf(
+    "%-7s %-10s %-10s %4s %3s %9s %9s %9s %9s %9s %7s %7s\n",
+    "seq", "res", "preset", "crf", "thr",
+    "enc_fps", "enc/core", "dec_fps", "dec/core", "kbps", "psnr_y", "psnr"
+  );
+
+  for (const std::string& res_str : split(resolutions)) {
+    config conf;
+    size_t x = res_str.find('x');
+    if (x == std::string::npos) {
+      fprintf(stderr, "Invalid resolution %s\n", res_str.c_str());
+      return EXIT_FAILURE;
+    }
+    conf.frame_width = std::stoi(res_str.substr(0, x));
+    conf.frame_height = std::stoi(res_str.substr(x + 1));
+    conf.fps = fps;
+    conf.recording_cpu = -1; // nothing to keep clear, encoder may use every core
+    conf.enc_cpus = "auto";
+
+    for (const std::string& kind : split(seqs)) {
+      std::vector<uint8_t> seq;
+      render_sequence(kind, conf.frame_width, conf.frame_height, frames, seq);
+
+      for (const std::string& preset : split(presets)) {
+        for (const std::string& crf : split(crfs)) {
+          for (const std::string& thr : split(threads)) {
+            conf.enc_speed = preset;
+            conf.enc_quality = crf;
+            conf.enc_threads = std::stoi(thr);
+
+            result r = run(kind, seq, frames, conf);
+            printf(
+              "%-7s %-10s %-10s %4s %3s %9.1f %9.1f %9.1f %9.1f %9.0f %7.2f %7.2f\n",
+              kind.c_str(),
+              res_str.c_str(),
+              preset.c_str(),
+              crf.c_str(),
+              thr.c_str(),
+              r.enc_fps,
+              r.enc_fps_core,
+              r.dec_fps,
+              r.dec_fps_core,
+              r.kbps,
+              r.psnr_y,
+              r.psnr
+            );
+            fflush(stdout);
+          }
+        }
+      }
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,205 @@
+// © 2024 Alec Fessler
+// MIT License
+// See LICENSE file in the project root for full license information.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <getopt.h>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <string>
+#include <time.h>
+#include <vector>
+
+#include "nv12_convert.h"
+
+/**
+ * NV12 conversion benchmark, toolkit kernels against cv::cvtColor
+ *
+ * Converts a synthetic frameset (every camera a different frame) to
+ * each target at full and half resolution and reports the time per
+ * frameset for:
+ *
+ * - nv12:        nv12_convert, one camera after another
+ * - nv12_par:    nv12_convert_frameset, cameras in parallel
+ * - opencv:      the equivalent cvtColor (+ resize INTER_AREA for half,
+ *                + convertTo and split for planar float), per camera
+ * - cv_par:      the same, cameras in parallel
+ *
+ * max_diff is the largest per channel difference of the 8 bit output
+ * against OpenCV's (for planar float, scaled back to levels), so the
+ * speedup is never bought with a different answer.
+ */
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void render_nv12(cv::Mat& frame, int width, int height, uint32_t seed) {
+  // gradients plus noise so no two cameras or rows convert alike
+  frame.create(height * 3 / 2, width, CV_8UC1);
+  uint32_t state = seed;
+  for (int row = 0; row < height * 3 / 2; row++) {
+    uint8_t* p = frame.ptr<uint8_t>(row);
+    for (int col = 0; col < width; col++) {
+      state = state * 1664525u + 1013904223u;
+      p[col] = (uint8_t)((row + col + seed * 37) / 4 + (state >> 28));
+    }
+  }
+}
+
+static void opencv_convert(const cv::Mat& src, cv::Mat& dst, nv12_target target, bool half) {
+  cv::Mat full;
+  switch (target) {
+    case nv12_target::BGR:
+      cv::cvtColor(src, full, cv::COLOR_YUV2BGR_NV12);
+      break;
+    case nv12_target::RGB_PLANAR:
+      cv::cvtColor(src, full, cv::COLOR_YUV2RGB_NV12);
+      break;
+    case nv12_target::GRAY:
+      cv::cvtColor(src, full, cv::COLOR_YUV2GRAY_NV12);
+      break;
+  }
+
+  cv::Mat scaled = full;
+  if (half)
+    cv::resize(full, scaled, cv::Size(full.cols / 2, full.rows / 2), 0, 0, cv::INTER_AREA);
+
+  if (target != nv12_target::RGB_PLANAR) {
+    dst = scaled;
+    return;
+  }
+
+  cv::Mat normalized;
+  scaled.convertTo(normalized, CV_32F, 1.0 / 255.0);
+  dst.create(scaled.rows * 3, scaled.cols, CV_32FC1);
+  std::vector<cv::Mat> planes;
+  for (int c = 0; c < 3; c++)
+    planes.push_back(dst.rowRange(c * scaled.rows, (c + 1) * scaled.rows));
+  cv::split(normalized, planes);
+}
+
+static double max_diff(const cv::Mat& ours, const cv::Mat& ref) {
+  cv::Mat a = ours;
+  cv::Mat b = ref;
+  if (ours.depth() == CV_32F) {
+    ours.convertTo(a, CV_32F, 255.0);
+    ref.convertTo(b, CV_32F, 255.0);
+  }
+  return cv::norm(a, b, cv::NORM_INF);
+}
+
+template <typename F>
+static double time_ms(int iters, F fn) {
+  fn(); // warm up, and let dst Mats reach their steady state size
+  uint64_t start = now_ns();
+  for (int i = 0; i < iters; i++)
+    fn();
+  return (now_ns() - start) / 1e6 / iters;
+}
+
+int main(int argc, char** argv) {
+  int cams = 8;
+  int width = 1280;
+  int height = 720;
+  int iters = 50;
+
+  static struct option long_opts[] = {
+    {"cams", required_argument, nullptr, 'c'},
+    {"res", required_argument, nullptr, 'r'},
+    {"iters", required_argument, nullptr, 'n'},
+    {nullptr, 0, nullptr, 0}
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "c:r:n:", long_opts, nullptr)) != -1) {
+    switch (opt) {
+      case 'c': cams = std::stoi(optarg); break;
+      case 'r':
+        if (sscanf(optarg, "%dx%d", &width, &height) != 2) {
+          fprintf(stderr, "Invalid resolution %s\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'n': iters = std::stoi(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [--cams N] [--res WxH] [--iters N]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+
+  std::vector<cv::Mat> frames(cams);
+  for (int i = 0; i < cams; i++)
+    render_nv12(frames[i], width, height, i + 1);
+
+  printf(
+    "kernels: %s, opencv threads: %d, %d x %dx%d, ms per frameset\n",
+    nv12_kernel_isa(),
+    cv::getNumThreads(),
+    cams,
+    width,
+    height
+  );
+  printf(
+    "%-10s %-4s %9s %9s %9s %9s %8s %8s\n",
+    "target", "res", "nv12", "nv12_par", "opencv", "cv_par", "speedup", "max_diff"
+  );
+
+  struct {
+    nv12_target target;
+    const char* name;
+  } targets[] = {
+    {nv12_target::BGR, "bgr"},
+    {nv12_target::RGB_PLANAR, "rgb_f32"},
+    {nv12_target::GRAY, "gray"}
+  };
+
+  for (const auto& t : targets) {
+    for (bool half : {false, true}) {
+      std::vector<cv::Mat> ours(cams);
+      std::vector<cv::Mat> ref(cams);
+
+      double serial = time_ms(iters, [&]() {
+        for (int i = 0; i < cams; i++)
+          nv12_convert(frames[i], ours[i], t.target, half);
+      });
+      double parallel = time_ms(iters, [&]() {
+        nv12_convert_frameset(frames.data(), ours.data(), cams, t.target, half);
+      });
+      double cv_serial = time_ms(iters, [&]() {
+        for (int i = 0; i < cams; i++)
+          opencv_convert(frames[i], ref[i], t.target, half);
+      });
+      double cv_parallel = time_ms(iters, [&]() {
+        cv::parallel_for_(cv::Range(0, cams), [&](const cv::Range& range) {
+          for (int i = range.start; i < range.end; i++)
+            opencv_convert(frames[i], ref[i], t.target, half);
+        });
+      });
+
+      double diff = 0;
+      for (int i = 0; i < cams; i++)
+        diff = std::max(diff, max_diff(ours[i], ref[i]));
+
+      printf(
+        "%-10s %-4s %9.3f %9.3f %9.3f %9.3f %7.2fx %8.0f\n",
+        t.name,
+        half ? "1/2" : "1",
+        serial,
+        parallel,
+        cv_serial,
+        cv_parallel,
+        cv_parallel / parallel,
+        diff
+      );
+      fflush(stdout);
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,207 @@
+// © 2024 Alec Fessler
+// MIT License
+// See LICENSE file in the project root for full license information.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <sched.h>
+#include <string>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "config.h"
+#include "logging.h"
+#include "videnc.h"
+
+/**
+ * Encoder headroom benchmark for the picam
+ *
+ * Encodes a deterministic synthetic sequence with videnc for every
+ * preset, once with the whole encoder on the recording cpu (the old
+ * behaviour, a single x264 thread sharing the core with timing) and
+ * once with slice workers on ENC_CPUS. The calling thread is pinned
+ * to the recording cpu, exactly like framecap's main loop, so the
+ * numbers reflect what the capture loop actually pays per frame.
+ *
+ * Budget is the share of the frame interval spent inside
+ * encode_frame()/recv_frame(), anything under 100% is headroom.
+ */
+
+static const char* presets[] = {
+  "ultrafast",
+  "superfast",
+  "veryfast",
+  "faster",
+  "fast",
+  "medium"
+};
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void fill_frame(uint8_t* buf, int width, int height, int n) {
+  /**
+   * Renders frame n of a moving gradient with a sliding bright square,
+   * enough motion that x264 can't skip every macroblock
+   */
+  uint8_t* y = buf;
+  uint8_t* u = buf + width * height;
+  uint8_t* v = u + width * height / 4;
+
+  for (int row = 0; row < height; row++)
+    for (int col = 0; col < width; col++)
+      y[row * width + col] = (uint8_t)(col + row + n * 3);
+
+  int sq = height / 4;
+  int sx = (n * 7) % (width - sq);
+  int sy = (n * 5) % (height - sq);
+  for (int row = sy; row < sy + sq; row++)
+    memset(y + row * width + sx, 235, sq);
+
+  memset(u, 128 + (n % 16), width * height / 4);
+  memset(v, 128 - (n % 16), width * height / 4);
+}
+
+int main(int argc, char** argv) {
+  config conf;
+  conf.frame_width = 1280;
+  conf.frame_height = 720;
+  conf.fps = 30;
+  conf.recording_cpu = 3;
+  conf.enc_quality = "23";
+  conf.enc_cpus = "auto";
+  int spread_threads = 3;
+  int frames = 300;
+  bool realtime = false;
+
+  static struct option long_opts[] = {
+    {"frames", required_argument, nullptr, 'n'},
+    {"width", required_argument, nullptr, 'w'},
+    {"height", required_argument, nullptr, 'h'},
+    {"fps", required_argument, nullptr, 'f'},
+    {"recording-cpu", required_argument, nullptr, 'r'},
+    {"enc-cpus", required_argument, nullptr, 'c'},
+    {"threads", required_argument, nullptr, 't'},
+    {"crf", required_argument, nullptr, 'q'},
+    {"rt", no_argument, nullptr, 'R'},
+    {nullptr, 0, nullptr, 0}
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "n:w:h:f:r:c:t:q:R", long_opts, nullptr)) != -1) {
+    switch (opt) {
+      case 'n': frames = std::stoi(optarg); break;
+      case 'w': conf.frame_width = std::stoi(optarg); break;
+      case 'h': conf.frame_height = std::stoi(optarg); break;
+      case 'f': conf.fps = std::stoi(optarg); break;
+      case 'r': conf.recording_cpu = std::stoi(optarg); break;
+      case 'c': conf.enc_cpus = optarg; break;
+      case 't': spread_threads = std::stoi(optarg); break;
+      case 'q': conf.enc_quality = optarg; break;
+      case 'R': realtime = true; break;
+      default:
+        fprintf(
+          stderr,
+          "usage: %s [--frames N] [--width W] [--height H] [--fps F] "
+          "[--recording-cpu C] [--enc-cpus LIST] [--threads T] [--crf Q] [--rt]\n",
+          argv[0]
+        );
+        return EXIT_FAILURE;
+    }
+  }
+
+  long online = sysconf(_SC_NPROCESSORS_ONLN);
+  if (conf.recording_cpu >= online) {
+    fprintf(stderr, "recording cpu %d is not online, using %ld\n", conf.recording_cpu, online - 1);
+    conf.recording_cpu = online - 1;
+  }
+
+  cpu_set_t cpuset;
+  CPU_ZERO(&cpuset);
+  CPU_SET(conf.recording_cpu, &cpuset);
+  if (sched_setaffinity(0, sizeof(cpuset), &cpuset) < 0) {
+    fprintf(stderr, "Failed to pin to recording cpu: %s\n", strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  if (realtime) {
+    struct sched_param param;
+    param.sched_priority = sched_get_priority_max(SCHED_FIFO);
+    if (sched_setscheduler(0, SCHED_FIFO, &param) < 0) {
+      fprintf(stderr, "Failed to set SCHED_FIFO: %s\n", strerror(errno));
+      return EXIT_FAILURE;
+    }
+  }
+
+  size_t frame_bytes = conf.frame_width * conf.frame_height * 3 / 2;
+  std::vector<uint8_t> seq((size_t)frames * frame_bytes);
+  for (int i = 0; i < frames; i++)
+    fill_frame(seq.data() + i * frame_bytes, conf.frame_width, conf.frame_height, i);
+
+  double budget_ns = 1e9 / conf.fps;
+
+  printf(
+    "%-10s %-10s %7s %9s %9s %9s %8s\n",
+    "preset", "placement", "threads", "fps", "mean_ms", "p99_ms", "budget"
+  );
+
+  struct placement {
+    const char* name;
+    int threads;
+  } placements[] = {
+    {"rt-core", 1},
+    {"spread", spread_threads}
+  };
+
+  for (const char* preset : presets) {
+    for (const placement& p : placements) {
+      conf.enc_speed = preset;
+      conf.enc_threads = p.threads;
+
+      videnc encoder(conf);
+      std::vector<uint64_t> lat(frames);
+
+      uint64_t start = now_ns();
+      for (int i = 0; i < frames; i++) {
+        uint64_t t0 = now_ns();
+        encoder.encode_frame(seq.data() + i * frame_bytes);
+        int pkt_size = 0;
+        while (encoder.recv_frame(pkt_size) != nullptr);
+        lat[i] = now_ns() - t0;
+      }
+      encoder.flush();
+      int pkt_size = 0;
+      while (encoder.recv_frame(pkt_size) != nullptr);
+      uint64_t elapsed = now_ns() - start;
+
+      uint64_t total = 0;
+      for (uint64_t l : lat)
+        total += l;
+      std::sort(lat.begin(), lat.end());
+      double mean_ns = (double)total / frames;
+      double p99_ns = (double)lat[std::min(lat.size() - 1, (size_t)(frames * 0.99))];
+
+      printf(
+        "%-10s %-10s %7d %9.1f %9.2f %9.2f %7.1f%%\n",
+        preset,
+        p.name,
+        p.threads,
+        frames * 1e9 / elapsed,
+        mean_ns / 1e6,
+        p99_ns / 1e6,
+        mean_ns / budget_ns * 100.0
+      );
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,938 @@
+// © 2024 Alec Fessler
+// MIT License
+// See LICENSE file in the project root for full license information.
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <getopt.h>
+#include <memory>
+#include <mutex>
+#include <opencv2/core.hpp>
+#include <semaphore.h>
+#include <sstream>
+#include <string>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "config.h"
+#include "connection.h"
+#include "server_metrics.h"
+#include "stream_controller.h"
+#include "videnc.h"
+
+/**
+ * Full pipeline scaling benchmark
+ *
+ * Runs N simulated cameras over loopback against mocap-toolkit-server and
+ * consumes the framesets through StreamController, exactly as the toolkit
+ * does. For each camera count it emits one JSON object per line:
+ *
+ * - frameset_fps / drop_rate: framesets delivered to the consumer during
+ *   the measurement window, against the fps * seconds that were captured
+ * - latency_ms: percentiles per stage, keyed by the capture timestamp
+ *     send:   capture timestamp -> packet fully written by the camera
+ *     server: last camera's packet written -> frameset in consumer hands
+ *             (decode, assembly, shm copy and the consumer handoff)
+ *     e2e:    capture timestamp -> frameset in consumer hands
+ * - server_cpu_pct_per_cam: server cpu time over the window / N
+ * - bench_cpu_pct: cpu used by the simulated cameras and the consumer,
+ *   to spot when the bench itself is the bottleneck
+ * - server_rss_kb / server_hwm_kb: server memory footprint
+ *
+ * The simulated cameras are picam's own connection class streaming a loop
+ * of packets pre-encoded with picam's videnc, so the wire format and the
+ * decode cost match the real rig. The server receives a generated cams.yaml
+ * pointing every camera at 127.0.0.1; all cameras share one control port,
+ * which the server's broadcast dedup turns into a single timestamp/STOP
+ * message for this process.
+ *
+ * With --prefetch gray|bgr|rgb_f32 (and --half) the consumer takes
+ * framesets from StreamController's prefetch thread instead, already
+ * converted, so e2e includes the conversion and prefetch_drops counts
+ * converted framesets the consumer never took.
+ *
+ * Soak mode (--soak MINUTES) instead runs the first camera count for a
+ * long session and emits one JSON sample per --sample-secs with server RSS,
+ * latency percentiles and the server's published metrics (frame buffer pool
+ * occupancy, assembly queue depths, timestamp queue depth and capacity).
+ * At the end it fits a per-hour trend to each series and exits non-zero if
+ * any trend exceeds its threshold, which is how slow leaks and unbounded
+ * queue growth that only show up after hours get caught.
+ *
+ * Requires mocap-toolkit-server installed at SERVER_EXE and a writable
+ * /var/log/mocap-toolkit/ for its log.
+ */
+
+static constexpr int FRAME_WIDTH = 1280;  // DECODED_FRAME_WIDTH on the server
+static constexpr int FRAME_HEIGHT = 720;  // DECODED_FRAME_HEIGHT on the server
+static constexpr uint32_t MAX_PKT_SIZE = 6400; // ENCODED_FRAME_BUF_SIZE on the server
+static constexpr int LOOP_FRAMES = 60;
+static constexpr int CONNECT_TIMEOUT = 10; // seconds, the server's accept timeout
+static constexpr int START_TIMEOUT = 15;   // seconds to wait for the timestamp broadcast
+static constexpr int SEND_RING_SECONDS = 8; // send times are kept this long for the server stage
+
+struct encoded_pkt {
+  std::vector<uint8_t> data;
+  frame_stats stats;
+};
+
+struct bench_opts {
+  std::vector<int> cam_counts;
+  int seconds;
+  int warmup;
+  int fps;
+  int tcp_port;
+  int udp_port;
+  std::string preset;
+  std::string crf;
+  std::string conf_path;
+  std::string prefetch; // conversion run by the prefetch thread, empty to lease raw framesets
+  bool half;
+  int soak_minutes;
+  int sample_secs;
+  double max_rss_slope;      // kB per hour
+  double max_p99_slope;      // ms per hour
+  double max_ts_queue_slope; // timestamps per hour
+  double max_pool_slope;     // frame buffers per hour
+};
+
+struct run_state {
+  int cam_count;
+  uint64_t interval_ns;
+  uint64_t slots; // send time ring size per camera, in frames
+  std::atomic<uint64_t> start_ts;
+  std::atomic<bool> stop;
+  std::atomic<int> failed;
+  // send completion time per camera, realtime ns, ring indexed by frame number
+  std::vector<std::unique_ptr<std::atomic<uint64_t>[]>> sent_ns;
+};
+
+static uint64_t real_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until_real(uint64_t target_ns) {
+  struct timespec ts = {
+    .tv_sec = (time_t)(target_ns / 1000000000ULL),
+    .tv_nsec = (long)(target_ns % 1000000000ULL)
+  };
+  while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &ts, nullptr) == EINTR);
+}
+
+static uint64_t self_cpu_ns() {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ((uint64_t)ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ULL +
+         ((uint64_t)ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL;
+}
+
+static uint64_t proc_cpu_ns(pid_t pid) {
+  /**
+   * Reads utime + stime for every thread of a process from /proc/<pid>/stat
+   *
+   * Returns:
+   *   Consumed cpu time in ns, or 0 if the process is gone
+   */
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  FILE* f = fopen(path, "r");
+  if (!f)
+    return 0;
+
+  char buf[1024];
+  size_t len = fread(buf, 1, sizeof(buf) - 1, f);
+  fclose(f);
+  buf[len] = '\0';
+
+  // comm may contain spaces, fields are counted from the closing paren
+  char* p = strrchr(buf, ')');
+  if (!p)
+    return 0;
+
+  unsigned long utime = 0;
+  unsigned long stime = 0;
+  int field = 2;
+  for (char* tok = strtok(p + 1, " "); tok; tok = strtok(nullptr, " ")) {
+    field++;
+    if (field == 14)
+      utime = strtoul(tok, nullptr, 10);
+    else if (field == 15) {
+      stime = strtoul(tok, nullptr, 10);
+      break;
+    }
+  }
+
+  return (uint64_t)(utime + stime) * 1000000000ULL / sysconf(_SC_CLK_TCK);
+}
+
+static long proc_status_kb(pid_t pid, const char* key) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/status", pid);
+  FILE* f = fopen(path, "r");
+  if (!f)
+    return -1;
+
+  char line[256];
+  long val = -1;
+  size_t key_len = strlen(key);
+  while (fgets(line, sizeof(line), f)) {
+    if (strncmp(line, key, key_len) == 0 && line[key_len] == ':') {
+      val = strtol(line + key_len + 1, nullptr, 10);
+      break;
+    }
+  }
+  fclose(f);
+  return val;
+}
+
+static void render_frame(std::vector<uint8_t>& frame, int n) {
+  /**
+   * Dark background with two moving bright blobs. Kept low in detail so
+   * every packet, keyframes included, fits the server's encoded frame buffer
+   */
+  size_t y_size = FRAME_WIDTH * FRAME_HEIGHT;
+  frame.assign(y_size * 3 / 2, 128);
+  memset(frame.data(), 16, y_size);
+
+  for (int blob = 0; blob < 2; blob++) {
+    int cx = FRAME_WIDTH / 4 + blob * FRAME_WIDTH / 2 + (n * 6 % 160) - 80;
+    int cy = FRAME_HEIGHT / 2 + (blob ? 1 : -1) * ((n * 4 % 120) - 60);
+    int r = FRAME_HEIGHT / 12;
+    for (int row = cy - r; row <= cy + r; row++) {
+      for (int col = cx - r; col <= cx + r; col++) {
+        if (row < 0 || row >= FRAME_HEIGHT || col < 0 || col >= FRAME_WIDTH)
+          continue;
+        if ((row - cy) * (row - cy) + (col - cx) * (col - cx) <= r * r)
+          frame[row * FRAME_WIDTH + col] = 220;
+      }
+    }
+  }
+}
+
+static std::vector<encoded_pkt> encode_loop(const bench_opts& opts) {
+  config conf;
+  conf.frame_width = FRAME_WIDTH;
+  conf.frame_height = FRAME_HEIGHT;
+  conf.fps = opts.fps;
+  conf.enc_speed = opts.preset;
+  conf.enc_quality = opts.crf;
+  conf.enc_threads = 0; // let x264 decide, this is setup not measurement
+  conf.enc_cpus = "auto";
+  conf.recording_cpu = -1;
+
+  videnc encoder(conf);
+  std::vector<encoded_pkt> pkts;
+  std::vector<uint8_t> frame;
+
+  auto drain = [&]() {
+    int size = 0;
+    frame_stats stats;
+    uint8_t* data;
+    while ((data = encoder.recv_frame(size, &stats)) != nullptr)
+      pkts.push_back({std::vector<uint8_t>(data, data + size), stats});
+  };
+
+  for (int n = 0; n < LOOP_FRAMES; n++) {
+    render_frame(frame, n);
+    encoder.encode_frame(frame.data());
+    drain();
+  }
+  encoder.flush();
+  drain();
+
+  for (const auto& pkt : pkts) {
+    if (pkt.data.size() > MAX_PKT_SIZE) {
+      fprintf(
+        stderr,
+        "Encoded packet of %zu bytes exceeds the server's %u byte buffer, raise --crf\n",
+        pkt.data.size(),
+        MAX_PKT_SIZE
+      );
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  return pkts;
+}
+
+static int write_cams_yaml(const bench_opts& opts, int cam_count) {
+  FILE* f = fopen(opts.conf_path.c_str(), "w");
+  if (!f) {
+    fprintf(stderr, "Failed to write %s: %s\n", opts.conf_path.c_str(), strerror(errno));
+    return -errno;
+  }
+
+  fprintf(f, "cameras:\n");
+  for (int i = 0; i < cam_count; i++) {
+    fprintf(
+      f,
+      "  - name: rpicam%02d\n"
+      "    id: %d\n"
+      "    eth_ip: 127.0.0.1\n"
+      "    wifi_ip: 127.0.0.1\n"
+      "    tcp_port: %d\n"
+      "    udp_port: %d\n",
+      i,
+      i,
+      opts.tcp_port + i,
+      opts.udp_port
+    );
+  }
+
+  fclose(f);
+  return 0;
+}
+
+static void camera_fn(
+  run_state& state,
+  const std::vector<encoded_pkt>& pkts,
+  const bench_opts& opts,
+  int idx
+) {
+  config conf;
+  conf.server_ip = "127.0.0.1";
+  conf.tcp_port = std::to_string(opts.tcp_port + idx);
+  conf.udp_port = std::to_string(opts.udp_port);
+  connection conn(conf);
+
+  // the server only listens once its stream thread is up
+  uint64_t deadline = real_ns() + CONNECT_TIMEOUT * 1000000000ULL;
+  while (conn.conn_tcp() < 0) {
+    conn.discon_tcp();
+    if (real_ns() > deadline || state.stop) {
+      fprintf(stderr, "Camera %d failed to connect\n", idx);
+      state.failed++;
+      return;
+    }
+    usleep(10000);
+  }
+
+  while (state.start_ts == 0 && !state.stop)
+    usleep(1000);
+
+  for (uint64_t k = 0; !state.stop; k++) {
+    uint64_t ts = state.start_ts + k * state.interval_ns;
+    sleep_until_real(ts);
+    if (state.stop)
+      break;
+
+    const encoded_pkt& pkt = pkts[k % pkts.size()];
+    conn.frame_timestamps.push(ts);
+    if (conn.stream_pkt(pkt.data.data(), pkt.data.size(), pkt.stats) < 0) {
+      fprintf(stderr, "Camera %d lost its connection\n", idx);
+      state.failed++;
+      return;
+    }
+
+    state.sent_ns[idx][k % state.slots].store(real_ns(), std::memory_order_relaxed);
+  }
+
+  conn.end_stream();
+}
+
+struct latencies {
+  std::mutex lock; // soak samples swap the vectors out while the consumer runs
+  std::vector<double> send;
+  std::vector<double> server;
+  std::vector<double> e2e;
+};
+
+static bool parse_target(const std::string& name, nv12_target& target) {
+  if (name == "gray")
+    target = nv12_target::GRAY;
+  else if (name == "bgr")
+    target = nv12_target::BGR;
+  else if (name == "rgb_f32")
+    target = nv12_target::RGB_PLANAR;
+  else
+    return false;
+  return true;
+}
+
+static void consumer_fn(
+  run_state& state,
+  StreamController& controller,
+  bool prefetch,
+  uint64_t window_start,
+  uint64_t window_end,
+  std::atomic<uint64_t>& delivered,
+  latencies& lat
+) {
+  uint64_t ring_ns = state.slots * state.interval_ns;
+
+  while (!state.stop) {
+    uint64_t ts = 0;
+    uint64_t now = 0;
+
+    if (prefetch) {
+      const cv::Mat* frames = controller.recv_prefetched(&ts);
+      now = real_ns();
+      if (state.stop || !frames)
+        break;
+    } else {
+      // only timestamps are needed, so lease the slot instead of copying frames out
+      FramesetLease lease = controller.acquire_frameset();
+      now = real_ns();
+      if (state.stop)
+        break;
+      if (!lease)
+        continue;
+
+      ts = lease.timestamp();
+    }
+
+    if (ts < window_start || ts >= window_end)
+      continue;
+
+    delivered++;
+    std::lock_guard<std::mutex> guard(lat.lock);
+    lat.e2e.push_back((now - ts) / 1e6);
+
+    uint64_t k = (ts - state.start_ts) / state.interval_ns;
+    uint64_t last_sent = 0;
+    for (int i = 0; i < state.cam_count; i++) {
+      uint64_t sent = state.sent_ns[i][k % state.slots].load(std::memory_order_relaxed);
+      if (sent < ts || sent - ts >= ring_ns) { // not sent yet, or a later frame's slot
+        last_sent = 0;
+        break;
+      }
+      lat.send.push_back((sent - ts) / 1e6);
+      last_sent = std::max(last_sent, sent);
+    }
+    if (last_sent && now > last_sent)
+      lat.server.push_back((now - last_sent) / 1e6);
+  }
+}
+
+static void print_percentiles(const char* name, std::vector<double>& v, bool last) {
+  std::sort(v.begin(), v.end());
+  auto pct = [&](double p) {
+    return v.empty() ? 0.0 : v[std::min(v.size() - 1, (size_t)(p * v.size()))];
+  };
+  printf(
+    "\"%s\":{\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f}%s",
+    name,
+    pct(0.50),
+    pct(0.90),
+    pct(0.99),
+    v.empty() ? 0.0 : v.back(),
+    last ? "" : ","
+  );
+}
+
+static double percentile(std::vector<double>& v, double p) {
+  // v must be sorted
+  return v.empty() ? 0.0 : v[std::min(v.size() - 1, (size_t)(p * v.size()))];
+}
+
+static double slope_per_hour(const std::vector<double>& t_s, const std::vector<double>& y) {
+  /**
+   * Least squares slope of y over time, scaled to units per hour
+   */
+  size_t n = t_s.size();
+  double mean_t = 0.0;
+  double mean_y = 0.0;
+  for (size_t i = 0; i < n; i++) {
+    mean_t += t_s[i] / n;
+    mean_y += y[i] / n;
+  }
+
+  double cov = 0.0;
+  double var = 0.0;
+  for (size_t i = 0; i < n; i++) {
+    cov += (t_s[i] - mean_t) * (y[i] - mean_y);
+    var += (t_s[i] - mean_t) * (t_s[i] - mean_t);
+  }
+
+  return var > 0.0 ? cov / var * 3600.0 : 0.0;
+}
+
+static const server_metrics* map_metrics(int cam_count, size_t& size) {
+  /**
+   * Maps the server's metrics segment read only, waiting for the
+   * server to create it and publish a header for this camera count
+   */
+  size = sizeof(server_metrics) + cam_count * sizeof(cam_metrics);
+  uint64_t deadline = real_ns() + START_TIMEOUT * 1000000000ULL;
+
+  while (real_ns() < deadline) {
+    int fd = shm_open(METRICS_SHM_NAME, O_RDONLY, 0);
+    if (fd >= 0) {
+      struct stat st;
+      void* buf = MAP_FAILED;
+      if (fstat(fd, &st) == 0 && (size_t)st.st_size >= size)
+        buf = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+      close(fd);
+
+      if (buf != MAP_FAILED) {
+        auto metrics = static_cast<const server_metrics*>(buf);
+        if (__atomic_load_n(&metrics->version, __ATOMIC_ACQUIRE) == METRICS_VERSION &&
+            metrics->cam_count == (uint32_t)cam_count)
+          return metrics;
+        munmap(buf, size);
+      }
+    }
+    usleep(100000);
+  }
+
+  return nullptr;
+}
+
+struct soak_series {
+  std::vector<double> t_s;
+  std::vector<double> rss_kb;
+  std::vector<double> p99_ms;
+  std::vector<double> ts_queue;
+  std::vector<double> pool_in_use;
+};
+
+static void soak_sample(
+  int sample,
+  double t_s,
+  double interval_s,
+  int cam_count,
+  pid_t server,
+  const server_metrics* metrics,
+  uint64_t framesets,
+  uint64_t server_cpu,
+  latencies& lat,
+  soak_series& series
+) {
+  std::vector<double> e2e;
+  std::vector<double> srv;
+  {
+    std::lock_guard<std::mutex> guard(lat.lock);
+    e2e.swap(lat.e2e);
+    srv.swap(lat.server);
+    lat.send.clear();
+  }
+  std::sort(e2e.begin(), e2e.end());
+  std::sort(srv.begin(), srv.end());
+
+  long rss_kb = proc_status_kb(server, "VmRSS");
+
+  uint32_t ts_queue_max = 0;
+  uint32_t ts_queue_cap_max = 0;
+  uint32_t filled_q_max = 0;
+  uint32_t pool_in_use_max = 0;
+  uint64_t assembled = 0;
+  uint64_t published = 0;
+  if (metrics) {
+    for (int i = 0; i < cam_count; i++) {
+      const cam_metrics& cam = metrics->cams[i];
+      ts_queue_max = std::max(ts_queue_max, metrics_load(cam.ts_queue_depth));
+      ts_queue_cap_max = std::max(ts_queue_cap_max, metrics_load(cam.ts_queue_cap));
+      filled_q_max = std::max(filled_q_max, metrics_load(cam.filled_q_depth));
+      uint32_t in_use = metrics->bufs_per_cam - metrics_load(cam.empty_q_depth);
+      pool_in_use_max = std::max(pool_in_use_max, in_use);
+    }
+    assembled = metrics_load(metrics->framesets_assembled);
+    published = metrics_load(metrics->framesets_published);
+  }
+
+  printf(
+    "{\"sample\":%d,\"t_s\":%.0f,\"server_rss_kb\":%ld,\"frameset_fps\":%.2f,"
+    "\"server_cpu_pct_per_cam\":%.2f,",
+    sample,
+    t_s,
+    rss_kb,
+    framesets / interval_s,
+    server_cpu / 1e7 / interval_s / cam_count
+  );
+  printf(
+    "\"latency_ms\":{\"e2e\":{\"p50\":%.3f,\"p99\":%.3f},\"server\":{\"p50\":%.3f,\"p99\":%.3f}},",
+    percentile(e2e, 0.50),
+    percentile(e2e, 0.99),
+    percentile(srv, 0.50),
+    percentile(srv, 0.99)
+  );
+  printf(
+    "\"pool_in_use_max\":%u,\"filled_q_max\":%u,\"ts_queue_max\":%u,\"ts_queue_cap_max\":%u,"
+    "\"framesets_assembled\":%lu,\"framesets_published\":%lu}\n",
+    pool_in_use_max,
+    filled_q_max,
+    ts_queue_max,
+    ts_queue_cap_max,
+    assembled,
+    published
+  );
+  fflush(stdout);
+
+  series.t_s.push_back(t_s);
+  series.rss_kb.push_back(rss_kb);
+  series.p99_ms.push_back(percentile(e2e, 0.99));
+  series.ts_queue.push_back(ts_queue_max);
+  series.pool_in_use.push_back(pool_in_use_max);
+}
+
+static bool soak_verdict(const bench_opts& opts, const soak_series& series) {
+  /**
+   * Fits per-hour trends over every sample but the first, which still
+   * carries startup allocation and queue fill, and checks the thresholds
+   *
+   * Returns:
+   *   true if every trend is within its threshold
+   */
+  size_t n = series.t_s.size();
+  if (n < 3) {
+    printf("{\"soak\":\"inconclusive\",\"samples\":%zu}\n", n);
+    return true;
+  }
+
+  auto tail = [](const std::vector<double>& v) {
+    return std::vector<double>(v.begin() + 1, v.end());
+  };
+  std::vector<double> t = tail(series.t_s);
+
+  struct trend {
+    const char* name;
+    double slope;
+    double max;
+  } trends[] = {
+    {"rss_kb_per_h", slope_per_hour(t, tail(series.rss_kb)), opts.max_rss_slope},
+    {"p99_ms_per_h", slope_per_hour(t, tail(series.p99_ms)), opts.max_p99_slope},
+    {"ts_queue_per_h", slope_per_hour(t, tail(series.ts_queue)), opts.max_ts_queue_slope},
+    {"pool_in_use_per_h", slope_per_hour(t, tail(series.pool_in_use)), opts.max_pool_slope}
+  };
+
+  bool pass = true;
+  std::string failures;
+  printf("{");
+  for (const trend& tr : trends) {
+    printf("\"%s\":%.3f,", tr.name, tr.slope);
+    if (tr.slope > tr.max) {
+      pass = false;
+      failures += std::string(failures.empty() ? "" : ",") + "\"" + tr.name + "\"";
+    }
+  }
+  printf(
+    "\"samples\":%zu,\"soak\":\"%s\",\"failures\":[%s]}\n",
+    n,
+    pass ? "pass" : "fail",
+    failures.c_str()
+  );
+  fflush(stdout);
+
+  return pass;
+}
+
+static int run(const bench_opts& opts, int cam_count, const std::vector<encoded_pkt>& pkts, connection& ctl) {
+  /**
+   * Runs one camera count end to end
+   *
+   * Returns:
+   *   0 on success, 1 if a soak trend failed, -1 on setup errors
+   */
+  if (write_cams_yaml(opts, cam_count) < 0)
+    return -1;
+
+  bool soak = opts.soak_minutes > 0;
+
+  run_state state;
+  state.cam_count = cam_count;
+  state.interval_ns = 1000000000ULL / opts.fps;
+  state.slots = (uint64_t)SEND_RING_SECONDS * opts.fps;
+  state.start_ts = 0;
+  state.stop = false;
+  state.failed = 0;
+  for (int i = 0; i < cam_count; i++) {
+    state.sent_ns.emplace_back(new std::atomic<uint64_t>[state.slots]);
+    for (uint64_t k = 0; k < state.slots; k++)
+      state.sent_ns[i][k] = 0;
+  }
+
+  auto controller = std::make_unique<StreamController>(
+    FRAME_WIDTH,
+    FRAME_HEIGHT,
+    cam_count,
+    opts.conf_path.c_str()
+  );
+  pid_t server = controller->server_pid();
+
+  nv12_target target;
+  bool prefetch = parse_target(opts.prefetch, target);
+  if (prefetch)
+    controller->start_prefetch(target, opts.half);
+
+  std::vector<std::thread> cams;
+  for (int i = 0; i < cam_count; i++)
+    cams.emplace_back(camera_fn, std::ref(state), std::cref(pkts), std::cref(opts), i);
+
+  uint64_t start_ts = 0;
+  ssize_t len = ctl.recv_msg((char*)&start_ts, sizeof(start_ts));
+  if (len != sizeof(start_ts)) {
+    fprintf(stderr, "No start timestamp from the server with %d cameras\n", cam_count);
+    state.stop = true;
+    for (auto& t : cams)
+      t.join();
+    controller.reset();
+    waitpid(server, nullptr, 0);
+    return -1;
+  }
+  state.start_ts = start_ts;
+
+  uint64_t duration_s = soak ? (uint64_t)opts.soak_minutes * 60 : opts.seconds;
+  uint64_t window_start = start_ts + (uint64_t)opts.warmup * 1000000000ULL;
+  uint64_t window_end = window_start + duration_s * 1000000000ULL;
+
+  std::atomic<uint64_t> delivered(0);
+  latencies lat;
+  std::thread consumer(
+    consumer_fn,
+    std::ref(state),
+    std::ref(*controller),
+    prefetch,
+    window_start,
+    window_end,
+    std::ref(delivered),
+    std::ref(lat)
+  );
+
+  size_t metrics_size = 0;
+  const server_metrics* metrics = nullptr;
+  if (soak) {
+    metrics = map_metrics(cam_count, metrics_size);
+    if (!metrics)
+      fprintf(stderr, "Server metrics unavailable, soaking on RSS and latency only\n");
+  }
+
+  sleep_until_real(window_start);
+  uint64_t server_cpu = proc_cpu_ns(server);
+  uint64_t bench_cpu = self_cpu_ns();
+
+  bool pass = true;
+  if (soak) {
+    soak_series series;
+    uint64_t sample_ns = (uint64_t)opts.sample_secs * 1000000000ULL;
+    uint64_t last_delivered = 0;
+    uint64_t last_cpu = server_cpu;
+    int sample = 0;
+
+    for (uint64_t t = window_start + sample_ns; t <= window_end && !state.failed; t += sample_ns) {
+      sleep_until_real(t);
+      uint64_t cpu = proc_cpu_ns(server);
+      uint64_t count = delivered;
+      soak_sample(
+        sample++,
+        (t - window_start) / 1e9,
+        opts.sample_secs,
+        cam_count,
+        server,
+        metrics,
+        count - last_delivered,
+        cpu - last_cpu,
+        lat,
+        series
+      );
+      last_delivered = count;
+      last_cpu = cpu;
+    }
+
+    pass = soak_verdict(opts, series) && !state.failed;
+  } else {
+    sleep_until_real(window_end);
+  }
+
+  server_cpu = proc_cpu_ns(server) - server_cpu;
+  bench_cpu = self_cpu_ns() - bench_cpu;
+  long rss_kb = proc_status_kb(server, "VmRSS");
+  long hwm_kb = proc_status_kb(server, "VmHWM");
+
+  state.stop = true;
+  for (auto& t : cams)
+    t.join();
+
+  // the consumer may be parked in recv_prefetched or on the
+  // semaphore with no more framesets coming
+  controller->stop_prefetch();
+  uint64_t prefetch_drops = controller->prefetch_drops();
+  sem_t* ready = sem_open(SEM_NAME, 0);
+  if (ready != SEM_FAILED) {
+    sem_post(ready);
+    sem_close(ready);
+  }
+  consumer.join();
+
+  if (metrics)
+    munmap((void*)metrics, metrics_size);
+
+  controller.reset();
+  waitpid(server, nullptr, 0);
+
+  if (soak)
+    return pass ? 0 : 1;
+
+  double window_s = (window_end - window_start) / 1e9;
+  uint64_t expected = (uint64_t)opts.seconds * opts.fps;
+  uint64_t count = delivered;
+
+  printf("{\"cams\":%d,\"fps\":%d,\"seconds\":%d,", cam_count, opts.fps, opts.seconds);
+  if (prefetch) {
+    printf(
+      "\"prefetch\":\"%s%s\",\"prefetch_drops\":%lu,",
+      opts.prefetch.c_str(),
+      opts.half ? "/2" : "",
+      prefetch_drops
+    );
+  }
+  printf(
+    "\"framesets\":%lu,\"expected\":%lu,\"frameset_fps\":%.2f,\"drop_rate\":%.4f,",
+    count,
+    expected,
+    count / window_s,
+    expected ? 1.0 - (double)std::min(count, expected) / expected : 0.0
+  );
+  printf("\"latency_ms\":{");
+  print_percentiles("send", lat.send, false);
+  print_percentiles("server", lat.server, false);
+  print_percentiles("e2e", lat.e2e, true);
+  printf("},");
+  printf(
+    "\"server_cpu_pct_per_cam\":%.2f,\"bench_cpu_pct\":%.2f,"
+    "\"server_rss_kb\":%ld,\"server_hwm_kb\":%ld,\"cam_failures\":%d}\n",
+    server_cpu / 1e7 / window_s / cam_count,
+    bench_cpu / 1e7 / window_s,
+    rss_kb,
+    hwm_kb,
+    state.failed.load()
+  );
+  fflush(stdout);
+
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  bench_opts opts;
+  std::string cams = "1,2,4,8,16,32,64";
+  opts.seconds = 10;
+  opts.warmup = 2;
+  opts.fps = 30;
+  opts.tcp_port = 12400;
+  opts.udp_port = 22400;
+  opts.preset = "ultrafast";
+  opts.crf = "30";
+  opts.conf_path = "/tmp/mocap-toolkit-bench-cams.yaml";
+  opts.half = false;
+  opts.soak_minutes = 0;
+  opts.sample_secs = 60;
+  opts.max_rss_slope = 4096;
+  opts.max_p99_slope = 5;
+  opts.max_ts_queue_slope = 8;
+  opts.max_pool_slope = 8;
+
+  static struct option long_opts[] = {
+    {"cams", required_argument, nullptr, 'c'},
+    {"seconds", required_argument, nullptr, 's'},
+    {"warmup", required_argument, nullptr, 'w'},
+    {"fps", required_argument, nullptr, 'f'},
+    {"tcp-port", required_argument, nullptr, 't'},
+    {"udp-port", required_argument, nullptr, 'u'},
+    {"preset", required_argument, nullptr, 'p'},
+    {"crf", required_argument, nullptr, 'q'},
+    {"conf", required_argument, nullptr, 'o'},
+    {"prefetch", required_argument, nullptr, 'x'},
+    {"half", no_argument, nullptr, 'H'},
+    {"soak", required_argument, nullptr, 'S'},
+    {"sample-secs", required_argument, nullptr, 'i'},
+    {"max-rss-slope", required_argument, nullptr, 'R'},
+    {"max-p99-slope", required_argument, nullptr, 'L'},
+    {"max-ts-queue-slope", required_argument, nullptr, 'T'},
+    {"max-pool-slope", required_argument, nullptr, 'P'},
+    {nullptr, 0, nullptr, 0}
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "c:s:w:f:t:u:p:q:o:x:HS:i:R:L:T:P:", long_opts, nullptr)) != -1) {
+    switch (opt) {
+      case 'c': cams = optarg; break;
+      case 's': opts.seconds = std::stoi(optarg); break;
+      case 'w': opts.warmup = std::stoi(optarg); break;
+      case 'f': opts.fps = std::stoi(optarg); break;
+      case 't': opts.tcp_port = std::stoi(optarg); break;
+      case 'u': opts.udp_port = std::stoi(optarg); break;
+      case 'p': opts.preset = optarg; break;
+      case 'q': opts.crf = optarg; break;
+      case 'o': opts.conf_path = optarg; break;
+      case 'x': opts.prefetch = optarg; break;
+      case 'H': opts.half = true; break;
+      case 'S': opts.soak_minutes = std::stoi(optarg); break;
+      case 'i': opts.sample_secs = std::stoi(optarg); break;
+      case 'R': opts.max_rss_slope = std::stod(optarg); break;
+      case 'L': opts.max_p99_slope = std::stod(optarg); break;
+      case 'T': opts.max_ts_queue_slope = std::stod(optarg); break;
+      case 'P': opts.max_pool_slope = std::stod(optarg); break;
+      default:
+        fprintf(
+          stderr,
+          "usage: %s [--cams 1,2,4,...] [--seconds S] [--warmup S] [--fps F] "
+          "[--tcp-port P] [--udp-port P] [--preset P] [--crf Q] [--conf PATH]\n"
+          "       [--prefetch gray|bgr|rgb_f32] [--half]\n"
+          "       [--soak MINUTES] [--sample-secs S] [--max-rss-slope KB_PER_H] "
+          "[--max-p99-slope MS_PER_H] [--max-ts-queue-slope N_PER_H] [--max-pool-slope N_PER_H]\n",
+          argv[0]
+        );
+        return EXIT_FAILURE;
+    }
+  }
+
+  std::stringstream ss(cams);
+  std::string item;
+  while (std::getline(ss, item, ','))
+    if (!item.empty())
+      opts.cam_counts.push_back(std::stoi(item));
+
+  nv12_target target;
+  if (!opts.prefetch.empty() && !parse_target(opts.prefetch, target)) {
+    fprintf(stderr, "Unknown prefetch conversion %s\n", opts.prefetch.c_str());
+    return EXIT_FAILURE;
+  }
+
+  // a soak is one long session at the first camera count
+  if (opts.soak_minutes > 0 && opts.cam_counts.size() > 1)
+    opts.cam_counts.resize(1);
+
+  // a stream the server drops must not kill the simulated cameras
+  signal(SIGPIPE, SIG_IGN);
+
+  std::vector<encoded_pkt> pkts = encode_loop(opts);
+
+  config ctl_conf;
+  ctl_conf.udp_port = std::to_string(opts.udp_port);
+  connection ctl(ctl_conf);
+  if (ctl.bind_udp() < 0) {
+    fprintf(stderr, "Failed to bind control port %d\n", opts.udp_port);
+    return EXIT_FAILURE;
+  }
+  struct timeval timeout = {
+    .tv_sec = START_TIMEOUT,
+    .tv_usec = 0
+  };
+  setsockopt(ctl.udpfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  for (int cam_count : opts.cam_counts) {
+    // drain a STOP left over from the previous run
+    char stale[16];
+    while (recv(ctl.udpfd, stale, sizeof(stale), MSG_DONTWAIT) > 0);
+
+    if (run(opts, cam_count, pkts, ctl) != 0)
+      return EXIT_FAILURE;
+  }
+
+  return 0;
+}
@@ -0,0 +1,204 @@
+// © 2024 Alec Fessler
+// MIT License
+// See LICENSE file in the project root for full license information.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <getopt.h>
+#include <opencv2/calib3d.hpp>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <string>
+#include <time.h>
+#include <vector>
+
+#include "undistort.h"
+
+/**
+ * Undistortion benchmark, toolkit remap tables against OpenCV
+ *
+ * Undistorts the luma plane of a synthetic frameset (every camera a
+ * different frame and slightly different lens) and reports the time
+ * per frameset for:
+ *
+ * - lut:       Undistorter::undistort, one camera after another
+ * - lut_par:   Undistorter::undistort_frameset, cameras in parallel
+ * - cv_undist: cv::undistort per camera, maps rebuilt every call
+ * - cv_remap:  cv::remap with maps precomputed as CV_16SC2, in parallel
+ *
+ * for the full view, a centered half size roi, and full NV12 output.
+ * max_diff is the largest luma difference against cv_remap, which
+ * uses the same 1/32 pixel weights, so it should stay at a level or
+ * two from rounding.
+ */
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void render_nv12(cv::Mat& frame, int width, int height, uint32_t seed) {
+  frame.create(height * 3 / 2, width, CV_8UC1);
+  uint32_t state = seed;
+  for (int row = 0; row < height * 3 / 2; row++) {
+    uint8_t* p = frame.ptr<uint8_t>(row);
+    for (int col = 0; col < width; col++) {
+      state = state * 1664525u + 1013904223u;
+      p[col] = (uint8_t)((row + col + seed * 37) / 4 + (state >> 28));
+    }
+  }
+}
+
+static camera_calibration synthetic_lens(int width, int height, int seed) {
+  camera_calibration calib;
+  calib.image_size = cv::Size(width, height);
+  calib.camera_matrix = cv::Mat(cv::Matx33d(
+    0.8 * width, 0, width / 2.0 + seed,
+    0, 0.8 * width, height / 2.0 - seed,
+    0, 0, 1
+  ));
+  calib.dist_coeffs = cv::Mat(cv::Matx<double, 1, 5>(-0.28 - 0.01 * seed, 0.09, 0.001, -0.001, -0.01));
+  calib.rms = 0.0;
+  return calib;
+}
+
+template <typename F>
+static double time_ms(int iters, F fn) {
+  fn();
+  uint64_t start = now_ns();
+  for (int i = 0; i < iters; i++)
+    fn();
+  return (now_ns() - start) / 1e6 / iters;
+}
+
+int main(int argc, char** argv) {
+  int cams = 8;
+  int width = 1280;
+  int height = 720;
+  int iters = 50;
+
+  static struct option long_opts[] = {
+    {"cams", required_argument, nullptr, 'c'},
+    {"res", required_argument, nullptr, 'r'},
+    {"iters", required_argument, nullptr, 'n'},
+    {nullptr, 0, nullptr, 0}
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "c:r:n:", long_opts, nullptr)) != -1) {
+    switch (opt) {
+      case 'c': cams = std::stoi(optarg); break;
+      case 'r':
+        if (sscanf(optarg, "%dx%d", &width, &height) != 2) {
+          fprintf(stderr, "Invalid resolution %s\n", optarg);
+          return EXIT_FAILURE;
+        }
+        break;
+      case 'n': iters = std::stoi(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [--cams N] [--res WxH] [--iters N]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+
+  cv::Size size(width, height);
+  std::vector<cv::Mat> frames(cams);
+  std::vector<cv::Mat> gray(cams);
+  std::vector<camera_calibration> calib;
+  for (int i = 0; i < cams; i++) {
+    render_nv12(frames[i], width, height, i + 1);
+    gray[i] = frames[i].rowRange(0, height);
+    calib.push_back(synthetic_lens(width, height, i));
+  }
+
+  printf(
+    "kernels: %s, opencv threads: %d, %d x %dx%d, ms per frameset\n",
+    remap_kernel_isa(),
+    cv::getNumThreads(),
+    cams,
+    width,
+    height
+  );
+  printf(
+    "%-6s %8s %9s %9s %9s %9s %8s %8s\n",
+    "view", "lut_mb", "lut", "lut_par", "cv_undist", "cv_remap", "speedup", "max_diff"
+  );
+
+  cv::Rect half_roi(width / 4 & ~1, height / 4 & ~1, width / 2 & ~1, height / 2 & ~1);
+  struct {
+    const char* name;
+    undistort_planes planes;
+    cv::Rect roi;
+  } views[] = {
+    {"y", undistort_planes::Y, cv::Rect()},
+    {"y_roi", undistort_planes::Y, half_roi},
+    {"nv12", undistort_planes::NV12, cv::Rect()}
+  };
+
+  for (const auto& v : views) {
+    Undistorter undistorter(calib, size, v.planes, v.roi);
+    cv::Rect roi = v.roi.area() > 0 ? v.roi : cv::Rect(0, 0, width, height);
+
+    std::vector<cv::Mat> map1(cams);
+    std::vector<cv::Mat> map2(cams);
+    for (int i = 0; i < cams; i++) {
+      cv::Mat new_matrix = cv::getOptimalNewCameraMatrix(calib[i].camera_matrix, calib[i].dist_coeffs, size, 0.0, size);
+      cv::initUndistortRectifyMap(
+        calib[i].camera_matrix,
+        calib[i].dist_coeffs,
+        cv::Mat(),
+        new_matrix,
+        size,
+        CV_16SC2,
+        map1[i],
+        map2[i]
+      );
+      map1[i] = map1[i](roi);
+      map2[i] = map2[i](roi);
+    }
+
+    std::vector<cv::Mat> ours(cams);
+    std::vector<cv::Mat> ref(cams);
+    std::vector<cv::Mat> undistorted(cams);
+
+    double serial = time_ms(iters, [&]() {
+      for (int i = 0; i < cams; i++)
+        undistorter.undistort(frames[i], ours[i], i);
+    });
+    double parallel = time_ms(iters, [&]() {
+      undistorter.undistort_frameset(frames.data(), ours.data());
+    });
+    double cv_undist = time_ms(iters, [&]() {
+      for (int i = 0; i < cams; i++)
+        cv::undistort(gray[i], undistorted[i], calib[i].camera_matrix, calib[i].dist_coeffs);
+    });
+    double cv_remap = time_ms(iters, [&]() {
+      cv::parallel_for_(cv::Range(0, cams), [&](const cv::Range& range) {
+        for (int i = range.start; i < range.end; i++)
+          cv::remap(gray[i], ref[i], map1[i], map2[i], cv::INTER_LINEAR, cv::BORDER_REPLICATE);
+      });
+    });
+
+    double diff = 0;
+    for (int i = 0; i < cams; i++)
+      diff = std::max(diff, cv::norm(ours[i].rowRange(0, roi.height), ref[i], cv::NORM_INF));
+
+    printf(
+      "%-6s %8.1f %9.3f %9.3f %9.3f %9.3f %7.2fx %8.0f\n",
+      v.name,
+      undistorter.lut_bytes() / 1e6,
+      serial,
+      parallel,
+      cv_undist,
+      cv_remap,
+      cv_remap / parallel,
+      diff
+    );
+    fflush(stdout);
+  }
+
+  return 0;
+}
@@ -0,0 +1,659 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "spsc_queue.h"
+
+/**
+ * Microbenchmark for spsc_queue.h
+ *
+ * Measures the queue the way the server uses it, one producer and one
+ * consumer thread passing frame buffer pointers, across thread placements
+ * derived from sysfs topology:
+ *
+ * - same_core:  both threads on one cpu, the cost of time slicing
+ * - smt:        hyperthread siblings sharing L1/L2
+ * - same_l3:    different physical cores sharing an L3 (one CCD)
+ * - cross_l3:   different L3 domains on one NUMA node (cross CCD)
+ * - cross_numa: different NUMA nodes
+ *
+ * Placements the machine doesn't have are skipped. For every placement,
+ * payload pattern and capacity it reports:
+ *
+ * - throughput: Mops/s of enqueue + dequeue pairs with both sides spinning
+ * - round trip latency: ping-pong over a queue pair, p50/p99 in ns
+ * - perf counters for the throughput run, per side: IPC and cache misses
+ *   per op (needs perf_event_paranoid <= 2, otherwise shown as -)
+ *
+ * --batch N moves items with spsc_enqueue_bulk/spsc_dequeue_bulk in
+ * groups of up to N instead of one at a time, to compare the cost of
+ * publishing the head/tail per item against once per batch. Token runs
+ * also verify the consumer saw every pointer in order of production.
+ *
+ * --wait uses spsc_enqueue_wait/spsc_dequeue_wait instead of spinning on
+ * the non-blocking calls, so round trips include futex sleep and wake
+ * whenever a side runs out of spins.
+ *
+ * Payload patterns:
+ * - token: pointers are passed but never dereferenced, pure queue cost
+ * - touch: the producer writes the first cache line of the pointed to
+ *   buffer and the consumer reads it, like stream_mgr handing a decoded
+ *   frame to the assembler
+ */
+
+#define MAX_CPUS 1024
+#define POOL_SIZE 4096
+#define BUF_SIZE 4096
+#define MAX_BATCH 256
+
+enum payload {
+  PAYLOAD_TOKEN,
+  PAYLOAD_TOUCH
+};
+
+struct placement {
+  const char* name;
+  int producer_cpu;
+  int consumer_cpu;
+};
+
+struct counters {
+  uint64_t cycles;
+  uint64_t instructions;
+  uint64_t cache_misses;
+  bool valid;
+};
+
+struct side_ctx {
+  struct producer_q* pq;
+  struct consumer_q* cq;
+  uint8_t** pool;
+  uint64_t ops;
+  size_t batch;
+  int cpu;
+  bool yield; // both sides share a cpu, spinning would burn the whole timeslice
+  enum payload payload;
+  pthread_barrier_t* start;
+  struct counters counters;
+  uint64_t checksum;
+};
+
+struct rtt_ctx {
+  struct producer_q* ping_pq;
+  struct consumer_q* ping_cq;
+  struct producer_q* pong_pq;
+  struct consumer_q* pong_cq;
+  uint8_t** pool;
+  uint64_t rounds;
+  int cpu;
+  bool yield;
+  enum payload payload;
+  pthread_barrier_t* start;
+  uint64_t* samples; // round trip ns, written by the initiating side only
+};
+
+static bool use_wait = false;
+
+static inline void enqueue_one(struct producer_q* q, void* item, bool yield) {
+  if (use_wait) {
+    while (spsc_enqueue_wait(q, item, NULL) != 0);
+    return;
+  }
+  while (spsc_enqueue(q, item) != 0)
+    if (yield) sched_yield();
+}
+
+static inline void* dequeue_one(struct consumer_q* q, bool yield) {
+  void* item;
+  if (use_wait) {
+    while ((item = spsc_dequeue_wait(q, NULL)) == NULL);
+    return item;
+  }
+  while ((item = spsc_dequeue(q)) == NULL)
+    if (yield) sched_yield();
+  return item;
+}
+
+static uint64_t mono_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int pin(int cpu) {
+  cpu_set_t cpuset;
+  CPU_ZERO(&cpuset);
+  CPU_SET(cpu, &cpuset);
+  return pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+}
+
+static int read_cpu_list(const char* path, cpu_set_t* set) {
+  /**
+   * Parses a sysfs cpu list such as "0-3,8-11" into a cpu set
+   *
+   * Returns:
+   * - int: 0 on success, -errno if the file can't be read
+   */
+  CPU_ZERO(set);
+  FILE* f = fopen(path, "r");
+  if (!f)
+    return -errno;
+
+  char buf[4096];
+  if (!fgets(buf, sizeof(buf), f)) {
+    fclose(f);
+    return -EIO;
+  }
+  fclose(f);
+
+  char* save = NULL;
+  for (char* tok = strtok_r(buf, ",\n", &save); tok; tok = strtok_r(NULL, ",\n", &save)) {
+    int first, last;
+    if (sscanf(tok, "%d-%d", &first, &last) != 2)
+      last = first = atoi(tok);
+    for (int cpu = first; cpu <= last && cpu < MAX_CPUS; cpu++)
+      CPU_SET(cpu, set);
+  }
+
+  return 0;
+}
+
+static int cpu_node(int cpu) {
+  char path[128];
+  for (int node = 0; node < 64; node++) {
+    cpu_set_t set;
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    if (read_cpu_list(path, &set) < 0)
+      continue;
+    if (CPU_ISSET(cpu, &set))
+      return node;
+  }
+  return 0;
+}
+
+static int find_placements(int base, struct placement* out) {
+  /**
+   * Finds a partner cpu for the base cpu for every placement class
+   *
+   * Returns:
+   * - int: the number of placements written to out
+   */
+  char path[128];
+  cpu_set_t online;
+  cpu_set_t siblings;
+  cpu_set_t l3;
+
+  if (read_cpu_list("/sys/devices/system/cpu/online", &online) < 0) {
+    CPU_ZERO(&online);
+    for (int cpu = 0; cpu < sysconf(_SC_NPROCESSORS_ONLN); cpu++)
+      CPU_SET(cpu, &online);
+  }
+
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", base);
+  if (read_cpu_list(path, &siblings) < 0) {
+    CPU_ZERO(&siblings);
+    CPU_SET(base, &siblings);
+  }
+
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index3/shared_cpu_list", base);
+  if (read_cpu_list(path, &l3) < 0)
+    CPU_ZERO(&l3);
+
+  int base_node = cpu_node(base);
+  int smt = -1, same_l3 = -1, cross_l3 = -1, cross_numa = -1;
+
+  for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+    if (cpu == base || !CPU_ISSET(cpu, &online))
+      continue;
+
+    bool sibling = CPU_ISSET(cpu, &siblings);
+    bool shares_l3 = CPU_ISSET(cpu, &l3);
+    bool same_node = cpu_node(cpu) == base_node;
+
+    if (sibling && smt < 0)
+      smt = cpu;
+    else if (!sibling && shares_l3 && same_l3 < 0)
+      same_l3 = cpu;
+    else if (!shares_l3 && CPU_COUNT(&l3) > 0 && same_node && cross_l3 < 0)
+      cross_l3 = cpu;
+    else if (!same_node && cross_numa < 0)
+      cross_numa = cpu;
+  }
+
+  int n = 0;
+  out[n++] = (struct placement){"same_core", base, base};
+  if (smt >= 0)
+    out[n++] = (struct placement){"smt", base, smt};
+  if (same_l3 >= 0)
+    out[n++] = (struct placement){"same_l3", base, same_l3};
+  if (cross_l3 >= 0)
+    out[n++] = (struct placement){"cross_l3", base, cross_l3};
+  if (cross_numa >= 0)
+    out[n++] = (struct placement){"cross_numa", base, cross_numa};
+
+  return n;
+}
+
+static int perf_open(uint32_t type, uint64_t config, int group_fd) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = group_fd == -1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP;
+
+  return syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+struct perf_group {
+  int fds[3];
+};
+
+static void perf_start(struct perf_group* g) {
+  g->fds[0] = perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1);
+  g->fds[1] = g->fds[0] < 0 ? -1 :
+              perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, g->fds[0]);
+  g->fds[2] = g->fds[0] < 0 ? -1 :
+              perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, g->fds[0]);
+
+  if (g->fds[0] >= 0) {
+    ioctl(g->fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(g->fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  }
+}
+
+static void perf_stop(struct perf_group* g, struct counters* c) {
+  memset(c, 0, sizeof(*c));
+  if (g->fds[0] < 0)
+    return;
+
+  ioctl(g->fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+  uint64_t vals[4] = {0}; // nr followed by one value per event
+  if (read(g->fds[0], vals, sizeof(vals)) > 0 && vals[0] == 3) {
+    c->cycles = vals[1];
+    c->instructions = vals[2];
+    c->cache_misses = vals[3];
+    c->valid = g->fds[1] >= 0 && g->fds[2] >= 0;
+  }
+
+  for (int i = 0; i < 3; i++)
+    if (g->fds[i] >= 0)
+      close(g->fds[i]);
+}
+
+static inline void produce_payload(uint8_t* buf, uint64_t i, enum payload payload) {
+  if (payload == PAYLOAD_TOUCH)
+    *(volatile uint64_t*)buf = i;
+}
+
+static inline uint64_t consume_payload(uint8_t* buf, enum payload payload) {
+  if (payload == PAYLOAD_TOUCH)
+    return *(volatile uint64_t*)buf;
+  return (uintptr_t)buf;
+}
+
+static void* producer_fn(void* ptr) {
+  struct side_ctx* ctx = ptr;
+  pin(ctx->cpu);
+  pthread_barrier_wait(ctx->start);
+
+  void* items[MAX_BATCH];
+  struct perf_group g;
+  perf_start(&g);
+  if (ctx->batch > 1) {
+    for (uint64_t i = 0; i < ctx->ops;) {
+      size_t n = ctx->ops - i < ctx->batch ? ctx->ops - i : ctx->batch;
+      for (size_t j = 0; j < n; j++) {
+        items[j] = ctx->pool[(i + j) % POOL_SIZE];
+        produce_payload(items[j], i + j, ctx->payload);
+      }
+      size_t sent = 0;
+      while (sent < n) {
+        size_t m = spsc_enqueue_bulk(ctx->pq, items + sent, n - sent);
+        if (m == 0 && ctx->yield)
+          sched_yield();
+        sent += m;
+      }
+      i += n;
+    }
+  } else {
+    for (uint64_t i = 0; i < ctx->ops; i++) {
+      uint8_t* buf = ctx->pool[i % POOL_SIZE];
+      produce_payload(buf, i, ctx->payload);
+      enqueue_one(ctx->pq, buf, ctx->yield);
+    }
+  }
+  perf_stop(&g, &ctx->counters);
+
+  return NULL;
+}
+
+static void* consumer_fn(void* ptr) {
+  struct side_ctx* ctx = ptr;
+  pin(ctx->cpu);
+  pthread_barrier_wait(ctx->start);
+
+  // any out of order or missing pointer breaks the running sum of index * pointer
+  uint64_t sum = 0;
+  void* items[MAX_BATCH];
+  struct perf_group g;
+  perf_start(&g);
+  if (ctx->batch > 1) {
+    for (uint64_t i = 0; i < ctx->ops;) {
+      size_t n = spsc_dequeue_bulk(ctx->cq, items, ctx->batch);
+      if (n == 0 && ctx->yield)
+        sched_yield();
+      for (size_t j = 0; j < n; j++, i++)
+        sum += consume_payload(items[j], ctx->payload) * (i + 1);
+    }
+  } else {
+    for (uint64_t i = 0; i < ctx->ops; i++) {
+      void* buf = dequeue_one(ctx->cq, ctx->yield);
+      sum += consume_payload(buf, ctx->payload) * (i + 1);
+    }
+  }
+  perf_stop(&g, &ctx->counters);
+
+  ctx->checksum = sum;
+  return NULL;
+}
+
+static uint8_t** alloc_pool() {
+  uint8_t** pool = malloc(sizeof(uint8_t*) * POOL_SIZE);
+  uint8_t* bufs = aligned_alloc(CACHE_LINE_SIZE, (size_t)POOL_SIZE * BUF_SIZE);
+  if (!pool || !bufs) {
+    fprintf(stderr, "Failed to allocate buffer pool\n");
+    exit(EXIT_FAILURE);
+  }
+
+  memset(bufs, 0, (size_t)POOL_SIZE * BUF_SIZE);
+  for (int i = 0; i < POOL_SIZE; i++)
+    pool[i] = bufs + (size_t)i * BUF_SIZE;
+
+  return pool;
+}
+
+static double throughput(
+  const struct placement* p,
+  size_t cap,
+  enum payload payload,
+  uint64_t ops,
+  size_t batch,
+  uint8_t** pool,
+  struct counters* prod,
+  struct counters* cons
+) {
+  struct producer_q pq;
+  struct consumer_q cq;
+  void** buf = aligned_alloc(CACHE_LINE_SIZE, ((sizeof(void*) * cap + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE) * CACHE_LINE_SIZE);
+  spsc_queue_init(&pq, &cq, buf, cap);
+
+  pthread_barrier_t start;
+  pthread_barrier_init(&start, NULL, 3);
+
+  bool yield = p->producer_cpu == p->consumer_cpu;
+  struct side_ctx pctx = {
+    .pq = &pq, .pool = pool, .ops = ops, .batch = batch, .cpu = p->producer_cpu,
+    .yield = yield, .payload = payload, .start = &start
+  };
+  struct side_ctx cctx = {
+    .cq = &cq, .pool = pool, .ops = ops, .batch = batch, .cpu = p->consumer_cpu,
+    .yield = yield, .payload = payload, .start = &start
+  };
+
+  pthread_t producer, consumer;
+  pthread_create(&consumer, NULL, consumer_fn, &cctx);
+  pthread_create(&producer, NULL, producer_fn, &pctx);
+
+  pthread_barrier_wait(&start);
+  uint64_t t0 = mono_ns();
+  pthread_join(producer, NULL);
+  pthread_join(consumer, NULL);
+  uint64_t elapsed = mono_ns() - t0;
+
+  pthread_barrier_destroy(&start);
+  free(buf);
+
+  if (payload == PAYLOAD_TOKEN) {
+    uint64_t expected = 0;
+    for (uint64_t i = 0; i < ops; i++)
+      expected += (uintptr_t)pool[i % POOL_SIZE] * (i + 1);
+    if (expected != cctx.checksum) {
+      fprintf(stderr, "Consumer saw items out of order or missing (cap %zu, batch %zu)\n", cap, batch);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  *prod = pctx.counters;
+  *cons = cctx.counters;
+  return ops * 1e3 / elapsed; // Mops/s
+}
+
+static void* pong_fn(void* ptr) {
+  struct rtt_ctx* ctx = ptr;
+  pin(ctx->cpu);
+  pthread_barrier_wait(ctx->start);
+
+  for (uint64_t i = 0; i < ctx->rounds; i++) {
+    void* buf = dequeue_one(ctx->ping_cq, ctx->yield);
+    consume_payload(buf, ctx->payload);
+    produce_payload(buf, i, ctx->payload);
+    enqueue_one(ctx->pong_pq, buf, ctx->yield);
+  }
+
+  return NULL;
+}
+
+static void* ping_fn(void* ptr) {
+  struct rtt_ctx* ctx = ptr;
+  pin(ctx->cpu);
+  pthread_barrier_wait(ctx->start);
+
+  for (uint64_t i = 0; i < ctx->rounds; i++) {
+    uint8_t* buf = ctx->pool[i % POOL_SIZE];
+    uint64_t t0 = mono_ns();
+    produce_payload(buf, i, ctx->payload);
+    enqueue_one(ctx->ping_pq, buf, ctx->yield);
+    void* back = dequeue_one(ctx->pong_cq, ctx->yield);
+    consume_payload(back, ctx->payload);
+    ctx->samples[i] = mono_ns() - t0;
+  }
+
+  return NULL;
+}
+
+static int cmp_u64(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+static void round_trip(
+  const struct placement* p,
+  size_t cap,
+  enum payload payload,
+  uint64_t rounds,
+  uint8_t** pool,
+  uint64_t* p50,
+  uint64_t* p99
+) {
+  struct producer_q ping_pq, pong_pq;
+  struct consumer_q ping_cq, pong_cq;
+  size_t bytes = ((sizeof(void*) * cap + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE) * CACHE_LINE_SIZE;
+  void** ping_buf = aligned_alloc(CACHE_LINE_SIZE, bytes);
+  void** pong_buf = aligned_alloc(CACHE_LINE_SIZE, bytes);
+  spsc_queue_init(&ping_pq, &ping_cq, ping_buf, cap);
+  spsc_queue_init(&pong_pq, &pong_cq, pong_buf, cap);
+
+  uint64_t* samples = malloc(sizeof(uint64_t) * rounds);
+
+  pthread_barrier_t start;
+  pthread_barrier_init(&start, NULL, 2);
+
+  bool yield = p->producer_cpu == p->consumer_cpu;
+  struct rtt_ctx ping = {
+    .ping_pq = &ping_pq, .pong_cq = &pong_cq, .pool = pool, .rounds = rounds,
+    .cpu = p->producer_cpu, .yield = yield, .payload = payload, .start = &start,
+    .samples = samples
+  };
+  struct rtt_ctx pong = {
+    .ping_cq = &ping_cq, .pong_pq = &pong_pq, .pool = pool, .rounds = rounds,
+    .cpu = p->consumer_cpu, .yield = yield, .payload = payload, .start = &start
+  };
+
+  pthread_t ping_thread, pong_thread;
+  pthread_create(&pong_thread, NULL, pong_fn, &pong);
+  pthread_create(&ping_thread, NULL, ping_fn, &ping);
+  pthread_join(ping_thread, NULL);
+  pthread_join(pong_thread, NULL);
+
+  qsort(samples, rounds, sizeof(uint64_t), cmp_u64);
+  *p50 = samples[rounds / 2];
+  *p99 = samples[rounds * 99 / 100];
+
+  pthread_barrier_destroy(&start);
+  free(samples);
+  free(ping_buf);
+  free(pong_buf);
+}
+
+static void print_counters(const struct counters* c, uint64_t ops) {
+  if (!c->valid) {
+    printf(" %6s %9s", "-", "-");
+    return;
+  }
+  printf(
+    " %6.2f %9.4f",
+    c->cycles ? (double)c->instructions / c->cycles : 0.0,
+    (double)c->cache_misses / ops
+  );
+}
+
+static int parse_sizes(const char* list, size_t* out, int max) {
+  int n = 0;
+  char buf[256];
+  snprintf(buf, sizeof(buf), "%s", list);
+  char* save = NULL;
+  for (char* tok = strtok_r(buf, ",", &save); tok && n < max; tok = strtok_r(NULL, ",", &save))
+    out[n++] = strtoul(tok, NULL, 10);
+  return n;
+}
+
+int main(int argc, char** argv) {
+  uint64_t ops = 20000000;
+  uint64_t rounds = 200000;
+  int base_cpu = 0;
+  const char* caps_arg = "16,256,4096";
+  const char* only = NULL;
+  size_t batch = 1;
+
+  static struct option long_opts[] = {
+    {"ops", required_argument, NULL, 'n'},
+    {"rounds", required_argument, NULL, 'r'},
+    {"cpu", required_argument, NULL, 'c'},
+    {"caps", required_argument, NULL, 'q'},
+    {"placement", required_argument, NULL, 'p'},
+    {"batch", required_argument, NULL, 'b'},
+    {"wait", no_argument, NULL, 'w'},
+    {NULL, 0, NULL, 0}
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "n:r:c:q:p:b:w", long_opts, NULL)) != -1) {
+    switch (opt) {
+      case 'n': ops = strtoull(optarg, NULL, 10); break;
+      case 'r': rounds = strtoull(optarg, NULL, 10); break;
+      case 'c': base_cpu = atoi(optarg); break;
+      case 'q': caps_arg = optarg; break;
+      case 'p': only = optarg; break;
+      case 'b': batch = strtoul(optarg, NULL, 10); break;
+      case 'w': use_wait = true; break;
+      default:
+        fprintf(
+          stderr,
+          "usage: %s [--ops N] [--rounds N] [--cpu BASE] [--caps 16,256,...] "
+          "[--placement same_core|smt|same_l3|cross_l3|cross_numa] [--batch N] [--wait]\n",
+          argv[0]
+        );
+        return EXIT_FAILURE;
+    }
+  }
+
+  if (batch < 1 || batch > MAX_BATCH) {
+    fprintf(stderr, "--batch must be between 1 and %d\n", MAX_BATCH);
+    return EXIT_FAILURE;
+  }
+
+  size_t caps[16];
+  int cap_count = parse_sizes(caps_arg, caps, 16);
+
+  struct placement placements[5];
+  int placement_count = find_placements(base_cpu, placements);
+
+  uint8_t** pool = alloc_pool();
+  const char* payload_names[] = {"token", "touch"};
+
+  printf(
+    "%-10s %4s %4s %-5s %5s %9s %8s %8s %6s %9s %6s %9s\n",
+    "placement", "prod", "cons", "load", "cap",
+    "Mops/s", "rtt_p50", "rtt_p99",
+    "p_ipc", "p_miss/op", "c_ipc", "c_miss/op"
+  );
+
+  for (int i = 0; i < placement_count; i++) {
+    const struct placement* p = &placements[i];
+    if (only && strcmp(only, p->name) != 0)
+      continue;
+
+    // sharing a cpu progresses one context switch at a time, keep it short
+    uint64_t p_ops = p->producer_cpu == p->consumer_cpu ? ops / 20 : ops;
+    uint64_t p_rounds = p->producer_cpu == p->consumer_cpu ? rounds / 20 : rounds;
+
+    for (int payload = PAYLOAD_TOKEN; payload <= PAYLOAD_TOUCH; payload++) {
+      for (int c = 0; c < cap_count; c++) {
+        struct counters prod, cons;
+        double mops = throughput(p, caps[c], payload, p_ops, batch, pool, &prod, &cons);
+
+        uint64_t p50 = 0, p99 = 0;
+        if (p_rounds > 0)
+          round_trip(p, caps[c], payload, p_rounds, pool, &p50, &p99);
+
+        printf(
+          "%-10s %4d %4d %-5s %5zu %9.2f %8lu %8lu",
+          p->name,
+          p->producer_cpu,
+          p->consumer_cpu,
+          payload_names[payload],
+          caps[c],
+          mops,
+          p50,
+          p99
+        );
+        print_counters(&prod, p_ops);
+        print_counters(&cons, p_ops);
+        printf("\n");
+        fflush(stdout);
+      }
+    }
+  }
+
+  free(pool[0]);
+  free(pool);
+  return 0;
+}
@@ -0,0 +1,55 @@
+#ifndef CALIBRATION_STORE_H
+#define CALIBRATION_STORE_H
+
+#include <stdint.h>
+
+#define CALIBRATION_STORE_PATH "/etc/mocap-toolkit/calibration.bin"
+#define CALIBRATION_STORE_MAGIC 0x4c41434d // "MCAL" little endian
+#define CALIBRATION_STORE_VERSION 1
+#define CALIBRATION_MAX_DIST 8 // k1 k2 p1 p2 k3 k4 k5 k6, OpenCV's rational model
+
+#define CALIBRATION_HAS_INTRINSICS 1
+#define CALIBRATION_HAS_EXTRINSICS 2
+
+/**
+ * Binary calibration store, the compact twin of the toolkit's YAML
+ * calibration for readers without OpenCV, i.e. the frameset server.
+ * This file is kept identical in frameset_server/include and
+ * toolkit/common/include.
+ *
+ * The file is a header followed by cam_count fixed size entries, each
+ * keyed by the camera's id from cams.yaml rather than its position, so
+ * reordering or adding cameras doesn't hand one camera another's lens.
+ * Everything is host endian, the store is written and read on the
+ * same machine.
+ *
+ * undistorted_matrix is the camera matrix of undistorted frames, as
+ * getOptimalNewCameraMatrix with alpha 0 (every output pixel valid)
+ * and no rectifying rotation. Undistorted frames have no distortion
+ * left, so it is all a consumer of them needs.
+ */
+
+struct calibration_store_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t cam_count;
+  uint32_t entry_size; // sizeof(struct calibration_store_entry) of the writer
+};
+
+struct calibration_store_entry {
+  uint8_t id;         // the camera's id in cams.yaml
+  uint8_t flags;      // CALIBRATION_HAS_*
+  uint8_t dist_count; // coefficients used in dist_coeffs, the rest are 0
+  uint8_t reserved;
+  uint32_t width;     // frame size the intrinsics were solved at
+  uint32_t height;
+  uint32_t reserved2;
+  double camera_matrix[9]; // row major
+  double dist_coeffs[CALIBRATION_MAX_DIST];
+  double undistorted_matrix[9];
+  double rms;              // of the intrinsic solve, in pixels
+  double rvec[3];          // world to camera
+  double tvec[3];
+};
+
+#endif // CALIBRATION_STORE_H
@@ -0,0 +1,66 @@
+#ifndef FRAME_REMAP_H
+#define FRAME_REMAP_H
+
+#include <stdint.h>
+
+#include "calibration_store.h"
+
+#define REMAP_FRAC_BITS 5 // bilinear weights in 1/32 pixel, as the toolkit's Undistorter
+
+/**
+ * Undistortion of decoded NV12 frames through precomputed tables, so
+ * frames are undistorted once in the server instead of once per
+ * consumer.
+ *
+ * Tables are laid out and blended as the toolkit Undistorter's: per
+ * output sample, the byte offset of the top left source sample and
+ * its two 1/32 pixel fractions. They are built once per camera at
+ * startup, so each stream thread only gathers and blends right after
+ * decoding, on the core it is already pinned to.
+ *
+ * Output frames use the calibration's undistorted_matrix and keep the
+ * full frame size. Source coordinates outside the frame are clamped to
+ * its edge.
+ */
+
+struct remap_lut {
+  uint32_t count;   // output samples
+  int32_t* offsets; // byte offset into the source frame, per output sample
+  uint16_t* fracs;  // x fraction in the low byte, y in the high byte
+};
+
+struct frame_remap {
+  uint32_t width;
+  uint32_t height;
+  struct remap_lut luma;
+  struct remap_lut chroma; // one sample per interleaved UV pair
+};
+
+int load_calibration_store(
+  const char* path,
+  struct calibration_store_entry** entries,
+  uint32_t* count
+);
+
+const struct calibration_store_entry* find_calibration(
+  const struct calibration_store_entry* entries,
+  uint32_t count,
+  uint8_t id
+);
+
+int init_frame_remap(
+  struct frame_remap* remap,
+  const struct calibration_store_entry* calib,
+  uint32_t width,
+  uint32_t height
+);
+
+void remap_frame(
+  const struct frame_remap* remap,
+  const uint8_t* src,
+  uint8_t* dst
+);
+
+void cleanup_frame_remap(struct frame_remap* remap);
+
+#endif // FRAME_REMAP_H
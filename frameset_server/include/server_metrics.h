@@ -0,0 +1,59 @@
+#ifndef SERVER_METRICS_H
+#define SERVER_METRICS_H
+
+#include <stdint.h>
+
+#define METRICS_SHM_NAME "/mocap-toolkit_metrics"
+#define METRICS_VERSION 2
+#define METRICS_INTERVAL 1 // seconds between main thread samples
+
+/**
+ * Live server internals published in shared memory so long running
+ * sessions and soak tests can watch for growth without parsing logs.
+ *
+ * The layout is plain integers so it can be mapped from C++ as well.
+ * Every field has exactly one writer and is accessed with the
+ * __atomic builtins, readers only ever see a slightly stale value.
+ *
+ * Per camera fields are split by writer:
+ * - frames_decoded, ts_queue_*: the camera's stream thread, per frame
+ * - enc_*: the camera's stream thread, per packet, from the encoder
+ *   statistics the camera sends (see stream_stats.h)
+ * - filled_q_depth, empty_q_depth: the main thread, every METRICS_INTERVAL
+ *
+ * enc_* are totals since the stream started, so readers get bitrate,
+ * average QP or encode time over any window from two samples.
+ */
+
+struct cam_metrics {
+  uint64_t frames_decoded;
+  uint32_t ts_queue_depth; // timestamps received but not yet matched to a decoded frame
+  uint32_t ts_queue_cap;   // only grows, a steady climb means the queue is leaking
+  uint32_t filled_q_depth; // decoded frames waiting for frameset assembly
+  uint32_t empty_q_depth;  // free frame buffers left in the camera's pool
+  uint64_t enc_packets;
+  uint64_t enc_bytes;
+  uint64_t enc_qp_sum;
+  uint64_t enc_us_sum;     // encode time on the camera
+  uint32_t enc_keyframes;
+  uint32_t enc_us_max;
+} __attribute__((aligned(64)));
+
+struct server_metrics {
+  uint32_t version;
+  uint32_t cam_count;
+  uint32_t bufs_per_cam;
+  uint32_t reserved;
+  uint64_t updated_ns; // CLOCK_MONOTONIC of the last main thread sample
+  uint64_t framesets_assembled;
+  uint64_t framesets_published; // assembled and handed to the consumer
+  struct cam_metrics cams[];
+};
+
+#define metrics_store(field, val) __atomic_store_n(&(field), (val), __ATOMIC_RELAXED)
+#define metrics_load(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+struct server_metrics* metrics_open(uint32_t cam_count, uint32_t bufs_per_cam);
+void metrics_close(struct server_metrics* metrics);
+
+#endif // SERVER_METRICS_H
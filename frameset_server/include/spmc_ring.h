@@ -0,0 +1,258 @@
+#ifndef SPMC_RING_H
+#define SPMC_RING_H
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdalign.h>
+
+#include "spsc_queue.h"
+
+#define SPMC_MAX_READERS 8
+
+/**
+ * Single producer, multi consumer broadcast ring. Every reader sees
+ * every published item (unless it is lossy and falls behind), unlike
+ * spsc_queue.h where each item goes to exactly one consumer.
+ *
+ * Sequence numbers are 64 bit and only ever increase, so they never
+ * wrap in practice and the ring size must be a power of two so a
+ * sequence maps to its slot with a mask instead of a modulo.
+ *
+ * Each reader owns a cursor, the sequence it reads next, padded to
+ * its own cache line so readers never false share with each other or
+ * with the producer's line. The producer only reads the cursors when
+ * its cached slowest-reader position says the ring might be full,
+ * the same caching trick spsc_queue.h uses for head/tail.
+ *
+ * Readers join in one of two modes:
+ * - blocking: counts towards the slowest reader, the producer will
+ *   not overwrite a slot it hasn't read and publish fails with -EAGAIN
+ *   when it is a full ring behind (recorder, anything that must see
+ *   every frameset)
+ * - lossy: never holds the producer back; when lapped it skips ahead
+ *   to the newest item and reports how many it missed (preview,
+ *   metrics, anything that only wants to keep up)
+ *
+ * Each slot carries a stamp, 2 * seq + 1 while the producer writes it
+ * and 2 * seq + 2 once published, which works as a per slot seqlock:
+ * a reader only accepts an item whose stamp matches its cursor before
+ * and after reading it, so an item overwritten mid-read by the
+ * producer is detected rather than returned. Items are single
+ * pointers kept in atomics, so the read between the two stamp checks
+ * is itself an atomic load and never tears; the acquire fence after
+ * it keeps the second check from being satisfied by a stale stamp.
+ *
+ * The ring only carries the pointer. Whatever it points to (a frame
+ * buffer, usually) must stay valid for as long as a reader can still
+ * use it: a blocking reader's items can't be overwritten before it
+ * reads them, but a lossy reader can be lapped right after a read, so
+ * the producer must not recycle a pointee lossy readers may hold,
+ * e.g. by only handing them refcounted or immutable data.
+ *
+ * Only the reader that joined may call spmc_read with its id, and only
+ * the one producer thread may call spmc_publish.
+ */
+
+enum spmc_reader_state {
+  SPMC_READER_FREE,
+  SPMC_READER_JOINING,
+  SPMC_READER_BLOCKING,
+  SPMC_READER_LOSSY
+};
+
+struct spmc_slot {
+  _Atomic uint64_t stamp;
+  _Atomic(void*) item;
+};
+
+struct spmc_reader {
+  alignas(CACHE_LINE_SIZE) _Atomic uint64_t cursor;
+  _Atomic uint32_t state;
+  char padding[
+    CACHE_LINE_SIZE
+    - (sizeof(_Atomic uint64_t)
+    + sizeof(_Atomic uint32_t))
+  ];
+};
+
+struct spmc_ring {
+  // producer's line
+  alignas(CACHE_LINE_SIZE) _Atomic uint64_t head; // next sequence to publish
+  uint64_t cached_min; // slowest blocking reader at the last check
+  size_t cap;
+  size_t mask;
+  struct spmc_slot* slots;
+  char padding[
+    CACHE_LINE_SIZE
+    - (sizeof(_Atomic uint64_t)
+    + sizeof(uint64_t)
+    + sizeof(size_t) * 2
+    + sizeof(struct spmc_slot*))
+  ];
+
+  struct spmc_reader readers[SPMC_MAX_READERS];
+};
+
+static inline int spmc_ring_init(
+  struct spmc_ring* r,
+  struct spmc_slot* slots,
+  size_t size
+) {
+  if ((uintptr_t)slots % CACHE_LINE_SIZE != 0)
+    return -EINVAL;
+  if (size == 0 || (size & (size - 1)) != 0)
+    return -EINVAL; // must be a power of two
+
+  atomic_store_explicit(&r->head, 0, memory_order_relaxed);
+  r->cached_min = 0;
+  r->cap = size;
+  r->mask = size - 1;
+  r->slots = slots;
+
+  // stamp 0 reads as "not yet published" for every sequence
+  for (size_t i = 0; i < size; i++) {
+    atomic_store_explicit(&slots[i].stamp, 0, memory_order_relaxed);
+    atomic_store_explicit(&slots[i].item, NULL, memory_order_relaxed);
+  }
+
+  for (int i = 0; i < SPMC_MAX_READERS; i++) {
+    atomic_store_explicit(&r->readers[i].cursor, 0, memory_order_relaxed);
+    atomic_store_explicit(&r->readers[i].state, SPMC_READER_FREE, memory_order_relaxed);
+  }
+
+  atomic_thread_fence(memory_order_release);
+  return 0;
+}
+
+static inline int spmc_join(struct spmc_ring* r, bool lossy) {
+  /**
+   * Claims a reader slot, starting at the next item to be published
+   *
+   * Returns:
+   *   The reader id to pass to spmc_read, or -EBUSY if all
+   *   SPMC_MAX_READERS slots are taken
+   */
+  for (int i = 0; i < SPMC_MAX_READERS; i++) {
+    uint32_t expected = SPMC_READER_FREE;
+    bool claimed = atomic_compare_exchange_strong_explicit(
+      &r->readers[i].state,
+      &expected,
+      SPMC_READER_JOINING,
+      memory_order_acq_rel,
+      memory_order_relaxed
+    );
+    if (!claimed)
+      continue;
+
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    atomic_store_explicit(&r->readers[i].cursor, head, memory_order_relaxed);
+
+    // the producer may run ahead before it sees this reader,
+    // the slot stamps catch that and it reads as an overrun
+    atomic_store_explicit(
+      &r->readers[i].state,
+      lossy ? SPMC_READER_LOSSY : SPMC_READER_BLOCKING,
+      memory_order_seq_cst
+    );
+    return i;
+  }
+
+  return -EBUSY;
+}
+
+static inline void spmc_leave(struct spmc_ring* r, int id) {
+  atomic_store_explicit(&r->readers[id].state, SPMC_READER_FREE, memory_order_release);
+}
+
+static inline uint64_t spmc_min_cursor(struct spmc_ring* r, uint64_t head) {
+  // lossy readers never hold the producer back
+  uint64_t min = head;
+  for (int i = 0; i < SPMC_MAX_READERS; i++) {
+    uint32_t state = atomic_load_explicit(&r->readers[i].state, memory_order_acquire);
+    if (state != SPMC_READER_BLOCKING)
+      continue;
+
+    uint64_t cursor = atomic_load_explicit(&r->readers[i].cursor, memory_order_acquire);
+    if (cursor < min)
+      min = cursor;
+  }
+  return min;
+}
+
+static inline int spmc_publish(struct spmc_ring* r, void* item) {
+  /**
+   * Publishes an item to every reader
+   *
+   * Returns:
+   *   0 on success, -EAGAIN if the slowest blocking reader is a full
+   *   ring behind
+   */
+  uint64_t seq = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+  if (seq - r->cached_min >= r->cap) { // check if the ring appears full
+    r->cached_min = spmc_min_cursor(r, seq);
+    if (seq - r->cached_min >= r->cap) // check if it actually is full
+      return -EAGAIN;
+  }
+
+  struct spmc_slot* slot = &r->slots[seq & r->mask];
+
+  // odd stamp marks the slot as being rewritten for lossy readers mid-read
+  atomic_store_explicit(&slot->stamp, seq * 2 + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&slot->item, item, memory_order_relaxed);
+  atomic_store_explicit(&slot->stamp, seq * 2 + 2, memory_order_release);
+
+  atomic_store_explicit(&r->head, seq + 1, memory_order_release);
+
+  return 0;
+}
+
+static inline void* spmc_read(struct spmc_ring* r, int id, uint64_t* skipped) {
+  /**
+   * Reads the reader's next item
+   *
+   * When the producer has lapped the reader (only possible for lossy
+   * readers, or a blocking reader racing its own join) the cursor moves
+   * to the newest published item and the number of items passed over
+   * is added to skipped, if given.
+   *
+   * Returns:
+   *   The item, or NULL if nothing new has been published
+   */
+  struct spmc_reader* reader = &r->readers[id];
+  uint64_t cursor = atomic_load_explicit(&reader->cursor, memory_order_relaxed);
+
+  while (true) {
+    struct spmc_slot* slot = &r->slots[cursor & r->mask];
+    uint64_t want = cursor * 2 + 2;
+
+    uint64_t stamp = atomic_load_explicit(&slot->stamp, memory_order_acquire);
+    if (stamp < want)
+      return NULL; // not published yet, or being published right now
+
+    if (stamp == want) {
+      // stamp, atomic copy, acquire fence, stamp again
+      void* item = atomic_load_explicit(&slot->item, memory_order_relaxed);
+      atomic_thread_fence(memory_order_acquire);
+      if (atomic_load_explicit(&slot->stamp, memory_order_relaxed) == want) {
+        // release so the producer only reuses the slot after this read
+        atomic_store_explicit(&reader->cursor, cursor + 1, memory_order_release);
+        return item;
+      }
+    }
+
+    // lapped, resume at the newest item
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    uint64_t newest = head - 1;
+    if (skipped)
+      *skipped += newest - cursor;
+    cursor = newest;
+    atomic_store_explicit(&reader->cursor, cursor, memory_order_release);
+  }
+}
+
+#endif // SPMC_RING_H
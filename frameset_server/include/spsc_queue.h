@@ -2,13 +2,21 @@
 #define SPSC_QUEUE_H
 
 #include <errno.h>
+#include <linux/futex.h>
 #include <stdatomic.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdalign.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
 
 #define CACHE_LINE_SIZE 64
+#define SPSC_WAIT_SPINS 256 // empty/full polls before a blocking wait sleeps
+#define SPSC_ASLEEP 1 // waiting flag: the other side is asleep on our index
+#define SPSC_BLOCKING 2 // waiting flag: the other side has made a blocking wait
 
 /**
  * This implementation uses two structs, one
@@ -36,6 +44,21 @@
  * the queue needs to maintain a single empty slot to
  * distinguish between queue full (head + 1 == tail)
  * and queue empty (head == tail) states.
+ *
+ * Blocking waits:
+ * spsc_dequeue_wait and spsc_enqueue_wait spin briefly and then
+ * sleep on a futex placed on the other side's index word. A waiting
+ * thread first raises a flag in the other side's struct, so every
+ * enqueue/dequeue only checks a word in a cache line it already owns
+ * and only pays for the wake syscall when someone is actually asleep.
+ * The flag check has to be ordered after the index publish by a full
+ * fence, so the flag word also carries a sticky SPSC_BLOCKING bit that
+ * the first blocking wait raises. Until then the check is a plain load
+ * and queues only used with spsc_enqueue/spsc_dequeue pay no fence.
+ * The first blocking wait on a side returns without sleeping after
+ * raising the bit, so it is visible before anyone relies on a wakeup.
+ * Indexes never exceed the capacity, so the futex is placed on the
+ * low 32 bits of the index and sees its full value.
  */
 
 struct producer_q {
@@ -43,12 +66,16 @@ struct producer_q {
   _Atomic size_t* tail_ptr;
   size_t cached_tail;
   size_t cap;
+  _Atomic uint32_t waiting; // SPSC_* flags, raised by the consumer
+  _Atomic uint32_t* waiting_ptr; // the consumer's flag, raised before sleeping on it
   alignas(CACHE_LINE_SIZE) void* buf;
   char padding[
     CACHE_LINE_SIZE
     - (sizeof(_Atomic size_t)
     + sizeof(_Atomic size_t*)
     + sizeof(size_t) * 2
+    + sizeof(_Atomic uint32_t)
+    + sizeof(_Atomic uint32_t*)
     + sizeof(void*))
   ];
 };
@@ -58,12 +85,16 @@ struct consumer_q {
   _Atomic size_t* head_ptr;
   size_t cached_head;
   size_t cap;
+  _Atomic uint32_t waiting; // SPSC_* flags, raised by the producer
+  _Atomic uint32_t* waiting_ptr; // the producer's flag, raised before sleeping on it
   alignas(CACHE_LINE_SIZE) void* buf;
   char padding[
     CACHE_LINE_SIZE
     - (sizeof(_Atomic size_t)
     + sizeof(_Atomic size_t*)
     + sizeof(size_t) * 2
+    + sizeof(_Atomic uint32_t)
+    + sizeof(_Atomic uint32_t*)
     + sizeof(void*))
   ];
 };
@@ -81,17 +112,90 @@ static inline int spsc_queue_init(
   pq->tail_ptr = &cq->tail;
   pq->cached_tail = 0;
   pq->cap = size;
+  atomic_store_explicit(&pq->waiting, 0, memory_order_relaxed);
+  pq->waiting_ptr = &cq->waiting;
   pq->buf = buf;
 
   atomic_store_explicit(&cq->tail, 0, memory_order_relaxed);
   cq->head_ptr = &pq->head;
   cq->cached_head = 0;
   cq->cap = size;
+  atomic_store_explicit(&cq->waiting, 0, memory_order_relaxed);
+  cq->waiting_ptr = &pq->waiting;
   cq->buf = buf;
 
   return 0;
 }
 
+static inline uint32_t* spsc_futex_word(_Atomic size_t* idx) {
+  // the low 32 bits of the index
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  return (uint32_t*)idx + (sizeof(size_t) / sizeof(uint32_t) - 1);
+#else
+  return (uint32_t*)idx;
+#endif
+}
+
+static inline void spsc_cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ volatile("yield");
+#endif
+}
+
+static inline void spsc_wake(_Atomic uint32_t* waiting, _Atomic size_t* idx) {
+  /**
+   * Wakes a thread sleeping on idx, called right after idx is published
+   *
+   * The fence pairs with the one in spsc_sleep. Either the sleeper
+   * sees the new index before sleeping, or this sees its flag. It is
+   * skipped while the other side has never made a blocking wait.
+   */
+  if (!atomic_load_explicit(waiting, memory_order_relaxed))
+    return;
+
+  atomic_thread_fence(memory_order_seq_cst);
+  if (!(atomic_load_explicit(waiting, memory_order_relaxed) & SPSC_ASLEEP))
+    return;
+
+  if (atomic_fetch_and_explicit(waiting, ~SPSC_ASLEEP, memory_order_relaxed) & SPSC_ASLEEP)
+    syscall(SYS_futex, spsc_futex_word(idx), FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static inline void spsc_sleep(
+  _Atomic uint32_t* waiting,
+  _Atomic size_t* idx,
+  size_t seen,
+  const struct timespec* timeout
+) {
+  /**
+   * Sleeps until idx moves away from seen, the timeout passes or a
+   * signal arrives. The caller rechecks the queue either way.
+   */
+  if (!(atomic_load_explicit(waiting, memory_order_relaxed) & SPSC_BLOCKING)) {
+    // first blocking wait, the other side may not fence its wakes yet
+    atomic_fetch_or_explicit(waiting, SPSC_BLOCKING, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    return;
+  }
+
+  atomic_fetch_or_explicit(waiting, SPSC_ASLEEP, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(idx, memory_order_relaxed) != seen)
+    return; // moved while the flag went up
+
+  syscall(
+    SYS_futex,
+    spsc_futex_word(idx),
+    FUTEX_WAIT_PRIVATE,
+    (uint32_t)seen,
+    timeout,
+    NULL,
+    0
+  );
+}
+
 static inline int spsc_enqueue(
   struct producer_q* q,
   void* data
@@ -117,6 +221,7 @@ static inline int spsc_enqueue(
 
   // update the head with release semantics so the consumer can see it
   atomic_store_explicit(&q->head, next, memory_order_release);
+  spsc_wake(&q->waiting, &q->head);
 
   return 0;
 }
@@ -144,8 +249,158 @@ static inline void* spsc_dequeue(struct consumer_q* q) {
   // immediately, because this will only lead to an extra conservative "is full"
   // check, but will not put the queue into an invalid state
   atomic_store_explicit(&q->tail, next_tail, memory_order_relaxed);
+  spsc_wake(&q->waiting, &q->tail);
 
   return data;
 }
 
+static inline size_t spsc_enqueue_bulk(
+  struct producer_q* q,
+  void** items,
+  size_t count
+) {
+  /**
+   * Enqueues up to count items with a single head publish
+   *
+   * Fewer items are enqueued if the queue doesn't have room for all
+   * of them, the caller keeps ownership of the rest.
+   *
+   * Returns:
+   *   The number of items enqueued, from the front of items
+   */
+  size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+
+  // free slots, keeping the one empty slot that marks full
+  size_t free_slots = (q->cached_tail + q->cap - head - 1) % q->cap;
+  if (free_slots < count) {
+    q->cached_tail = atomic_load_explicit(q->tail_ptr, memory_order_acquire);
+    free_slots = (q->cached_tail + q->cap - head - 1) % q->cap;
+  }
+
+  size_t n = count < free_slots ? count : free_slots;
+  if (n == 0)
+    return 0;
+
+  // copy up to the end of the buffer, then wrap to the start
+  size_t first = q->cap - head;
+  if (first > n)
+    first = n;
+  memcpy((void**)q->buf + head, items, first * sizeof(void*));
+  memcpy(q->buf, items + first, (n - first) * sizeof(void*));
+
+  size_t next = head + n;
+  if (next >= q->cap)
+    next -= q->cap;
+
+  // one release store publishes every slot written above
+  atomic_store_explicit(&q->head, next, memory_order_release);
+  spsc_wake(&q->waiting, &q->head);
+
+  return n;
+}
+
+static inline size_t spsc_dequeue_bulk(
+  struct consumer_q* q,
+  void** items,
+  size_t max
+) {
+  /**
+   * Dequeues up to max items with a single tail update
+   *
+   * Returns:
+   *   The number of items written to items, 0 if the queue is empty
+   */
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+  size_t avail = (q->cached_head + q->cap - tail) % q->cap;
+  if (avail < max) {
+    q->cached_head = atomic_load_explicit(q->head_ptr, memory_order_acquire);
+    avail = (q->cached_head + q->cap - tail) % q->cap;
+  }
+
+  size_t n = max < avail ? max : avail;
+  if (n == 0)
+    return 0;
+
+  size_t first = q->cap - tail;
+  if (first > n)
+    first = n;
+  memcpy(items, (void**)q->buf + tail, first * sizeof(void*));
+  memcpy(items + first, q->buf, (n - first) * sizeof(void*));
+
+  size_t next_tail = tail + n;
+  if (next_tail >= q->cap)
+    next_tail -= q->cap;
+
+  // relaxed for the same reason as spsc_dequeue
+  atomic_store_explicit(&q->tail, next_tail, memory_order_relaxed);
+  spsc_wake(&q->waiting, &q->tail);
+
+  return n;
+}
+
+static inline void* spsc_dequeue_wait(
+  struct consumer_q* q,
+  const struct timespec* timeout
+) {
+  /**
+   * Dequeues, blocking while the queue is empty
+   *
+   * Spins for SPSC_WAIT_SPINS polls, then sleeps until the producer
+   * enqueues. A timeout of NULL sleeps indefinitely.
+   *
+   * Returns:
+   *   The dequeued item, or NULL on timeout, signal or spurious wakeup,
+   *   so callers wanting an item loop and check their own exit conditions
+   */
+  void* data;
+  for (int i = 0; i < SPSC_WAIT_SPINS; i++) {
+    data = spsc_dequeue(q);
+    if (data)
+      return data;
+    spsc_cpu_relax();
+  }
+
+  // empty means the producer's head equals our tail
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  spsc_sleep(q->waiting_ptr, q->head_ptr, tail, timeout);
+
+  return spsc_dequeue(q);
+}
+
+static inline int spsc_enqueue_wait(
+  struct producer_q* q,
+  void* data,
+  const struct timespec* timeout
+) {
+  /**
+   * Enqueues, blocking while the queue is full
+   *
+   * Returns:
+   *   0 on success, -EAGAIN if still full after the timeout, a signal
+   *   or a spurious wakeup
+   */
+  for (int i = 0; i < SPSC_WAIT_SPINS; i++) {
+    if (spsc_enqueue(q, data) == 0)
+      return 0;
+    spsc_cpu_relax();
+  }
+
+  // full means the consumer's tail is one past our head
+  size_t full_tail = atomic_load_explicit(&q->head, memory_order_relaxed) + 1;
+  if (full_tail == q->cap)
+    full_tail = 0;
+  spsc_sleep(q->waiting_ptr, q->tail_ptr, full_tail, timeout);
+
+  return spsc_enqueue(q, data);
+}
+
+static inline size_t spsc_size(struct consumer_q* q) {
+  // safe from any thread, but only exact when called by the
+  // consumer or producer, since the other side may move meanwhile
+  size_t head = atomic_load_explicit(q->head_ptr, memory_order_acquire);
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  return head >= tail ? head - tail : q->cap - tail + head;
+}
+
 #endif // SPSC_QUEUE_H
@@ -3,7 +3,9 @@
 
 #include <stdint.h>
 
+#include "frame_remap.h"
 #include "parse_conf.h"
+#include "server_metrics.h"
 #include "spsc_queue.h"
 
 #define ENCODED_FRAME_BUF_SIZE 6400 // 6.4kb
@@ -14,6 +16,8 @@ struct thread_ctx {
   cam_conf* conf;
   struct producer_q* filled_bufs;
   struct consumer_q* empty_bufs;
+  struct cam_metrics* metrics; // NULL when metrics are unavailable
+  const struct frame_remap* remap; // NULL publishes frames as decoded
   uint32_t core;
   pid_t main_thread;
 };
@@ -0,0 +1,45 @@
+#ifndef STREAM_STATS_H
+#define STREAM_STATS_H
+
+#include <stdint.h>
+
+#include "server_metrics.h"
+
+#define STATS_REPORT_INTERVAL 5 // seconds
+
+// per packet encoder statistics sent by the camera after the frame size
+struct __attribute__((packed)) frame_stats {
+  uint8_t pict_type; // AVPictureType, 1 = I, 2 = P, 3 = B
+  uint8_t qp;
+  uint16_t reserved;
+  uint32_t encode_us;
+};
+
+// per camera aggregate over one report interval, owned by its stream thread
+struct stream_stats {
+  uint64_t window_start_ns;
+  uint64_t frames;
+  uint64_t bytes;
+  uint64_t qp_sum;
+  uint64_t encode_us_sum;
+  uint32_t frame_types[4]; // indexed by pict_type, 0 = unknown
+  uint32_t size_max;
+  uint32_t encode_us_max;
+  uint8_t qp_min;
+  uint8_t qp_max;
+};
+
+void stream_stats_reset(struct stream_stats* stats, uint64_t now_ns);
+void stream_stats_add(
+  struct stream_stats* stats,
+  struct cam_metrics* metrics,
+  const struct frame_stats* frame,
+  uint32_t frame_size
+);
+int stream_stats_report(
+  struct stream_stats* stats,
+  const char* cam_name,
+  uint64_t now_ns
+);
+
+#endif // STREAM_STATS_H
@@ -25,6 +25,13 @@ int init_decoder(
   uint32_t height
 );
 
+int init_sw_decoder(
+  decoder* dec,
+  uint32_t width,
+  uint32_t height,
+  int threads
+);
+
 int decode_packet(
   decoder* dec,
   uint8_t* data,
@@ -0,0 +1,347 @@
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "frame_remap.h"
+#include "logging.h"
+
+#define FRAC_ONE (1 << REMAP_FRAC_BITS)
+
+struct lens {
+  double fx;
+  double fy;
+  double cx;
+  double cy;
+};
+
+static struct lens lens_from_matrix(const double* k, bool half);
+static void build_lut(
+  struct remap_lut* lut,
+  const struct lens* raw,
+  const struct lens* out,
+  const double* dist,
+  uint32_t width,
+  uint32_t height,
+  size_t base,
+  uint32_t stride,
+  uint32_t sample_bytes
+);
+
+int load_calibration_store(
+  const char* path,
+  struct calibration_store_entry** entries,
+  uint32_t* count
+) {
+  /**
+   * Reads every camera's calibration from the binary store
+   *
+   * Parameters:
+   * - const char* path: the store written by the toolkit's calibration tools
+   * - struct calibration_store_entry** entries: set to the malloced entries, freed by the caller
+   * - uint32_t* count: set to the number of entries
+   *
+   * Returns:
+   * - int: 0 on success, or a negative error code
+   */
+  int ret = 0;
+  char logstr[128];
+  struct calibration_store_entry* loaded = NULL;
+
+  FILE* infile = fopen(path, "rb");
+  if (!infile) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error opening calibration store %s: %s",
+      path,
+      strerror(errno)
+    );
+    log(ERROR, logstr);
+    return -errno;
+  }
+
+  struct calibration_store_header header;
+  if (fread(&header, sizeof(header), 1, infile) != 1) {
+    log(ERROR, "Calibration store is truncated");
+    ret = -EINVAL;
+    goto err_cleanup;
+  }
+
+  if (
+    header.magic != CALIBRATION_STORE_MAGIC ||
+    header.version != CALIBRATION_STORE_VERSION ||
+    header.entry_size != sizeof(struct calibration_store_entry)
+  ) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Calibration store has magic %08x version %u, expected %08x version %u",
+      header.magic,
+      header.version,
+      CALIBRATION_STORE_MAGIC,
+      CALIBRATION_STORE_VERSION
+    );
+    log(ERROR, logstr);
+    ret = -EINVAL;
+    goto err_cleanup;
+  }
+
+  if (header.cam_count == 0) {
+    log(ERROR, "Calibration store has no cameras");
+    ret = -EINVAL;
+    goto err_cleanup;
+  }
+
+  loaded = malloc(header.cam_count * sizeof(struct calibration_store_entry));
+  if (!loaded) {
+    log(ERROR, "Failed to allocate calibration entries");
+    ret = -ENOMEM;
+    goto err_cleanup;
+  }
+
+  if (fread(loaded, sizeof(struct calibration_store_entry), header.cam_count, infile) != header.cam_count) {
+    log(ERROR, "Calibration store is truncated");
+    ret = -EINVAL;
+    goto err_cleanup;
+  }
+
+  fclose(infile);
+  *entries = loaded;
+  *count = header.cam_count;
+  return 0;
+
+err_cleanup:
+  if (loaded)
+    free(loaded);
+  fclose(infile);
+  return ret;
+}
+
+const struct calibration_store_entry* find_calibration(
+  const struct calibration_store_entry* entries,
+  uint32_t count,
+  uint8_t id
+) {
+  for (uint32_t i = 0; i < count; i++) {
+    if (entries[i].id == id)
+      return &entries[i];
+  }
+
+  return NULL;
+}
+
+int init_frame_remap(
+  struct frame_remap* remap,
+  const struct calibration_store_entry* calib,
+  uint32_t width,
+  uint32_t height
+) {
+  /**
+   * Builds the luma and chroma tables undistorting one camera's frames
+   *
+   * Parameters:
+   * - struct frame_remap* remap: the tables to fill
+   * - const struct calibration_store_entry* calib: the camera's calibration, intrinsics are required
+   * - uint32_t width: decoded frame width, must match the calibration
+   * - uint32_t height: decoded frame height, must match the calibration
+   *
+   * Returns:
+   * - int: 0 on success, or a negative error code, leaving remap empty
+   */
+  char logstr[128];
+  memset(remap, 0, sizeof(*remap));
+
+  if (!(calib->flags & CALIBRATION_HAS_INTRINSICS) || calib->dist_count > CALIBRATION_MAX_DIST) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Camera id %u has no intrinsics to undistort with",
+      calib->id
+    );
+    log(ERROR, logstr);
+    return -EINVAL;
+  }
+
+  if (calib->width != width || calib->height != height || width % 2 || height % 2) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Camera id %u was calibrated at %ux%u, frames are %ux%u",
+      calib->id,
+      calib->width,
+      calib->height,
+      width,
+      height
+    );
+    log(ERROR, logstr);
+    return -EINVAL;
+  }
+
+  remap->width = width;
+  remap->height = height;
+  remap->luma.count = width * height;
+  remap->chroma.count = width / 2 * height / 2;
+  remap->luma.offsets = malloc(remap->luma.count * sizeof(int32_t));
+  remap->luma.fracs = malloc(remap->luma.count * sizeof(uint16_t));
+  remap->chroma.offsets = malloc(remap->chroma.count * sizeof(int32_t));
+  remap->chroma.fracs = malloc(remap->chroma.count * sizeof(uint16_t));
+  if (!remap->luma.offsets || !remap->luma.fracs || !remap->chroma.offsets || !remap->chroma.fracs) {
+    log(ERROR, "Failed to allocate remap tables");
+    cleanup_frame_remap(remap);
+    return -ENOMEM;
+  }
+
+  struct lens raw = lens_from_matrix(calib->camera_matrix, false);
+  struct lens out = lens_from_matrix(calib->undistorted_matrix, false);
+  build_lut(&remap->luma, &raw, &out, calib->dist_coeffs, width, height, 0, width, 1);
+
+  raw = lens_from_matrix(calib->camera_matrix, true);
+  out = lens_from_matrix(calib->undistorted_matrix, true);
+  build_lut(
+    &remap->chroma,
+    &raw,
+    &out,
+    calib->dist_coeffs,
+    width / 2,
+    height / 2,
+    (size_t)width * height,
+    width,
+    2
+  );
+
+  return 0;
+}
+
+static struct lens lens_from_matrix(const double* k, bool half) {
+  struct lens lens = {k[0], k[4], k[2], k[5]};
+  if (!half)
+    return lens;
+
+  // the chroma plane samples pixel centers (2x + 0.5, 2y + 0.5) of the luma plane
+  lens.fx *= 0.5;
+  lens.fy *= 0.5;
+  lens.cx = (lens.cx + 0.5) * 0.5 - 0.5;
+  lens.cy = (lens.cy + 0.5) * 0.5 - 0.5;
+  return lens;
+}
+
+static void split_coord(double coord, uint32_t limit, int* whole, int* frac) {
+  double clamped = fmin(fmax(coord, 0.0), (double)(limit - 1));
+  int fixed = (int)lround(clamped * FRAC_ONE);
+  *whole = fixed >> REMAP_FRAC_BITS;
+  *frac = fixed & (FRAC_ONE - 1);
+  if (*whole >= (int)limit - 1) { // keep the pair in bounds, all weight on the far one
+    *whole = limit - 2;
+    *frac = FRAC_ONE;
+  }
+}
+
+static void build_lut(
+  struct remap_lut* lut,
+  const struct lens* raw,
+  const struct lens* out,
+  const double* dist,
+  uint32_t width,
+  uint32_t height,
+  size_t base,
+  uint32_t stride,
+  uint32_t sample_bytes
+) {
+  /**
+   * Fills a plane's table with the source position of every output
+   * sample, through OpenCV's distortion model with no rectifying
+   * rotation, as cv::initUndistortRectifyMap
+   *
+   * Parameters:
+   * - const struct lens* raw: intrinsics of the decoded plane
+   * - const struct lens* out: intrinsics of the undistorted plane
+   * - const double* dist: k1 k2 p1 p2 k3 k4 k5 k6, unused ones 0
+   * - uint32_t width, height: plane size in samples
+   * - size_t base: byte offset of the plane in the frame
+   * - uint32_t stride: bytes per source row
+   * - uint32_t sample_bytes: 1 for luma, 2 for interleaved chroma
+   */
+  double k1 = dist[0];
+  double k2 = dist[1];
+  double p1 = dist[2];
+  double p2 = dist[3];
+  double k3 = dist[4];
+  double k4 = dist[5];
+  double k5 = dist[6];
+  double k6 = dist[7];
+
+  size_t i = 0;
+  for (uint32_t row = 0; row < height; row++) {
+    double y = (row - out->cy) / out->fy;
+    for (uint32_t col = 0; col < width; col++, i++) {
+      double x = (col - out->cx) / out->fx;
+
+      double r2 = x * x + y * y;
+      double r4 = r2 * r2;
+      double r6 = r4 * r2;
+      double radial = (1 + k1 * r2 + k2 * r4 + k3 * r6) / (1 + k4 * r2 + k5 * r4 + k6 * r6);
+      double xd = x * radial + 2 * p1 * x * y + p2 * (r2 + 2 * x * x);
+      double yd = y * radial + p1 * (r2 + 2 * y * y) + 2 * p2 * x * y;
+
+      int src_x;
+      int src_y;
+      int fx;
+      int fy;
+      split_coord(raw->fx * xd + raw->cx, width, &src_x, &fx);
+      split_coord(raw->fy * yd + raw->cy, height, &src_y, &fy);
+      lut->offsets[i] = (int32_t)(base + (size_t)src_y * stride + (size_t)src_x * sample_bytes);
+      lut->fracs[i] = (uint16_t)(fx | fy << 8);
+    }
+  }
+}
+
+static inline uint8_t blend(int p00, int p01, int p10, int p11, int fx, int fy) {
+  int top = p00 * (FRAC_ONE - fx) + p01 * fx;
+  int bottom = p10 * (FRAC_ONE - fx) + p11 * fx;
+  return (uint8_t)((top * (FRAC_ONE - fy) + bottom * fy + 512) >> 10);
+}
+
+void remap_frame(
+  const struct frame_remap* remap,
+  const uint8_t* src,
+  uint8_t* dst
+) {
+  /**
+   * Undistorts one decoded NV12 frame
+   *
+   * Parameters:
+   * - const struct frame_remap* remap: the camera's tables
+   * - const uint8_t* src: the decoded frame
+   * - uint8_t* dst: the undistorted frame, the same size, must not overlap src
+   */
+  const uint32_t stride = remap->width;
+
+  const struct remap_lut* luma = &remap->luma;
+  for (uint32_t i = 0; i < luma->count; i++) {
+    const uint8_t* p = src + luma->offsets[i];
+    int fx = luma->fracs[i] & 0xff;
+    int fy = luma->fracs[i] >> 8;
+    dst[i] = blend(p[0], p[1], p[stride], p[stride + 1], fx, fy);
+  }
+
+  const struct remap_lut* chroma = &remap->chroma;
+  uint8_t* uv = dst + luma->count;
+  for (uint32_t i = 0; i < chroma->count; i++) {
+    const uint8_t* p = src + chroma->offsets[i];
+    int fx = chroma->fracs[i] & 0xff;
+    int fy = chroma->fracs[i] >> 8;
+    uv[2 * i] = blend(p[0], p[2], p[stride], p[stride + 2], fx, fy);
+    uv[2 * i + 1] = blend(p[1], p[3], p[stride + 1], p[stride + 3], fx, fy);
+  }
+}
+
+void cleanup_frame_remap(struct frame_remap* remap) {
+  free(remap->luma.offsets);
+  free(remap->luma.fracs);
+  free(remap->chroma.offsets);
+  free(remap->chroma.fracs);
+  memset(remap, 0, sizeof(*remap));
+}
@@ -1,6 +1,7 @@
 #define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include <sched.h>
@@ -10,30 +11,58 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "spsc_queue.h"
+#include "frameset_shm.h"
+#include "frame_remap.h"
 #include "logging.h"
 #include "parse_conf.h"
 #include "stream_mgr.h"
 #include "network.h"
+#include "server_metrics.h"
 
 #define LOG_PATH "/var/log/mocap-toolkit/server.log"
 #define CAM_CONF_PATH "/etc/mocap-toolkit/cams.yaml"
 
-#define SHM_NAME "/mocap-toolkit_frameset"
 #define SEM_CONSUMER_READY "/mocap-toolkit_consumer_ready"
 
 #define CORES_PER_CCD 8
 #define TIMESTAMP_DELAY 1 // seconds
-#define EMPTY_QS_WAIT 10000 // 0.01 ms
+#define EMPTY_QS_TIMEOUT 100000000 // 100 ms, bounds shutdown and metrics latency while blocked
 #define FRAME_BUFS_PER_THREAD 256
+#define RETURN_BATCH 8 // empty buffers handed back to a stream thread per publish
 
 static void shutdown_handler(int signum);
 static void perform_cleanup();
+static void publish_metrics(
+  struct server_metrics* metrics,
+  struct consumer_q* filled_qs,
+  struct consumer_q* empty_qs,
+  int cam_count
+);
+static void return_frame_buf(
+  struct producer_q* empty_q,
+  void** batch,
+  uint32_t* batch_size,
+  void* buf
+);
+static int claim_frameset_slot(struct frameset_shm* shm, pid_t consumer, int consumer_pidfd);
+static int open_consumer_pidfd(pid_t consumer);
+static bool consumer_exited(int consumer_pidfd);
+static int init_remaps(
+  struct frame_remap* remaps,
+  cam_conf* confs,
+  int cam_count,
+  bool* undistorted
+);
+static int inherited_eventfd();
+static void notify_eventfd(int fd);
 
 struct cleanup_ctx {
   void* frame_bufs;
@@ -41,23 +70,40 @@ struct cleanup_ctx {
   void* frameset_buf;
   size_t shm_size;
   int shm_fd;
+  int consumer_pidfd;
   sem_t* consumer_ready;
+  int frameset_eventfd;
   pthread_t* threads;
   int thread_count;
+  struct server_metrics* metrics;
+  struct frame_remap* remaps;
+  int remap_count;
   bool logging_initialized;
 };
 
 static struct cleanup_ctx cleanup = {
   0,
-  .shm_fd = -1
+  .shm_fd = -1,
+  .consumer_pidfd = -1,
+  .frameset_eventfd = -1
 };
 
 static volatile sig_atomic_t running = 1;
 
-int main() {
+int main(int argc, char* argv[]) {
   int ret = 0;
   char logstr[128];
 
+  // -u publishes undistorted frames, and an alternate camera conf
+  // may be passed, e.g. by benchmarks with simulated cameras
+  bool undistort = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "u")) != -1) {
+    if (opt == 'u')
+      undistort = true;
+  }
+  const char* cam_conf_path = optind < argc ? argv[optind] : CAM_CONF_PATH;
+
   ret = setup_logging(LOG_PATH);
   if (ret) {
     printf("Error opening log file: %s\n", strerror(errno));
@@ -91,7 +137,7 @@ int main() {
     log(ERROR, logstr);
   }
 
-  int cam_count = count_cameras(CAM_CONF_PATH);
+  int cam_count = count_cameras(cam_conf_path);
   if (cam_count <= 0) {
     snprintf(
       logstr,
@@ -118,6 +164,17 @@ int main() {
     return ret;
   }
 
+  // built before the stream threads start, so they only ever read the tables
+  struct frame_remap remaps[cam_count];
+  memset(remaps, 0, sizeof(struct frame_remap) * cam_count);
+  cleanup.remaps = remaps;
+  cleanup.remap_count = cam_count;
+
+  bool undistorted[cam_count];
+  memset(undistorted, 0, sizeof(bool) * cam_count);
+  if (undistort)
+    init_remaps(remaps, confs, cam_count, undistorted);
+
   // pin to cam_count % 8 to stay on ccd0 for 3dv cache with threads
   // but not be on the same core as any threads until there are 8+
   cpu_set_t cpuset;
@@ -190,14 +247,24 @@ int main() {
       FRAME_BUFS_PER_THREAD
     );
 
-    for (int j = 0; j < FRAME_BUFS_PER_THREAD; j++) {
-      spsc_enqueue(
-        &empty_frame_producer_qs[i],
-        &ts_frame_bufs[i * FRAME_BUFS_PER_THREAD + j]
-      );
-    }
+    // the queue holds one less than its size, so the last buffer stays unused
+    void* initial_bufs[FRAME_BUFS_PER_THREAD];
+    for (int j = 0; j < FRAME_BUFS_PER_THREAD; j++)
+      initial_bufs[j] = &ts_frame_bufs[i * FRAME_BUFS_PER_THREAD + j];
+
+    spsc_enqueue_bulk(
+      &empty_frame_producer_qs[i],
+      initial_bufs,
+      FRAME_BUFS_PER_THREAD
+    );
   }
 
+  // metrics are diagnostics only, the server runs without them
+  struct server_metrics* metrics = metrics_open(cam_count, FRAME_BUFS_PER_THREAD);
+  if (!metrics)
+    log(WARNING, "Running without metrics");
+  cleanup.metrics = metrics;
+
   struct thread_ctx ctxs[cam_count];
   pthread_t threads[cam_count];
   cleanup.threads = threads;
@@ -205,6 +272,8 @@ int main() {
     ctxs[i].conf = &confs[i];
     ctxs[i].filled_bufs = &filled_frame_producer_qs[i];
     ctxs[i].empty_bufs = &empty_frame_consumer_qs[i];
+    ctxs[i].metrics = metrics ? &metrics->cams[i] : NULL;
+    ctxs[i].remap = undistorted[i] ? &remaps[i] : NULL;
     ctxs[i].core = i % CORES_PER_CCD;
     ctxs[i].main_thread = pid;
 
@@ -243,8 +312,18 @@ int main() {
   }
   cleanup.consumer_ready = consumer_ready;
 
+  // only set when spawned by a consumer that polls, the semaphore stays authoritative
+  int frameset_eventfd = inherited_eventfd();
+  cleanup.frameset_eventfd = frameset_eventfd;
+
+  // the consumer is the parent that spawned the server, its leases are
+  // only reclaimed once the pidfd held from here on says it exited
+  pid_t consumer = getppid();
+  int consumer_pidfd = open_consumer_pidfd(consumer);
+  cleanup.consumer_pidfd = consumer_pidfd;
+
   int shm_fd = shm_open(
-    SHM_NAME,
+    FRAMESET_SHM_NAME,
     O_CREAT | O_RDWR,
     0666
   );
@@ -257,10 +336,11 @@ int main() {
     );
     log(ERROR, logstr);
     perform_cleanup();
+    return -errno;
   }
   cleanup.shm_fd = shm_fd;
 
-  size_t shm_size = frame_buf_size * cam_count + sizeof(uint64_t);
+  size_t shm_size = frameset_shm_size(cam_count, frame_buf_size);
   ret = ftruncate(
     shm_fd,
     shm_size
@@ -274,17 +354,18 @@ int main() {
     );
     log(ERROR, logstr);
     perform_cleanup();
+    return -errno;
   }
 
-  void* frameset_buf = mmap(
+  struct frameset_shm* frameset_shm = mmap(
     NULL,
     shm_size,
-    PROT_WRITE,
+    PROT_READ | PROT_WRITE,
     MAP_SHARED,
     shm_fd,
     0
   );
-  if (frameset_buf == MAP_FAILED) {
+  if (frameset_shm == MAP_FAILED) {
     snprintf(
       logstr,
       sizeof(logstr),
@@ -293,8 +374,26 @@ int main() {
     );
     log(ERROR, logstr);
     perform_cleanup();
+    return -errno;
+  }
+  cleanup.frameset_buf = frameset_shm;
+  cleanup.shm_size = shm_size;
+
+  // the consumer may have created the shm first, but nothing is leased before the first publish
+  frameset_shm->version = FRAMESET_SHM_VERSION;
+  frameset_shm->slot_count = FRAMESET_SLOTS;
+  frameset_shm->cam_count = cam_count;
+  for (int i = 0; i < cam_count; i++) {
+    frameset_shm->cams[i].id = confs[i].id;
+    frameset_shm->cams[i].flags = undistorted[i] ? FRAMESET_CAM_UNDISTORTED : 0;
+  }
+  frameset_shm->frame_size = frame_buf_size;
+  frameset_shm->slot_stride = frameset_slot_stride(cam_count, frame_buf_size);
+  frameset_shm->data_offset = frameset_data_offset(cam_count);
+  for (int i = 0; i < FRAMESET_SLOTS; i++) {
+    frameset_set_seq(&frameset_shm->slots[i], 0);
+    frameset_set_owner(&frameset_shm->slots[i], FRAMESET_SLOT_FREE);
   }
-  cleanup.frameset_buf = frameset_buf;
 
   struct timespec ts;
   clock_gettime(CLOCK_REALTIME, &ts);
@@ -304,11 +403,39 @@ int main() {
   struct ts_frame_buf* current_frames[cam_count];
   memset(current_frames, 0, sizeof(struct ts_frame_buf*) * cam_count);
 
-  // reuse ts for our sleep timer to prevent busy waiting
+  // used buffers are returned in batches so each camera's
+  // empty queue head is published once per RETURN_BATCH frames
+  void* return_batches[cam_count][RETURN_BATCH];
+  uint32_t return_batch_sizes[cam_count];
+  memset(return_batch_sizes, 0, sizeof(uint32_t) * cam_count);
+
+  // reuse ts as the timeout for blocking on an empty queue
   ts.tv_sec = 0;
-  ts.tv_nsec = EMPTY_QS_WAIT;
+  ts.tv_nsec = EMPTY_QS_TIMEOUT;
+
+  struct timespec now;
+  uint64_t next_metrics_ns = 0;
+  uint64_t framesets_assembled = 0;
+  uint64_t framesets_published = 0;
 
   while (running) {
+    if (metrics) {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      uint64_t now_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+      if (now_ns >= next_metrics_ns) {
+        metrics_store(metrics->framesets_assembled, framesets_assembled);
+        metrics_store(metrics->framesets_published, framesets_published);
+        metrics_store(metrics->updated_ns, now_ns);
+        publish_metrics(
+          metrics,
+          filled_frame_consumer_qs,
+          empty_frame_consumer_qs,
+          cam_count
+        );
+        next_metrics_ns = now_ns + METRICS_INTERVAL * 1000000000ULL;
+      }
+    }
+
     // dequeue a full set of timestamped frame buffers from each worker thread
     bool full_set = true;
     for(int i = 0; i < cam_count; i++) {
@@ -324,7 +451,13 @@ int main() {
     }
 
     if (!full_set) { // need a full set to proceed
-      nanosleep(&ts, NULL);
+      // any camera still missing a frame holds up the set, so sleep on the first one
+      for (int i = 0; i < cam_count; i++) {
+        if (current_frames[i] == NULL) {
+          current_frames[i] = spsc_dequeue_wait(&filled_frame_consumer_qs[i], &ts);
+          break;
+        }
+      }
       continue;
     }
 
@@ -340,7 +473,12 @@ int main() {
     for (int i = 0; i < cam_count; i++) {
       if (current_frames[i]->timestamp != max_timestamp) {
         all_equal = false;
-        spsc_enqueue(&empty_frame_producer_qs[i], current_frames[i]);
+        return_frame_buf(
+          &empty_frame_producer_qs[i],
+          return_batches[i],
+          &return_batch_sizes[i],
+          current_frames[i]
+        );
         current_frames[i] = NULL; // get a new timestamped buffer
       }
     }
@@ -351,30 +489,43 @@ int main() {
     snprintf(
       logstr,
       sizeof(logstr),
-      "Received frameset with timestamp %lu",
+      "Received frameset with timestamp %" PRIu64,
       max_timestamp
     );
     log(DEBUG, logstr);
+    framesets_assembled++;
 
     // check if consumer_ready here
     int consumer_ready_val;
     sem_getvalue(consumer_ready, &consumer_ready_val);
-    if (consumer_ready_val == 0) { // consumer is waiting on sem
+    int slot = -1;
+    if (consumer_ready_val == 0) // consumer is waiting on sem
+      slot = claim_frameset_slot(frameset_shm, consumer, consumer_pidfd);
+
+    if (slot >= 0) { // none free while the consumer holds every slot
       for (int i = 0; i < cam_count; i++) {
         memcpy(
-          frameset_buf + (i * frame_buf_size),
+          frameset_frame(frameset_shm, cam_count, frame_buf_size, slot, i),
           current_frames[i]->frame_buf,
           frame_buf_size
         );
       }
-      uint64_t* timestamp_ptr = frameset_buf + (frame_buf_size * cam_count);
-      *timestamp_ptr = max_timestamp;
+      frameset_shm->slots[slot].timestamp = max_timestamp;
+      frameset_set_seq(&frameset_shm->slots[slot], framesets_published + 1);
+      frameset_set_owner(&frameset_shm->slots[slot], FRAMESET_SLOT_READY);
       sem_post(consumer_ready);
+      notify_eventfd(frameset_eventfd);
+      framesets_published++;
     }
 
     // get a new full set
     for (int i = 0; i < cam_count; i++) {
-      spsc_enqueue(&empty_frame_producer_qs[i], current_frames[i]);
+      return_frame_buf(
+        &empty_frame_producer_qs[i],
+        return_batches[i],
+        &return_batch_sizes[i],
+        current_frames[i]
+      );
       current_frames[i] = NULL;
     }
   }
@@ -392,13 +543,284 @@ static void shutdown_handler(int signum) {
   running = 0;
 }
 
+static void publish_metrics(
+  struct server_metrics* metrics,
+  struct consumer_q* filled_qs,
+  struct consumer_q* empty_qs,
+  int cam_count
+) {
+  /**
+   * Samples the depth of every camera's frame buffer queues
+   *
+   * The main thread consumes the filled queues and produces into the
+   * empty queues, so both depths are exact from here apart from what
+   * the stream threads do concurrently.
+   */
+  for (int i = 0; i < cam_count; i++) {
+    metrics_store(metrics->cams[i].filled_q_depth, (uint32_t)spsc_size(&filled_qs[i]));
+    metrics_store(metrics->cams[i].empty_q_depth, (uint32_t)spsc_size(&empty_qs[i]));
+  }
+}
+
+static void return_frame_buf(
+  struct producer_q* empty_q,
+  void** batch,
+  uint32_t* batch_size,
+  void* buf
+) {
+  /**
+   * Adds a used frame buffer to a camera's return batch and hands
+   * the whole batch back to the stream thread once it is full
+   *
+   * Every buffer came out of the same queue, so it always has room
+   * for the batch, anything not taken is simply retried next time.
+   */
+  batch[(*batch_size)++] = buf;
+  if (*batch_size < RETURN_BATCH)
+    return;
+
+  size_t returned = spsc_enqueue_bulk(empty_q, batch, *batch_size);
+  memmove(
+    batch,
+    batch + returned,
+    (*batch_size - returned) * sizeof(void*)
+  );
+  *batch_size -= returned;
+}
+
+static int claim_frameset_slot(struct frameset_shm* shm, pid_t consumer, int consumer_pidfd) {
+  /**
+   * Claims a frameset slot to write the next published frameset into
+   *
+   * In order of preference:
+   * 1. A free slot
+   * 2. The oldest ready slot, the consumer never took it and the
+   *    frameset about to be written supersedes it
+   * 3. A slot leased by the consumer that spawned the server, once
+   *    its pidfd shows it exited. Leases by any other pid are never
+   *    reclaimed, a bare pid can't tell a live consumer in another
+   *    namespace or a recycled pid from a dead one
+   *
+   * Returns:
+   *   The slot index, now owned as FRAMESET_SLOT_WRITING, or -1 if
+   *   the consumer holds a lease on every slot
+   */
+  char logstr[128];
+
+  for (int i = 0; i < FRAMESET_SLOTS; i++) {
+    if (frameset_cas_owner(&shm->slots[i], FRAMESET_SLOT_FREE, FRAMESET_SLOT_WRITING))
+      return i;
+  }
+
+  int oldest = -1;
+  for (int i = 0; i < FRAMESET_SLOTS; i++) {
+    if (frameset_owner(&shm->slots[i]) != FRAMESET_SLOT_READY)
+      continue;
+    if (oldest == -1 || frameset_seq(&shm->slots[i]) < frameset_seq(&shm->slots[oldest]))
+      oldest = i;
+  }
+  // the consumer may lease it first, then fall through to the dead lease check
+  if (oldest >= 0 && frameset_cas_owner(&shm->slots[oldest], FRAMESET_SLOT_READY, FRAMESET_SLOT_WRITING))
+    return oldest;
+
+  if (!consumer_exited(consumer_pidfd))
+    return -1;
+
+  for (int i = 0; i < FRAMESET_SLOTS; i++) {
+    int32_t owner = frameset_owner(&shm->slots[i]);
+    if (owner != consumer)
+      continue;
+
+    if (frameset_cas_owner(&shm->slots[i], owner, FRAMESET_SLOT_WRITING)) {
+      snprintf(
+        logstr,
+        sizeof(logstr),
+        "Reclaimed frameset slot %d leased by exited consumer %d",
+        i,
+        owner
+      );
+      log(WARNING, logstr);
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+static int open_consumer_pidfd(pid_t consumer) {
+  /**
+   * Opens a pidfd on the consumer that spawned the server
+   *
+   * Taken while the consumer is still the parent, so the pid can't
+   * have been recycled yet, and the pidfd keeps referring to that
+   * process even once its pid is reused.
+   *
+   * Returns:
+   *   The pidfd, or -1 if there is no consumer parent to watch or the
+   *   kernel has no pidfds, in which case leases are never reclaimed
+   */
+  char logstr[128];
+
+  if (consumer <= 1)
+    return -1;
+
+  int pidfd = syscall(SYS_pidfd_open, consumer, 0);
+  if (pidfd == -1 || getppid() != consumer) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Can't watch consumer %d, its leases won't be reclaimed: %s",
+      consumer,
+      pidfd == -1 ? strerror(errno) : "it already exited"
+    );
+    log(WARNING, logstr);
+    if (pidfd != -1)
+      close(pidfd);
+    return -1;
+  }
+
+  return pidfd;
+}
+
+static bool consumer_exited(int consumer_pidfd) {
+  // a pidfd polls readable once its process has exited
+  if (consumer_pidfd < 0)
+    return false;
+
+  struct pollfd pfd = {
+    .fd = consumer_pidfd,
+    .events = POLLIN
+  };
+  return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN);
+}
+
+static int init_remaps(
+  struct frame_remap* remaps,
+  cam_conf* confs,
+  int cam_count,
+  bool* undistorted
+) {
+  /**
+   * Builds the undistortion tables of every camera in the calibration
+   * store, matched to the camera confs by id
+   *
+   * A camera without a usable calibration is published as decoded
+   * rather than stopping the server, the consumer can tell from the
+   * shm's per camera flags.
+   *
+   * Parameters:
+   * - bool* undistorted: set for each camera whose tables were built, index i for confs[i]
+   *
+   * Returns:
+   * - int: the number of cameras whose tables were built
+   */
+  char logstr[128];
+  int built = 0;
+
+  struct calibration_store_entry* entries = NULL;
+  uint32_t entry_count = 0;
+  int ret = load_calibration_store(CALIBRATION_STORE_PATH, &entries, &entry_count);
+  if (ret) {
+    log(WARNING, "Publishing frames as decoded, no calibration store to undistort with");
+    return 0;
+  }
+
+  for (int i = 0; i < cam_count; i++) {
+    const struct calibration_store_entry* calib = find_calibration(
+      entries,
+      entry_count,
+      confs[i].id
+    );
+
+    if (calib)
+      ret = init_frame_remap(&remaps[i], calib, DECODED_FRAME_WIDTH, DECODED_FRAME_HEIGHT);
+
+    if (!calib || ret) {
+      snprintf(
+        logstr,
+        sizeof(logstr),
+        "Publishing frames of cam %s as decoded, it has no usable calibration",
+        confs[i].name
+      );
+      log(WARNING, logstr);
+      continue;
+    }
+
+    undistorted[i] = true;
+    built++;
+  }
+
+  free(entries);
+
+  snprintf(
+    logstr,
+    sizeof(logstr),
+    "Undistorting frames of %d of %d cameras",
+    built,
+    cam_count
+  );
+  log(INFO, logstr);
+  return built;
+}
+
+static int inherited_eventfd() {
+  /**
+   * Looks up the eventfd a consumer handed down through
+   * FRAMESET_EVENTFD_ENV when it spawned the server
+   *
+   * Returns:
+   *   The fd, or -1 if none was passed or it isn't open
+   */
+  char logstr[128];
+
+  const char* env = getenv(FRAMESET_EVENTFD_ENV);
+  if (env == NULL)
+    return -1;
+
+  char* end;
+  long fd = strtol(env, &end, 10);
+  if (*env == '\0' || *end != '\0' || fd < 0 || fcntl((int)fd, F_GETFD) == -1) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Ignoring invalid frameset eventfd %s",
+      env
+    );
+    log(WARNING, logstr);
+    return -1;
+  }
+
+  snprintf(
+    logstr,
+    sizeof(logstr),
+    "Notifying frameset publishes on eventfd %ld",
+    fd
+  );
+  log(INFO, logstr);
+  return (int)fd;
+}
+
+static void notify_eventfd(int fd) {
+  /**
+   * Wakes a consumer polling the frameset eventfd. The consumer made
+   * it non blocking, and a counter at its limit already reads as
+   * readable, so a failed write loses nothing.
+   */
+  if (fd < 0)
+    return;
+
+  uint64_t one = 1;
+  ssize_t ret = write(fd, &one, sizeof(one));
+  (void)ret;
+}
+
 static void perform_cleanup() {
   if (cleanup.frameset_buf)
     munmap(cleanup.frameset_buf, cleanup.shm_size);
 
   if (cleanup.shm_fd >= 0) {
     close(cleanup.shm_fd);
-    shm_unlink(SHM_NAME);
+    shm_unlink(FRAMESET_SHM_NAME);
   }
 
   if (cleanup.consumer_ready) {
@@ -406,6 +828,12 @@ static void perform_cleanup() {
     sem_unlink(SEM_CONSUMER_READY);
   }
 
+  if (cleanup.frameset_eventfd >= 0)
+    close(cleanup.frameset_eventfd);
+
+  if (cleanup.consumer_pidfd >= 0)
+    close(cleanup.consumer_pidfd);
+
   if (cleanup.threads) {
     for (int i = 0; i < cleanup.thread_count; i++) {
       pthread_kill(cleanup.threads[i], SIGUSR2);
@@ -416,6 +844,12 @@ static void perform_cleanup() {
     }
   }
 
+  metrics_close(cleanup.metrics);
+
+  // only after the stream threads that read them have been joined
+  for (int i = 0; i < cleanup.remap_count; i++)
+    cleanup_frame_remap(&cleanup.remaps[i]);
+
   if (cleanup.q_bufs)
     free(cleanup.q_bufs);
 
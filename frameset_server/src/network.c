@@ -48,6 +48,19 @@ int broadcast_msg(cam_conf* confs, int confs_size, const char* msg, size_t msg_s
   bool eth_conn = is_eth_conn(sockfd);
 
   for (int i = 0; i < confs_size; i++) {
+    // a picam driving two sensors appears as two confs sharing
+    // one control port, so it must only receive each message once
+    bool already_sent = false;
+    for (int j = 0; j < i; j++) {
+      if (confs[j].eth_ip.s_addr == confs[i].eth_ip.s_addr &&
+          confs[j].udp_port == confs[i].udp_port) {
+        already_sent = true;
+        break;
+      }
+    }
+    if (already_sent)
+      continue;
+
     struct sockaddr_in rcvr_addr;
     memset(&rcvr_addr, 0, sizeof(rcvr_addr));
     rcvr_addr.sin_family = AF_INET;
@@ -0,0 +1,93 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "server_metrics.h"
+
+static size_t metrics_size = 0;
+
+struct server_metrics* metrics_open(uint32_t cam_count, uint32_t bufs_per_cam) {
+  /**
+   * Creates and maps the metrics segment for the given camera count
+   *
+   * Parameters:
+   * - uint32_t cam_count: number of cam_metrics slots
+   * - uint32_t bufs_per_cam: frame buffer pool size of each camera
+   *
+   * Returns:
+   * - struct server_metrics*: zeroed metrics with the header filled, or NULL on error
+   */
+  char logstr[128];
+
+  int fd = shm_open(
+    METRICS_SHM_NAME,
+    O_CREAT | O_RDWR,
+    0666
+  );
+  if (fd == -1) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error creating metrics shared memory: %s",
+      strerror(errno)
+    );
+    log(ERROR, logstr);
+    return NULL;
+  }
+
+  size_t size = sizeof(struct server_metrics) + cam_count * sizeof(struct cam_metrics);
+  if (ftruncate(fd, size) == -1) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error sizing metrics shared memory: %s",
+      strerror(errno)
+    );
+    log(ERROR, logstr);
+    close(fd);
+    shm_unlink(METRICS_SHM_NAME);
+    return NULL;
+  }
+
+  struct server_metrics* metrics = mmap(
+    NULL,
+    size,
+    PROT_READ | PROT_WRITE,
+    MAP_SHARED,
+    fd,
+    0
+  );
+  close(fd);
+  if (metrics == MAP_FAILED) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error mapping metrics shared memory: %s",
+      strerror(errno)
+    );
+    log(ERROR, logstr);
+    shm_unlink(METRICS_SHM_NAME);
+    return NULL;
+  }
+
+  memset(metrics, 0, size);
+  metrics->cam_count = cam_count;
+  metrics->bufs_per_cam = bufs_per_cam;
+  // version last, readers treat 0 as not ready
+  __atomic_store_n(&metrics->version, METRICS_VERSION, __ATOMIC_RELEASE);
+
+  metrics_size = size;
+  return metrics;
+}
+
+void metrics_close(struct server_metrics* metrics) {
+  if (!metrics)
+    return;
+
+  munmap(metrics, metrics_size);
+  shm_unlink(METRICS_SHM_NAME);
+}
@@ -15,14 +15,33 @@
 #include "logging.h"
 #include "network.h"
 #include "stream_mgr.h"
+#include "stream_stats.h"
 #include "viddec.h"
 
 #define TS_Q_INIT_SIZE 8
-#define EMPTY_Q_WAIT 10000 // 0.01 ms
+#define EMPTY_Q_TIMEOUT 100000000 // 100 ms, bounds shutdown latency while blocked
+#define EMPTY_BATCH 8 // empty frame buffers taken from the main thread at once
+
+// empty buffers already dequeued, so the queue tail is only published once per batch
+struct empty_buf_cache {
+  void* bufs[EMPTY_BATCH];
+  size_t size;
+  size_t next;
+};
 
 static volatile sig_atomic_t running = 1;
 
 static void shutdown_handler(int signum);
+static struct ts_frame_buf* take_empty_buf(
+  struct consumer_q* empty_bufs,
+  struct empty_buf_cache* cache
+);
+
+static uint64_t mono_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
 void* stream_mgr_fn(void* ptr) {
   int ret = 0;
@@ -39,6 +58,7 @@ void* stream_mgr_fn(void* ptr) {
   int clientfd = -1;
 
   struct thread_ctx* ctx = (struct thread_ctx*)ptr;
+  uint8_t* decoded_buf = NULL;
 
   uint8_t* enc_frame_buf = malloc(ENCODED_FRAME_BUF_SIZE);
   if (!enc_frame_buf) {
@@ -46,6 +66,15 @@ void* stream_mgr_fn(void* ptr) {
     goto err_cleanup;
   }
 
+  // undistorted frames are decoded aside, then remapped into the frame buffer
+  if (ctx->remap) {
+    decoded_buf = malloc(DECODED_FRAME_WIDTH * DECODED_FRAME_HEIGHT * 3 / 2);
+    if (!decoded_buf) {
+      log(ERROR, "Failed to allocate decoded frame buffer in a thread");
+      goto err_cleanup;
+    }
+  }
+
   cpu_set_t cpuset;
   CPU_ZERO(&cpuset);
   CPU_SET(ctx->core, &cpuset);
@@ -98,7 +127,14 @@ void* stream_mgr_fn(void* ptr) {
     goto err_cleanup;
   }
 
-  struct ts_frame_buf* current_buf = (struct ts_frame_buf*)spsc_dequeue(ctx->empty_bufs);
+  struct stream_stats stats;
+  stream_stats_reset(&stats, mono_ns());
+
+  struct empty_buf_cache empty_cache = {
+    .size = 0,
+    .next = 0
+  };
+  struct ts_frame_buf* current_buf = take_empty_buf(ctx->empty_bufs, &empty_cache);
 
   bool incoming_stream = true;
   while (running) {
@@ -138,6 +174,11 @@ void* stream_mgr_fn(void* ptr) {
       if (ret)
         goto err_cleanup;
 
+      if (ctx->metrics) {
+        metrics_store(ctx->metrics->ts_queue_depth, timestamp_queue.size);
+        metrics_store(ctx->metrics->ts_queue_cap, timestamp_queue.capacity);
+      }
+
       uint32_t frame_size = 0;
       pkt_size = recv_from_stream(
         clientfd,
@@ -160,6 +201,28 @@ void* stream_mgr_fn(void* ptr) {
         goto err_cleanup;
       }
 
+      struct frame_stats fstats;
+      pkt_size = recv_from_stream(
+        clientfd,
+        (char*)&fstats,
+        sizeof(fstats)
+      );
+
+      if (pkt_size != sizeof(fstats)) {
+        if (errno == -EINTR)
+          goto shutdown_cleanup;
+
+        snprintf(
+          logstr,
+          sizeof(logstr),
+          "Received unexpected frame stats size %zd from cam %s",
+          pkt_size,
+          ctx->conf->name
+        );
+        log(ERROR, logstr);
+        goto err_cleanup;
+      }
+
       if (frame_size > ENCODED_FRAME_BUF_SIZE) {
         snprintf(
           logstr,
@@ -200,11 +263,14 @@ void* stream_mgr_fn(void* ptr) {
       );
       if (ret)
         goto err_cleanup;
+
+      stream_stats_add(&stats, ctx->metrics, &fstats, frame_size);
+      stream_stats_report(&stats, ctx->conf->name, mono_ns());
     }
 
     ret = recv_frame(
       &viddec,
-      current_buf->frame_buf
+      decoded_buf ? decoded_buf : current_buf->frame_buf
     );
 
     if (ret == EAGAIN) {
@@ -212,20 +278,29 @@ void* stream_mgr_fn(void* ptr) {
     } else if (ret) {
       goto err_cleanup;
     } else {
+      if (decoded_buf)
+        remap_frame(ctx->remap, decoded_buf, current_buf->frame_buf);
+
       dequeue(&timestamp_queue, (void*)&current_buf->timestamp);
       spsc_enqueue(ctx->filled_bufs, (void*)current_buf);
 
-      current_buf = (struct ts_frame_buf*)spsc_dequeue(ctx->empty_bufs);
+      if (ctx->metrics) {
+        metrics_store(ctx->metrics->ts_queue_depth, timestamp_queue.size);
+        metrics_store(
+          ctx->metrics->frames_decoded,
+          metrics_load(ctx->metrics->frames_decoded) + 1
+        );
+      }
+
+      current_buf = take_empty_buf(ctx->empty_bufs, &empty_cache);
       if (!current_buf) {
         log(WARNING, "Frame buffer queue was empty");
-        while (!current_buf && running) {
-          struct timespec ts = {
-            .tv_sec = 0,
-            .tv_nsec = EMPTY_Q_WAIT
-          };
-          nanosleep(&ts, NULL);
-          current_buf = (struct ts_frame_buf*)spsc_dequeue(ctx->empty_bufs);
-        }
+        struct timespec timeout = {
+          .tv_sec = 0,
+          .tv_nsec = EMPTY_Q_TIMEOUT
+        };
+        while (!current_buf && running)
+          current_buf = spsc_dequeue_wait(ctx->empty_bufs, &timeout);
       }
     }
   }
@@ -237,6 +312,8 @@ err_cleanup:
 shutdown_cleanup:
   if (enc_frame_buf)
     free(enc_frame_buf);
+  if (decoded_buf)
+    free(decoded_buf);
   cleanup_decoder(&viddec);
   cleanup_queue(&timestamp_queue);
   if (sockfd >= 0)
@@ -247,6 +324,20 @@ shutdown_cleanup:
   return NULL;
 }
 
+static struct ts_frame_buf* take_empty_buf(
+  struct consumer_q* empty_bufs,
+  struct empty_buf_cache* cache
+) {
+  if (cache->next == cache->size) {
+    cache->size = spsc_dequeue_bulk(empty_bufs, cache->bufs, EMPTY_BATCH);
+    cache->next = 0;
+    if (cache->size == 0)
+      return NULL;
+  }
+
+  return (struct ts_frame_buf*)cache->bufs[cache->next++];
+}
+
 static void shutdown_handler(int signum) {
   (void)signum;
   running = 0;
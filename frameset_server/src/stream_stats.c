@@ -0,0 +1,114 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "logging.h"
+#include "stream_stats.h"
+
+#define NS_PER_S 1000000000ULL
+
+void stream_stats_reset(struct stream_stats* stats, uint64_t now_ns) {
+  memset(stats, 0, sizeof(*stats));
+  stats->window_start_ns = now_ns;
+  stats->qp_min = UINT8_MAX;
+}
+
+void stream_stats_add(
+  struct stream_stats* stats,
+  struct cam_metrics* metrics,
+  const struct frame_stats* frame,
+  uint32_t frame_size
+) {
+  /**
+   * Adds one packet to the current window, and to the camera's totals
+   * in the metrics shm when the server has one
+   *
+   * Parameters:
+   * - struct stream_stats* stats: the camera's window
+   * - struct cam_metrics* metrics: the camera's metrics, or NULL
+   * - const struct frame_stats* frame: the statistics the camera sent
+   * - uint32_t frame_size: encoded packet size in bytes
+   */
+  stats->frames++;
+  stats->bytes += frame_size;
+  stats->qp_sum += frame->qp;
+  stats->encode_us_sum += frame->encode_us;
+  stats->frame_types[frame->pict_type < 4 ? frame->pict_type : 0]++;
+
+  if (frame_size > stats->size_max)
+    stats->size_max = frame_size;
+  if (frame->encode_us > stats->encode_us_max)
+    stats->encode_us_max = frame->encode_us;
+  if (frame->qp < stats->qp_min)
+    stats->qp_min = frame->qp;
+  if (frame->qp > stats->qp_max)
+    stats->qp_max = frame->qp;
+
+  if (!metrics)
+    return;
+
+  // the stream thread is the only writer, so load and store is enough
+  metrics_store(metrics->enc_packets, metrics_load(metrics->enc_packets) + 1);
+  metrics_store(metrics->enc_bytes, metrics_load(metrics->enc_bytes) + frame_size);
+  metrics_store(metrics->enc_qp_sum, metrics_load(metrics->enc_qp_sum) + frame->qp);
+  metrics_store(metrics->enc_us_sum, metrics_load(metrics->enc_us_sum) + frame->encode_us);
+  if (frame->pict_type == 1)
+    metrics_store(metrics->enc_keyframes, metrics_load(metrics->enc_keyframes) + 1);
+  if (frame->encode_us > metrics_load(metrics->enc_us_max))
+    metrics_store(metrics->enc_us_max, frame->encode_us);
+}
+
+int stream_stats_report(
+  struct stream_stats* stats,
+  const char* cam_name,
+  uint64_t now_ns
+) {
+  /**
+   * Logs the aggregate for the current window once it spans
+   * STATS_REPORT_INTERVAL, then starts a new window
+   *
+   * Reported per camera:
+   * - Frame count and bitrate over the window, for network sizing
+   * - Average and max encoded frame size
+   * - I/P/B frame counts, so keyframe driven spikes are visible
+   * - Average and range of the encoder QP
+   * - Average and max encode time on the camera
+   *
+   * Returns:
+   * - int: 1 if a report was logged, 0 if the window is still open
+   */
+  uint64_t elapsed_ns = now_ns - stats->window_start_ns;
+  if (elapsed_ns < STATS_REPORT_INTERVAL * NS_PER_S)
+    return 0;
+
+  if (stats->frames == 0) {
+    stream_stats_reset(stats, now_ns);
+    return 0;
+  }
+
+  char logstr[160]; // log_msg prepends ~64 bytes into a 256 byte line
+  double secs = (double)elapsed_ns / NS_PER_S;
+  snprintf(
+    logstr,
+    sizeof(logstr),
+    "%s: %" PRIu64 " frames %.1f fps %.2f Mbps size avg %" PRIu64 " max %u I/P/B %u/%u/%u qp avg %.1f [%u-%u] enc avg %.2f ms max %.2f ms",
+    cam_name,
+    stats->frames,
+    stats->frames / secs,
+    stats->bytes * 8 / secs / 1e6,
+    stats->bytes / stats->frames,
+    stats->size_max,
+    stats->frame_types[1],
+    stats->frame_types[2],
+    stats->frame_types[3],
+    (double)stats->qp_sum / stats->frames,
+    stats->qp_min,
+    stats->qp_max,
+    stats->encode_us_sum / 1e3 / stats->frames,
+    stats->encode_us_max / 1e3
+  );
+  log(INFO, logstr);
+
+  stream_stats_reset(stats, now_ns);
+  return 1;
+}
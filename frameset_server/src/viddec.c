@@ -20,8 +20,8 @@ int init_decoder(
 
   const AVCodec* codec = avcodec_find_decoder_by_name("h264_cuvid");
   if (!codec) {
-    log(ERROR, "Could not find cuvid H.264 decoder");
-    return -ENODEV;
+    log(WARNING, "Could not find cuvid H.264 decoder, falling back to software decoding");
+    return init_sw_decoder(dec, width, height, 1);
   }
 
   dec->ctx = avcodec_alloc_context3(codec);
@@ -41,16 +41,18 @@ int init_decoder(
     snprintf(
       logstr,
       sizeof(logstr),
-      "Failed to create CUDA device: %s",
-      strerror(ret)
+      "Failed to create CUDA device, falling back to software decoding: %s",
+      strerror(-ret)
     );
-    log(ERROR, logstr);
-    goto cleanup;
+    log(WARNING, logstr);
+    cleanup_decoder(dec);
+    return init_sw_decoder(dec, width, height, 1);
   }
 
   dec->ctx->hw_device_ctx = av_buffer_ref(dec->hw_device_ctx);
   if (!dec->ctx->hw_device_ctx) {
     log(ERROR, "Failed to reference hw device context");
+    ret = -ENOMEM;
     goto cleanup;
   }
 
@@ -65,13 +67,16 @@ int init_decoder(
     NULL
   );
   if (ret < 0) {
+    // e.g. a driver too old for cuvid, which only shows up on open
     snprintf(
       logstr,
       sizeof(logstr),
-      "Failed to open codec: %s",
-      strerror(ret)
+      "Failed to open cuvid decoder, falling back to software decoding: %s",
+      strerror(-ret)
     );
-    goto cleanup;
+    log(WARNING, logstr);
+    cleanup_decoder(dec);
+    return init_sw_decoder(dec, width, height, 1);
   }
 
   dec->frame = av_frame_alloc();
@@ -79,6 +84,7 @@ int init_decoder(
   dec->pkt = av_packet_alloc();
   if (!dec->frame || !dec->hw_frame || !dec->pkt) {
     log(ERROR, "Failed to allocate frame/packet");
+    ret = -ENOMEM;
     goto cleanup;
   }
 
@@ -98,6 +104,111 @@ int init_decoder(
   return ret;
 }
 
+int init_sw_decoder(
+  decoder* dec,
+  uint32_t width,
+  uint32_t height,
+  int threads
+) {
+  /**
+   * Initializes the libavcodec software H.264 decoder
+   *
+   * Used when no CUDA device or cuvid decoder is available, and by
+   * the codec benchmark to measure the CPU decode path directly.
+   * The decoder has no hw_device_ctx, which recv_frame uses to tell
+   * the two paths apart.
+   *
+   * Parameters:
+   * - decoder* dec: the decoder to initialize
+   * - uint32_t width, height: the expected frame dimensions
+   * - int threads: decoder threads, the server uses 1 since every
+   *   stream already has its own pinned thread
+   *
+   * Returns:
+   * - int: 0 on success, or a negative error code
+   */
+  int ret = 0;
+
+  memset(dec, 0, sizeof(*dec));
+  dec->width = width;
+  dec->height = height;
+
+  const AVCodec* codec = avcodec_find_decoder_by_name("h264");
+  if (!codec) {
+    log(ERROR, "Could not find software H.264 decoder");
+    return -ENODEV;
+  }
+
+  dec->ctx = avcodec_alloc_context3(codec);
+  if (!dec->ctx) {
+    log(ERROR, "Could not allocate decoder context");
+    return -ENOMEM;
+  }
+
+  dec->ctx->width = width;
+  dec->ctx->height = height;
+  dec->ctx->thread_count = threads;
+  dec->ctx->pkt_timebase = (AVRational){1, 90000};
+
+  ret = avcodec_open2(
+    dec->ctx,
+    codec,
+    NULL
+  );
+  if (ret < 0) {
+    log(ERROR, "Failed to open software decoder");
+    goto cleanup;
+  }
+
+  // hw_frame receives the decoded frame on both paths
+  dec->hw_frame = av_frame_alloc();
+  dec->pkt = av_packet_alloc();
+  if (!dec->hw_frame || !dec->pkt) {
+    log(ERROR, "Failed to allocate frame/packet");
+    ret = -ENOMEM;
+    goto cleanup;
+  }
+
+  return 0;
+
+  cleanup:
+  cleanup_decoder(dec);
+  return ret;
+}
+
+static void copy_to_nv12(
+  const AVFrame* src,
+  uint8_t* out_buf,
+  uint32_t width,
+  uint32_t height
+) {
+  /**
+   * Copies a software decoded frame into a tightly packed NV12 buffer
+   *
+   * The software decoder produces planar YUV420P with padded
+   * linesizes, while the frame buffers shared with consumers are
+   * NV12, so the chroma planes are interleaved on the way out.
+   */
+  for (uint32_t row = 0; row < height; row++) {
+    memcpy(
+      out_buf + row * width,
+      src->data[0] + row * src->linesize[0],
+      width
+    );
+  }
+
+  uint8_t* uv = out_buf + width * height;
+  for (uint32_t row = 0; row < height / 2; row++) {
+    const uint8_t* u = src->data[1] + row * src->linesize[1];
+    const uint8_t* v = src->data[2] + row * src->linesize[2];
+    uint8_t* dst = uv + row * width;
+    for (uint32_t col = 0; col < width / 2; col++) {
+      dst[col * 2] = u[col];
+      dst[col * 2 + 1] = v[col];
+    }
+  }
+}
+
 void cleanup_decoder(decoder* dec) {
   if (dec->pkt) {
     av_packet_free(&dec->pkt);
@@ -152,6 +263,11 @@ int recv_frame(decoder* dec, uint8_t* out_buf) {
     return ret;
   }
 
+  if (!dec->hw_device_ctx) {
+    copy_to_nv12(dec->hw_frame, out_buf, dec->width, dec->height);
+    return 0;
+  }
+
   dec->frame->data[0] = out_buf;
   dec->frame->data[1] = out_buf + (dec->width * dec->height);
   dec->frame->linesize[0] = dec->width;
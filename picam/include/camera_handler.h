@@ -17,6 +17,8 @@ class camera_handler_t {
 public:
   camera_handler_t(
     config& config,
+    libcamera::CameraManager& cm,
+    unsigned int camera_idx,
     sem_t& loop_ctl_sem,
     volatile sig_atomic_t& frame_rdy
   );
@@ -25,13 +27,14 @@ public:
   camera_handler_t& operator=(const camera_handler_t&) = delete;
   camera_handler_t(camera_handler_t&&) = delete;
   camera_handler_t& operator=(camera_handler_t&&) = delete;
-  void queue_request();
+  int queue_request();
 
   uint8_t* frame_buffer;
+  volatile uint64_t completed_ns; // CLOCK_MONOTONIC time of the last completed capture
 
 private:
   void init_frame_bytes(config& config);
-  void init_camera_manager();
+  void init_camera(libcamera::CameraManager& cm, unsigned int camera_idx);
   void init_camera_config(config& config);
   void init_dma_buffer();
   void init_camera_controls(config& config);
@@ -43,7 +46,6 @@ private:
   volatile sig_atomic_t& frame_rdy;
 
   std::unique_ptr<libcamera::Request> request;
-  std::unique_ptr<libcamera::CameraManager> cm_;
   std::shared_ptr<libcamera::Camera> camera_;
   std::unique_ptr<libcamera::CameraConfiguration> config_;
   std::unique_ptr<libcamera::FrameBufferAllocator> allocator_;
@@ -51,4 +53,6 @@ private:
   libcamera::Stream* stream_;
 };
 
+std::unique_ptr<libcamera::CameraManager> init_camera_manager(unsigned int camera_count);
+
 #endif // CAMERAHANDLER_H
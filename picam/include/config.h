@@ -12,7 +12,10 @@ struct config {
   std::string udp_port;
   std::string enc_speed;
   std::string enc_quality;
+  std::string enc_cpus; // "auto" when missing
   int recording_cpu;
+  int camera_count;     // 1 when missing
+  int enc_threads;      // 0 when missing, one worker per ENC_CPUS core
   int dma_buffers;
   int frame_width;
   int frame_height;
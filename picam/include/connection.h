@@ -5,9 +5,23 @@
 #ifndef CONNECTION_H
 #define CONNECTION_H
 
-#include <queue>
+#include <cstdint>
 #include <string>
 #include "config.h"
+#include "lockfree_ring.h"
+
+// x264 holds frames for lookahead and B-frames before the first packet
+// comes out, about 40 at preset medium, so the ring is sized well past
+// the most videnc lets it hold (see ENC_MAX_DELAY)
+constexpr size_t FRAME_TS_RING_SIZE = 128;
+
+// per packet encoder statistics, sent to the server after the frame size
+struct __attribute__((packed)) frame_stats {
+  uint8_t pict_type;  // AVPictureType, 1 = I, 2 = P, 3 = B
+  uint8_t qp;         // average quantizer of the frame
+  uint16_t reserved;
+  uint32_t encode_us; // time from encode_frame() to the packet being received
+};
 
 class connection {
 public:
@@ -17,7 +31,7 @@ public:
 
   int tcpfd;
   int conn_tcp();
-  int stream_pkt(const uint8_t* data, uint32_t size);
+  int stream_pkt(const uint8_t* data, uint32_t size, const frame_stats& stats);
   int end_stream();
   void discon_tcp();
 
@@ -25,7 +39,8 @@ public:
   int bind_udp();
   size_t recv_msg(char* msg_buf, size_t size);
 
-  std::queue<uint64_t> frame_timestamps;
+  // capture timestamps of frames inside the encoder, in encode order
+  spsc_ring<uint64_t, FRAME_TS_RING_SIZE> frame_timestamps;
 
 private:
   std::string server_ip;
@@ -14,6 +14,14 @@ extern "C" {
 #include <libavcodec/avcodec.h>
 }
 
+// x264's rc-lookahead, set explicitly so no preset can deepen the frame delay
+constexpr int ENC_LOOKAHEAD = 40;
+// frames x264 can hold before returning a packet: lookahead, B-frames (16 at most) and margin
+constexpr int ENC_MAX_DELAY = ENC_LOOKAHEAD + 16 + 8;
+static_assert(ENC_MAX_DELAY < (int)FRAME_TS_RING_SIZE - 1, "capture timestamp ring can't cover the encoder delay");
+
+constexpr int ENC_TIMES_SIZE = FRAME_TS_RING_SIZE; // one encode start time per frame in flight
+
 class videnc {
 public:
   videnc(const config& config);
@@ -21,12 +29,13 @@ public:
 
   void encode_frame(uint8_t* data);
   void flush();
-  uint8_t* recv_frame(int& size);
+  uint8_t* recv_frame(int& size, frame_stats* stats = nullptr);
 
 private:
   int width;
   int height;
   int64_t pts_counter;
+  uint64_t enc_start_ns[ENC_TIMES_SIZE];
   const AVCodec* codec;
   AVCodecContext* ctx;
   AVFrame* frame;
@@ -0,0 +1,56 @@
+// © 2024 Alec Fessler
+// MIT License
+// See LICENSE file in the project root for full license information.
+
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+#include <cstdint>
+#include <signal.h>
+
+constexpr int WD_MAX_SENSORS = 2;
+constexpr int WD_MISS_LIMIT = 5; // consecutive misses before a sensor is restarted
+
+enum frame_stage {
+  STAGE_ARM,      // timer armed for the frame's target time
+  STAGE_FIRE,     // timer fired and the capture request was queued
+  STAGE_COMPLETE, // camera finished the capture
+  STAGE_SENT,     // encoded frame handed to the server
+  STAGE_COUNT
+};
+
+class watchdog_t {
+public:
+  watchdog_t(uint64_t frame_duration, int sensor_count);
+  watchdog_t(const watchdog_t&) = delete;
+  watchdog_t& operator=(const watchdog_t&) = delete;
+
+  void arm(uint64_t mono_target_ns);
+  void mark(int sensor, frame_stage stage, uint64_t mono_ns);
+  void fail(int sensor, frame_stage stage);
+  int check(uint64_t mono_now_ns);
+  void recovered(int sensor);
+  void reset();
+  uint64_t misses(int sensor, frame_stage stage) const;
+
+private:
+  void miss(int sensor, frame_stage stage);
+
+  uint64_t frame_duration;
+  int sensor_count;
+
+  // written from signal handlers, read by check() on the main thread
+  volatile uint64_t target_ns;
+  volatile uint64_t stage_ns[WD_MAX_SENSORS][STAGE_COUNT];
+  volatile sig_atomic_t failed[WD_MAX_SENSORS][STAGE_COUNT];
+
+  // main thread only
+  uint64_t judged_fire_ns[WD_MAX_SENSORS];
+  uint64_t judged_target_ns[WD_MAX_SENSORS];
+  uint64_t miss_counts[WD_MAX_SENSORS][STAGE_COUNT];
+  int consecutive_misses[WD_MAX_SENSORS];
+};
+
+uint64_t mono_now_ns();
+
+#endif // WATCHDOG_H
@@ -3,6 +3,7 @@
 #include <semaphore.h>
 #include <stdexcept>
 #include <sys/mman.h>
+#include <time.h>
 
 #include "camera_handler.h"
 #include "config.h"
@@ -11,9 +12,12 @@
 
 camera_handler_t::camera_handler_t(
   config& config,
+  libcamera::CameraManager& cm,
+  unsigned int camera_idx,
   sem_t& loop_ctl_sem,
   volatile sig_atomic_t& frame_rdy
 ) :
+  completed_ns(0),
   loop_ctl_sem(loop_ctl_sem),
   frame_rdy(frame_rdy) {
   /**
@@ -30,18 +34,20 @@ camera_handler_t::camera_handler_t(
    *
    * Parameters:
    *   config:        Camera and frame settings including resolution and buffer counts
-   *   frame_queue:   Lock-free queue for sharing frame buffers with main loop
-   *   loop_ctl_sem: Semaphore tracking available frames in the queue
+   *   cm:            Started camera manager, shared by every sensor in the process
+   *   camera_idx:    Which of the manager's cameras (CSI port) this handler drives
+   *   loop_ctl_sem:  Semaphore tracking available frames in the queue
+   *   frame_rdy:     Flag set when this sensor has a completed frame
    *
    * The initialization sequence is:
    * 1. Configure frame properties (resolution, format)
-   * 2. Initialize camera manager and acquire device
+   * 2. Acquire the camera device from the manager
    * 3. Apply camera configuration
    * 4. Set up DMA buffers and memory mapping
    * 5. Configure camera controls (exposure, focus, etc)
    */
   init_frame_bytes(config);
-  init_camera_manager();
+  init_camera(cm, camera_idx);
   init_camera_config(config);
   init_dma_buffer();
   init_camera_controls(config);
@@ -64,33 +70,56 @@ void camera_handler_t::init_frame_bytes(config& config) {
   frame_bytes_ = y_plane_bytes + u_plane_bytes + v_plane_bytes;
 }
 
-void camera_handler_t::init_camera_manager() {
+std::unique_ptr<libcamera::CameraManager> init_camera_manager(unsigned int camera_count) {
   /**
-   * Initializes and acquires exclusive access to the camera device.
+   * Starts the camera manager shared by every sensor in the process.
    *
-   * The initialization sequence is:
-   * 1. Start the camera manager service
-   * 2. Enumerate available cameras
-   * 3. Select and acquire first available camera
+   * libcamera only allows a single camera manager per process, so it's
+   * owned by main rather than by each camera handler. It must outlive
+   * all handlers created from it.
+   *
+   * Parameters:
+   *   camera_count: Number of sensors the process will drive
    *
    * Throws:
-   *   std::runtime_error: On any initialization failure (detailed in error message)
+   *   std::runtime_error: If the manager fails to start or fewer than
+   *                       camera_count cameras are connected
    */
-  cm_ = std::make_unique<libcamera::CameraManager>();
-  if (cm_->start() < 0) {
+  auto cm = std::make_unique<libcamera::CameraManager>();
+  if (cm->start() < 0) {
     const char* err = "Failed to start camera manager";
     LOG(ERROR, err);
     throw std::runtime_error(err);
   }
 
-  auto cameras = cm_->cameras();
-  if (cameras.empty()) {
-    const char* err = "No cameras available";
+  if (cm->cameras().size() < camera_count) {
+    const char* err = "Fewer cameras available than CAMERA_COUNT";
     LOG(ERROR, err);
     throw std::runtime_error(err);
   }
 
-  camera_ = cm_->get(cameras[0]->id());
+  return cm;
+}
+
+void camera_handler_t::init_camera(libcamera::CameraManager& cm, unsigned int camera_idx) {
+  /**
+   * Acquires exclusive access to one of the manager's cameras.
+   *
+   * Parameters:
+   *   cm:         Started camera manager
+   *   camera_idx: Index into the manager's camera list
+   *
+   * Throws:
+   *   std::runtime_error: On any initialization failure (detailed in error message)
+   */
+  auto cameras = cm.cameras();
+  if (camera_idx >= cameras.size()) {
+    const char* err = "No camera available at the requested index";
+    LOG(ERROR, err);
+    throw std::runtime_error(err);
+  }
+
+  camera_ = cm.get(cameras[camera_idx]->id());
   if (!camera_) {
     const char* err = "Failed to retrieve camera";
     LOG(ERROR, err);
@@ -268,7 +297,9 @@ camera_handler_t::~camera_handler_t() {
    * 2. Unmap DMA buffers
    * 3. Free buffer allocator
    * 4. Release camera device
-   * 5. Stop camera manager
+   *
+   * The camera manager is stopped by its owner once every
+   * handler has been destroyed.
    *
    * Warning: Do not modify this sequence as it may cause
    * undefined behavior or resource leaks
@@ -279,15 +310,21 @@ camera_handler_t::~camera_handler_t() {
   allocator_.reset();
   camera_->release();
   camera_.reset();
-  cm_->stop();
 }
 
-void camera_handler_t::queue_request() {
-  if (camera_->queueRequest(request.get()) < 0) {
-    const char* err = "Failed to queue request";
-    LOG(ERROR, err);
-    throw std::runtime_error(err);
-  }
+int camera_handler_t::queue_request() {
+  /**
+   * Queues the capture request, called from the timer signal handler.
+   *
+   * Must not throw or log, since neither is async-signal-safe. A
+   * failure, typically because the previous capture never completed
+   * and the request is still queued, is returned so the caller can
+   * report it to the watchdog, which logs it from thread context.
+   *
+   * Returns:
+   *   0 on success, negative error code from libcamera on failure
+   */
+  return camera_->queueRequest(request.get());
 }
 
 void camera_handler_t::request_complete(libcamera::Request* request) {
@@ -295,6 +332,9 @@ void camera_handler_t::request_complete(libcamera::Request* request) {
     return;
 
   request->reuse(libcamera::Request::ReuseBuffers);
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  completed_ns = (uint64_t)ts.tv_sec * 1'000'000'000 + ts.tv_nsec;
   frame_rdy = 1;
   sem_post(&loop_ctl_sem);
 }
@@ -53,6 +53,11 @@ config parse_config(const std::string& filename) {
    * - Presence of both key and value in each non-comment line
    * - Recognition of all configuration keys
    * - Successful conversion of numeric values
+   * - Encoder placement: ENC_CPUS defaults to "auto" and ENC_THREADS
+   *   to 0 (one worker per encoder core) when missing, an empty
+   *   ENC_CPUS or a negative ENC_THREADS is rejected here rather than
+   *   deep in encoder setup
+   * - CAMERA_COUNT defaults to 1 when missing, as before it existed
    *
    * Parameters:
    *   filename: Path to the configuration file
@@ -63,10 +68,15 @@ config parse_config(const std::string& filename) {
    * Throws:
    *   std::runtime_error: If file cannot be opened
    *   std::runtime_error: If an unknown configuration key is found
+   *   std::runtime_error: If ENC_CPUS is empty or ENC_THREADS is negative
    *   std::invalid_argument: If numeric conversion fails (via std::stoi)
    *   std::out_of_range: If numeric value exceeds integer limits
    */
   config config;
+  config.enc_cpus = "auto";
+  config.enc_threads = 0;
+  config.camera_count = 1;
+
   std::ifstream file(filename);
   if (!file)
     LOG(ERROR, "Could not open config file");
@@ -91,6 +101,12 @@ config parse_config(const std::string& filename) {
         config.enc_speed = value;
       else if (key == "ENC_QUALITY")
         config.enc_quality = value;
+      else if (key == "ENC_CPUS")
+        config.enc_cpus = value;
+      else if (key == "ENC_THREADS")
+        config.enc_threads = std::stoi(value);
+      else if (key == "CAMERA_COUNT")
+        config.camera_count = std::stoi(value);
       else if (key == "RECORDING_CPU")
         config.recording_cpu = std::stoi(value);
       else if (key == "DMA_BUFFERS")
@@ -110,5 +126,17 @@ config parse_config(const std::string& filename) {
     }
   }
 
+  if (config.enc_cpus.empty()) {
+    const char* err = "ENC_CPUS is empty, list cores (e.g. 0-2) or use auto";
+    LOG(ERROR, err);
+    throw std::runtime_error(err);
+  }
+
+  if (config.enc_threads < 0) {
+    const char* err = "ENC_THREADS must be 0 (one per encoder core) or more";
+    LOG(ERROR, err);
+    throw std::runtime_error(err);
+  }
+
   return config;
 }
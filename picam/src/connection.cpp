@@ -146,12 +146,26 @@ int connection::conn_tcp() {
   return 0;
 }
 
-int connection::stream_pkt(const uint8_t* data, uint32_t size) {
+int connection::stream_pkt(const uint8_t* data, uint32_t size, const frame_stats& stats) {
+  /**
+   * Streams one encoded frame to the server.
+   *
+   * Packet layout:
+   *   uint64_t    timestamp (the frame's scheduled capture time)
+   *   uint32_t    size of the encoded frame
+   *   frame_stats encoder statistics for the frame
+   *   uint8_t[]   encoded frame
+   */
   char logstr[128];
 
-  uint64_t timestamp = frame_timestamps.front();
-  frame_timestamps.pop();
-  uint64_t pkt_size = size + sizeof(size) + sizeof(timestamp);
+  uint64_t timestamp;
+  if (!frame_timestamps.pop(timestamp)) {
+    LOG(ERROR, "Encoded frame has no capture timestamp");
+    return -EPROTO;
+  }
+
+  uint64_t header_size = sizeof(timestamp) + sizeof(size) + sizeof(stats);
+  uint64_t pkt_size = size + header_size;
   uint8_t pkt[pkt_size];
 
   memcpy(
@@ -166,6 +180,11 @@ int connection::stream_pkt(const uint8_t* data, uint32_t size) {
   );
   memcpy(
     pkt + sizeof(timestamp) + sizeof(size),
+    (const uint8_t*)&stats,
+    sizeof(stats)
+  );
+  memcpy(
+    pkt + header_size,
     data,
     size
   );
@@ -13,6 +13,7 @@
 #include <fcntl.h>
 #include <iostream>
 #include <memory>
+#include <pthread.h>
 #include <sched.h>
 #include <signal.h>
 #include <sstream>
@@ -25,17 +26,32 @@
 #include "logging.h"
 #include "sem_init.h"
 #include "videnc.h"
+#include "watchdog.h"
 
 constexpr uint64_t ns_per_s = 1'000'000'000;
+constexpr int max_sensors = 2; // the Pi 5 has two CSI ports
+
+struct sensor {
+  std::unique_ptr<camera_handler_t> cam;
+  std::unique_ptr<connection> conn;
+  std::unique_ptr<videnc> encoder;
+  volatile sig_atomic_t frame_rdy;
+  volatile uint64_t capture_ts; // target timestamp of the capture in flight
+  config conf; // per sensor copy, differs only in tcp_port
+};
 
 volatile static uint64_t timestamp = 0;
 volatile static sig_atomic_t running = 1;
 volatile static sig_atomic_t stream_end = 0;
-volatile static sig_atomic_t frame_rdy = 0;
+volatile static sig_atomic_t timer_armed = 0;
+volatile static uint64_t armed_target = 0;
 
 static std::unique_ptr<sem_t, sem_deleter> loop_ctl_sem;
-static std::unique_ptr<camera_handler_t> cam;
-static std::unique_ptr<connection> conn;
+static std::unique_ptr<libcamera::CameraManager> cm;
+static sensor sensors[max_sensors];
+static int sensor_count = 0;
+static std::unique_ptr<connection> ctl_conn;
+static std::unique_ptr<watchdog_t> watchdog;
 
 inline int init_realtime_scheduling(int recording_cpu);
 inline int init_timer(timer_t* timerid);
@@ -50,6 +66,8 @@ inline int flush_encoder(
   videnc& encoder,
   connection& conn
 );
+inline void wait_for_event(uint64_t frame_duration);
+inline void recover_sensor(int idx);
 
 int main() {
   try {
@@ -60,29 +78,50 @@ int main() {
     }
 
     config config = parse_config("config.txt");
+    if (config.camera_count < 1 || config.camera_count > max_sensors) {
+      LOG(ERROR, "CAMERA_COUNT must be 1 or 2");
+      return -EINVAL;
+    }
 
     uint64_t frame_counter = 0;
     uint64_t frame_duration = ns_per_s / config.fps;
     timer_t timerid;
 
     loop_ctl_sem = init_semaphore();
-
-    cam = std::make_unique<camera_handler_t>(
-      config,
-      *loop_ctl_sem.get(),
-      frame_rdy
-    );
-    conn = std::make_unique<connection>(config);
-    auto encoder = std::make_unique<videnc>(config);
+    cm = init_camera_manager(config.camera_count);
+
+    // every sensor shares the capture schedule, but streams to
+    // its own server port at TCP_PORT + sensor index
+    for (int i = 0; i < config.camera_count; i++) {
+      sensor& s = sensors[i];
+      s.conf = config;
+      s.conf.tcp_port = std::to_string(std::stoi(config.tcp_port) + i);
+      s.frame_rdy = 0;
+      s.cam = std::make_unique<camera_handler_t>(
+        s.conf,
+        *cm,
+        i,
+        *loop_ctl_sem.get(),
+        s.frame_rdy
+      );
+      s.conn = std::make_unique<connection>(s.conf);
+      s.encoder = std::make_unique<videnc>(s.conf);
+      sensor_count++;
+    }
+    ctl_conn = std::make_unique<connection>(config);
+    watchdog = std::make_unique<watchdog_t>(frame_duration, sensor_count);
 
     if ((ret = init_realtime_scheduling(config.recording_cpu)) < 0) return ret;
     if ((ret = init_timer(&timerid)) < 0) return ret;
     if ((ret = init_signals()) < 0) return ret;
-    if ((ret = conn->bind_udp()) < 0) return ret;
-    if ((ret = init_sigio(conn->udpfd)) < 0) return ret;
+    if ((ret = ctl_conn->bind_udp()) < 0) return ret;
+    if ((ret = init_sigio(ctl_conn->udpfd)) < 0) return ret;
 
     while (running) {
-      if (timestamp) {
+      // each sensor posts the semaphore for its own frame, so only
+      // arm once per capture, after the previous timer has fired
+      if (timestamp && !timer_armed) {
+        timer_armed = 1;
         arm_timer(
           timerid,
           frame_duration,
@@ -90,38 +129,90 @@ int main() {
         );
       }
 
-      sem_wait(loop_ctl_sem.get());
-
-      if (frame_rdy) {
-        frame_rdy = 0;
-        if (!stream_end) {
-          encoder->encode_frame(cam->frame_buffer);
+      wait_for_event(frame_duration);
+
+      bool conn_reset = false;
+      for (int i = 0; i < sensor_count; i++) {
+        sensor& s = sensors[i];
+        if (!s.frame_rdy)
+          continue;
+
+        s.frame_rdy = 0;
+        watchdog->mark(i, STAGE_COMPLETE, s.cam->completed_ns);
+        if (stream_end)
+          continue;
+
+        try {
+          // pair the timestamp with the frame as it enters the encoder,
+          // so a missed capture can never shift later frames' timestamps.
+          // A lost timestamp would shift every later packet's instead, so
+          // it resets the stream just like a lost connection
+          if (!s.conn->frame_timestamps.push((uint64_t)s.capture_ts)) {
+            LOG(ERROR, "Frame timestamp ring full, resetting the stream");
+            conn_reset = true;
+            continue;
+          }
+          s.encoder->encode_frame(s.cam->frame_buffer);
           int pkt_size = 0;
-          uint8_t* ptr = encoder->recv_frame(pkt_size);
+          frame_stats stats;
+          uint8_t* ptr = s.encoder->recv_frame(pkt_size, &stats);
           if (ptr) {
-            ret = conn->stream_pkt(ptr, pkt_size);
-            if (ret == -ECONNRESET) {
-              timestamp = 0;
-              frame_counter = 0;
-              stream_end = 0;
-              conn->discon_tcp();
-              encoder = std::make_unique<videnc>(config);
-            }
+            ret = s.conn->stream_pkt(ptr, pkt_size, stats);
+            if (ret == -ECONNRESET || ret == -EPROTO)
+              conn_reset = true;
           }
+          watchdog->mark(i, STAGE_SENT, mono_now_ns());
+        } catch (const std::runtime_error& e) {
+          LOG(ERROR, "Encoder failed, restarting it");
+          s.conn->frame_timestamps.clear();
+          s.encoder = std::make_unique<videnc>(s.conf);
+        }
+      }
+
+      if (timestamp) {
+        int recover = watchdog->check(mono_now_ns());
+        for (int i = 0; i < sensor_count; i++) {
+          if (recover & (1 << i))
+            recover_sensor(i);
+        }
+      }
+
+      if (conn_reset) {
+        // the server restarts every stream together, so drop all of
+        // them and wait for the next timestamp broadcast
+        timestamp = 0;
+        frame_counter = 0;
+        stream_end = 0;
+        watchdog->reset();
+        for (int i = 0; i < sensor_count; i++) {
+          sensors[i].conn->discon_tcp();
+          sensors[i].conn->frame_timestamps.clear();
+          sensors[i].encoder = std::make_unique<videnc>(sensors[i].conf);
         }
       }
 
       if (stream_end) {
         stream_end = 0;
         frame_counter = 0;
-        ret = flush_encoder(*encoder, *conn);
-        if (ret == 0)
-          conn->end_stream();
-        encoder = std::make_unique<videnc>(config);
+        watchdog->reset();
+        for (int i = 0; i < sensor_count; i++) {
+          sensor& s = sensors[i];
+          ret = flush_encoder(*s.encoder, *s.conn);
+          if (ret == 0)
+            s.conn->end_stream();
+          s.conn->frame_timestamps.clear();
+          s.encoder = std::make_unique<videnc>(s.conf);
+        }
       }
     }
 
-    flush_encoder(*encoder, *conn);
+    for (int i = 0; i < sensor_count; i++)
+      flush_encoder(*sensors[i].encoder, *sensors[i].conn);
+
+    // handlers must release their cameras before the manager stops
+    for (int i = 0; i < sensor_count; i++)
+      sensors[i].cam.reset();
+    cm.reset();
     cleanup_logging();
 
   } catch (const std::exception& e) {
@@ -143,7 +234,17 @@ void capture_signal_handler(int signo, siginfo_t* info, void* context) {
   (void)signo;
   (void)info;
   (void)context;
-  cam->queue_request();
+  timer_armed = 0;
+  uint64_t fired_ns = mono_now_ns();
+  for (int i = 0; i < sensor_count; i++) {
+    sensor& s = sensors[i];
+    if (!s.cam || s.cam->queue_request() < 0) {
+      watchdog->fail(i, STAGE_FIRE);
+      continue;
+    }
+    s.capture_ts = armed_target;
+    watchdog->mark(i, STAGE_FIRE, fired_ns);
+  }
 }
 
 void io_signal_handler(int signo, siginfo_t* info, void* context) {
@@ -153,7 +254,7 @@ void io_signal_handler(int signo, siginfo_t* info, void* context) {
 
   size_t buf_size = 8; // bytes
   char buf[buf_size];
-  size_t size = conn->recv_msg(buf, buf_size);
+  size_t size = ctl_conn->recv_msg(buf, buf_size);
 
   // 8 bytes is our timestamp
   if (size == 8) {
@@ -197,6 +298,10 @@ inline int init_realtime_scheduling(int recording_cpu) {
    *    before it can be scheduled on our core. Additionally, any process
    *    of lower priority than max will be preempted as soon as we have
    *    a signal to handle or the semaphore is unblocked.
+   *
+   * Both calls only apply to the calling (main) thread. Encoder worker
+   * threads are created on ENC_CPUS at normal priority (see videnc), so
+   * they keep running on the other cores while this one stays isolated.
    */
   char logstr[128];
 
@@ -251,12 +356,18 @@ inline int init_timer(timer_t* timerid) {
    * signals is controlled by arm_timer(), which calculates the appropriate
    * monotonic clock targets based on our PTP-synchronized real time targets.
    *
+   * The signal is directed at the main thread (SIGEV_THREAD_ID) rather than
+   * the process, so it can never land on an encoder or libcamera thread,
+   * and so recover_sensor() can hold it off by blocking it on this thread.
+   *
    * Returns 0 on success, -errno on failure
    */
   char logstr[128];
 
   struct sigevent sev;
-  sev.sigev_notify = SIGEV_SIGNAL;
+  memset(&sev, 0, sizeof(sev));
+  sev.sigev_notify = SIGEV_THREAD_ID;
+  sev._sigev_un._tid = gettid(); // sigev_notify_thread_id, not exposed by older glibc
   sev.sigev_signo = SIGUSR1;
   sev.sigev_value.sival_ptr = timerid;
 
@@ -317,7 +428,7 @@ inline void arm_timer(timer_t timerid, uint64_t frame_duration, uint64_t& frame_
     uint64_t current_mono_ns = (uint64_t)mono_time.tv_sec * ns_per_s + mono_time.tv_nsec;
 
     uint64_t target = timestamp + frame_duration * frame_counter;
-    uint64_t ns_until_target = target - current_real_ns;
+    int64_t ns_until_target = (int64_t)(target - current_real_ns);
 
     if (ns_until_target <= 0) {
         uint32_t frames_elapsed = (-ns_until_target / frame_duration) + 1;
@@ -327,9 +438,10 @@ inline void arm_timer(timer_t timerid, uint64_t frame_duration, uint64_t& frame_
         target += frame_duration * frames_elapsed; // adjust the target for the connections timestamp queue
     }
 
-    conn->frame_timestamps.push(target);
+    armed_target = target;
 
     uint64_t mono_target_ns = current_mono_ns + ns_until_target;
+    watchdog->arm(mono_target_ns);
 
     struct itimerspec its;
     its.it_value.tv_sec = mono_target_ns / ns_per_s;
@@ -389,7 +501,7 @@ inline int init_signals() {
    *
    * SIGUSR1 - emitted when the timer (see init_timer(), arm_timer())
    *           reaches the assigned timestamp, handled by enqueueing
-   *           a capture request with the camera
+   *           a capture request with every camera
    *
    * SIGIO   - emitted whenever data is received on the udp port
    *           (see connection::bind_udp(), io_signal_handler()).
@@ -441,10 +553,101 @@ inline int init_signals() {
 inline int flush_encoder(videnc& encoder, connection& conn) {
     encoder.flush();
     int pkt_size = 0;
+    frame_stats stats;
     uint8_t* ptr = nullptr;
-    while ((ptr = encoder.recv_frame(pkt_size)) != nullptr) {
-      int ret = conn.stream_pkt(ptr, pkt_size);
-      if (ret == -ECONNRESET) return ret;
+    while ((ptr = encoder.recv_frame(pkt_size, &stats)) != nullptr) {
+      int ret = conn.stream_pkt(ptr, pkt_size, stats);
+      if (ret == -ECONNRESET || ret == -EPROTO) return ret;
     }
     return 0;
 }
+
+inline void wait_for_event(uint64_t frame_duration) {
+  /**
+   * Blocks on the loop semaphore until there is work to do
+   *
+   * While idle (no timestamp) this blocks indefinitely, exactly like
+   * a plain sem_wait. While recording, the wait is bounded to one frame
+   * interval so the watchdog still gets to run if a capture completion
+   * never arrives, instead of the loop blocking forever.
+   *
+   * The timeout uses CLOCK_MONOTONIC so PTP adjustments to the realtime
+   * clock can't stretch or shorten it.
+   */
+  if (!timestamp) {
+    sem_wait(loop_ctl_sem.get());
+    return;
+  }
+
+  uint64_t deadline = mono_now_ns() + frame_duration;
+  struct timespec ts;
+  ts.tv_sec = deadline / ns_per_s;
+  ts.tv_nsec = deadline % ns_per_s;
+  sem_clockwait(loop_ctl_sem.get(), CLOCK_MONOTONIC, &ts);
+}
+
+inline void recover_sensor(int idx) {
+  /**
+   * Restarts a sensor's camera and encoder in process
+   *
+   * Called once the watchdog has seen WD_MISS_LIMIT consecutive missed
+   * deadlines. Recreating the camera handler stops the camera, which
+   * cancels any stuck request, and reacquires it from the shared manager.
+   * The capture signal is blocked meanwhile so the handler never sees a
+   * half constructed camera; a timer that fires during the restart is
+   * delivered as soon as it's unblocked.
+   *
+   * The frame schedule itself is untouched, arm_timer() skips any frames
+   * whose target passed during the restart, so the sensor rejoins at the
+   * next frame index in sync with the rest of the rig. This costs a few
+   * frames rather than the seconds a systemd restart would.
+   *
+   * If the camera can't be reacquired the sensor is left without one,
+   * the capture handler skips it, and the next round of misses retries.
+   */
+  char logstr[128];
+  sensor& s = sensors[idx];
+
+  sigset_t capture_sig, prev_mask;
+  sigemptyset(&capture_sig);
+  sigaddset(&capture_sig, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &capture_sig, &prev_mask);
+
+  snprintf(
+    logstr,
+    sizeof(logstr),
+    "Sensor %d missed %d consecutive deadlines, restarting camera and encoder",
+    idx,
+    WD_MISS_LIMIT
+  );
+  LOG(WARNING, logstr);
+
+  try {
+    s.cam.reset();
+    s.frame_rdy = 0;
+    s.cam = std::make_unique<camera_handler_t>(
+      s.conf,
+      *cm,
+      idx,
+      *loop_ctl_sem.get(),
+      s.frame_rdy
+    );
+
+    // anything still in the encoder belongs to frames before the stall
+    flush_encoder(*s.encoder, *s.conn);
+    s.conn->frame_timestamps.clear();
+    s.encoder = std::make_unique<videnc>(s.conf);
+  } catch (const std::exception& e) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Failed to restart sensor %d: %s",
+      idx,
+      e.what()
+    );
+    LOG(ERROR, logstr);
+  }
+
+  watchdog->recovered(idx);
+  pthread_sigmask(SIG_SETMASK, &prev_mask, nullptr);
+}
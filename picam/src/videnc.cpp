@@ -2,13 +2,147 @@
 // MIT License
 // See LICENSE file in the project root for full license information.
 
+#include <cerrno>
+#include <cstring>
 #include <functional>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdexcept>
 #include <string>
+#include <time.h>
+#include <unistd.h>
 
 #include "logging.h"
 #include "videnc.h"
 
+static uint64_t mono_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void parse_cpu_list(
+  const std::string& cpus,
+  int recording_cpu,
+  cpu_set_t* cpuset
+) {
+  /**
+   * Parses the ENC_CPUS config value into a cpu set.
+   *
+   * Accepts a comma separated list of cores and inclusive ranges,
+   * e.g. "0-2" or "0,1,2". The value "auto" selects every online
+   * core except the recording cpu.
+   *
+   * The recording cpu is always removed from the resulting set so
+   * encoder workers can never compete with the timing thread.
+   *
+   * Throws:
+   *   std::runtime_error: If the list is malformed or leaves no usable cores
+   */
+  CPU_ZERO(cpuset);
+
+  if (cpus == "auto") {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    for (long cpu = 0; cpu < online && cpu < CPU_SETSIZE; cpu++)
+      CPU_SET(cpu, cpuset);
+  } else {
+    size_t pos = 0;
+    while (pos < cpus.length()) {
+      size_t end = cpus.find(',', pos);
+      if (end == std::string::npos)
+        end = cpus.length();
+
+      std::string token = cpus.substr(pos, end - pos);
+      size_t dash = token.find('-');
+      int first = std::stoi(token.substr(0, dash));
+      int last = dash == std::string::npos ? first : std::stoi(token.substr(dash + 1));
+      if (first < 0 || last < first || last >= CPU_SETSIZE)
+        throw std::runtime_error("Invalid ENC_CPUS entry: " + token);
+
+      for (int cpu = first; cpu <= last; cpu++)
+        CPU_SET(cpu, cpuset);
+
+      pos = end + 1;
+    }
+  }
+
+  CPU_CLR(recording_cpu, cpuset);
+  if (CPU_COUNT(cpuset) == 0) {
+    const char* err = "ENC_CPUS leaves no cores for the encoder";
+    LOG(ERROR, err);
+    throw std::runtime_error(err);
+  }
+}
+
+static int open_codec_off_rt_core(
+  AVCodecContext* ctx,
+  const AVCodec* codec,
+  AVDictionary** opts,
+  const cpu_set_t& enc_cpus
+) {
+  /**
+   * Opens the codec so that any threads x264 spawns land on the encoder cores.
+   *
+   * x264 creates its slice/frame worker pool and lookahead thread inside
+   * avcodec_open2, and new threads inherit the affinity, scheduling policy
+   * and signal mask of the thread that creates them. Once the main thread
+   * has been made realtime (see init_realtime_scheduling()), opening the
+   * codec directly would put every worker on the recording cpu at max
+   * FIFO priority, where they would compete with the capture timing.
+   *
+   * To avoid that, the calling thread temporarily:
+   * 1. Moves itself onto the encoder cores
+   * 2. Drops to SCHED_OTHER so workers run at normal priority
+   * 3. Blocks the timing/control signals so the kernel can only ever
+   *    deliver them to the main thread, never to an encoder worker
+   *
+   * All three are restored before returning, whatever the result.
+   *
+   * Returns:
+   *   The avcodec_open2 result, or -errno if the thread state can't be changed
+   */
+  char logstr[128];
+
+  cpu_set_t prev_cpus;
+  if (sched_getaffinity(0, sizeof(prev_cpus), &prev_cpus) < 0)
+    return -errno;
+
+  struct sched_param prev_param;
+  int prev_policy = sched_getscheduler(0);
+  if (prev_policy < 0 || sched_getparam(0, &prev_param) < 0)
+    return -errno;
+
+  sigset_t rt_signals, prev_mask;
+  sigemptyset(&rt_signals);
+  sigaddset(&rt_signals, SIGUSR1);
+  sigaddset(&rt_signals, SIGIO);
+  sigaddset(&rt_signals, SIGINT);
+  sigaddset(&rt_signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &rt_signals, &prev_mask);
+
+  struct sched_param normal_param;
+  normal_param.sched_priority = 0;
+  if (sched_setaffinity(0, sizeof(enc_cpus), &enc_cpus) < 0 ||
+      sched_setscheduler(0, SCHED_OTHER, &normal_param) < 0) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Failed to move encoder thread creation off the recording cpu: %s",
+      strerror(errno)
+    );
+    LOG(WARNING, logstr);
+  }
+
+  int ret = avcodec_open2(ctx, codec, opts);
+
+  sched_setscheduler(0, prev_policy, &prev_param);
+  sched_setaffinity(0, sizeof(prev_cpus), &prev_cpus);
+  pthread_sigmask(SIG_SETMASK, &prev_mask, nullptr);
+
+  return ret;
+}
+
 videnc::videnc(const config& config)
   : width(config.frame_width),
     height(config.frame_height),
@@ -27,6 +161,11 @@ videnc::videnc(const config& config)
    * - Time base and framerate from config ensure proper timing
    * - CRF (Constant Rate Factor) for quality-based bitrate
    * - Preset controls encoding speed/compression tradeoff
+   * - Slice threading with ENC_THREADS workers pinned to ENC_CPUS,
+   *   slices rather than frames so threading adds no frame delay
+   * - Lookahead capped at ENC_LOOKAHEAD, so together with B-frames
+   *   the frames held before a packet comes out always fit the
+   *   capture timestamp ring
    *
    * Parameters:
    *   config: Contains resolution, framerate, and encoding settings
@@ -35,6 +174,9 @@ videnc::videnc(const config& config)
    *   std::runtime_error: On any initialization failure, with cleanup
    *                      of previously allocated resources
    */
+  cpu_set_t enc_cpus;
+  parse_cpu_list(config.enc_cpus, config.recording_cpu, &enc_cpus);
+
   codec = avcodec_find_encoder_by_name("libx264");
   if (!codec) {
     const char* err = "Could not find libx264 encoder";
@@ -56,11 +198,15 @@ videnc::videnc(const config& config)
   ctx->pix_fmt = AV_PIX_FMT_YUV420P;
   ctx->codec_type = AVMEDIA_TYPE_VIDEO;
 
+  ctx->thread_count = config.enc_threads > 0 ? config.enc_threads : CPU_COUNT(&enc_cpus);
+  ctx->thread_type = FF_THREAD_SLICE;
+
   AVDictionary *opts = NULL;
   av_dict_set(&opts, "preset", config.enc_speed.c_str(), 0);
   av_dict_set(&opts, "crf", config.enc_quality.c_str(), 0);
+  av_dict_set_int(&opts, "rc-lookahead", ENC_LOOKAHEAD, 0);
 
-  if (avcodec_open2(ctx, codec, &opts) < 0) {
+  if (open_codec_off_rt_core(ctx, codec, &opts, enc_cpus) < 0) {
     av_dict_free(&opts);
     avcodec_free_context(&ctx);
     const char* err = "Could not open codec";
@@ -131,6 +277,7 @@ void videnc::encode_frame(uint8_t* data) {
   frame->data[2] = data + y_size + uv_size;
 
   frame->pts = pts_counter++;
+  enc_start_ns[frame->pts % ENC_TIMES_SIZE] = mono_ns();
 
   if (avcodec_send_frame(ctx, frame) < 0) {
     const char* err = "Error sending frame for encoding";
@@ -148,7 +295,21 @@ void videnc::flush() {
   }
 }
 
-uint8_t* videnc::recv_frame(int& size) {
+uint8_t* videnc::recv_frame(int& size, frame_stats* stats) {
+  /**
+   * Receives the next encoded packet, if one is available.
+   *
+   * When stats is provided it's filled from the packet:
+   * - Picture type and average QP come from the quality stats side
+   *   data x264 attaches to every packet (QP is stored as a lambda,
+   *   QP * FF_QP2LAMBDA, followed by the picture type byte)
+   * - Encode time is measured from when the frame with this packet's
+   *   pts was handed to encode_frame(), so lookahead delay is included
+   *
+   * Returns:
+   *   Pointer to the packet data, valid until the next call, or nullptr
+   *   if no packet is ready
+   */
   int ret = avcodec_receive_packet(ctx, pkt);
   if (ret == AVERROR(EAGAIN)) return nullptr; // no packets available yet
   if (ret == AVERROR_EOF) return nullptr; // no more packets
@@ -158,5 +319,22 @@ uint8_t* videnc::recv_frame(int& size) {
     throw std::runtime_error(err);
   }
   size = pkt->size;
+
+  if (stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->pict_type = (pkt->flags & AV_PKT_FLAG_KEY) ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+
+    size_t side_size = 0;
+    uint8_t* side = av_packet_get_side_data(pkt, AV_PKT_DATA_QUALITY_STATS, &side_size);
+    if (side && side_size >= 5) {
+      uint32_t quality;
+      memcpy(&quality, side, sizeof(quality));
+      stats->qp = (uint8_t)((quality + FF_QP2LAMBDA / 2) / FF_QP2LAMBDA);
+      stats->pict_type = side[4];
+    }
+
+    stats->encode_us = (uint32_t)((mono_ns() - enc_start_ns[pkt->pts % ENC_TIMES_SIZE]) / 1000);
+  }
+
   return pkt->data;
 }
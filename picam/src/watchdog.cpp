@@ -0,0 +1,176 @@
+// © 2024 Alec Fessler
+// MIT License
+// See LICENSE file in the project root for full license information.
+
+#include <cstdio>
+#include <cstring>
+#include <time.h>
+
+#include "logging.h"
+#include "watchdog.h"
+
+static const char* stage_names[] = {
+  "arm",
+  "fire",
+  "complete",
+  "sent"
+};
+
+uint64_t mono_now_ns() {
+  /**
+   * Reads CLOCK_MONOTONIC in nanoseconds, async-signal-safe
+   */
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1'000'000'000 + ts.tv_nsec;
+}
+
+watchdog_t::watchdog_t(uint64_t frame_duration, int sensor_count) :
+  frame_duration(frame_duration),
+  sensor_count(sensor_count) {
+  /**
+   * Tracks per-frame deadlines through the capture pipeline.
+   *
+   * Every frame passes through four stages, each stamped with
+   * CLOCK_MONOTONIC as it happens:
+   *
+   * 1. arm      - main loop sets the timer for the frame's target time
+   * 2. fire     - timer signal handler queues the capture request
+   * 3. complete - libcamera reports the capture as done
+   * 4. sent     - main loop streams the encoded frame
+   *
+   * A stage misses its deadline when the timer hasn't fired half a frame
+   * after its target, a queued capture hasn't completed two frames after
+   * it fired, or a completed frame hasn't been sent a frame later. A
+   * capture request that fails to queue is an immediate miss.
+   *
+   * Misses are counted per sensor and stage. After WD_MISS_LIMIT
+   * consecutive misses check() flags the sensor for recovery, and the
+   * main loop restarts its camera and encoder in process.
+   *
+   * mark() and fail() only store to volatile words, so they're safe to
+   * call from signal handlers.
+   */
+  reset();
+  memset(miss_counts, 0, sizeof(miss_counts));
+}
+
+void watchdog_t::reset() {
+  /**
+   * Forgets in flight frames, called when a stream ends so the idle
+   * period before the next timestamp isn't judged as missed frames
+   */
+  target_ns = 0;
+  for (int i = 0; i < WD_MAX_SENSORS; i++) {
+    for (int j = 0; j < STAGE_COUNT; j++) {
+      stage_ns[i][j] = 0;
+      failed[i][j] = 0;
+    }
+    judged_fire_ns[i] = 0;
+    judged_target_ns[i] = 0;
+    consecutive_misses[i] = 0;
+  }
+}
+
+void watchdog_t::arm(uint64_t mono_target_ns) {
+  target_ns = mono_target_ns;
+  for (int i = 0; i < sensor_count; i++)
+    stage_ns[i][STAGE_ARM] = mono_target_ns;
+}
+
+void watchdog_t::mark(int sensor, frame_stage stage, uint64_t mono_ns) {
+  stage_ns[sensor][stage] = mono_ns;
+}
+
+void watchdog_t::fail(int sensor, frame_stage stage) {
+  failed[sensor][stage] = 1;
+}
+
+void watchdog_t::miss(int sensor, frame_stage stage) {
+  char logstr[128];
+
+  miss_counts[sensor][stage]++;
+  consecutive_misses[sensor]++;
+
+  snprintf(
+    logstr,
+    sizeof(logstr),
+    "Sensor %d missed %s deadline (%lu total, %d consecutive)",
+    sensor,
+    stage_names[stage],
+    miss_counts[sensor][stage],
+    consecutive_misses[sensor]
+  );
+  LOG(WARNING, logstr);
+}
+
+int watchdog_t::check(uint64_t mono_now_ns) {
+  /**
+   * Judges every frame whose deadline has passed, each frame once.
+   *
+   * Returns:
+   *   Bitmask of sensors that reached WD_MISS_LIMIT consecutive misses
+   */
+  int recover = 0;
+  uint64_t target = target_ns;
+
+  for (int i = 0; i < sensor_count; i++) {
+    uint64_t fire = stage_ns[i][STAGE_FIRE];
+    uint64_t complete = stage_ns[i][STAGE_COMPLETE];
+    uint64_t sent = stage_ns[i][STAGE_SENT];
+
+    if (failed[i][STAGE_FIRE]) {
+      failed[i][STAGE_FIRE] = 0;
+      judged_target_ns[i] = target;
+      miss(i, STAGE_FIRE);
+    } else if (target &&
+               judged_target_ns[i] != target &&
+               fire < target &&
+               mono_now_ns > target + frame_duration / 2) {
+      judged_target_ns[i] = target;
+      miss(i, STAGE_FIRE);
+    }
+
+    if (fire == 0 || judged_fire_ns[i] == fire)
+      goto next;
+
+    if (complete < fire) {
+      if (mono_now_ns > fire + 2 * frame_duration) {
+        judged_fire_ns[i] = fire;
+        miss(i, STAGE_COMPLETE);
+      }
+      goto next;
+    }
+
+    if (sent < complete) {
+      if (mono_now_ns > complete + frame_duration) {
+        judged_fire_ns[i] = fire;
+        miss(i, STAGE_SENT);
+      }
+      goto next;
+    }
+
+    judged_fire_ns[i] = fire;
+    consecutive_misses[i] = 0;
+
+  next:
+    if (consecutive_misses[i] >= WD_MISS_LIMIT)
+      recover |= 1 << i;
+  }
+
+  return recover;
+}
+
+void watchdog_t::recovered(int sensor) {
+  consecutive_misses[sensor] = 0;
+  for (int j = 0; j < STAGE_COUNT; j++) {
+    stage_ns[sensor][j] = 0;
+    failed[sensor][j] = 0;
+  }
+  judged_fire_ns[sensor] = 0;
+  judged_target_ns[sensor] = target_ns;
+}
+
+uint64_t watchdog_t::misses(int sensor, frame_stage stage) const {
+  return miss_counts[sensor][stage];
+}
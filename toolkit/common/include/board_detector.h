@@ -0,0 +1,62 @@
+#ifndef BOARD_DETECTOR_H
+#define BOARD_DETECTOR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <opencv2/core.hpp>
+#include <vector>
+
+struct board_detection {
+  bool found;
+  std::vector<cv::Point2f> corners; // inner corners found, at full resolution
+  std::vector<int> ids;             // each corner's index among the board's inner corners, row by row
+  uint64_t detect_ns;
+};
+
+struct detector_stats {
+  uint64_t frames;
+  uint64_t coarse_hits; // boards seen by the downscaled presence check
+  uint64_t found;       // of those, boards located at full resolution
+  uint64_t fallbacks;   // found by refining the coarse corners instead (chessboard only)
+  uint64_t corners;     // over every board found, for the average per board
+  uint64_t detect_ns;   // total time spent, for the average per frame
+};
+
+/**
+ * How far a view's corners spread over the board, as the standard
+ * deviation of their board positions along its thinnest direction,
+ * in squares. Near 0 for corners along a single row, column or
+ * diagonal, which don't constrain a pose or a homography.
+ */
+double corner_spread(const std::vector<int>& ids, cv::Size board_size);
+
+class BoardDetector {
+  /**
+   * Calibration target detection over every camera of a frameset
+   *
+   * Frames are the NV12 views a FramesetLease hands out, whose luma
+   * plane is used in place as the gray image. Implementations keep
+   * their scratch buffers per camera, so cameras are detected in
+   * parallel on OpenCV's thread pool.
+   *
+   * Corners come with ids, so a board that is only partly in view
+   * still gives usable corners where the target allows it.
+   */
+public:
+  BoardDetector(cv::Size board_size, size_t num_cameras);
+  virtual ~BoardDetector() = default;
+
+  // detections must hold num_cameras entries
+  void detect_frameset(const cv::Mat* frames, board_detection* detections);
+  virtual bool detect(const cv::Mat& frame, size_t cam, board_detection& detection) = 0;
+
+  const detector_stats& stats(size_t cam) const { return stats_[cam]; }
+  cv::Size board_size() const { return board_size_; } // inner corners
+
+protected:
+  cv::Size board_size_;
+  size_t num_cameras;
+  std::vector<detector_stats> stats_;
+};
+
+#endif // BOARD_DETECTOR_H
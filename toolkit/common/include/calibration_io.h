@@ -0,0 +1,54 @@
+#ifndef CALIBRATION_IO_H
+#define CALIBRATION_IO_H
+
+#include <cstdint>
+#include <opencv2/core.hpp>
+#include <vector>
+
+#include "calibration_store.h"
+
+#define CALIBRATION_PATH "/etc/mocap-toolkit/calibration.yaml"
+
+/**
+ * Calibration shared between the toolkit's tools, one entry per camera
+ * in camera order. lens_calibration fills in the intrinsics and
+ * extrinsic_calibration the poses, each keeping what the other wrote.
+ *
+ * Entries are keyed by the camera's id from cams.yaml, which the tools
+ * take from the frameset server, so a reordered cams.yaml still pairs
+ * every camera with its own calibration. Files written before ids were
+ * stored load with id -1 and are taken to be in camera order.
+ *
+ * Every save also writes the binary store (see calibration_store.h)
+ * the frameset server undistorts frames with.
+ */
+struct camera_calibration {
+  int id = -1;
+  cv::Size image_size;
+  cv::Mat camera_matrix; // 3x3 CV_64F, empty until lens calibration has run
+  cv::Mat dist_coeffs;
+  double rms;            // of the intrinsic solve, in pixels
+  cv::Mat rvec;          // world to camera, empty until extrinsic calibration has run
+  cv::Mat tvec;
+};
+
+// a missing file loads as no cameras
+std::vector<camera_calibration> load_calibration(const char* path);
+
+// writes the YAML at path and the binary store at store_path
+void save_calibration(
+  const char* path,
+  const std::vector<camera_calibration>& cams,
+  const char* store_path = CALIBRATION_STORE_PATH
+);
+
+// cams in the order of ids, then any others with an id, ids not found get empty entries
+std::vector<camera_calibration> order_calibration(
+  const std::vector<camera_calibration>& cams,
+  const std::vector<uint8_t>& ids
+);
+
+// intrinsics of frames the frameset server undistorted, without distortion
+cv::Mat undistorted_matrix(const camera_calibration& cam);
+
+#endif // CALIBRATION_IO_H
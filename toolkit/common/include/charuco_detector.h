@@ -0,0 +1,75 @@
+#ifndef CHARUCO_DETECTOR_H
+#define CHARUCO_DETECTOR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <opencv2/core.hpp>
+#include <opencv2/objdetect/charuco_detector.hpp>
+#include <vector>
+
+#include "board_detector.h"
+
+#define CHARUCO_MIN_MARKERS 2   // a corner is only interpolated between two markers
+#define CHARUCO_MIN_CORNERS 6
+#define CHARUCO_MIN_SPREAD 0.5  // squares, see corner_spread
+#define CHARUCO_PRINT_SQUARE_PX 200 // pixels per square of a printable board image
+
+// the board CharucoBoardDetector looks for, drawn for printing with a half square white margin
+cv::Mat charuco_board_image(
+  cv::Size board_size,
+  float marker_ratio,
+  int dictionary,
+  int square_px = CHARUCO_PRINT_SQUARE_PX
+);
+
+class CharucoBoardDetector : public BoardDetector {
+  /**
+   * Coarse to fine ChArUco detection over every camera of a frameset
+   *
+   * Every marker identifies the squares around it, so any part of the
+   * board that shows a few markers gives corners with ids. In a tight
+   * rig a board is rarely whole in more than one camera, but some of
+   * it is in most, which keeps far more framesets usable.
+   *
+   * Markers are found on a downscaled copy of the luma plane, which
+   * doubles as the presence check since most frames have no board.
+   * Their corners are then scaled up, sharpened with cornerSubPix at
+   * full resolution, and handed to the ChArUco detector, which only
+   * interpolates and refines the chessboard corners between them over
+   * the region they cover, without searching the frame for markers
+   * again.
+   *
+   * A view is kept when it has at least CHARUCO_MIN_CORNERS corners
+   * spread over more than a line of the board, so every detection
+   * constrains a pose.
+   *
+   * The board is board_size inner corners, one square more each way,
+   * with markers of marker_ratio the square's side from dictionary,
+   * as drawn by cv::aruco::CharucoBoard::generateImage.
+   */
+public:
+  CharucoBoardDetector(
+    cv::Size board_size,
+    float marker_ratio,
+    int dictionary,
+    size_t num_cameras,
+    int coarse_width = 640
+  );
+
+  bool detect(const cv::Mat& frame, size_t cam, board_detection& detection) override;
+
+private:
+  int coarse_width;
+  float marker_ratio;
+  cv::aruco::CharucoBoard board;
+
+  // per camera, so cameras can be detected concurrently
+  std::vector<cv::aruco::ArucoDetector> marker_detectors;
+  std::vector<cv::aruco::CharucoDetector> board_detectors;
+  std::vector<cv::Mat> coarse;
+  std::vector<std::vector<std::vector<cv::Point2f>>> markers;
+  std::vector<std::vector<int>> marker_ids;
+  std::vector<std::vector<cv::Point2f>> marker_corners; // markers flattened for cornerSubPix
+};
+
+#endif // CHARUCO_DETECTOR_H
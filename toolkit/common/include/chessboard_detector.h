@@ -0,0 +1,38 @@
+#ifndef CHESSBOARD_DETECTOR_H
+#define CHESSBOARD_DETECTOR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <opencv2/core.hpp>
+#include <vector>
+
+#include "board_detector.h"
+
+class ChessboardDetector : public BoardDetector {
+  /**
+   * Coarse to fine chessboard detection over every camera of a frameset
+   *
+   * Most frames don't contain the board, so each one first gets a cheap
+   * presence check on a downscaled copy of its luma plane. Only a hit
+   * pays for findChessboardCornersSB at full resolution, and only over
+   * the region around the coarse corners. If the full resolution pass
+   * misses what the coarse pass saw, the coarse corners are scaled up
+   * and refined with cornerSubPix instead.
+   *
+   * The whole board has to be in view, and its corners come back with
+   * ids in order.
+   */
+public:
+  ChessboardDetector(cv::Size board_size, size_t num_cameras, int coarse_width = 320);
+
+  bool detect(const cv::Mat& frame, size_t cam, board_detection& detection) override;
+
+private:
+  int coarse_width;
+
+  // per camera, so cameras can be detected concurrently
+  std::vector<cv::Mat> coarse;
+  std::vector<std::vector<cv::Point2f>> coarse_corners;
+};
+
+#endif // CHESSBOARD_DETECTOR_H
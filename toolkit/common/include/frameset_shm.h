@@ -0,0 +1,147 @@
+#ifndef FRAMESET_SHM_H
+#define FRAMESET_SHM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define FRAMESET_SHM_NAME "/mocap-toolkit_frameset"
+#define FRAMESET_SHM_VERSION 3
+#define FRAMESET_SLOTS 3 // one being written, one ready, one leased
+#define FRAMESET_PAGE_SIZE 4096
+#define FRAMESET_CAM_UNDISTORTED 1 // frameset_cam flag, the server undistorts the camera's frames
+
+// a server spawned by the consumer finds the consumer's eventfd number in
+// this environment variable and adds 1 to it after every publish, so the
+// consumer can poll for framesets alongside its other fds
+#define FRAMESET_EVENTFD_ENV "MOCAP_FRAMESET_EVENTFD"
+
+/**
+ * Layout of the frameset shared memory between the server and the
+ * consumer (toolkit StreamController). This file is kept identical in
+ * frameset_server/include and toolkit/common/include.
+ *
+ * The shm holds a header, one frameset_cam per camera, then
+ * FRAMESET_SLOTS page aligned slots, each a full frameset of cam_count
+ * NV12 frames back to back.
+ * A slot's owner word says who may touch its pixels:
+ *
+ * - FRAMESET_SLOT_FREE:    nobody, the server may claim it
+ * - FRAMESET_SLOT_WRITING: the server is copying a frameset into it
+ * - FRAMESET_SLOT_READY:   published, not yet taken by the consumer,
+ *                          the server may still reuse it once stale,
+ *                          and the consumer frees it once it has
+ *                          leased a newer seq
+ * - any positive value:    leased by the consumer with that pid, the
+ *                          server leaves it alone until it is released
+ *                          or the consumer that spawned the server has
+ *                          exited, which the server watches through a
+ *                          pidfd so a recycled pid or a pid from
+ *                          another namespace can never pass for it
+ *
+ * Owner transitions are compare and swaps with the __atomic builtins,
+ * so the layout is plain integers and maps the same from C and C++.
+ * timestamp is written before the slot turns READY and only read after
+ * a consumer has leased it. seq is also read by whoever scans for the
+ * newest or oldest READY slot, so it goes through frameset_seq and
+ * frameset_set_seq.
+ *
+ * cams describes the cameras in frame order, as many as cam_count, so
+ * the camera count is only bounded by the ids cams.yaml can hold. The
+ * server writes them with the rest of the header before its first
+ * publish, so they are valid once a frameset has been received.
+ */
+
+#define FRAMESET_SLOT_FREE 0
+#define FRAMESET_SLOT_WRITING -1
+#define FRAMESET_SLOT_READY -2
+
+struct frameset_slot {
+  int32_t owner;
+  uint32_t reserved;
+  uint64_t seq;       // publish order, the newest ready slot has the highest
+  uint64_t timestamp; // capture timestamp shared by every frame in the set
+} __attribute__((aligned(64)));
+
+struct frameset_cam {
+  uint8_t id;    // the camera's id in cams.yaml
+  uint8_t flags; // FRAMESET_CAM_*
+};
+
+struct frameset_shm {
+  uint32_t version;
+  uint32_t slot_count;
+  uint32_t cam_count;
+  uint32_t reserved;
+  uint64_t frame_size;  // bytes per NV12 frame
+  uint64_t slot_stride; // bytes between consecutive slots' pixels
+  uint64_t data_offset; // bytes from the start of the shm to slot 0's pixels
+  struct frameset_slot slots[FRAMESET_SLOTS];
+  struct frameset_cam cams[]; // cam_count of them
+};
+
+static inline uint64_t frameset_page_align(uint64_t size) {
+  return (size + FRAMESET_PAGE_SIZE - 1) & ~(uint64_t)(FRAMESET_PAGE_SIZE - 1);
+}
+
+static inline uint64_t frameset_header_size(uint32_t cam_count) {
+  return sizeof(struct frameset_shm) + cam_count * sizeof(struct frameset_cam);
+}
+
+static inline uint64_t frameset_data_offset(uint32_t cam_count) {
+  return frameset_page_align(frameset_header_size(cam_count));
+}
+
+static inline uint64_t frameset_slot_stride(uint32_t cam_count, uint64_t frame_size) {
+  return frameset_page_align(frame_size * cam_count);
+}
+
+static inline uint64_t frameset_shm_size(uint32_t cam_count, uint64_t frame_size) {
+  return frameset_data_offset(cam_count) + FRAMESET_SLOTS * frameset_slot_stride(cam_count, frame_size);
+}
+
+// takes the geometry explicitly so either side can locate frames before the other wrote the header
+static inline uint8_t* frameset_frame(
+  struct frameset_shm* shm,
+  uint32_t cam_count,
+  uint64_t frame_size,
+  uint32_t slot,
+  uint32_t cam
+) {
+  return (uint8_t*)shm
+    + frameset_data_offset(cam_count)
+    + slot * frameset_slot_stride(cam_count, frame_size)
+    + cam * frame_size;
+}
+
+static inline int32_t frameset_owner(struct frameset_slot* slot) {
+  return __atomic_load_n(&slot->owner, __ATOMIC_ACQUIRE);
+}
+
+static inline bool frameset_cas_owner(
+  struct frameset_slot* slot,
+  int32_t expected,
+  int32_t desired
+) {
+  return __atomic_compare_exchange_n(
+    &slot->owner,
+    &expected,
+    desired,
+    false,
+    __ATOMIC_ACQ_REL,
+    __ATOMIC_ACQUIRE
+  );
+}
+
+static inline void frameset_set_owner(struct frameset_slot* slot, int32_t owner) {
+  __atomic_store_n(&slot->owner, owner, __ATOMIC_RELEASE);
+}
+
+static inline uint64_t frameset_seq(struct frameset_slot* slot) {
+  return __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+}
+
+static inline void frameset_set_seq(struct frameset_slot* slot, uint64_t seq) {
+  __atomic_store_n(&slot->seq, seq, __ATOMIC_RELEASE);
+}
+
+#endif // FRAMESET_SHM_H
@@ -0,0 +1,248 @@
+#ifndef KEYPOINT_DATASET_H
+#define KEYPOINT_DATASET_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#define DATASET_MAGIC 0x5453444b504d434dULL // "MCMPKDST"
+#define DATASET_VERSION 1
+#define DATASET_INDEX_FILE "index.bin"
+#define DATASET_CHUNK_ROWS 65536 // rows a chunk closes at, rounded up to a whole frameset
+#define DATASET_ALIGN 64         // column data of every chunk starts on this boundary
+
+/**
+ * On disk layout of a keypoint dataset
+ *
+ * A dataset is a directory holding one file per column plus an index.
+ * A row is one joint of one camera's view of one frameset:
+ *
+ *   timestamp u64 | camera u16 | joint u16 | frame u32 | x f32 | y f32 | conf f32
+ *
+ * frame is the view's frame number in that camera's recording, so the
+ * image a row came from can be fetched without matching timestamps.
+ *
+ * Rows are in timestamp order and grouped into chunks that never split
+ * a frameset. Each column file is the chunks' values back to back, every
+ * chunk starting DATASET_ALIGN aligned, so an uncompressed chunk's column
+ * is a plain array straight out of the mapping. A compressed chunk's
+ * column holds its values byte shuffled (all first bytes, then all
+ * second bytes...) and deflated, which suits slowly varying fixed width
+ * values far better than deflating them as they are. Compression is
+ * per chunk and column, and only kept where it saves space.
+ *
+ * The index is a dataset_header followed by chunk_count dataset_chunk
+ * entries, written when the writer closes, so a dataset without an
+ * index was never finished.
+ */
+
+enum dataset_column {
+  COLUMN_TIMESTAMP,
+  COLUMN_CAMERA,
+  COLUMN_JOINT,
+  COLUMN_FRAME,
+  COLUMN_X,
+  COLUMN_Y,
+  COLUMN_CONF,
+  COLUMN_COUNT
+};
+
+#define DATASET_COMPRESSED 1u // flag of a chunk's column that is shuffled and deflated
+
+struct dataset_header {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t column_count;
+  uint64_t row_count;
+  uint64_t frameset_count;
+  uint64_t chunk_count;
+};
+
+struct dataset_extent {
+  uint64_t offset; // bytes into the column's file
+  uint64_t stored; // bytes on disk, rows * width unless compressed
+  uint32_t flags;
+  uint32_t reserved;
+};
+
+struct dataset_chunk {
+  uint64_t first_timestamp;
+  uint64_t last_timestamp;
+  uint64_t first_row;
+  uint64_t first_frameset;
+  uint32_t rows;
+  uint32_t framesets;
+  struct dataset_extent columns[COLUMN_COUNT];
+};
+
+// name of each column's file in the dataset directory
+const char* dataset_column_file(dataset_column column);
+
+// bytes per value of each column
+size_t dataset_column_width(dataset_column column);
+
+template <typename T>
+struct column_span {
+  const T* values;
+  size_t count;
+
+  const T& operator[](size_t i) const { return values[i]; }
+  const T* begin() const { return values; }
+  const T* end() const { return values + count; }
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+
+  column_span<T> subspan(size_t offset, size_t length) const {
+    return {values + offset, length};
+  }
+};
+
+// a run of consecutive rows, column by column
+struct dataset_rows {
+  column_span<uint64_t> timestamp;
+  column_span<uint16_t> camera;
+  column_span<uint16_t> joint;
+  column_span<uint32_t> frame;
+  column_span<float> x;
+  column_span<float> y;
+  column_span<float> conf;
+
+  size_t size() const { return timestamp.size(); }
+  dataset_rows subrange(size_t offset, size_t length) const;
+};
+
+struct dataset_options {
+  bool compress = false;
+  uint32_t chunk_rows = DATASET_CHUNK_ROWS;
+  int compression_level = 1; // zlib level, 1 already gets most of the gain of shuffled columns
+};
+
+class DatasetWriter {
+  /**
+   * Appends camera views of framesets to a new dataset directory
+   *
+   * Views arrive a whole camera at a time, as the detectors produce
+   * them, and must come in non decreasing timestamp order (the views of
+   * one frameset may come in any camera order). Every view has the
+   * same number of joints, set by the first one. The current chunk is
+   * held in memory column by column and appended to the column files
+   * once it has DATASET_CHUNK_ROWS rows and a new frameset starts, so
+   * memory stays at one chunk however long the session is.
+   *
+   * close() flushes the last chunk and writes the index, replacing it
+   * atomically; the destructor closes a writer that wasn't.
+   */
+public:
+  DatasetWriter(const char* dir, dataset_options options = dataset_options());
+  ~DatasetWriter();
+
+  DatasetWriter(const DatasetWriter&) = delete;
+  DatasetWriter& operator=(const DatasetWriter&) = delete;
+
+  void append(
+    uint64_t timestamp,
+    uint16_t camera,
+    uint32_t frame,
+    const float* x,
+    const float* y,
+    const float* conf,
+    uint16_t num_joints
+  );
+
+  void close();
+
+  uint64_t rows_written() const;
+
+private:
+  std::string dir;
+  dataset_options options;
+  int fds[COLUMN_COUNT];
+  uint64_t file_sizes[COLUMN_COUNT];
+  bool closed;
+
+  std::vector<dataset_chunk> chunks;
+  uint64_t row_count;
+  uint64_t frameset_count;
+  uint64_t last_timestamp;
+  uint16_t joint_count; // of every view, 0 until the first append
+
+  // the chunk being assembled
+  std::vector<uint64_t> timestamps;
+  std::vector<uint16_t> cameras;
+  std::vector<uint16_t> joints;
+  std::vector<uint32_t> frames;
+  std::vector<float> xs;
+  std::vector<float> ys;
+  std::vector<float> confs;
+  uint32_t chunk_framesets;
+
+  // compression scratch
+  std::vector<uint8_t> shuffled;
+  std::vector<uint8_t> deflated;
+
+  void flush_chunk();
+  void write_column(dataset_column column, const void* values, dataset_chunk& chunk);
+  void write_index();
+};
+
+class Dataset {
+  /**
+   * Read only view of a dataset, every column file mapped
+   *
+   * Rows come back as spans straight into the mappings, so reading a
+   * frameset touches only the pages holding it and the kernel pages
+   * the rest in and out as needed, however large the dataset. A
+   * compressed chunk is inflated into the caller's chunk_buffer
+   * instead, and its spans stay valid until that buffer is reused.
+   * Nothing in a Dataset changes after it opens, so threads can share
+   * one as long as each has its own buffer.
+   *
+   * Framesets are numbered in timestamp order from 0, and found by
+   * binary search of the chunk index and then of the chunk's
+   * timestamps, from either their number or their timestamp.
+   */
+public:
+  // holds an inflated chunk, reused across calls
+  struct chunk_buffer {
+    const Dataset* dataset = nullptr;
+    uint64_t chunk = 0;
+    std::vector<uint8_t> columns[COLUMN_COUNT];
+    std::vector<uint8_t> shuffled;
+  };
+
+  explicit Dataset(const char* dir);
+  ~Dataset();
+
+  Dataset(const Dataset&) = delete;
+  Dataset& operator=(const Dataset&) = delete;
+
+  uint64_t num_rows() const;
+  uint64_t num_framesets() const;
+  size_t num_chunks() const;
+  const dataset_chunk& chunk_info(size_t chunk) const;
+
+  // every row of a chunk
+  dataset_rows chunk(size_t chunk, chunk_buffer& buffer) const;
+
+  // the rows of the n-th frameset
+  dataset_rows frameset(uint64_t n, chunk_buffer& buffer) const;
+
+  /**
+   * Rows of the frameset captured at timestamp
+   *
+   * Returns false when no frameset has exactly that timestamp, leaving
+   * rows untouched.
+   */
+  bool find(uint64_t timestamp, dataset_rows& rows, chunk_buffer& buffer) const;
+
+private:
+  dataset_header header;
+  std::vector<dataset_chunk> chunks;
+  const uint8_t* maps[COLUMN_COUNT];
+  size_t map_sizes[COLUMN_COUNT];
+
+  void inflate(size_t chunk, chunk_buffer& buffer) const;
+};
+
+#endif // KEYPOINT_DATASET_H
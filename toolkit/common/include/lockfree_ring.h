@@ -0,0 +1,255 @@
+// © 2024 Alec Fessler
+// MIT License
+// See LICENSE file in the project root for full license information.
+
+#ifndef LOCKFREE_RING_H
+#define LOCKFREE_RING_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+/**
+ * Header only C++ counterparts of frameset_server's spsc_queue.h and
+ * spmc_ring.h, with the capacity fixed at compile time so the index
+ * wrap is a mask with a constant instead of a modulo.
+ *
+ * Both are async-signal-safe: they never allocate, lock or make a
+ * syscall, every shared word is an always lock-free atomic (checked
+ * at compile time), and T must be trivially copyable so a push or pop
+ * can't run user code. That makes them fine for passing data between
+ * signal handlers, libcamera's callback thread and worker threads, as
+ * long as each side stays a single context. A signal handler producing
+ * into a ring whose consumer is the thread it interrupted is fine, the
+ * handler and the thread must just never both produce or both consume.
+ *
+ * This file is kept identical in picam/include and
+ * toolkit/common/include.
+ */
+
+namespace ring_detail {
+  constexpr size_t cache_line_size = 64;
+
+  constexpr bool is_pow2(size_t n) {
+    return n >= 2 && (n & (n - 1)) == 0;
+  }
+}
+
+template <typename T, size_t Capacity>
+class spsc_ring {
+  /**
+   * Single producer, single consumer ring with spsc_queue.h semantics:
+   *
+   * - One slot always stays empty to tell full (head + 1 == tail) from
+   *   empty (head == tail), so it holds Capacity - 1 items
+   * - Each side caches the other's index and only reloads it when the
+   *   ring appears full/empty
+   * - head and tail live on separate cache lines with the cached copy
+   *   each side needs, so neither side false shares with the other
+   */
+  static_assert(ring_detail::is_pow2(Capacity), "Capacity must be a power of two");
+  static_assert(std::is_trivially_copyable_v<T>, "T must be trivially copyable");
+  static_assert(std::atomic<size_t>::is_always_lock_free, "size_t atomics must be lock free");
+
+  static constexpr size_t mask = Capacity - 1;
+
+public:
+  static constexpr size_t capacity() noexcept { return Capacity - 1; }
+
+  bool push(const T& item) noexcept {
+    size_t head = head_.load(std::memory_order_relaxed);
+    size_t next = (head + 1) & mask;
+
+    if (next == cached_tail) { // check if the ring appears full
+      cached_tail = tail_.load(std::memory_order_acquire);
+      if (next == cached_tail) // check if it actually is full
+        return false;
+    }
+
+    buf[head] = item;
+    head_.store(next, std::memory_order_release);
+    return true;
+  }
+
+  bool pop(T& item) noexcept {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+
+    if (tail == cached_head) { // check if the ring appears empty
+      cached_head = head_.load(std::memory_order_acquire);
+      if (tail == cached_head) // check if it actually is empty
+        return false;
+    }
+
+    item = buf[tail];
+    tail_.store((tail + 1) & mask, std::memory_order_release);
+    return true;
+  }
+
+  // consumer side, drops everything currently queued
+  void clear() noexcept {
+    cached_head = head_.load(std::memory_order_acquire);
+    tail_.store(cached_head, std::memory_order_release);
+  }
+
+  // exact from either side, only a snapshot from anywhere else
+  size_t size() const noexcept {
+    size_t head = head_.load(std::memory_order_acquire);
+    size_t tail = tail_.load(std::memory_order_acquire);
+    return (head - tail) & mask;
+  }
+
+  bool empty() const noexcept { return size() == 0; }
+
+private:
+  // producer's line
+  alignas(ring_detail::cache_line_size) std::atomic<size_t> head_{0};
+  size_t cached_tail = 0;
+
+  // consumer's line
+  alignas(ring_detail::cache_line_size) std::atomic<size_t> tail_{0};
+  size_t cached_head = 0;
+
+  alignas(ring_detail::cache_line_size) T buf[Capacity];
+};
+
+template <typename T, size_t Capacity, size_t Readers = 4>
+class spmc_ring {
+  /**
+   * Single producer broadcast ring with spmc_ring.h semantics, every
+   * reader sees every item unless it joined as lossy and fell a full
+   * ring behind, in which case it skips to the newest item.
+   *
+   * Sequences are free running 64 bit counters, each slot is stamped
+   * 2 * seq + 1 while being written and 2 * seq + 2 once published,
+   * and a reader accepts an item only if the stamp matches before and
+   * after reading it. Slots are atomic<T>, so T must be lock free as an
+   * atomic, which covers timestamps, indices and pointers.
+   */
+  static_assert(ring_detail::is_pow2(Capacity), "Capacity must be a power of two");
+  static_assert(Readers > 0, "need at least one reader slot");
+  static_assert(std::atomic<T>::is_always_lock_free, "T must be lock free as an atomic");
+  static_assert(std::atomic<uint64_t>::is_always_lock_free, "uint64_t atomics must be lock free");
+
+  static constexpr uint64_t mask = Capacity - 1;
+
+  enum reader_state : uint32_t { FREE, JOINING, BLOCKING, LOSSY };
+
+public:
+  static constexpr size_t capacity() noexcept { return Capacity; }
+
+  // returns the reader id, or -1 if all Readers slots are taken
+  int join(bool lossy) noexcept {
+    for (size_t i = 0; i < Readers; i++) {
+      uint32_t expected = FREE;
+      if (!readers[i].state.compare_exchange_strong(
+        expected,
+        JOINING,
+        std::memory_order_acq_rel,
+        std::memory_order_relaxed
+      )) continue;
+
+      readers[i].cursor.store(
+        head.load(std::memory_order_acquire),
+        std::memory_order_relaxed
+      );
+
+      // a producer that runs ahead before seeing this reader shows up
+      // as an overrun through the stamps, never as a stale item
+      readers[i].state.store(lossy ? LOSSY : BLOCKING, std::memory_order_seq_cst);
+      return (int)i;
+    }
+    return -1;
+  }
+
+  void leave(int id) noexcept {
+    readers[id].state.store(FREE, std::memory_order_release);
+  }
+
+  // false if the slowest blocking reader is a full ring behind
+  bool publish(const T& item) noexcept {
+    uint64_t seq = head.load(std::memory_order_relaxed);
+
+    if (seq - cached_min >= Capacity) { // check if the ring appears full
+      cached_min = min_cursor(seq);
+      if (seq - cached_min >= Capacity) // check if it actually is full
+        return false;
+    }
+
+    slot& s = slots[seq & mask];
+    s.stamp.store(seq * 2 + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    s.item.store(item, std::memory_order_relaxed);
+    s.stamp.store(seq * 2 + 2, std::memory_order_release);
+
+    head.store(seq + 1, std::memory_order_release);
+    return true;
+  }
+
+  // false if nothing new, skipped gains the items a lapped reader missed
+  bool read(int id, T& item, uint64_t* skipped = nullptr) noexcept {
+    reader& r = readers[id];
+    uint64_t cursor = r.cursor.load(std::memory_order_relaxed);
+
+    while (true) {
+      slot& s = slots[cursor & mask];
+      uint64_t want = cursor * 2 + 2;
+
+      uint64_t stamp = s.stamp.load(std::memory_order_acquire);
+      if (stamp < want)
+        return false; // not published yet, or being published right now
+
+      if (stamp == want) {
+        T val = s.item.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (s.stamp.load(std::memory_order_relaxed) == want) {
+          item = val;
+          r.cursor.store(cursor + 1, std::memory_order_release);
+          return true;
+        }
+      }
+
+      // lapped, resume at the newest item
+      uint64_t newest = head.load(std::memory_order_acquire) - 1;
+      if (skipped)
+        *skipped += newest - cursor;
+      cursor = newest;
+      r.cursor.store(cursor, std::memory_order_release);
+    }
+  }
+
+private:
+  struct slot {
+    std::atomic<uint64_t> stamp{0};
+    std::atomic<T> item{};
+  };
+
+  struct alignas(ring_detail::cache_line_size) reader {
+    std::atomic<uint64_t> cursor{0};
+    std::atomic<uint32_t> state{FREE};
+  };
+
+  uint64_t min_cursor(uint64_t seq) const noexcept {
+    // lossy readers never hold the producer back
+    uint64_t min = seq;
+    for (const reader& r : readers) {
+      if (r.state.load(std::memory_order_acquire) != BLOCKING)
+        continue;
+
+      uint64_t cursor = r.cursor.load(std::memory_order_acquire);
+      if (cursor < min)
+        min = cursor;
+    }
+    return min;
+  }
+
+  // producer's line
+  alignas(ring_detail::cache_line_size) std::atomic<uint64_t> head{0};
+  uint64_t cached_min = 0;
+
+  reader readers[Readers];
+
+  alignas(ring_detail::cache_line_size) slot slots[Capacity];
+};
+
+#endif // LOCKFREE_RING_H
@@ -0,0 +1,56 @@
+#ifndef NV12_CONVERT_H
+#define NV12_CONVERT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <opencv2/core.hpp>
+
+/**
+ * NV12 conversion for frameset consumers
+ *
+ * Converts the server's NV12 frames (BT.601 limited range, the same
+ * coefficients as cv::COLOR_YUV2BGR_NV12) into:
+ *
+ * - BGR:        8 bit interleaved, CV_8UC3
+ * - RGB_PLANAR: float R, G and B planes normalized to [0, 1], stacked
+ *               as a (3 * height) x width CV_32FC1 Mat (CHW for ML code)
+ * - GRAY:       the luma plane, CV_8UC1, as cv::COLOR_YUV2GRAY_NV12
+ *
+ * Each can be downscaled by 2 in the same pass, averaging every 2x2
+ * luma block with the chroma sample it already shares, so a half
+ * resolution frame never exists at full resolution.
+ *
+ * Kernels are AVX2 (picked at runtime) or NEON, with a scalar fallback
+ * that computes bit identical results, and write into caller provided
+ * buffers so steady state conversion allocates nothing.
+ */
+
+enum class nv12_target {
+  BGR,
+  RGB_PLANAR,
+  GRAY
+};
+
+// raw kernels, width and height are the NV12 frame's and must be even,
+// dst is tightly packed at the output size (halved when half is set)
+void nv12_to_bgr(const uint8_t* src, int width, int height, uint8_t* dst, bool half = false);
+void nv12_to_rgb_planar(const uint8_t* src, int width, int height, float* dst, bool half = false);
+void nv12_to_gray(const uint8_t* src, int width, int height, uint8_t* dst, bool half = false);
+
+// src is an NV12 frame as (height * 3/2) x width CV_8UC1, e.g. a FramesetLease view,
+// dst is only (re)allocated when its size or type doesn't match the target
+void nv12_convert(const cv::Mat& src, cv::Mat& dst, nv12_target target, bool half = false);
+
+// converts every camera's frame in parallel on OpenCV's thread pool
+void nv12_convert_frameset(
+  const cv::Mat* src,
+  cv::Mat* dst,
+  size_t count,
+  nv12_target target,
+  bool half = false
+);
+
+// "avx2", "neon" or "scalar", whichever kernels this process runs
+const char* nv12_kernel_isa();
+
+#endif // NV12_CONVERT_H
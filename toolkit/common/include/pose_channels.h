@@ -0,0 +1,128 @@
+#ifndef POSE_CHANNELS_H
+#define POSE_CHANNELS_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <semaphore.h>
+#include <time.h>
+#include <vector>
+
+#include "pose_shm.h"
+
+/**
+ * Endpoints of the rings in pose_shm.h
+ *
+ * pose_fusion owns both rings: it creates them with a KeypointReceiver
+ * and a PosePublisher and unlinks them on exit. Detector processes
+ * attach a KeypointPublisher and pose consumers a PoseSubscriber, both
+ * of which throw if pose_fusion isn't running.
+ */
+
+class KeypointPublisher {
+public:
+  KeypointPublisher();
+  ~KeypointPublisher();
+  KeypointPublisher(const KeypointPublisher&) = delete;
+  KeypointPublisher& operator=(const KeypointPublisher&) = delete;
+
+  uint32_t num_cameras() const { return shm->cam_count; }
+  uint32_t num_joints() const { return shm->joint_count; }
+
+  // x, y and conf hold num_joints values in pixels of the frame as received from the server,
+  // raw or undistorted (see pose_shm.h), NaN or conf 0 for a missed joint.
+  // Each camera must only ever be published from one thread.
+  void publish(uint32_t cam, uint64_t timestamp, const float* x, const float* y, const float* conf);
+
+private:
+  int shm_fd;
+  size_t shm_size;
+  keypoint_shm* shm;
+  sem_t* ready_sem;
+};
+
+class KeypointReceiver {
+public:
+  KeypointReceiver(uint32_t cam_count, uint32_t joint_count);
+  ~KeypointReceiver();
+  KeypointReceiver(const KeypointReceiver&) = delete;
+  KeypointReceiver& operator=(const KeypointReceiver&) = delete;
+
+  // waits for a publish until deadline (CLOCK_MONOTONIC), false on timeout or a signal
+  bool wait(const struct timespec& deadline);
+
+  // copies out camera cam's next unread entry, false when there is none
+  bool read(uint32_t cam, uint64_t* timestamp, uint64_t* produced_ns, float* x, float* y, float* conf);
+
+  uint64_t skipped() const { return skipped_; } // entries overwritten before they were read
+
+private:
+  int shm_fd;
+  size_t shm_size;
+  keypoint_shm* shm;
+  sem_t* ready_sem;
+  std::vector<uint64_t> cursors;
+  uint64_t skipped_;
+};
+
+struct pose_frame {
+  uint64_t seq;
+  uint64_t timestamp;   // frameset timestamp
+  uint64_t produced_ns; // CLOCK_REALTIME when fused, latency is produced_ns - timestamp
+  uint64_t detected_ns; // CLOCK_REALTIME when its last view arrived
+  std::vector<float> x; // NaN for joints that couldn't be triangulated
+  std::vector<float> y;
+  std::vector<float> z;
+  std::vector<float> error;
+  std::vector<uint32_t> views;
+};
+
+class PosePublisher {
+public:
+  explicit PosePublisher(uint32_t joint_count);
+  ~PosePublisher();
+  PosePublisher(const PosePublisher&) = delete;
+  PosePublisher& operator=(const PosePublisher&) = delete;
+
+  void publish(
+    uint64_t timestamp,
+    uint64_t detected_ns,
+    const float* x,
+    const float* y,
+    const float* z,
+    const float* error,
+    const uint32_t* views
+  );
+
+private:
+  int shm_fd;
+  size_t shm_size;
+  pose_shm* shm;
+};
+
+class PoseSubscriber {
+public:
+  PoseSubscriber();
+  ~PoseSubscriber();
+  PoseSubscriber(const PoseSubscriber&) = delete;
+  PoseSubscriber& operator=(const PoseSubscriber&) = delete;
+
+  uint32_t num_joints() const { return shm->joint_count; }
+
+  // the newest pose, false if nothing newer than the last one returned has been published
+  bool latest(pose_frame& pose);
+
+  // latest, waiting up to timeout for a new pose
+  bool wait_next(pose_frame& pose, std::chrono::nanoseconds timeout);
+
+  uint64_t missed() const { return missed_; } // poses published but never returned
+
+private:
+  int shm_fd;
+  size_t shm_size;
+  pose_shm* shm;
+  uint64_t next_seq;
+  uint64_t missed_;
+};
+
+#endif // POSE_CHANNELS_H
@@ -0,0 +1,157 @@
+#ifndef POSE_SHM_H
+#define POSE_SHM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define KEYPOINT_SHM_NAME "/mocap-toolkit_keypoints"
+#define KEYPOINT_SEM_NAME "/mocap-toolkit_keypoints_ready"
+#define POSE_SHM_NAME "/mocap-toolkit_poses"
+#define POSE_SHM_VERSION 1
+#define KEYPOINT_SLOTS 16 // per camera, a power of two
+#define POSE_SLOTS 16     // a power of two
+#define POSE_MAX_CAMERAS 32
+#define POSE_PAGE_SIZE 4096
+
+/**
+ * Layouts of the two shared memory rings around the pose fusion stage,
+ * created by pose_fusion next to the server's frameset shm:
+ *
+ * - keypoints: one ring per camera, written by whichever detector
+ *   process handles that camera (one producer each) and read by
+ *   pose_fusion. Each entry is a camera's 2D joints for one frameset
+ *   timestamp, as x, y and confidence arrays in pixels of the frame
+ *   the detector was handed: raw, or undistorted when the frameset
+ *   shm flags that camera FRAMESET_CAM_UNDISTORTED, in which case the
+ *   pixels are those of the calibration's undistorted_matrix. The
+ *   producer posts KEYPOINT_SEM_NAME after every entry.
+ * - poses: one ring written by pose_fusion and read by any number of
+ *   consumers. Each entry is a frameset's filtered 3D joints. The
+ *   producer bumps notify and futex wakes it after every entry.
+ *
+ * Both are lossy for readers: a producer never waits, it overwrites
+ * the oldest entry. Each entry starts with a stamp, 2 * seq + 1 while
+ * it is written and 2 * seq + 2 once published, checked before and
+ * after copying it out, so a reader that was lapped mid-copy notices
+ * instead of returning a torn entry (the same seqlock as spmc_ring.h).
+ * All shared words are plain integers used with the __atomic builtins,
+ * so this maps the same from C and C++.
+ *
+ * Timestamps are the frameset's (CLOCK_REALTIME ns), and every entry
+ * records when it was produced on the same clock, so any stage can
+ * measure latency from capture.
+ */
+
+struct keypoint_entry {
+  uint64_t stamp;
+  uint64_t timestamp;   // frameset timestamp the detections are for
+  uint64_t produced_ns; // CLOCK_REALTIME when the detector published it
+  uint64_t reserved;
+  // followed by float x[joint_count], y[joint_count], conf[joint_count]
+};
+
+struct keypoint_cursor {
+  uint64_t head; // next sequence the camera's producer publishes
+} __attribute__((aligned(64)));
+
+struct keypoint_shm {
+  uint32_t version; // written last by the creator, 0 until the rest is valid
+  uint32_t cam_count;
+  uint32_t joint_count;
+  uint32_t slot_count;
+  uint64_t entry_stride;
+  uint64_t data_offset; // bytes from the start of the shm to camera 0's entries
+  struct keypoint_cursor cams[POSE_MAX_CAMERAS];
+};
+
+struct pose_entry {
+  uint64_t stamp;
+  uint64_t timestamp;    // frameset timestamp the joints are for
+  uint64_t produced_ns;  // CLOCK_REALTIME when the joints were published
+  uint64_t detected_ns;  // CLOCK_REALTIME when the last view used arrived
+  // followed by float x[joint_count], y[joint_count], z[joint_count],
+  // error[joint_count] (reprojection, pixels) and uint32_t views[joint_count]
+};
+
+struct pose_shm {
+  uint32_t version;
+  uint32_t joint_count;
+  uint32_t slot_count;
+  uint32_t notify; // futex word, bumped after every publish
+  uint64_t entry_stride;
+  uint64_t data_offset;
+  uint64_t head __attribute__((aligned(64))); // next sequence to publish
+};
+
+static inline uint64_t pose_page_align(uint64_t size) {
+  return (size + POSE_PAGE_SIZE - 1) & ~(uint64_t)(POSE_PAGE_SIZE - 1);
+}
+
+static inline uint64_t keypoint_entry_stride(uint32_t joint_count) {
+  uint64_t size = sizeof(struct keypoint_entry) + 3 * sizeof(float) * joint_count;
+  return (size + 63) & ~(uint64_t)63;
+}
+
+static inline uint64_t keypoint_shm_size(uint32_t cam_count, uint32_t joint_count) {
+  return pose_page_align(sizeof(struct keypoint_shm))
+    + (uint64_t)cam_count * KEYPOINT_SLOTS * keypoint_entry_stride(joint_count);
+}
+
+static inline struct keypoint_entry* keypoint_slot(
+  struct keypoint_shm* shm,
+  uint32_t cam,
+  uint64_t seq
+) {
+  return (struct keypoint_entry*)((uint8_t*)shm
+    + shm->data_offset
+    + ((uint64_t)cam * shm->slot_count + (seq & (shm->slot_count - 1))) * shm->entry_stride);
+}
+
+static inline float* keypoint_coords(struct keypoint_entry* entry) {
+  return (float*)(entry + 1); // x, then y, then conf
+}
+
+static inline uint64_t pose_entry_stride(uint32_t joint_count) {
+  uint64_t size = sizeof(struct pose_entry) + 4 * sizeof(float) * joint_count
+    + sizeof(uint32_t) * joint_count;
+  return (size + 63) & ~(uint64_t)63;
+}
+
+static inline uint64_t pose_shm_size(uint32_t joint_count) {
+  return pose_page_align(sizeof(struct pose_shm)) + POSE_SLOTS * pose_entry_stride(joint_count);
+}
+
+static inline struct pose_entry* pose_slot(struct pose_shm* shm, uint64_t seq) {
+  return (struct pose_entry*)((uint8_t*)shm
+    + shm->data_offset
+    + (seq & (shm->slot_count - 1)) * shm->entry_stride);
+}
+
+static inline float* pose_coords(struct pose_entry* entry) {
+  return (float*)(entry + 1); // x, y, z, then error
+}
+
+static inline uint32_t* pose_views(struct pose_entry* entry, uint32_t joint_count) {
+  return (uint32_t*)(pose_coords(entry) + 4 * joint_count);
+}
+
+static inline void pose_begin_write(uint64_t* stamp, uint64_t seq) {
+  __atomic_store_n(stamp, seq * 2 + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void pose_end_write(uint64_t* stamp, uint64_t seq) {
+  __atomic_store_n(stamp, seq * 2 + 2, __ATOMIC_RELEASE);
+}
+
+static inline bool pose_stamp_is(uint64_t* stamp, uint64_t seq) {
+  // before a copy, pair with pose_stamp_still after it
+  return __atomic_load_n(stamp, __ATOMIC_ACQUIRE) == seq * 2 + 2;
+}
+
+static inline bool pose_stamp_still(uint64_t* stamp, uint64_t seq) {
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(stamp, __ATOMIC_RELAXED) == seq * 2 + 2;
+}
+
+#endif // POSE_SHM_H
@@ -1,14 +1,70 @@
 #ifndef STREAM_CONTROLLER_H
 #define STREAM_CONTROLLER_H
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstddef>
+#include <cstdint>
+#include <mutex>
 #include <opencv2/core.hpp>
 #include <semaphore.h>
 #include <sys/types.h>
+#include <thread>
+#include <vector>
+
+#include "frameset_shm.h"
+#include "nv12_convert.h"
 
-#define SHM_NAME "/mocap-toolkit_frameset"
 #define SEM_NAME "/mocap-toolkit_consumer_ready"
 #define SERVER_EXE "/usr/local/bin/mocap-toolkit-server"
+#define SERVER_CHECK_INTERVAL std::chrono::seconds(1) // how often a blocked receive checks the server is alive
+#define PREFETCH_STOP_INTERVAL std::chrono::milliseconds(50) // how often a waiting prefetch thread checks for a stop
+
+// cameras of a server another consumer spawned, see read_frameset_cameras
+struct frameset_cameras {
+  std::vector<uint8_t> ids;      // id in cams.yaml of each camera, in frame order
+  std::vector<bool> undistorted; // whether each camera's frames are undistorted by the server
+};
+
+bool read_frameset_cameras(frameset_cameras* cams);
+
+class FramesetLease {
+  /**
+   * Pins one frameset slot in the server's shared memory. The frames
+   * are NV12 views straight over the slot, (height * 3/2) x width
+   * CV_8UC1 each, and are only valid until the lease is released or
+   * destroyed. They must be treated as read only, and the lease must
+   * not outlive the StreamController it came from.
+   *
+   * If the consumer process dies while holding a lease, the server
+   * reclaims the slot once it needs it.
+   */
+public:
+  FramesetLease() = default;
+  ~FramesetLease() { release(); }
+
+  FramesetLease(FramesetLease&& other) noexcept;
+  FramesetLease& operator=(FramesetLease&& other) noexcept;
+  FramesetLease(const FramesetLease&) = delete;
+  FramesetLease& operator=(const FramesetLease&) = delete;
+
+  void release();
+
+  explicit operator bool() const { return slot != nullptr; }
+  const cv::Mat* frames() const { return frames_; }
+  const cv::Mat& operator[](size_t cam) const { return frames_[cam]; }
+  uint64_t timestamp() const { return timestamp_; }
+
+private:
+  friend class StreamController;
+  FramesetLease(frameset_slot* slot, const cv::Mat* frames, uint64_t timestamp)
+    : slot(slot), frames_(frames), timestamp_(timestamp) {}
+
+  frameset_slot* slot = nullptr;
+  const cv::Mat* frames_ = nullptr;
+  uint64_t timestamp_ = 0;
+};
 
 class StreamController {
 private:
@@ -16,20 +72,74 @@ private:
   size_t frame_height;
   size_t num_cameras;
   pid_t server_pid_;
+  std::atomic<bool> server_exited;
+  int notify_fd_; // eventfd the server adds to on every publish
   sem_t* frameset_ctl_sem;
   int shm_fd;
   size_t shm_size;
-  void* frameset_buf;
+  frameset_shm* shm;
+  pid_t pid;
+  uint64_t leased_seq; // seq of the newest frameset leased, older ready ones are stale
+  std::vector<cv::Mat> slot_frames; // num_cameras views per slot, built once
+
+  enum prefetch_state {
+    PREFETCH_FREE,
+    PREFETCH_FILLING,
+    PREFETCH_READY,
+    PREFETCH_HELD // returned by recv_prefetched, until the next call
+  };
+
+  struct prefetch_buf {
+    std::vector<cv::Mat> frames;
+    uint64_t timestamp;
+    uint64_t seq;
+    prefetch_state state;
+  };
+
+  std::thread prefetch_thread;
+  std::mutex prefetch_lock;
+  std::condition_variable prefetch_ready;
+  std::vector<prefetch_buf> prefetch_bufs;
+  nv12_target prefetch_target;
+  bool prefetch_half;
+  bool prefetch_stop;
+  uint64_t prefetch_seq;
+  uint64_t prefetch_drops_;
+
+  FramesetLease lease_newest();
+  void prefetch_fn();
+  int claim_prefetch_buf();
 
 public:
   StreamController(
     size_t frame_width,
     size_t frame_height,
-    size_t num_cameras
+    size_t num_cameras,
+    const char* cam_conf_path = nullptr,
+    bool undistort = false // the server undistorts frames with the calibration store
   );
   ~StreamController();
 
+  FramesetLease acquire_frameset();
+  FramesetLease acquire_frameset_for(std::chrono::nanoseconds timeout);
+  FramesetLease try_acquire_frameset();
   void recv_frameset(cv::Mat* frames, uint64_t* timestamp);
+  bool recv_frameset_for(cv::Mat* frames, uint64_t* timestamp, std::chrono::nanoseconds timeout);
+
+  // readable whenever a frameset may be ready, for poll/epoll loops, see try_acquire_frameset
+  int notify_fd() const { return notify_fd_; }
+  bool server_alive();
+
+  // background receive and conversion, see start_prefetch
+  void start_prefetch(nv12_target target, bool half = false, size_t depth = 2);
+  void stop_prefetch();
+  const cv::Mat* recv_prefetched(uint64_t* timestamp);
+  uint64_t prefetch_drops();
+  pid_t server_pid() const { return server_pid_; }
+
+  // from the server's header, valid once a frameset has been received
+  uint8_t camera_id(size_t cam) const { return shm->cams[cam].id; }
+  bool undistorted(size_t cam) const { return shm->cams[cam].flags & FRAMESET_CAM_UNDISTORTED; }
 
   StreamController(const StreamController&) = delete;
   StreamController& operator=(const StreamController&) = delete;
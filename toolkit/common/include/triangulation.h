@@ -0,0 +1,99 @@
+#ifndef TRIANGULATION_H
+#define TRIANGULATION_H
+
+#include <cstddef>
+#include <cstdint>
+#include <opencv2/core.hpp>
+#include <vector>
+
+#define TRIANGULATION_MAX_CAMERAS 32 // views used are reported as a bitmask
+
+/**
+ * Batched multi-view triangulation of 2D keypoints
+ *
+ * Keypoints come in structure of arrays form, one x, y and confidence
+ * per camera per point, in the undistorted pixel coordinates of each
+ * camera's projection matrix (e.g. detections on Undistorter output,
+ * projected with its camera_matrix). Each point is solved as:
+ *
+ * 1. Optionally, outlier camera rejection: every pair of confident
+ *    views is triangulated and the pair whose point reprojects within
+ *    inlier_px in the most views (least total error on ties) decides
+ *    which views are kept. With a rig's handful of cameras the pairs
+ *    are the whole RANSAC sample space, so it is searched exhaustively
+ *    and the result is deterministic.
+ * 2. A linear (DLT) solve with each view's rows scaled by confidence.
+ * 3. Gauss-Newton refinement of the confidence weighted reprojection
+ *    error, which the DLT only approximates.
+ *
+ * Points are solved 8 at a time, one per SIMD lane, so a frameset's
+ * joints are a few hundred short, branch free solves. Projections
+ * are preconditioned once (image coordinates scaled by the focal
+ * length, world coordinates centered and scaled to the rig) so the
+ * lanes can be 32 bit floats without losing precision at mm scale.
+ * Kernels are AVX2 when the CPU has it (picked at runtime), otherwise
+ * the baseline vector unit (SSE2 or NEON).
+ */
+
+struct triangulation_params {
+  float min_confidence = 0.2f; // views below this are ignored
+  int min_views = 2;
+  int refine_iterations = 3;    // Gauss-Newton steps after the DLT, 0 for the DLT alone
+  bool reject_outliers = false; // pick the largest consistent set of views first
+  float inlier_px = 8.0f;       // reprojection error within which a view agrees
+};
+
+// non owning, each array is camera major: camera c's point p is at [c * num_points + p]
+struct keypoints_2d {
+  const float* x;
+  const float* y;
+  const float* conf;
+  size_t num_points;
+};
+
+struct points_3d {
+  std::vector<float> x; // in the projections' world frame, NaN where not triangulated
+  std::vector<float> y;
+  std::vector<float> z;
+  std::vector<float> error;    // rms reprojection error over the views used, pixels
+  std::vector<uint32_t> views; // bit c set when camera c was used
+};
+
+// a projection after preconditioning, solved against in float
+struct normalized_camera {
+  float rows[3][4];
+  float cx; // pixel to normalized image coordinates
+  float cy;
+  float focal;
+};
+
+class Triangulator {
+public:
+  // projections map world points to undistorted pixels, as K [R | t]
+  Triangulator(
+    const std::vector<cv::Matx34d>& projections,
+    triangulation_params params = triangulation_params()
+  );
+
+  // points is resized to keypoints.num_points
+  void triangulate(const keypoints_2d& keypoints, points_3d& points) const;
+
+  // triangulates every frameset in parallel on OpenCV's thread pool
+  void triangulate_framesets(const keypoints_2d* keypoints, points_3d* points, size_t count) const;
+
+  size_t num_cameras() const { return cameras.size(); }
+
+private:
+  std::vector<normalized_camera> cameras;
+  cv::Vec3d origin; // world point of the normalized frame's origin
+  double scale;     // world units per normalized unit
+  triangulation_params params;
+};
+
+// K [R | t] from a camera matrix and a world to camera pose (Rodrigues rvec)
+cv::Matx34d projection_matrix(const cv::Mat& camera_matrix, const cv::Mat& rvec, const cv::Mat& tvec);
+
+// "avx2", "sse2", "neon" or "scalar", whichever kernels this process runs
+const char* triangulation_kernel_isa();
+
+#endif // TRIANGULATION_H
@@ -0,0 +1,94 @@
+#ifndef UNDISTORT_H
+#define UNDISTORT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <opencv2/core.hpp>
+#include <vector>
+
+#include "calibration_io.h"
+
+#define REMAP_FRAC_BITS 5 // bilinear weights in 1/32 pixel, as OpenCV's fixed point remap
+
+/**
+ * Undistortion of NV12 frames through precomputed remap tables
+ *
+ * Each camera's calibration is turned into lookup tables once, so
+ * undistorting a frame is a single gather and bilinear blend per
+ * output sample, with no per frame map math. Entries are the byte
+ * offset of the top left source sample plus its two 1/32 pixel
+ * fractions, 6 bytes per sample, about what cv::convertMaps' fixed
+ * point maps take.
+ *
+ * Tables can cover just the luma plane (a gray image, which is all
+ * corner and keypoint detectors need) or the chroma plane too (an
+ * NV12 frame again), and just a region of the output, so consumers
+ * only interested in part of the view don't pay for the rest.
+ *
+ * Kernels are AVX2 (picked at runtime, using 32 bit gathers) or NEON,
+ * with a scalar fallback that computes bit identical results. Source
+ * coordinates outside the frame are clamped to its edge.
+ */
+
+enum class undistort_planes {
+  Y,   // output is the undistorted luma plane, CV_8UC1
+  NV12 // output is an undistorted NV12 frame, (height * 3/2) x width CV_8UC1
+};
+
+struct remap_lut {
+  int width;                    // output samples per row
+  int height;
+  std::vector<int32_t> offsets; // byte offset into the source frame, per output sample
+  std::vector<uint16_t> fracs;  // x fraction in the low byte, y in the high byte
+};
+
+class Undistorter {
+public:
+  /**
+   * Builds every camera's tables
+   *
+   * Parameters:
+   *   cams:   calibration per camera, intrinsics are required
+   *   size:   frame size every camera streams at
+   *   planes: which planes to produce
+   *   roi:    region of the undistorted image to produce, even aligned
+   *           for NV12, empty for all of it
+   *   alpha:  as getOptimalNewCameraMatrix, 0 keeps only valid pixels,
+   *           1 keeps every source pixel
+   */
+  Undistorter(
+    const std::vector<camera_calibration>& cams,
+    cv::Size size,
+    undistort_planes planes = undistort_planes::NV12,
+    cv::Rect roi = cv::Rect(),
+    double alpha = 0.0
+  );
+
+  // src is an NV12 frame, dst is only (re)allocated when its shape doesn't match
+  void undistort(const cv::Mat& src, cv::Mat& dst, size_t cam) const;
+
+  // undistorts every camera's frame in parallel on OpenCV's thread pool
+  void undistort_frameset(const cv::Mat* src, cv::Mat* dst) const;
+
+  // intrinsics of the undistorted output, with the roi's offset applied
+  const cv::Mat& camera_matrix(size_t cam) const { return out_matrices[cam]; }
+  cv::Size output_size() const { return roi.size(); }
+  size_t lut_bytes() const;
+
+private:
+  cv::Size size;
+  undistort_planes planes;
+  cv::Rect roi;
+  std::vector<remap_lut> luma_luts;
+  std::vector<remap_lut> chroma_luts;
+  std::vector<cv::Mat> out_matrices;
+};
+
+// raw kernels, dst holds width * height samples (twice the bytes for chroma)
+void remap_luma(const uint8_t* src, int stride, const remap_lut& lut, uint8_t* dst);
+void remap_chroma(const uint8_t* src, int stride, const remap_lut& lut, uint8_t* dst);
+
+// "avx2", "neon" or "scalar", whichever kernels this process runs
+const char* remap_kernel_isa();
+
+#endif // UNDISTORT_H
@@ -0,0 +1,52 @@
+#include <algorithm>
+#include <cmath>
+#include <opencv2/core.hpp>
+
+#include "board_detector.h"
+
+double corner_spread(const std::vector<int>& ids, cv::Size board_size) {
+  if (ids.size() < 2)
+    return 0.0;
+
+  double mean_col = 0;
+  double mean_row = 0;
+  for (int id : ids) {
+    mean_col += id % board_size.width;
+    mean_row += id / board_size.width;
+  }
+  mean_col /= ids.size();
+  mean_row /= ids.size();
+
+  double cc = 0;
+  double rr = 0;
+  double cr = 0;
+  for (int id : ids) {
+    double col = id % board_size.width - mean_col;
+    double row = id / board_size.width - mean_row;
+    cc += col * col;
+    rr += row * row;
+    cr += col * row;
+  }
+  cc /= ids.size();
+  rr /= ids.size();
+  cr /= ids.size();
+
+  // smaller eigenvalue of the 2x2 covariance
+  double half_trace = (cc + rr) / 2;
+  double det = cc * rr - cr * cr;
+  double smallest = half_trace - std::sqrt(std::max(half_trace * half_trace - det, 0.0));
+  return std::sqrt(std::max(smallest, 0.0));
+}
+
+BoardDetector::BoardDetector(cv::Size board_size, size_t num_cameras) :
+  board_size_(board_size),
+  num_cameras(num_cameras),
+  stats_(num_cameras, detector_stats{0, 0, 0, 0, 0, 0})
+{}
+
+void BoardDetector::detect_frameset(const cv::Mat* frames, board_detection* detections) {
+  cv::parallel_for_(cv::Range(0, (int)num_cameras), [&](const cv::Range& range) {
+    for (int i = range.start; i < range.end; i++)
+      detect(frames[i], i, detections[i]);
+  });
+}
@@ -0,0 +1,218 @@
+#include <errno.h>
+#include <opencv2/calib3d.hpp>
+#include <opencv2/core.hpp>
+#include <stdexcept>
+#include <stdio.h>
+#include <string>
+#include <string.h>
+#include <unistd.h>
+
+#include "calibration_io.h"
+#include "logging.h"
+
+std::vector<camera_calibration> load_calibration(const char* path) {
+  std::vector<camera_calibration> cams;
+  if (access(path, F_OK) == -1)
+    return cams;
+
+  char logstr[128];
+  cv::FileStorage fs(path, cv::FileStorage::READ);
+  if (!fs.isOpened()) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error opening calibration %s",
+      path
+    );
+    LOG(ERROR, logstr);
+    throw std::runtime_error(logstr);
+  }
+
+  int cam_count = 0;
+  fs["cam_count"] >> cam_count;
+  cams.resize(cam_count);
+
+  for (int i = 0; i < cam_count; i++) {
+    cv::FileNode node = fs["cam_" + std::to_string(i)];
+    camera_calibration& cam = cams[i];
+    if (!node["id"].empty())
+      node["id"] >> cam.id;
+    node["image_width"] >> cam.image_size.width;
+    node["image_height"] >> cam.image_size.height;
+    node["camera_matrix"] >> cam.camera_matrix;
+    node["dist_coeffs"] >> cam.dist_coeffs;
+    node["rms"] >> cam.rms;
+    node["rvec"] >> cam.rvec;
+    node["tvec"] >> cam.tvec;
+  }
+
+  return cams;
+}
+
+static void save_calibration_store(const char* path, const std::vector<camera_calibration>& cams);
+
+void save_calibration(
+  const char* path,
+  const std::vector<camera_calibration>& cams,
+  const char* store_path
+) {
+  char logstr[128];
+  cv::FileStorage fs(path, cv::FileStorage::WRITE);
+  if (!fs.isOpened()) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error writing calibration %s",
+      path
+    );
+    LOG(ERROR, logstr);
+    throw std::runtime_error(logstr);
+  }
+
+  fs << "cam_count" << (int)cams.size();
+  for (size_t i = 0; i < cams.size(); i++) {
+    const camera_calibration& cam = cams[i];
+    fs << "cam_" + std::to_string(i) << "{";
+    fs << "id" << cam.id;
+    fs << "image_width" << cam.image_size.width;
+    fs << "image_height" << cam.image_size.height;
+    fs << "camera_matrix" << cam.camera_matrix;
+    fs << "dist_coeffs" << cam.dist_coeffs;
+    fs << "rms" << cam.rms;
+    fs << "rvec" << cam.rvec;
+    fs << "tvec" << cam.tvec;
+    fs << "}";
+  }
+  fs.release();
+
+  save_calibration_store(store_path, cams);
+}
+
+std::vector<camera_calibration> order_calibration(
+  const std::vector<camera_calibration>& cams,
+  const std::vector<uint8_t>& ids
+) {
+  std::vector<camera_calibration> ordered(ids.size());
+  std::vector<bool> placed(cams.size(), false);
+
+  for (size_t i = 0; i < ids.size(); i++) {
+    ordered[i].id = ids[i];
+    for (size_t j = 0; j < cams.size(); j++) {
+      // an entry without an id is taken to be the camera at its position
+      bool match = cams[j].id == -1 ? j == i : cams[j].id == ids[i];
+      if (!match || placed[j])
+        continue;
+
+      ordered[i] = cams[j];
+      ordered[i].id = ids[i];
+      placed[j] = true;
+      break;
+    }
+  }
+
+  // cameras not streaming now keep their calibration for when they are
+  for (size_t j = 0; j < cams.size(); j++) {
+    if (!placed[j] && cams[j].id != -1)
+      ordered.push_back(cams[j]);
+  }
+
+  return ordered;
+}
+
+cv::Mat undistorted_matrix(const camera_calibration& cam) {
+  // as the Undistorter's default alpha, only pixels with a source in the frame
+  return cv::getOptimalNewCameraMatrix(
+    cam.camera_matrix,
+    cam.dist_coeffs,
+    cam.image_size,
+    0.0,
+    cam.image_size
+  );
+}
+
+static void copy_doubles(const cv::Mat& src, double* dst, size_t count) {
+  cv::Mat converted;
+  src.convertTo(converted, CV_64F);
+  const double* values = converted.ptr<double>();
+  for (size_t i = 0; i < count; i++)
+    dst[i] = values[i];
+}
+
+static void save_calibration_store(const char* path, const std::vector<camera_calibration>& cams) {
+  /**
+   * Writes every camera with an id to the binary store, written aside
+   * and renamed over so the server never reads a partial store
+   *
+   * Cameras whose distortion model has more coefficients than the
+   * store holds are written without intrinsics, so the server leaves
+   * their frames as decoded rather than undistorting them wrongly.
+   */
+  char logstr[128];
+
+  std::vector<calibration_store_entry> entries;
+  for (const camera_calibration& cam : cams) {
+    if (cam.id < 0 || cam.id > UINT8_MAX)
+      continue;
+
+    calibration_store_entry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.id = (uint8_t)cam.id;
+    entry.width = cam.image_size.width;
+    entry.height = cam.image_size.height;
+    entry.rms = cam.rms;
+
+    size_t dist_count = cam.dist_coeffs.total();
+    if (!cam.camera_matrix.empty() && dist_count > CALIBRATION_MAX_DIST) {
+      snprintf(
+        logstr,
+        sizeof(logstr),
+        "Camera id %d has %zu distortion coefficients, the server can't undistort it",
+        cam.id,
+        dist_count
+      );
+      LOG(WARNING, logstr);
+    } else if (!cam.camera_matrix.empty()) {
+      entry.flags |= CALIBRATION_HAS_INTRINSICS;
+      entry.dist_count = (uint8_t)dist_count;
+      copy_doubles(cam.camera_matrix, entry.camera_matrix, 9);
+      copy_doubles(cam.dist_coeffs, entry.dist_coeffs, dist_count);
+      copy_doubles(undistorted_matrix(cam), entry.undistorted_matrix, 9);
+    }
+
+    if (!cam.rvec.empty() && !cam.tvec.empty()) {
+      entry.flags |= CALIBRATION_HAS_EXTRINSICS;
+      copy_doubles(cam.rvec, entry.rvec, 3);
+      copy_doubles(cam.tvec, entry.tvec, 3);
+    }
+
+    entries.push_back(entry);
+  }
+
+  calibration_store_header header = {
+    CALIBRATION_STORE_MAGIC,
+    CALIBRATION_STORE_VERSION,
+    (uint32_t)entries.size(),
+    sizeof(calibration_store_entry)
+  };
+
+  std::string tmp_path = std::string(path) + ".tmp";
+  FILE* out = fopen(tmp_path.c_str(), "wb");
+  bool written = out != nullptr
+    && fwrite(&header, sizeof(header), 1, out) == 1
+    && fwrite(entries.data(), sizeof(calibration_store_entry), entries.size(), out) == entries.size();
+  if (out != nullptr && fclose(out) != 0)
+    written = false;
+
+  if (!written || rename(tmp_path.c_str(), path) == -1) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error writing calibration store %s: %s",
+      path,
+      strerror(errno)
+    );
+    LOG(ERROR, logstr);
+    unlink(tmp_path.c_str());
+    throw std::runtime_error(logstr);
+  }
+}
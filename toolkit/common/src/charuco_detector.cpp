@@ -0,0 +1,206 @@
+#include <algorithm>
+#include <cmath>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/objdetect/charuco_detector.hpp>
+#include <stdexcept>
+#include <time.h>
+
+#include "charuco_detector.h"
+#include "logging.h"
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static cv::aruco::CharucoBoard charuco_board(cv::Size board_size, float marker_ratio, int dictionary) {
+  if (board_size.width < 2 || board_size.height < 2 || marker_ratio <= 0.0f || marker_ratio >= 1.0f) {
+    char logstr[128];
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "ChArUco board needs at least 2x2 inner corners and markers inside squares, got %dx%d, %.2f",
+      board_size.width,
+      board_size.height,
+      marker_ratio
+    );
+    LOG(ERROR, logstr);
+    throw std::invalid_argument(logstr);
+  }
+
+  // only the ratio matters for interpolating corners, so squares are unit length
+  return cv::aruco::CharucoBoard(
+    cv::Size(board_size.width + 1, board_size.height + 1),
+    1.0f,
+    marker_ratio,
+    cv::aruco::getPredefinedDictionary(dictionary)
+  );
+}
+
+cv::Mat charuco_board_image(
+  cv::Size board_size,
+  float marker_ratio,
+  int dictionary,
+  int square_px
+) {
+  /**
+   * Draws the board to print, from the same constants the detector is
+   * built with, so the printed markers always match what is searched
+   * for. Printed at any scale, the square side measured on the print
+   * is the calibration tools' SQUARE_SIZE.
+   *
+   * Returns:
+   *   A CV_8UC1 image, (board_size + 1) squares each way plus margins
+   */
+  cv::aruco::CharucoBoard board = charuco_board(board_size, marker_ratio, dictionary);
+  cv::Size squares = board.getChessboardSize();
+  int margin = square_px / 2;
+
+  cv::Mat image;
+  board.generateImage(
+    cv::Size(squares.width * square_px + 2 * margin, squares.height * square_px + 2 * margin),
+    image,
+    margin,
+    1
+  );
+  return image;
+}
+
+CharucoBoardDetector::CharucoBoardDetector(
+  cv::Size board_size,
+  float marker_ratio,
+  int dictionary,
+  size_t num_cameras,
+  int coarse_width
+) :
+  BoardDetector(board_size, num_cameras),
+  coarse_width(coarse_width),
+  marker_ratio(marker_ratio),
+  board(charuco_board(board_size, marker_ratio, dictionary)),
+  coarse(num_cameras),
+  markers(num_cameras),
+  marker_ids(num_cameras),
+  marker_corners(num_cameras)
+{
+  cv::aruco::CharucoParameters charuco_params;
+  charuco_params.minMarkers = CHARUCO_MIN_MARKERS;
+
+  marker_detectors.reserve(num_cameras);
+  board_detectors.reserve(num_cameras);
+  for (size_t i = 0; i < num_cameras; i++) {
+    marker_detectors.emplace_back(cv::aruco::getPredefinedDictionary(dictionary));
+    board_detectors.emplace_back(board, charuco_params);
+  }
+}
+
+bool CharucoBoardDetector::detect(const cv::Mat& frame, size_t cam, board_detection& detection) {
+  /**
+   * Detects whatever part of the board is in one camera's frame
+   *
+   * Parameters:
+   *   frame:     an NV12 frame, (height * 3/2) x width CV_8UC1
+   *   cam:       the camera's index, selects its scratch buffers
+   *   detection: set to the result, corners and ids are reused across calls
+   *
+   * Returns:
+   *   Whether enough of the board was found
+   */
+  uint64_t start = now_ns();
+  detector_stats& stats = stats_[cam];
+  stats.frames++;
+
+  detection.found = false;
+  detection.corners.clear();
+  detection.ids.clear();
+
+  // the luma plane of an NV12 frame is already a gray image
+  cv::Mat gray = frame.rowRange(0, frame.rows * 2 / 3);
+
+  double scale = 1.0;
+  cv::Mat small = gray;
+  if (gray.cols > coarse_width) {
+    scale = (double)coarse_width / gray.cols;
+    cv::resize(gray, coarse[cam], cv::Size(), scale, scale, cv::INTER_AREA);
+    small = coarse[cam];
+  }
+
+  std::vector<std::vector<cv::Point2f>>& found_markers = markers[cam];
+  std::vector<int>& ids = marker_ids[cam];
+  found_markers.clear();
+  ids.clear();
+  marker_detectors[cam].detectMarkers(small, found_markers, ids);
+  if (ids.size() < CHARUCO_MIN_MARKERS) {
+    detection.detect_ns = now_ns() - start;
+    stats.detect_ns += detection.detect_ns;
+    return false;
+  }
+  stats.coarse_hits++;
+
+  std::vector<cv::Point2f>& flat = marker_corners[cam];
+  flat.clear();
+  double perimeter = 0;
+  for (const std::vector<cv::Point2f>& marker : found_markers) {
+    for (size_t k = 0; k < marker.size(); k++) {
+      flat.push_back(marker[k] * (1.0 / scale));
+      perimeter += cv::norm(marker[k] - marker[(k + 1) % marker.size()]) / scale;
+    }
+  }
+
+  // chessboard corners lie within a square of some marker corner, pad by two
+  float square = perimeter / (4 * found_markers.size()) / marker_ratio;
+  cv::Rect bounds = cv::boundingRect(flat);
+  int pad = (int)(2 * square) + 8;
+  cv::Rect roi = cv::Rect(
+    bounds.x - pad,
+    bounds.y - pad,
+    bounds.width + 2 * pad,
+    bounds.height + 2 * pad
+  ) & cv::Rect(0, 0, gray.cols, gray.rows);
+
+  for (cv::Point2f& p : flat) {
+    p.x -= roi.x;
+    p.y -= roi.y;
+  }
+
+  // upscaled corners are off by up to a coarse pixel, which the window has to cover
+  int win = std::max(2, std::min(5, (int)std::ceil(1.0 / scale) + 1));
+  cv::cornerSubPix(
+    gray(roi),
+    flat,
+    cv::Size(win, win),
+    cv::Size(-1, -1),
+    cv::TermCriteria(cv::TermCriteria::EPS + cv::TermCriteria::COUNT, 20, 0.01)
+  );
+
+  for (size_t m = 0; m < found_markers.size(); m++) {
+    for (size_t k = 0; k < found_markers[m].size(); k++)
+      found_markers[m][k] = flat[m * 4 + k];
+  }
+
+  // given markers, the detector interpolates and refines the corners without searching again
+  board_detectors[cam].detectBoard(gray(roi), detection.corners, detection.ids, found_markers, ids);
+
+  bool found = detection.corners.size() >= CHARUCO_MIN_CORNERS
+    && corner_spread(detection.ids, board_size_) >= CHARUCO_MIN_SPREAD;
+  if (!found) {
+    detection.corners.clear();
+    detection.ids.clear();
+    detection.detect_ns = now_ns() - start;
+    stats.detect_ns += detection.detect_ns;
+    return false;
+  }
+
+  for (cv::Point2f& p : detection.corners) {
+    p.x += roi.x;
+    p.y += roi.y;
+  }
+
+  detection.found = true;
+  stats.found++;
+  stats.corners += detection.corners.size();
+  detection.detect_ns = now_ns() - start;
+  stats.detect_ns += detection.detect_ns;
+  return true;
+}
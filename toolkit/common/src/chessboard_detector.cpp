@@ -0,0 +1,139 @@
+#include <algorithm>
+#include <numeric>
+#include <opencv2/calib3d.hpp>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <stdexcept>
+#include <time.h>
+
+#include "chessboard_detector.h"
+#include "logging.h"
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+ChessboardDetector::ChessboardDetector(
+  cv::Size board_size,
+  size_t num_cameras,
+  int coarse_width
+) :
+  BoardDetector(board_size, num_cameras),
+  coarse_width(coarse_width),
+  coarse(num_cameras),
+  coarse_corners(num_cameras)
+{
+  if (board_size.width < 3 || board_size.height < 3) {
+    char logstr[128];
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Chessboard needs at least 3x3 inner corners, got %dx%d",
+      board_size.width,
+      board_size.height
+    );
+    LOG(ERROR, logstr);
+    throw std::invalid_argument(logstr);
+  }
+}
+
+bool ChessboardDetector::detect(const cv::Mat& frame, size_t cam, board_detection& detection) {
+  /**
+   * Detects the board in one camera's frame
+   *
+   * Parameters:
+   *   frame:     an NV12 frame, (height * 3/2) x width CV_8UC1
+   *   cam:       the camera's index, selects its scratch buffers
+   *   detection: set to the result, corners are reused across calls
+   *
+   * Returns:
+   *   Whether the board was found
+   */
+  uint64_t start = now_ns();
+  detector_stats& stats = stats_[cam];
+  stats.frames++;
+
+  detection.found = false;
+  detection.corners.clear();
+  detection.ids.clear();
+
+  // the luma plane of an NV12 frame is already a gray image
+  cv::Mat gray = frame.rowRange(0, frame.rows * 2 / 3);
+
+  double scale = 1.0;
+  cv::Mat small = gray;
+  if (gray.cols > coarse_width) {
+    scale = (double)coarse_width / gray.cols;
+    cv::resize(gray, coarse[cam], cv::Size(), scale, scale, cv::INTER_AREA);
+    small = coarse[cam];
+  }
+
+  std::vector<cv::Point2f>& hint = coarse_corners[cam];
+  bool present = cv::findChessboardCorners(
+    small,
+    board_size_,
+    hint,
+    cv::CALIB_CB_ADAPTIVE_THRESH | cv::CALIB_CB_NORMALIZE_IMAGE | cv::CALIB_CB_FAST_CHECK
+  );
+  if (!present) {
+    detection.detect_ns = now_ns() - start;
+    stats.detect_ns += detection.detect_ns;
+    return false;
+  }
+  stats.coarse_hits++;
+
+  for (cv::Point2f& p : hint)
+    p *= 1.0 / scale;
+
+  // the outer squares extend a square past the inner corners, pad by two
+  cv::Rect bounds = cv::boundingRect(hint);
+  float square = std::max(
+    (float)bounds.width / (board_size_.width - 1),
+    (float)bounds.height / (board_size_.height - 1)
+  );
+  int pad = (int)(2 * square) + 8;
+  cv::Rect roi = cv::Rect(
+    bounds.x - pad,
+    bounds.y - pad,
+    bounds.width + 2 * pad,
+    bounds.height + 2 * pad
+  ) & cv::Rect(0, 0, gray.cols, gray.rows);
+
+  bool found = cv::findChessboardCornersSB(
+    gray(roi),
+    board_size_,
+    detection.corners,
+    cv::CALIB_CB_NORMALIZE_IMAGE | cv::CALIB_CB_ACCURACY
+  );
+
+  if (found) {
+    for (cv::Point2f& p : detection.corners) {
+      p.x += roi.x;
+      p.y += roi.y;
+    }
+  } else {
+    // the coarse pass saw a whole board, so its corners only need sharpening
+    int win = std::max(3, std::min(11, (int)(square / 4)));
+    detection.corners = hint;
+    cv::cornerSubPix(
+      gray,
+      detection.corners,
+      cv::Size(win, win),
+      cv::Size(-1, -1),
+      cv::TermCriteria(cv::TermCriteria::EPS + cv::TermCriteria::COUNT, 30, 0.01)
+    );
+    stats.fallbacks++;
+  }
+
+  detection.ids.resize(detection.corners.size());
+  std::iota(detection.ids.begin(), detection.ids.end(), 0);
+
+  detection.found = true;
+  stats.found++;
+  stats.corners += detection.corners.size();
+  detection.detect_ns = now_ns() - start;
+  stats.detect_ns += detection.detect_ns;
+  return true;
+}
@@ -0,0 +1,574 @@
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdexcept>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "keypoint_dataset.h"
+#include "logging.h"
+
+static const char* COLUMN_FILES[COLUMN_COUNT] = {
+  "timestamp.col",
+  "camera.col",
+  "joint.col",
+  "frame.col",
+  "x.col",
+  "y.col",
+  "conf.col"
+};
+
+static const size_t COLUMN_WIDTHS[COLUMN_COUNT] = {
+  sizeof(uint64_t),
+  sizeof(uint16_t),
+  sizeof(uint16_t),
+  sizeof(uint32_t),
+  sizeof(float),
+  sizeof(float),
+  sizeof(float)
+};
+
+const char* dataset_column_file(dataset_column column) {
+  return COLUMN_FILES[column];
+}
+
+size_t dataset_column_width(dataset_column column) {
+  return COLUMN_WIDTHS[column];
+}
+
+[[noreturn]] static void fail(const char* what, const std::string& path) {
+  char logstr[128];
+  snprintf(
+    logstr,
+    sizeof(logstr),
+    "%s %s: %s",
+    what,
+    path.c_str(),
+    strerror(errno)
+  );
+  LOG(ERROR, logstr);
+  throw std::runtime_error(logstr);
+}
+
+[[noreturn]] static void corrupt(const std::string& dir, const char* why) {
+  char logstr[128];
+  snprintf(
+    logstr,
+    sizeof(logstr),
+    "Dataset %s is corrupt: %s",
+    dir.c_str(),
+    why
+  );
+  LOG(ERROR, logstr);
+  throw std::runtime_error(logstr);
+}
+
+static void pwrite_all(int fd, const void* buf, size_t size, uint64_t offset, const std::string& path) {
+  const uint8_t* bytes = (const uint8_t*)buf;
+  while (size > 0) {
+    ssize_t written = pwrite(fd, bytes, size, offset);
+    if (written == -1) {
+      if (errno == EINTR)
+        continue;
+      fail("Error writing", path);
+    }
+    bytes += written;
+    size -= written;
+    offset += written;
+  }
+}
+
+static void shuffle(const uint8_t* values, size_t count, size_t width, uint8_t* out) {
+  // byte b of value i goes to out[b * count + i]
+  for (size_t b = 0; b < width; b++) {
+    uint8_t* plane = out + b * count;
+    for (size_t i = 0; i < count; i++)
+      plane[i] = values[i * width + b];
+  }
+}
+
+static void unshuffle(const uint8_t* planes, size_t count, size_t width, uint8_t* out) {
+  for (size_t b = 0; b < width; b++) {
+    const uint8_t* plane = planes + b * count;
+    for (size_t i = 0; i < count; i++)
+      out[i * width + b] = plane[i];
+  }
+}
+
+dataset_rows dataset_rows::subrange(size_t offset, size_t length) const {
+  return {
+    timestamp.subspan(offset, length),
+    camera.subspan(offset, length),
+    joint.subspan(offset, length),
+    frame.subspan(offset, length),
+    x.subspan(offset, length),
+    y.subspan(offset, length),
+    conf.subspan(offset, length)
+  };
+}
+
+static void unmap_columns(const uint8_t** maps, size_t* map_sizes) {
+  for (int c = 0; c < COLUMN_COUNT; c++) {
+    if (maps[c] != nullptr)
+      munmap((void*)maps[c], map_sizes[c]);
+    maps[c] = nullptr;
+  }
+}
+
+static dataset_rows frameset_at(const dataset_rows& rows, size_t start) {
+  // framesets are runs of equal timestamps, and never split across chunks
+  const uint64_t* end = std::upper_bound(
+    rows.timestamp.begin() + start,
+    rows.timestamp.end(),
+    rows.timestamp[start]
+  );
+  return rows.subrange(start, end - rows.timestamp.begin() - start);
+}
+
+DatasetWriter::DatasetWriter(const char* dir, dataset_options options) :
+  dir(dir),
+  options(options),
+  closed(false),
+  row_count(0),
+  frameset_count(0),
+  last_timestamp(0),
+  joint_count(0),
+  chunk_framesets(0)
+{
+  std::fill(fds, fds + COLUMN_COUNT, -1);
+  std::fill(file_sizes, file_sizes + COLUMN_COUNT, 0);
+
+  if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+    fail("Error creating dataset directory", this->dir);
+
+  // a finished dataset is never appended to or overwritten
+  std::string index = this->dir + "/" + DATASET_INDEX_FILE;
+  if (access(index.c_str(), F_OK) == 0) {
+    char logstr[128];
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Dataset %s already exists",
+      dir
+    );
+    LOG(ERROR, logstr);
+    throw std::invalid_argument(logstr);
+  }
+
+  for (int c = 0; c < COLUMN_COUNT; c++) {
+    std::string path = this->dir + "/" + COLUMN_FILES[c];
+    fds[c] = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fds[c] == -1) {
+      for (int opened = 0; opened < c; opened++)
+        ::close(fds[opened]);
+      fail("Error creating", path);
+    }
+  }
+
+  size_t reserve = options.chunk_rows + UINT16_MAX;
+  timestamps.reserve(reserve);
+  cameras.reserve(reserve);
+  joints.reserve(reserve);
+  frames.reserve(reserve);
+  xs.reserve(reserve);
+  ys.reserve(reserve);
+  confs.reserve(reserve);
+}
+
+DatasetWriter::~DatasetWriter() {
+  try {
+    close();
+  } catch (const std::exception&) {
+    // already logged, and the missing index marks the dataset unfinished
+  }
+
+  for (int c = 0; c < COLUMN_COUNT; c++) {
+    if (fds[c] != -1)
+      ::close(fds[c]);
+  }
+}
+
+void DatasetWriter::append(
+  uint64_t timestamp,
+  uint16_t camera,
+  uint32_t frame,
+  const float* x,
+  const float* y,
+  const float* conf,
+  uint16_t num_joints
+) {
+  if (closed || (row_count > 0 && timestamp < last_timestamp)) {
+    char logstr[128];
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Dataset %s %s",
+      dir.c_str(),
+      closed ? "is closed" : "needs views in timestamp order"
+    );
+    LOG(ERROR, logstr);
+    throw std::invalid_argument(logstr);
+  }
+
+  // rows are addressed as whole views, so every view needs the same joints
+  if (num_joints == 0 || (joint_count > 0 && num_joints != joint_count)) {
+    char logstr[128];
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Dataset %s got a view of %u joints, %s %u",
+      dir.c_str(),
+      num_joints,
+      joint_count > 0 ? "its views have" : "a view needs at least",
+      joint_count > 0 ? joint_count : 1
+    );
+    LOG(ERROR, logstr);
+    throw std::invalid_argument(logstr);
+  }
+  joint_count = num_joints;
+
+  if (row_count == 0 || timestamp != last_timestamp) {
+    if (timestamps.size() >= options.chunk_rows)
+      flush_chunk();
+    frameset_count++;
+    chunk_framesets++;
+    last_timestamp = timestamp;
+  }
+
+  timestamps.insert(timestamps.end(), num_joints, timestamp);
+  cameras.insert(cameras.end(), num_joints, camera);
+  frames.insert(frames.end(), num_joints, frame);
+  for (uint16_t j = 0; j < num_joints; j++)
+    joints.push_back(j);
+  xs.insert(xs.end(), x, x + num_joints);
+  ys.insert(ys.end(), y, y + num_joints);
+  confs.insert(confs.end(), conf, conf + num_joints);
+  row_count += num_joints;
+}
+
+void DatasetWriter::close() {
+  if (closed)
+    return;
+
+  flush_chunk();
+  for (int c = 0; c < COLUMN_COUNT; c++) {
+    if (fdatasync(fds[c]) == -1)
+      fail("Error syncing", dir + "/" + COLUMN_FILES[c]);
+  }
+  write_index();
+  closed = true;
+}
+
+uint64_t DatasetWriter::rows_written() const {
+  return row_count;
+}
+
+void DatasetWriter::flush_chunk() {
+  if (timestamps.empty())
+    return;
+
+  dataset_chunk chunk = {};
+  chunk.first_timestamp = timestamps.front();
+  chunk.last_timestamp = timestamps.back();
+  chunk.rows = timestamps.size();
+  chunk.framesets = chunk_framesets;
+  chunk.first_row = row_count - chunk.rows;
+  chunk.first_frameset = chunks.empty()
+    ? 0
+    : chunks.back().first_frameset + chunks.back().framesets;
+
+  write_column(COLUMN_TIMESTAMP, timestamps.data(), chunk);
+  write_column(COLUMN_CAMERA, cameras.data(), chunk);
+  write_column(COLUMN_JOINT, joints.data(), chunk);
+  write_column(COLUMN_FRAME, frames.data(), chunk);
+  write_column(COLUMN_X, xs.data(), chunk);
+  write_column(COLUMN_Y, ys.data(), chunk);
+  write_column(COLUMN_CONF, confs.data(), chunk);
+  chunks.push_back(chunk);
+
+  timestamps.clear();
+  cameras.clear();
+  joints.clear();
+  frames.clear();
+  xs.clear();
+  ys.clear();
+  confs.clear();
+  chunk_framesets = 0;
+}
+
+void DatasetWriter::write_column(dataset_column column, const void* values, dataset_chunk& chunk) {
+  size_t width = COLUMN_WIDTHS[column];
+  size_t bytes = chunk.rows * width;
+  const void* stored = values;
+  dataset_extent& extent = chunk.columns[column];
+  extent.stored = bytes;
+  extent.flags = 0;
+
+  if (options.compress) {
+    shuffled.resize(bytes);
+    shuffle((const uint8_t*)values, chunk.rows, width, shuffled.data());
+
+    uLongf deflated_size = compressBound(bytes);
+    deflated.resize(deflated_size);
+    int ret = compress2(
+      deflated.data(),
+      &deflated_size,
+      shuffled.data(),
+      bytes,
+      options.compression_level
+    );
+
+    // kept only where it pays, noisy low bits of coordinates may not
+    if (ret == Z_OK && deflated_size < bytes) {
+      stored = deflated.data();
+      extent.stored = deflated_size;
+      extent.flags = DATASET_COMPRESSED;
+    }
+  }
+
+  // the gap left by aligning is a hole, it reads back as zeros and takes no space
+  extent.offset = (file_sizes[column] + DATASET_ALIGN - 1) & ~(uint64_t)(DATASET_ALIGN - 1);
+  pwrite_all(fds[column], stored, extent.stored, extent.offset, dir + "/" + COLUMN_FILES[column]);
+  file_sizes[column] = extent.offset + extent.stored;
+}
+
+void DatasetWriter::write_index() {
+  dataset_header header = {};
+  header.magic = DATASET_MAGIC;
+  header.version = DATASET_VERSION;
+  header.column_count = COLUMN_COUNT;
+  header.row_count = row_count;
+  header.frameset_count = frameset_count;
+  header.chunk_count = chunks.size();
+
+  // written aside and renamed over, so a crash never leaves a partial index
+  std::string path = dir + "/" + DATASET_INDEX_FILE;
+  std::string tmp_path = path + ".tmp";
+  int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1)
+    fail("Error creating", tmp_path);
+
+  try {
+    pwrite_all(fd, &header, sizeof(header), 0, tmp_path);
+    pwrite_all(fd, chunks.data(), chunks.size() * sizeof(dataset_chunk), sizeof(header), tmp_path);
+    if (fdatasync(fd) == -1)
+      fail("Error syncing", tmp_path);
+  } catch (const std::exception&) {
+    ::close(fd);
+    throw;
+  }
+  ::close(fd);
+
+  if (rename(tmp_path.c_str(), path.c_str()) == -1)
+    fail("Error renaming", tmp_path);
+}
+
+Dataset::Dataset(const char* dir) {
+  std::string dir_path = dir;
+  std::fill(maps, maps + COLUMN_COUNT, nullptr);
+  std::fill(map_sizes, map_sizes + COLUMN_COUNT, 0);
+
+  std::string index = dir_path + "/" + DATASET_INDEX_FILE;
+  int fd = open(index.c_str(), O_RDONLY);
+  if (fd == -1)
+    fail("Error opening dataset index (was the writer closed?)", index);
+
+  ssize_t read_size = pread(fd, &header, sizeof(header), 0);
+  if (read_size != (ssize_t)sizeof(header)) {
+    ::close(fd);
+    corrupt(dir_path, "short index header");
+  }
+  if (header.magic != DATASET_MAGIC || header.version != DATASET_VERSION || header.column_count != COLUMN_COUNT) {
+    ::close(fd);
+    corrupt(dir_path, "unknown index format or version");
+  }
+
+  chunks.resize(header.chunk_count);
+  size_t chunks_size = chunks.size() * sizeof(dataset_chunk);
+  read_size = pread(fd, chunks.data(), chunks_size, sizeof(header));
+  ::close(fd);
+  if (read_size != (ssize_t)chunks_size)
+    corrupt(dir_path, "short chunk index");
+
+  for (int c = 0; c < COLUMN_COUNT; c++) {
+    std::string path = dir_path + "/" + COLUMN_FILES[c];
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+      unmap_columns(maps, map_sizes);
+      fail("Error opening", path);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+      ::close(fd);
+      unmap_columns(maps, map_sizes);
+      fail("Error reading size of", path);
+    }
+
+    // an empty dataset has empty columns, which can't be mapped
+    if (st.st_size > 0) {
+      void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      if (map == MAP_FAILED) {
+        ::close(fd);
+        unmap_columns(maps, map_sizes);
+        fail("Error mapping", path);
+      }
+      maps[c] = (const uint8_t*)map;
+      map_sizes[c] = st.st_size;
+    }
+    ::close(fd);
+  }
+
+  // every extent checked once here, so reads never fault on a truncated file
+  for (const dataset_chunk& chunk : chunks) {
+    for (int c = 0; c < COLUMN_COUNT; c++) {
+      const dataset_extent& extent = chunk.columns[c];
+      bool bad = extent.offset > map_sizes[c]
+        || extent.stored > map_sizes[c] - extent.offset
+        || extent.offset % DATASET_ALIGN != 0
+        || (!(extent.flags & DATASET_COMPRESSED) && extent.stored != chunk.rows * COLUMN_WIDTHS[c]);
+      if (bad) {
+        unmap_columns(maps, map_sizes);
+        corrupt(dir_path, COLUMN_FILES[c]);
+      }
+    }
+  }
+}
+
+Dataset::~Dataset() {
+  unmap_columns(maps, map_sizes);
+}
+
+uint64_t Dataset::num_rows() const {
+  return header.row_count;
+}
+
+uint64_t Dataset::num_framesets() const {
+  return header.frameset_count;
+}
+
+size_t Dataset::num_chunks() const {
+  return chunks.size();
+}
+
+const dataset_chunk& Dataset::chunk_info(size_t chunk) const {
+  return chunks.at(chunk);
+}
+
+void Dataset::inflate(size_t chunk, chunk_buffer& buffer) const {
+  const dataset_chunk& info = chunks[chunk];
+
+  for (int c = 0; c < COLUMN_COUNT; c++) {
+    const dataset_extent& extent = info.columns[c];
+    if (!(extent.flags & DATASET_COMPRESSED))
+      continue;
+
+    size_t width = COLUMN_WIDTHS[c];
+    uLongf bytes = info.rows * width;
+    buffer.shuffled.resize(bytes);
+    buffer.columns[c].resize(bytes);
+
+    int ret = uncompress(buffer.shuffled.data(), &bytes, maps[c] + extent.offset, extent.stored);
+    if (ret != Z_OK || bytes != info.rows * width) {
+      buffer.dataset = nullptr;
+      char logstr[128];
+      snprintf(
+        logstr,
+        sizeof(logstr),
+        "Error inflating chunk %zu of %s: %s",
+        chunk,
+        COLUMN_FILES[c],
+        zError(ret)
+      );
+      LOG(ERROR, logstr);
+      throw std::runtime_error(logstr);
+    }
+
+    unshuffle(buffer.shuffled.data(), info.rows, width, buffer.columns[c].data());
+  }
+
+  buffer.dataset = this;
+  buffer.chunk = chunk;
+}
+
+dataset_rows Dataset::chunk(size_t chunk, chunk_buffer& buffer) const {
+  const dataset_chunk& info = chunks.at(chunk);
+
+  bool compressed = false;
+  for (int c = 0; c < COLUMN_COUNT; c++)
+    compressed = compressed || (info.columns[c].flags & DATASET_COMPRESSED);
+  if (compressed && (buffer.dataset != this || buffer.chunk != chunk))
+    inflate(chunk, buffer);
+
+  const void* data[COLUMN_COUNT];
+  for (int c = 0; c < COLUMN_COUNT; c++) {
+    if (info.columns[c].flags & DATASET_COMPRESSED)
+      data[c] = buffer.columns[c].data();
+    else
+      data[c] = maps[c] + info.columns[c].offset;
+  }
+
+  return {
+    {(const uint64_t*)data[COLUMN_TIMESTAMP], info.rows},
+    {(const uint16_t*)data[COLUMN_CAMERA], info.rows},
+    {(const uint16_t*)data[COLUMN_JOINT], info.rows},
+    {(const uint32_t*)data[COLUMN_FRAME], info.rows},
+    {(const float*)data[COLUMN_X], info.rows},
+    {(const float*)data[COLUMN_Y], info.rows},
+    {(const float*)data[COLUMN_CONF], info.rows}
+  };
+}
+
+dataset_rows Dataset::frameset(uint64_t n, chunk_buffer& buffer) const {
+  if (n >= header.frameset_count) {
+    char logstr[128];
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Frameset %lu is out of range, the dataset has %lu",
+      n,
+      header.frameset_count
+    );
+    LOG(ERROR, logstr);
+    throw std::out_of_range(logstr);
+  }
+
+  // the last chunk starting at or before frameset n
+  auto found = std::upper_bound(
+    chunks.begin(),
+    chunks.end(),
+    n,
+    [](uint64_t target, const dataset_chunk& chunk) { return target < chunk.first_frameset; }
+  );
+  size_t index = found - chunks.begin() - 1;
+
+  dataset_rows rows = chunk(index, buffer);
+  size_t start = 0;
+  for (uint64_t skip = n - chunks[index].first_frameset; skip > 0; skip--)
+    start += frameset_at(rows, start).size();
+
+  return frameset_at(rows, start);
+}
+
+bool Dataset::find(uint64_t timestamp, dataset_rows& rows, chunk_buffer& buffer) const {
+  // the first chunk that ends at or after timestamp is the only one that can hold it
+  auto found = std::lower_bound(
+    chunks.begin(),
+    chunks.end(),
+    timestamp,
+    [](const dataset_chunk& chunk, uint64_t target) { return chunk.last_timestamp < target; }
+  );
+  if (found == chunks.end() || found->first_timestamp > timestamp)
+    return false;
+
+  dataset_rows all = chunk(found - chunks.begin(), buffer);
+  const uint64_t* row = std::lower_bound(all.timestamp.begin(), all.timestamp.end(), timestamp);
+  if (row == all.timestamp.end() || *row != timestamp)
+    return false;
+
+  rows = frameset_at(all, row - all.timestamp.begin());
+  return true;
+}
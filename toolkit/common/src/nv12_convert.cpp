@@ -0,0 +1,654 @@
+#include <cstring>
+#include <opencv2/core.hpp>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NV12_HAVE_AVX2 1
+#define AVX2_FN __attribute__((target("avx2")))
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define NV12_HAVE_NEON 1
+#endif
+
+#include "logging.h"
+#include "nv12_convert.h"
+
+/**
+ * Every kernel uses the same 16 bit fixed point math, so SIMD and
+ * scalar paths agree exactly and the scalar path doubles as the
+ * reference:
+ *
+ *   y' = max(Y - 16, 0) * 1.164
+ *   R  = y' + 1.596 (V - 128)
+ *   G  = y' - 0.391 (U - 128) - 0.813 (V - 128)
+ *   B  = y' + 2.018 (U - 128)
+ *
+ * Each product is a rounding Q15 multiply of the input shifted up by
+ * 7 with a Q14 coefficient (mulhrs on x86, vqrdmulh on ARM), which
+ * lands in Q6 with room to spare in int16, then the sums saturate and
+ * shift down by 6. 2.018 doesn't fit in Q14, so B adds the integer
+ * part as a shift. The coefficients are OpenCV's BT.601 ones, so
+ * results are within a couple of levels of cv::cvtColor.
+ */
+
+namespace {
+
+constexpr int16_t CY = 19071;  // 1.164 in Q14
+constexpr int16_t CVR = 26149; // 1.596
+constexpr int16_t CUG = 6406;  // 0.391
+constexpr int16_t CVG = 13320; // 0.813
+constexpr int16_t CUB = 16679; // 2.018 - 1
+constexpr float inv255 = 1.0f / 255.0f;
+
+struct chroma_terms {
+  int r;
+  int g;
+  int b;
+};
+
+inline int mulhrs(int a, int b) {
+  return (a * b + (1 << 14)) >> 15;
+}
+
+inline int sat16(int v) {
+  return v < -32768 ? -32768 : v > 32767 ? 32767 : v;
+}
+
+inline uint8_t clamp8(int v) {
+  return v < 0 ? 0 : v > 255 ? 255 : (uint8_t)v;
+}
+
+inline chroma_terms chroma(int u, int v) {
+  int du = u - 128;
+  int dv = v - 128;
+  return {
+    mulhrs(dv * 128, CVR),
+    mulhrs(du * 128, CUG) + mulhrs(dv * 128, CVG),
+    du * 64 + mulhrs(du * 128, CUB)
+  };
+}
+
+inline int luma(int y) {
+  return mulhrs((y > 16 ? y - 16 : 0) * 128, CY) + 32;
+}
+
+// rounds like averaging the two rows and then the two columns with pavgb
+inline int avg4(int a, int b, int c, int d) {
+  return (((a + c + 1) >> 1) + ((b + d + 1) >> 1) + 1) >> 1;
+}
+
+struct bgr_out {
+  uint8_t* dst;
+  int width;
+
+  void put(int row, int x, int yt, const chroma_terms& c) const {
+    uint8_t* p = dst + ((size_t)row * width + x) * 3;
+    p[0] = clamp8(sat16(yt + c.b) >> 6);
+    p[1] = clamp8(sat16(yt - c.g) >> 6);
+    p[2] = clamp8(sat16(yt + c.r) >> 6);
+  }
+};
+
+struct planar_out {
+  float* dst;
+  int width;
+  size_t plane;
+
+  void put(int row, int x, int yt, const chroma_terms& c) const {
+    size_t i = (size_t)row * width + x;
+    dst[i] = clamp8(sat16(yt + c.r) >> 6) * inv255;
+    dst[plane + i] = clamp8(sat16(yt - c.g) >> 6) * inv255;
+    dst[2 * plane + i] = clamp8(sat16(yt + c.b) >> 6) * inv255;
+  }
+};
+
+template <typename Out>
+void color_span_full(
+  const uint8_t* y0,
+  const uint8_t* y1,
+  const uint8_t* uv,
+  int row,
+  int x0,
+  int x1,
+  const Out& out
+) {
+  for (int x = x0; x < x1; x++) {
+    int cx = x & ~1;
+    chroma_terms c = chroma(uv[cx], uv[cx + 1]);
+    out.put(row, x, luma(y0[x]), c);
+    out.put(row + 1, x, luma(y1[x]), c);
+  }
+}
+
+template <typename Out>
+void color_span_half(
+  const uint8_t* y0,
+  const uint8_t* y1,
+  const uint8_t* uv,
+  int row,
+  int x0,
+  int x1,
+  const Out& out
+) {
+  for (int x = x0; x < x1; x++) {
+    int y = avg4(y0[2 * x], y0[2 * x + 1], y1[2 * x], y1[2 * x + 1]);
+    out.put(row, x, luma(y), chroma(uv[2 * x], uv[2 * x + 1]));
+  }
+}
+
+void gray_span_half(const uint8_t* y0, const uint8_t* y1, uint8_t* dst, int x0, int x1) {
+  for (int x = x0; x < x1; x++)
+    dst[x] = (uint8_t)avg4(y0[2 * x], y0[2 * x + 1], y1[2 * x], y1[2 * x + 1]);
+}
+
+// each isa converts as much of a row as its vector width allows and
+// returns where it stopped, the scalar spans finish the row
+struct scalar_isa {
+  template <typename Out>
+  static int color_full(const uint8_t*, const uint8_t*, const uint8_t*, int, int, const Out&) {
+    return 0;
+  }
+
+  template <typename Out>
+  static int color_half(const uint8_t*, const uint8_t*, const uint8_t*, int, int, const Out&) {
+    return 0;
+  }
+
+  static int gray_half(const uint8_t*, const uint8_t*, uint8_t*, int) {
+    return 0;
+  }
+};
+
+#ifdef NV12_HAVE_AVX2
+
+struct avx2_chroma {
+  __m256i r;
+  __m256i g;
+  __m256i b;
+};
+
+struct bgr_shuffles {
+  uint8_t m[3][3][16]; // [output block][b, g, r][byte]
+};
+
+constexpr bgr_shuffles make_bgr_shuffles() {
+  // picks each output byte of 16 interleaved pixels from its channel
+  bgr_shuffles s{};
+  for (int k = 0; k < 3; k++) {
+    for (int c = 0; c < 3; c++) {
+      for (int i = 0; i < 16; i++) {
+        int idx = 16 * k + i;
+        s.m[k][c][i] = idx % 3 == c ? (uint8_t)(idx / 3) : 0x80;
+      }
+    }
+  }
+  return s;
+}
+
+alignas(16) constexpr bgr_shuffles bgr_shuffle = make_bgr_shuffles();
+
+AVX2_FN inline __m256i avx2_luma(__m256i y) {
+  __m256i yt = _mm256_mulhrs_epi16(_mm256_slli_epi16(y, 7), _mm256_set1_epi16(CY));
+  return _mm256_add_epi16(yt, _mm256_set1_epi16(32));
+}
+
+AVX2_FN inline avx2_chroma avx2_chroma_terms(__m256i u, __m256i v) {
+  __m256i du = _mm256_sub_epi16(u, _mm256_set1_epi16(128));
+  __m256i dv = _mm256_sub_epi16(v, _mm256_set1_epi16(128));
+  __m256i du7 = _mm256_slli_epi16(du, 7);
+  __m256i dv7 = _mm256_slli_epi16(dv, 7);
+  return {
+    _mm256_mulhrs_epi16(dv7, _mm256_set1_epi16(CVR)),
+    _mm256_add_epi16(
+      _mm256_mulhrs_epi16(du7, _mm256_set1_epi16(CUG)),
+      _mm256_mulhrs_epi16(dv7, _mm256_set1_epi16(CVG))
+    ),
+    _mm256_add_epi16(
+      _mm256_slli_epi16(du, 6),
+      _mm256_mulhrs_epi16(du7, _mm256_set1_epi16(CUB))
+    )
+  };
+}
+
+// 2x2 block averages of 32 luma columns from two rows, as 16 epi16
+AVX2_FN inline __m256i avx2_avg4(const uint8_t* y0, const uint8_t* y1) {
+  __m256i rows = _mm256_avg_epu8(
+    _mm256_loadu_si256((const __m256i*)y0),
+    _mm256_loadu_si256((const __m256i*)y1)
+  );
+  __m256i pairs = _mm256_maddubs_epi16(rows, _mm256_set1_epi8(1));
+  return _mm256_srli_epi16(_mm256_add_epi16(pairs, _mm256_set1_epi16(1)), 1);
+}
+
+AVX2_FN inline __m128i avx2_pack(__m256i v) {
+  return _mm_packus_epi16(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+}
+
+AVX2_FN inline void avx2_store(const bgr_out& out, int row, int x, __m256i yt, const avx2_chroma& c) {
+  __m128i ch[3] = {
+    avx2_pack(_mm256_srai_epi16(_mm256_adds_epi16(yt, c.b), 6)),
+    avx2_pack(_mm256_srai_epi16(_mm256_subs_epi16(yt, c.g), 6)),
+    avx2_pack(_mm256_srai_epi16(_mm256_adds_epi16(yt, c.r), 6))
+  };
+
+  uint8_t* p = out.dst + ((size_t)row * out.width + x) * 3;
+  for (int k = 0; k < 3; k++) {
+    __m128i v = _mm_shuffle_epi8(ch[0], _mm_load_si128((const __m128i*)bgr_shuffle.m[k][0]));
+    v = _mm_or_si128(v, _mm_shuffle_epi8(ch[1], _mm_load_si128((const __m128i*)bgr_shuffle.m[k][1])));
+    v = _mm_or_si128(v, _mm_shuffle_epi8(ch[2], _mm_load_si128((const __m128i*)bgr_shuffle.m[k][2])));
+    _mm_storeu_si128((__m128i*)(p + 16 * k), v);
+  }
+}
+
+AVX2_FN inline void avx2_store_plane(float* p, __m256i v) {
+  v = _mm256_min_epi16(_mm256_max_epi16(v, _mm256_setzero_si256()), _mm256_set1_epi16(255));
+  __m256 scale = _mm256_set1_ps(inv255);
+  __m256 lo = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm256_castsi256_si128(v)));
+  __m256 hi = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm256_extracti128_si256(v, 1)));
+  _mm256_storeu_ps(p, _mm256_mul_ps(lo, scale));
+  _mm256_storeu_ps(p + 8, _mm256_mul_ps(hi, scale));
+}
+
+AVX2_FN inline void avx2_store(const planar_out& out, int row, int x, __m256i yt, const avx2_chroma& c) {
+  float* p = out.dst + (size_t)row * out.width + x;
+  avx2_store_plane(p, _mm256_srai_epi16(_mm256_adds_epi16(yt, c.r), 6));
+  avx2_store_plane(p + out.plane, _mm256_srai_epi16(_mm256_subs_epi16(yt, c.g), 6));
+  avx2_store_plane(p + 2 * out.plane, _mm256_srai_epi16(_mm256_adds_epi16(yt, c.b), 6));
+}
+
+struct avx2_isa {
+  template <typename Out>
+  AVX2_FN static int color_full(
+    const uint8_t* y0,
+    const uint8_t* y1,
+    const uint8_t* uv,
+    int row,
+    int width,
+    const Out& out
+  ) {
+    const __m128i udup = _mm_setr_epi8(0, 0, 2, 2, 4, 4, 6, 6, 8, 8, 10, 10, 12, 12, 14, 14);
+    const __m128i vdup = _mm_setr_epi8(1, 1, 3, 3, 5, 5, 7, 7, 9, 9, 11, 11, 13, 13, 15, 15);
+    const __m128i black = _mm_set1_epi8(16);
+
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+      // 8 chroma pairs, each shared by a 2x2 block
+      __m128i uv8 = _mm_loadu_si128((const __m128i*)(uv + x));
+      avx2_chroma c = avx2_chroma_terms(
+        _mm256_cvtepu8_epi16(_mm_shuffle_epi8(uv8, udup)),
+        _mm256_cvtepu8_epi16(_mm_shuffle_epi8(uv8, vdup))
+      );
+
+      __m128i l0 = _mm_subs_epu8(_mm_loadu_si128((const __m128i*)(y0 + x)), black);
+      __m128i l1 = _mm_subs_epu8(_mm_loadu_si128((const __m128i*)(y1 + x)), black);
+      avx2_store(out, row, x, avx2_luma(_mm256_cvtepu8_epi16(l0)), c);
+      avx2_store(out, row + 1, x, avx2_luma(_mm256_cvtepu8_epi16(l1)), c);
+    }
+    return x;
+  }
+
+  template <typename Out>
+  AVX2_FN static int color_half(
+    const uint8_t* y0,
+    const uint8_t* y1,
+    const uint8_t* uv,
+    int row,
+    int out_width,
+    const Out& out
+  ) {
+    const __m256i black = _mm256_set1_epi16(16);
+    const __m256i low_byte = _mm256_set1_epi16(0x00ff);
+
+    int x = 0;
+    for (; x + 16 <= out_width; x += 16) {
+      // one chroma pair per output pixel
+      __m256i uv16 = _mm256_loadu_si256((const __m256i*)(uv + 2 * x));
+      avx2_chroma c = avx2_chroma_terms(
+        _mm256_and_si256(uv16, low_byte),
+        _mm256_srli_epi16(uv16, 8)
+      );
+
+      __m256i l = _mm256_subs_epu16(avx2_avg4(y0 + 2 * x, y1 + 2 * x), black);
+      avx2_store(out, row, x, avx2_luma(l), c);
+    }
+    return x;
+  }
+
+  AVX2_FN static int gray_half(const uint8_t* y0, const uint8_t* y1, uint8_t* dst, int out_width) {
+    int x = 0;
+    for (; x + 16 <= out_width; x += 16)
+      _mm_storeu_si128((__m128i*)(dst + x), avx2_pack(avx2_avg4(y0 + 2 * x, y1 + 2 * x)));
+    return x;
+  }
+};
+
+#endif // NV12_HAVE_AVX2
+
+#ifdef NV12_HAVE_NEON
+
+struct neon_chroma {
+  int16x8_t r;
+  int16x8_t g;
+  int16x8_t b;
+};
+
+inline int16x8_t neon_luma(uint8x8_t y) {
+  int16x8_t y16 = vreinterpretq_s16_u16(vmovl_u8(y));
+  return vaddq_s16(vqrdmulhq_n_s16(vshlq_n_s16(y16, 7), CY), vdupq_n_s16(32));
+}
+
+inline neon_chroma neon_chroma_terms(uint8x8_t u, uint8x8_t v) {
+  int16x8_t du = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(u)), vdupq_n_s16(128));
+  int16x8_t dv = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(v)), vdupq_n_s16(128));
+  int16x8_t du7 = vshlq_n_s16(du, 7);
+  int16x8_t dv7 = vshlq_n_s16(dv, 7);
+  return {
+    vqrdmulhq_n_s16(dv7, CVR),
+    vaddq_s16(vqrdmulhq_n_s16(du7, CUG), vqrdmulhq_n_s16(dv7, CVG)),
+    vaddq_s16(vshlq_n_s16(du, 6), vqrdmulhq_n_s16(du7, CUB))
+  };
+}
+
+// 2x2 block averages of 16 luma columns from two rows
+inline uint8x8_t neon_avg4(const uint8_t* y0, const uint8_t* y1) {
+  uint16x8_t pairs = vpaddlq_u8(vrhaddq_u8(vld1q_u8(y0), vld1q_u8(y1)));
+  return vmovn_u16(vrshrq_n_u16(pairs, 1));
+}
+
+inline uint8x16_t neon_channel(int16x8_t lo, int16x8_t hi) {
+  return vcombine_u8(vqmovun_s16(vshrq_n_s16(lo, 6)), vqmovun_s16(vshrq_n_s16(hi, 6)));
+}
+
+inline void neon_store(
+  const bgr_out& out,
+  int row,
+  int x,
+  int16x8_t yt_lo,
+  int16x8_t yt_hi,
+  const neon_chroma& c_lo,
+  const neon_chroma& c_hi
+) {
+  uint8x16x3_t px;
+  px.val[0] = neon_channel(vqaddq_s16(yt_lo, c_lo.b), vqaddq_s16(yt_hi, c_hi.b));
+  px.val[1] = neon_channel(vqsubq_s16(yt_lo, c_lo.g), vqsubq_s16(yt_hi, c_hi.g));
+  px.val[2] = neon_channel(vqaddq_s16(yt_lo, c_lo.r), vqaddq_s16(yt_hi, c_hi.r));
+  vst3q_u8(out.dst + ((size_t)row * out.width + x) * 3, px);
+}
+
+inline void neon_store_plane(float* p, int16x8_t v) {
+  v = vminq_s16(vmaxq_s16(vshrq_n_s16(v, 6), vdupq_n_s16(0)), vdupq_n_s16(255));
+  vst1q_f32(p, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v))), inv255));
+  vst1q_f32(p + 4, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v))), inv255));
+}
+
+inline void neon_store(
+  const planar_out& out,
+  int row,
+  int x,
+  int16x8_t yt_lo,
+  int16x8_t yt_hi,
+  const neon_chroma& c_lo,
+  const neon_chroma& c_hi
+) {
+  float* p = out.dst + (size_t)row * out.width + x;
+  neon_store_plane(p, vqaddq_s16(yt_lo, c_lo.r));
+  neon_store_plane(p + 8, vqaddq_s16(yt_hi, c_hi.r));
+  neon_store_plane(p + out.plane, vqsubq_s16(yt_lo, c_lo.g));
+  neon_store_plane(p + out.plane + 8, vqsubq_s16(yt_hi, c_hi.g));
+  neon_store_plane(p + 2 * out.plane, vqaddq_s16(yt_lo, c_lo.b));
+  neon_store_plane(p + 2 * out.plane + 8, vqaddq_s16(yt_hi, c_hi.b));
+}
+
+struct neon_isa {
+  template <typename Out>
+  static int color_full(
+    const uint8_t* y0,
+    const uint8_t* y1,
+    const uint8_t* uv,
+    int row,
+    int width,
+    const Out& out
+  ) {
+    const uint8x16_t black = vdupq_n_u8(16);
+
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+      // 8 chroma pairs, each shared by a 2x2 block
+      uint8x8x2_t uv8 = vld2_u8(uv + x);
+      uint8x8x2_t u = vzip_u8(uv8.val[0], uv8.val[0]);
+      uint8x8x2_t v = vzip_u8(uv8.val[1], uv8.val[1]);
+      neon_chroma c_lo = neon_chroma_terms(u.val[0], v.val[0]);
+      neon_chroma c_hi = neon_chroma_terms(u.val[1], v.val[1]);
+
+      uint8x16_t l0 = vqsubq_u8(vld1q_u8(y0 + x), black);
+      uint8x16_t l1 = vqsubq_u8(vld1q_u8(y1 + x), black);
+      neon_store(out, row, x, neon_luma(vget_low_u8(l0)), neon_luma(vget_high_u8(l0)), c_lo, c_hi);
+      neon_store(out, row + 1, x, neon_luma(vget_low_u8(l1)), neon_luma(vget_high_u8(l1)), c_lo, c_hi);
+    }
+    return x;
+  }
+
+  template <typename Out>
+  static int color_half(
+    const uint8_t* y0,
+    const uint8_t* y1,
+    const uint8_t* uv,
+    int row,
+    int out_width,
+    const Out& out
+  ) {
+    const uint8x8_t black = vdup_n_u8(16);
+
+    int x = 0;
+    for (; x + 16 <= out_width; x += 16) {
+      // one chroma pair per output pixel
+      uint8x16x2_t uv16 = vld2q_u8(uv + 2 * x);
+      neon_chroma c_lo = neon_chroma_terms(vget_low_u8(uv16.val[0]), vget_low_u8(uv16.val[1]));
+      neon_chroma c_hi = neon_chroma_terms(vget_high_u8(uv16.val[0]), vget_high_u8(uv16.val[1]));
+
+      uint8x8_t l_lo = vqsub_u8(neon_avg4(y0 + 2 * x, y1 + 2 * x), black);
+      uint8x8_t l_hi = vqsub_u8(neon_avg4(y0 + 2 * x + 16, y1 + 2 * x + 16), black);
+      neon_store(out, row, x, neon_luma(l_lo), neon_luma(l_hi), c_lo, c_hi);
+    }
+    return x;
+  }
+
+  static int gray_half(const uint8_t* y0, const uint8_t* y1, uint8_t* dst, int out_width) {
+    int x = 0;
+    for (; x + 16 <= out_width; x += 16) {
+      vst1q_u8(
+        dst + x,
+        vcombine_u8(neon_avg4(y0 + 2 * x, y1 + 2 * x), neon_avg4(y0 + 2 * x + 16, y1 + 2 * x + 16))
+      );
+    }
+    return x;
+  }
+};
+
+#endif // NV12_HAVE_NEON
+
+template <typename Isa, typename Out>
+void color_rows(const uint8_t* src, int width, int height, bool half, const Out& out) {
+  const uint8_t* uv_plane = src + (size_t)width * height;
+
+  if (!half) {
+    // every chroma row is shared by two luma rows
+    for (int row = 0; row < height; row += 2) {
+      const uint8_t* y0 = src + (size_t)row * width;
+      const uint8_t* uv = uv_plane + (size_t)row / 2 * width;
+      int x = Isa::color_full(y0, y0 + width, uv, row, width, out);
+      color_span_full(y0, y0 + width, uv, row, x, width, out);
+    }
+    return;
+  }
+
+  for (int row = 0; row < height / 2; row++) {
+    const uint8_t* y0 = src + (size_t)row * 2 * width;
+    const uint8_t* uv = uv_plane + (size_t)row * width;
+    int x = Isa::color_half(y0, y0 + width, uv, row, width / 2, out);
+    color_span_half(y0, y0 + width, uv, row, x, width / 2, out);
+  }
+}
+
+template <typename Isa>
+void gray_rows(const uint8_t* src, int width, int height, uint8_t* dst, bool half) {
+  if (!half) {
+    memcpy(dst, src, (size_t)width * height); // the luma plane already is the gray image
+    return;
+  }
+
+  for (int row = 0; row < height / 2; row++) {
+    const uint8_t* y0 = src + (size_t)row * 2 * width;
+    uint8_t* out = dst + (size_t)row * (width / 2);
+    int x = Isa::gray_half(y0, y0 + width, out, width / 2);
+    gray_span_half(y0, y0 + width, out, x, width / 2);
+  }
+}
+
+enum class kernel_isa {
+  SCALAR,
+  AVX2,
+  NEON
+};
+
+kernel_isa detect_isa() {
+#if defined(NV12_HAVE_AVX2)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return kernel_isa::AVX2;
+#elif defined(NV12_HAVE_NEON)
+  return kernel_isa::NEON;
+#endif
+  return kernel_isa::SCALAR;
+}
+
+const kernel_isa active_isa = detect_isa();
+
+template <typename Out>
+void convert_color(const uint8_t* src, int width, int height, bool half, const Out& out) {
+  switch (active_isa) {
+#ifdef NV12_HAVE_AVX2
+    case kernel_isa::AVX2:
+      color_rows<avx2_isa>(src, width, height, half, out);
+      return;
+#endif
+#ifdef NV12_HAVE_NEON
+    case kernel_isa::NEON:
+      color_rows<neon_isa>(src, width, height, half, out);
+      return;
+#endif
+    default:
+      color_rows<scalar_isa>(src, width, height, half, out);
+  }
+}
+
+} // namespace
+
+void nv12_to_bgr(const uint8_t* src, int width, int height, uint8_t* dst, bool half) {
+  int out_width = half ? width / 2 : width;
+  convert_color(src, width, height, half, bgr_out{dst, out_width});
+}
+
+void nv12_to_rgb_planar(const uint8_t* src, int width, int height, float* dst, bool half) {
+  int out_width = half ? width / 2 : width;
+  int out_height = half ? height / 2 : height;
+  convert_color(
+    src,
+    width,
+    height,
+    half,
+    planar_out{dst, out_width, (size_t)out_width * out_height}
+  );
+}
+
+void nv12_to_gray(const uint8_t* src, int width, int height, uint8_t* dst, bool half) {
+  switch (active_isa) {
+#ifdef NV12_HAVE_AVX2
+    case kernel_isa::AVX2:
+      gray_rows<avx2_isa>(src, width, height, dst, half);
+      return;
+#endif
+#ifdef NV12_HAVE_NEON
+    case kernel_isa::NEON:
+      gray_rows<neon_isa>(src, width, height, dst, half);
+      return;
+#endif
+    default:
+      gray_rows<scalar_isa>(src, width, height, dst, half);
+  }
+}
+
+void nv12_convert(const cv::Mat& src, cv::Mat& dst, nv12_target target, bool half) {
+  int width = src.cols;
+  int height = src.rows * 2 / 3;
+
+  if (src.type() != CV_8UC1 || !src.isContinuous() || src.rows % 3 || width % 2 || height % 2) {
+    char logstr[128];
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Expected a continuous even sized NV12 frame, got %dx%d type %d",
+      src.cols,
+      src.rows,
+      src.type()
+    );
+    LOG(ERROR, logstr);
+    throw std::invalid_argument(logstr);
+  }
+
+  int out_width = half ? width / 2 : width;
+  int out_height = half ? height / 2 : height;
+
+  // create is a no-op when dst already has the right shape, so
+  // reusing the same Mats across framesets never allocates
+  switch (target) {
+    case nv12_target::BGR:
+      dst.create(out_height, out_width, CV_8UC3);
+      break;
+    case nv12_target::RGB_PLANAR:
+      dst.create(out_height * 3, out_width, CV_32FC1);
+      break;
+    case nv12_target::GRAY:
+      dst.create(out_height, out_width, CV_8UC1);
+      break;
+  }
+  if (!dst.isContinuous()) // a caller provided roi, replace it
+    dst = cv::Mat(dst.rows, dst.cols, dst.type());
+
+  switch (target) {
+    case nv12_target::BGR:
+      nv12_to_bgr(src.ptr<uint8_t>(), width, height, dst.ptr<uint8_t>(), half);
+      break;
+    case nv12_target::RGB_PLANAR:
+      nv12_to_rgb_planar(src.ptr<uint8_t>(), width, height, dst.ptr<float>(), half);
+      break;
+    case nv12_target::GRAY:
+      nv12_to_gray(src.ptr<uint8_t>(), width, height, dst.ptr<uint8_t>(), half);
+      break;
+  }
+}
+
+void nv12_convert_frameset(
+  const cv::Mat* src,
+  cv::Mat* dst,
+  size_t count,
+  nv12_target target,
+  bool half
+) {
+  cv::parallel_for_(cv::Range(0, (int)count), [&](const cv::Range& range) {
+    for (int i = range.start; i < range.end; i++)
+      nv12_convert(src[i], dst[i], target, half);
+  });
+}
+
+const char* nv12_kernel_isa() {
+  switch (active_isa) {
+    case kernel_isa::AVX2:
+      return "avx2";
+    case kernel_isa::NEON:
+      return "neon";
+    default:
+      return "scalar";
+  }
+}
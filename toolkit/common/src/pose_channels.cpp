@@ -0,0 +1,382 @@
+#include <climits>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <semaphore.h>
+#include <stdexcept>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "pose_channels.h"
+
+static uint64_t realtime_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+[[noreturn]] static void fail(const char* what, const char* name) {
+  char logstr[128];
+  snprintf(
+    logstr,
+    sizeof(logstr),
+    "%s %s: %s",
+    what,
+    name,
+    strerror(errno)
+  );
+  LOG(ERROR, logstr);
+  throw std::runtime_error(logstr);
+}
+
+static void* create_shm(const char* name, size_t size, int* fd) {
+  /**
+   * Creates (or replaces a stale copy of) a shm zero filled at size
+   *
+   * Parameters:
+   *   fd: set to the shm's fd, which the caller closes and unlinks
+   */
+  *fd = shm_open(name, O_CREAT | O_RDWR, 0666);
+  if (*fd == -1)
+    fail("Error creating shared memory", name);
+
+  // truncating to 0 first zeroes whatever a previous run left behind
+  if (ftruncate(*fd, 0) == -1 || ftruncate(*fd, size) == -1)
+    fail("Error resizing shared memory", name);
+
+  void* buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+  if (buf == MAP_FAILED)
+    fail("Error mapping shared memory", name);
+
+  return buf;
+}
+
+static void* attach_shm(const char* name, size_t* size, int* fd) {
+  // the creator writes the version last, so a 0 version means it is still setting up
+  *fd = shm_open(name, O_RDWR, 0);
+  if (*fd == -1)
+    fail("Error opening shared memory (is pose_fusion running?)", name);
+
+  struct stat st;
+  if (fstat(*fd, &st) == -1)
+    fail("Error reading shared memory size", name);
+  *size = st.st_size;
+
+  void* buf = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+  if (buf == MAP_FAILED)
+    fail("Error mapping shared memory", name);
+
+  uint32_t version = __atomic_load_n((uint32_t*)buf, __ATOMIC_ACQUIRE);
+  if (version != POSE_SHM_VERSION) {
+    char logstr[128];
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Shared memory %s has version %u, expected %u",
+      name,
+      version,
+      POSE_SHM_VERSION
+    );
+    LOG(ERROR, logstr);
+    munmap(buf, *size);
+    close(*fd);
+    throw std::runtime_error(logstr);
+  }
+
+  return buf;
+}
+
+KeypointPublisher::KeypointPublisher() : shm_fd(-1), shm_size(0), shm(nullptr), ready_sem(nullptr) {
+  shm = static_cast<keypoint_shm*>(attach_shm(KEYPOINT_SHM_NAME, &shm_size, &shm_fd));
+
+  ready_sem = sem_open(KEYPOINT_SEM_NAME, 0);
+  if (ready_sem == SEM_FAILED) {
+    munmap(shm, shm_size);
+    close(shm_fd);
+    fail("Error opening semaphore", KEYPOINT_SEM_NAME);
+  }
+}
+
+KeypointPublisher::~KeypointPublisher() {
+  sem_close(ready_sem);
+  munmap(shm, shm_size);
+  close(shm_fd);
+}
+
+void KeypointPublisher::publish(
+  uint32_t cam,
+  uint64_t timestamp,
+  const float* x,
+  const float* y,
+  const float* conf
+) {
+  if (cam >= shm->cam_count) {
+    char logstr[128];
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Camera %u is out of range, pose_fusion was started with %u",
+      cam,
+      shm->cam_count
+    );
+    LOG(ERROR, logstr);
+    throw std::invalid_argument(logstr);
+  }
+
+  uint32_t joints = shm->joint_count;
+  uint64_t seq = __atomic_load_n(&shm->cams[cam].head, __ATOMIC_RELAXED);
+  keypoint_entry* entry = keypoint_slot(shm, cam, seq);
+
+  pose_begin_write(&entry->stamp, seq);
+  entry->timestamp = timestamp;
+  entry->produced_ns = realtime_ns();
+  float* coords = keypoint_coords(entry);
+  memcpy(coords, x, joints * sizeof(float));
+  memcpy(coords + joints, y, joints * sizeof(float));
+  memcpy(coords + 2 * joints, conf, joints * sizeof(float));
+  pose_end_write(&entry->stamp, seq);
+
+  __atomic_store_n(&shm->cams[cam].head, seq + 1, __ATOMIC_RELEASE);
+  sem_post(ready_sem);
+}
+
+KeypointReceiver::KeypointReceiver(uint32_t cam_count, uint32_t joint_count) :
+  shm_fd(-1),
+  shm_size(keypoint_shm_size(cam_count, joint_count)),
+  shm(nullptr),
+  ready_sem(nullptr),
+  cursors(cam_count, 0),
+  skipped_(0)
+{
+  if (cam_count == 0 || cam_count > POSE_MAX_CAMERAS) {
+    char logstr[128];
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Keypoint ring needs 1 to %d cameras, got %u",
+      POSE_MAX_CAMERAS,
+      cam_count
+    );
+    LOG(ERROR, logstr);
+    throw std::invalid_argument(logstr);
+  }
+
+  // a stale count from a previous run would only cause spurious wakeups, start from 0 anyway
+  sem_unlink(KEYPOINT_SEM_NAME);
+  ready_sem = sem_open(KEYPOINT_SEM_NAME, O_CREAT, 0666, 0);
+  if (ready_sem == SEM_FAILED)
+    fail("Error opening semaphore", KEYPOINT_SEM_NAME);
+
+  shm = static_cast<keypoint_shm*>(create_shm(KEYPOINT_SHM_NAME, shm_size, &shm_fd));
+  shm->cam_count = cam_count;
+  shm->joint_count = joint_count;
+  shm->slot_count = KEYPOINT_SLOTS;
+  shm->entry_stride = keypoint_entry_stride(joint_count);
+  shm->data_offset = pose_page_align(sizeof(keypoint_shm));
+  __atomic_store_n(&shm->version, POSE_SHM_VERSION, __ATOMIC_RELEASE);
+}
+
+KeypointReceiver::~KeypointReceiver() {
+  if (shm != nullptr)
+    munmap(shm, shm_size);
+
+  if (shm_fd > -1) {
+    close(shm_fd);
+    shm_unlink(KEYPOINT_SHM_NAME);
+  }
+
+  if (ready_sem != nullptr) {
+    sem_close(ready_sem);
+    sem_unlink(KEYPOINT_SEM_NAME);
+  }
+}
+
+bool KeypointReceiver::wait(const struct timespec& deadline) {
+  if (sem_clockwait(ready_sem, CLOCK_MONOTONIC, &deadline) == -1)
+    return false;
+
+  // one wake covers every entry published so far, the caller drains them all
+  while (sem_trywait(ready_sem) == 0) {}
+  return true;
+}
+
+bool KeypointReceiver::read(
+  uint32_t cam,
+  uint64_t* timestamp,
+  uint64_t* produced_ns,
+  float* x,
+  float* y,
+  float* conf
+) {
+  uint32_t joints = shm->joint_count;
+  uint64_t cursor = cursors[cam];
+  uint64_t head = __atomic_load_n(&shm->cams[cam].head, __ATOMIC_ACQUIRE);
+
+  if (head - cursor > shm->slot_count) { // lapped, the oldest entries are gone
+    skipped_ += head - shm->slot_count - cursor;
+    cursor = head - shm->slot_count;
+  }
+
+  for (; cursor < head; cursor++) {
+    keypoint_entry* entry = keypoint_slot(shm, cam, cursor);
+    if (!pose_stamp_is(&entry->stamp, cursor)) {
+      skipped_++;
+      continue;
+    }
+
+    *timestamp = entry->timestamp;
+    *produced_ns = entry->produced_ns;
+    const float* coords = keypoint_coords(entry);
+    memcpy(x, coords, joints * sizeof(float));
+    memcpy(y, coords + joints, joints * sizeof(float));
+    memcpy(conf, coords + 2 * joints, joints * sizeof(float));
+
+    if (pose_stamp_still(&entry->stamp, cursor)) {
+      cursors[cam] = cursor + 1;
+      return true;
+    }
+    skipped_++; // rewritten while it was copied
+  }
+
+  cursors[cam] = cursor;
+  return false;
+}
+
+PosePublisher::PosePublisher(uint32_t joint_count) :
+  shm_fd(-1),
+  shm_size(pose_shm_size(joint_count)),
+  shm(nullptr)
+{
+  shm = static_cast<pose_shm*>(create_shm(POSE_SHM_NAME, shm_size, &shm_fd));
+  shm->joint_count = joint_count;
+  shm->slot_count = POSE_SLOTS;
+  shm->entry_stride = pose_entry_stride(joint_count);
+  shm->data_offset = pose_page_align(sizeof(pose_shm));
+  __atomic_store_n(&shm->version, POSE_SHM_VERSION, __ATOMIC_RELEASE);
+}
+
+PosePublisher::~PosePublisher() {
+  if (shm != nullptr)
+    munmap(shm, shm_size);
+
+  if (shm_fd > -1) {
+    close(shm_fd);
+    shm_unlink(POSE_SHM_NAME);
+  }
+}
+
+void PosePublisher::publish(
+  uint64_t timestamp,
+  uint64_t detected_ns,
+  const float* x,
+  const float* y,
+  const float* z,
+  const float* error,
+  const uint32_t* views
+) {
+  uint32_t joints = shm->joint_count;
+  uint64_t seq = __atomic_load_n(&shm->head, __ATOMIC_RELAXED);
+  pose_entry* entry = pose_slot(shm, seq);
+
+  pose_begin_write(&entry->stamp, seq);
+  entry->timestamp = timestamp;
+  entry->detected_ns = detected_ns;
+  entry->produced_ns = realtime_ns();
+  float* coords = pose_coords(entry);
+  memcpy(coords, x, joints * sizeof(float));
+  memcpy(coords + joints, y, joints * sizeof(float));
+  memcpy(coords + 2 * joints, z, joints * sizeof(float));
+  memcpy(coords + 3 * joints, error, joints * sizeof(float));
+  memcpy(pose_views(entry, joints), views, joints * sizeof(uint32_t));
+  pose_end_write(&entry->stamp, seq);
+
+  __atomic_store_n(&shm->head, seq + 1, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&shm->notify, 1, __ATOMIC_RELEASE);
+  syscall(SYS_futex, &shm->notify, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+PoseSubscriber::PoseSubscriber() : shm_fd(-1), shm_size(0), shm(nullptr), next_seq(0), missed_(0) {
+  shm = static_cast<pose_shm*>(attach_shm(POSE_SHM_NAME, &shm_size, &shm_fd));
+
+  // the first call returns the newest pose already published, if any
+  uint64_t head = __atomic_load_n(&shm->head, __ATOMIC_ACQUIRE);
+  next_seq = head > 0 ? head - 1 : 0;
+}
+
+PoseSubscriber::~PoseSubscriber() {
+  munmap(shm, shm_size);
+  close(shm_fd);
+}
+
+bool PoseSubscriber::latest(pose_frame& pose) {
+  uint32_t joints = shm->joint_count;
+
+  // a retry only happens when the producer laps the copy, which takes a full ring of poses
+  for (int attempt = 0; attempt < 4; attempt++) {
+    uint64_t head = __atomic_load_n(&shm->head, __ATOMIC_ACQUIRE);
+    if (head == 0 || head - 1 < next_seq)
+      return false;
+
+    uint64_t seq = head - 1;
+    pose_entry* entry = pose_slot(shm, seq);
+    if (!pose_stamp_is(&entry->stamp, seq))
+      continue;
+
+    pose.timestamp = entry->timestamp;
+    pose.produced_ns = entry->produced_ns;
+    pose.detected_ns = entry->detected_ns;
+    pose.x.resize(joints);
+    pose.y.resize(joints);
+    pose.z.resize(joints);
+    pose.error.resize(joints);
+    pose.views.resize(joints);
+    const float* coords = pose_coords(entry);
+    memcpy(pose.x.data(), coords, joints * sizeof(float));
+    memcpy(pose.y.data(), coords + joints, joints * sizeof(float));
+    memcpy(pose.z.data(), coords + 2 * joints, joints * sizeof(float));
+    memcpy(pose.error.data(), coords + 3 * joints, joints * sizeof(float));
+    memcpy(pose.views.data(), pose_views(entry, joints), joints * sizeof(uint32_t));
+
+    if (!pose_stamp_still(&entry->stamp, seq))
+      continue;
+
+    missed_ += seq - next_seq;
+    next_seq = seq + 1;
+    pose.seq = seq;
+    return true;
+  }
+
+  return false;
+}
+
+bool PoseSubscriber::wait_next(pose_frame& pose, std::chrono::nanoseconds timeout) {
+  uint64_t deadline = now_ns() + (timeout.count() > 0 ? timeout.count() : 0);
+
+  while (true) {
+    // loaded before checking, so a publish in between changes it and the wait returns at once
+    uint32_t notify = __atomic_load_n(&shm->notify, __ATOMIC_ACQUIRE);
+    if (latest(pose))
+      return true;
+
+    uint64_t now = now_ns();
+    if (now >= deadline)
+      return false;
+
+    struct timespec remaining;
+    remaining.tv_sec = (deadline - now) / 1000000000ULL;
+    remaining.tv_nsec = (deadline - now) % 1000000000ULL;
+    syscall(SYS_futex, &shm->notify, FUTEX_WAIT, notify, &remaining, nullptr, 0);
+  }
+}
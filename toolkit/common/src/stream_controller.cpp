@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <csignal>
 #include <cstdlib>
 #include <fcntl.h>
@@ -5,11 +6,16 @@
 #include <opencv2/core.hpp>
 #include <semaphore.h>
 #include <stdexcept>
+#include <string>
 #include <string.h>
 #include <system_error>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
+#include <vector>
 
 #include "logging.h"
 #include "stream_controller.h"
@@ -17,18 +23,59 @@
 StreamController::StreamController(
   size_t frame_width,
   size_t frame_height,
-  size_t num_cameras
+  size_t num_cameras,
+  const char* cam_conf_path,
+  bool undistort
 ) :
   frame_width(frame_width),
   frame_height(frame_height),
   num_cameras(num_cameras),
   server_pid_(0),
+  server_exited(false),
+  notify_fd_(-1),
   frameset_ctl_sem(nullptr),
   shm_fd(-1),
-  frameset_buf(nullptr)
+  shm(nullptr),
+  pid(getpid()),
+  leased_seq(0),
+  prefetch_target(nv12_target::GRAY),
+  prefetch_half(false),
+  prefetch_stop(false),
+  prefetch_seq(0),
+  prefetch_drops_(0)
 {
   char logstr[128];
 
+  // made before forking so the server inherits it, non blocking on both sides
+  notify_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (notify_fd_ == -1) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Error creating frameset eventfd: %s",
+      strerror(errno)
+    );
+    LOG(ERROR, logstr);
+    throw std::runtime_error(logstr);
+  }
+
+  // the child may only make async signal safe calls, so its argv and environment are built here
+  std::string notify_env = std::string(FRAMESET_EVENTFD_ENV "=") + std::to_string(notify_fd_);
+  std::vector<char*> server_env;
+  for (char** env = environ; *env != nullptr; env++) {
+    if (strncmp(*env, FRAMESET_EVENTFD_ENV "=", strlen(FRAMESET_EVENTFD_ENV) + 1) != 0)
+      server_env.push_back(*env);
+  }
+  server_env.push_back(&notify_env[0]);
+  server_env.push_back(nullptr);
+
+  std::vector<char*> server_argv = {const_cast<char*>(SERVER_EXE)};
+  if (undistort)
+    server_argv.push_back(const_cast<char*>("-u"));
+  if (cam_conf_path != nullptr)
+    server_argv.push_back(const_cast<char*>(cam_conf_path));
+  server_argv.push_back(nullptr);
+
   server_pid_ = fork();
   if (server_pid_ == -1) {
     snprintf(
@@ -42,7 +89,9 @@ StreamController::StreamController(
   }
 
   if (server_pid_ == 0) {
-    execl(SERVER_EXE, SERVER_EXE, nullptr);
+    // without a path the server falls back to its default camera conf
+    fcntl(notify_fd_, F_SETFD, 0);
+    execve(SERVER_EXE, server_argv.data(), server_env.data());
     _exit(errno);
   }
 
@@ -64,7 +113,7 @@ StreamController::StreamController(
   }
 
   shm_fd = shm_open(
-    SHM_NAME,
+    FRAMESET_SHM_NAME,
     O_CREAT | O_RDWR,
     0666
   );
@@ -79,7 +128,8 @@ StreamController::StreamController(
     throw std::runtime_error(logstr);
   }
 
-  shm_size = frame_width * frame_height * 3 / 2 * num_cameras + sizeof(uint64_t);
+  size_t frame_size = frame_width * frame_height * 3 / 2;
+  shm_size = frameset_shm_size(num_cameras, frame_size);
 
   int ret = ftruncate(
     shm_fd,
@@ -96,15 +146,16 @@ StreamController::StreamController(
     throw std::runtime_error(logstr);
   }
 
-  frameset_buf = mmap(
+  // writable for the slot owner words, the pixels are only ever read
+  void* buf = mmap(
     NULL,
     shm_size,
-    PROT_READ,
+    PROT_READ | PROT_WRITE,
     MAP_SHARED,
     shm_fd,
     0
   );
-  if (frameset_buf == MAP_FAILED) {
+  if (buf == MAP_FAILED) {
     snprintf(
       logstr,
       sizeof(logstr),
@@ -114,42 +165,501 @@ StreamController::StreamController(
     LOG(ERROR, logstr);
     throw std::runtime_error(logstr);
   }
+  shm = static_cast<frameset_shm*>(buf);
+
+  // views over every slot are made once, so leasing a frameset allocates nothing
+  slot_frames.reserve(FRAMESET_SLOTS * num_cameras);
+  for (uint32_t slot = 0; slot < FRAMESET_SLOTS; slot++) {
+    for (size_t i = 0; i < num_cameras; i++) {
+      slot_frames.emplace_back(
+        frame_height * 3/2,
+        frame_width,
+        CV_8UC1,
+        frameset_frame(shm, num_cameras, frame_size, slot, i)
+      );
+    }
+  }
 }
 
 StreamController::~StreamController() {
+  stop_prefetch();
+
   if (server_pid_ > 0)
     kill(server_pid_, SIGTERM);
 
-  if (frameset_buf != nullptr)
-    munmap(frameset_buf, shm_size);
+  if (shm != nullptr)
+    munmap(shm, shm_size);
 
   if (shm_fd > -1) {
     close(shm_fd);
-    shm_unlink(SHM_NAME);
+    shm_unlink(FRAMESET_SHM_NAME);
   }
 
   if (frameset_ctl_sem != nullptr) {
     sem_close(frameset_ctl_sem);
     sem_unlink(SEM_NAME);
   }
+
+  if (notify_fd_ > -1)
+    close(notify_fd_);
+}
+
+static struct timespec deadline_after(std::chrono::nanoseconds timeout) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  uint64_t nsec = ts.tv_nsec + (timeout.count() > 0 ? timeout.count() : 0);
+  ts.tv_sec += nsec / 1000000000ULL;
+  ts.tv_nsec = nsec % 1000000000ULL;
+  return ts;
+}
+
+FramesetLease StreamController::acquire_frameset() {
+  /**
+   * Waits for the next published frameset and leases its slot
+   *
+   * The wait wakes every SERVER_CHECK_INTERVAL to check on the server,
+   * so a consumer isn't left blocked forever once it has died.
+   *
+   * Returns:
+   *   A lease over the frameset, or an empty lease if woken without
+   *   one ready (e.g. interrupted by a signal, or the server exited)
+   */
+  while (true) {
+    struct timespec deadline = deadline_after(SERVER_CHECK_INTERVAL);
+    if (sem_clockwait(frameset_ctl_sem, CLOCK_MONOTONIC, &deadline) == 0) {
+      // a post left over from a frameset already superseded finds nothing newer
+      FramesetLease lease = lease_newest();
+      if (lease)
+        return lease;
+      continue;
+    }
+
+    if (errno != ETIMEDOUT || !server_alive())
+      return FramesetLease();
+  }
+}
+
+FramesetLease StreamController::acquire_frameset_for(std::chrono::nanoseconds timeout) {
+  /**
+   * acquire_frameset with a bound on the wait
+   *
+   * Returns:
+   *   A lease over the frameset, or an empty lease if none was
+   *   published within timeout or the wait was interrupted
+   */
+  struct timespec deadline = deadline_after(timeout);
+  while (sem_clockwait(frameset_ctl_sem, CLOCK_MONOTONIC, &deadline) == 0) {
+    FramesetLease lease = lease_newest();
+    if (lease)
+      return lease;
+  }
+
+  return FramesetLease();
+}
+
+FramesetLease StreamController::try_acquire_frameset() {
+  /**
+   * Leases the published frameset if there is one, without waiting
+   *
+   * Meant to be called when notify_fd polls readable, which it stays
+   * until this is called. A readable fd is a hint, not a promise, so
+   * an empty lease here just means poll again.
+   *
+   * Returns:
+   *   A lease over the frameset, or an empty lease if none is ready
+   */
+  // drained before the semaphore is checked, so a publish racing with
+  // this makes the fd readable again rather than being missed
+  uint64_t count;
+  ssize_t ret = read(notify_fd_, &count, sizeof(count));
+  (void)ret;
+
+  if (sem_trywait(frameset_ctl_sem) == -1)
+    return FramesetLease();
+
+  return lease_newest();
+}
+
+FramesetLease StreamController::lease_newest() {
+  /**
+   * Leases the newest ready slot, after a semaphore post was taken
+   *
+   * The server normally keeps one frameset ready at a time and may
+   * reuse a ready slot that was never leased, so the newest ready
+   * slot is taken and a lost race against the server just rescans.
+   *
+   * A post can outlive its frameset: the server may publish a newer
+   * one into a free slot before this scans, leaving the older slot
+   * ready after the newer was leased. Ready slots at or below the
+   * last leased seq are handed back as free instead, so framesets
+   * never go backwards or arrive twice. Only one thread leases at a
+   * time (the caller's, or the prefetch thread's while it runs).
+   *
+   * Returns:
+   *   A lease over the newest frameset, or an empty lease if nothing
+   *   newer than the last one leased is ready
+   */
+  while (true) {
+    int newest = -1;
+    uint64_t newest_seq = leased_seq;
+    bool rescan = false;
+    for (int i = 0; i < FRAMESET_SLOTS; i++) {
+      frameset_slot* slot = &shm->slots[i];
+      if (frameset_owner(slot) != FRAMESET_SLOT_READY)
+        continue;
+
+      uint64_t seq = frameset_seq(slot);
+      if (seq <= leased_seq) {
+        // held while its seq is checked again, the server may have republished it since
+        if (frameset_cas_owner(slot, FRAMESET_SLOT_READY, pid)) {
+          bool stale = frameset_seq(slot) <= leased_seq;
+          frameset_set_owner(slot, stale ? FRAMESET_SLOT_FREE : FRAMESET_SLOT_READY);
+          rescan = rescan || !stale; // a candidate after all
+        }
+        continue;
+      }
+
+      if (seq > newest_seq) {
+        newest = i;
+        newest_seq = seq;
+      }
+    }
+
+    if (rescan)
+      continue;
+    if (newest == -1)
+      return FramesetLease();
+
+    frameset_slot* slot = &shm->slots[newest];
+    if (!frameset_cas_owner(slot, FRAMESET_SLOT_READY, pid))
+      continue;
+
+    // reread, the server may have republished the slot between the scan and the swap
+    leased_seq = frameset_seq(slot);
+    return FramesetLease(
+      slot,
+      &slot_frames[newest * num_cameras],
+      slot->timestamp
+    );
+  }
+}
+
+bool StreamController::server_alive() {
+  /**
+   * Checks whether the spawned server is still running. The server is
+   * not reaped, so its parent can still waitpid for the exit status.
+   */
+  if (server_exited)
+    return false;
+
+  siginfo_t info;
+  info.si_pid = 0;
+  int ret = waitid(P_PID, server_pid_, &info, WEXITED | WNOHANG | WNOWAIT);
+  if (ret == 0 && info.si_pid == 0)
+    return true;
+  if (ret == -1 && errno == EINTR)
+    return true;
+
+  // exited, or already reaped by the caller
+  if (!server_exited.exchange(true))
+    LOG(ERROR, "Frameset server exited");
+  return false;
 }
 
 void StreamController::recv_frameset(cv::Mat* frames, uint64_t* timestamp) {
-  sem_wait(frameset_ctl_sem);
+  /**
+   * Copying variant of acquire_frameset for consumers that keep
+   * frames around, each frame is cloned and the slot released
+   */
+  FramesetLease lease;
+  while (!(lease = acquire_frameset())) {
+    if (!server_alive())
+      throw std::runtime_error("Frameset server exited");
+  }
 
-  size_t frame_size = frame_width * frame_height * 3 / 2;
-  for(size_t i = 0; i < num_cameras; i++) {
-    size_t offset = i * frame_size;
-    uint8_t* frame = static_cast<uint8_t*>(frameset_buf) + offset;
+  for (size_t i = 0; i < num_cameras; i++)
+    frames[i] = lease[i].clone();
+
+  *timestamp = lease.timestamp();
+}
 
-    frames[i] = cv::Mat(
-      frame_height * 3/2,
-      frame_width,
-      CV_8UC1,
-      frame
-    ).clone();
+bool StreamController::recv_frameset_for(
+  cv::Mat* frames,
+  uint64_t* timestamp,
+  std::chrono::nanoseconds timeout
+) {
+  /**
+   * Copying variant of acquire_frameset_for
+   *
+   * Returns:
+   *   true with frames and timestamp set, false on timeout
+   */
+  FramesetLease lease = acquire_frameset_for(timeout);
+  if (!lease)
+    return false;
+
+  for (size_t i = 0; i < num_cameras; i++)
+    frames[i] = lease[i].clone();
+
+  *timestamp = lease.timestamp();
+  return true;
+}
+
+void StreamController::start_prefetch(nv12_target target, bool half, size_t depth) {
+  /**
+   * Starts a thread that receives every frameset as soon as the server
+   * publishes it and converts it into one of depth buffers, so by the
+   * time the consumer calls recv_prefetched the frameset is already
+   * converted and its shm slot already released.
+   *
+   * depth 2 double buffers (one held by the consumer, one being
+   * filled), 3 also keeps a finished frameset waiting while the next
+   * one converts. When the consumer falls behind the oldest unclaimed
+   * buffer is overwritten, so it always gets the newest frameset and
+   * prefetch_drops counts the ones it never saw.
+   *
+   * Parameters:
+   *   target: conversion applied to every camera's frame
+   *   half:   downscale by 2 during the conversion
+   *   depth:  converted framesets buffered, at least 2
+   */
+  stop_prefetch();
+
+  prefetch_target = target;
+  prefetch_half = half;
+  prefetch_stop = false;
+  prefetch_seq = 0;
+  prefetch_drops_ = 0;
+
+  prefetch_bufs.assign(depth < 2 ? 2 : depth, prefetch_buf());
+  for (prefetch_buf& buf : prefetch_bufs) {
+    buf.frames.resize(num_cameras);
+    buf.timestamp = 0;
+    buf.seq = 0;
+    buf.state = PREFETCH_FREE;
+  }
+
+  prefetch_thread = std::thread(&StreamController::prefetch_fn, this);
+}
+
+void StreamController::stop_prefetch() {
+  if (!prefetch_thread.joinable())
+    return;
+
+  {
+    std::lock_guard<std::mutex> guard(prefetch_lock);
+    prefetch_stop = true;
+  }
+  prefetch_ready.notify_all();
+
+  // the semaphore is the server's, posting it would stall publishing,
+  // so a thread waiting on it sees the stop at its next timeout
+  prefetch_thread.join();
+}
+
+int StreamController::claim_prefetch_buf() {
+  /**
+   * Picks the buffer for the next frameset, a free one if there is
+   * one, otherwise the oldest ready one the consumer hasn't taken yet.
+   * Called with prefetch_lock held.
+   */
+  int oldest = -1;
+  for (size_t i = 0; i < prefetch_bufs.size(); i++) {
+    if (prefetch_bufs[i].state == PREFETCH_FREE)
+      return (int)i;
+    if (prefetch_bufs[i].state != PREFETCH_READY)
+      continue;
+    if (oldest == -1 || prefetch_bufs[i].seq < prefetch_bufs[oldest].seq)
+      oldest = (int)i;
+  }
+
+  if (oldest != -1)
+    prefetch_drops_++;
+  return oldest;
+}
+
+void StreamController::prefetch_fn() {
+  while (true) {
+    FramesetLease lease = acquire_frameset_for(PREFETCH_STOP_INTERVAL);
+
+    std::unique_lock<std::mutex> guard(prefetch_lock);
+    if (prefetch_stop)
+      return;
+    if (!lease && server_alive())
+      continue;
+
+    if (!lease) { // nothing more is coming, let recv_prefetched return
+      prefetch_stop = true;
+      guard.unlock();
+      prefetch_ready.notify_all();
+      return;
+    }
+
+    // depth >= 2 and the consumer holds at most one, so there's always one
+    int idx = claim_prefetch_buf();
+    prefetch_buf& buf = prefetch_bufs[idx];
+    buf.state = PREFETCH_FILLING;
+    guard.unlock();
+
+    nv12_convert_frameset(
+      lease.frames(),
+      buf.frames.data(),
+      num_cameras,
+      prefetch_target,
+      prefetch_half
+    );
+    buf.timestamp = lease.timestamp();
+    lease.release();
+
+    guard.lock();
+    buf.seq = ++prefetch_seq;
+    buf.state = PREFETCH_READY;
+    guard.unlock();
+    prefetch_ready.notify_one();
+  }
+}
+
+const cv::Mat* StreamController::recv_prefetched(uint64_t* timestamp) {
+  /**
+   * Waits for the newest converted frameset
+   *
+   * The frameset returned by the previous call goes back to the
+   * prefetch thread, so the returned frames stay valid until the next
+   * call or stop_prefetch. Ready framesets older than the one returned
+   * are dropped.
+   *
+   * Returns:
+   *   num_cameras converted frames, or nullptr once prefetch is stopped
+   *   or the server exited
+   */
+  std::unique_lock<std::mutex> guard(prefetch_lock);
+
+  for (prefetch_buf& buf : prefetch_bufs) {
+    if (buf.state == PREFETCH_HELD)
+      buf.state = PREFETCH_FREE;
   }
 
-  uint8_t* timestamp_ptr = static_cast<uint8_t*>(frameset_buf) + (frame_size * num_cameras);
-  *timestamp = *reinterpret_cast<uint64_t*>(timestamp_ptr);
+  int newest = -1;
+  prefetch_ready.wait(guard, [&]() {
+    if (prefetch_stop)
+      return true;
+    newest = -1;
+    for (size_t i = 0; i < prefetch_bufs.size(); i++) {
+      if (prefetch_bufs[i].state != PREFETCH_READY)
+        continue;
+      if (newest == -1 || prefetch_bufs[i].seq > prefetch_bufs[newest].seq)
+        newest = (int)i;
+    }
+    return newest != -1;
+  });
+
+  if (prefetch_stop)
+    return nullptr;
+
+  for (size_t i = 0; i < prefetch_bufs.size(); i++) {
+    if ((int)i != newest && prefetch_bufs[i].state == PREFETCH_READY) {
+      prefetch_bufs[i].state = PREFETCH_FREE;
+      prefetch_drops_++;
+    }
+  }
+
+  prefetch_buf& buf = prefetch_bufs[newest];
+  buf.state = PREFETCH_HELD;
+  *timestamp = buf.timestamp;
+  return buf.frames.data();
+}
+
+uint64_t StreamController::prefetch_drops() {
+  std::lock_guard<std::mutex> guard(prefetch_lock);
+  return prefetch_drops_;
+}
+
+bool read_frameset_cameras(frameset_cameras* cams) {
+  /**
+   * Reads which cameras a running server publishes, for processes
+   * downstream of the consumer that spawned it, e.g. pose fusion lining
+   * up detector output with calibration. Only the header is mapped,
+   * read only, and nothing is leased.
+   *
+   * Returns false until the server has published its first frameset,
+   * the point from which the header is valid.
+   */
+  int fd = shm_open(FRAMESET_SHM_NAME, O_RDONLY, 0);
+  if (fd == -1)
+    return false;
+
+  struct stat st;
+  if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(frameset_shm)) {
+    close(fd);
+    return false;
+  }
+
+  // the first page holds the header, the camera entries run on past it for large rigs
+  size_t map_size = std::min<size_t>(st.st_size, FRAMESET_PAGE_SIZE);
+  void* buf = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (buf != MAP_FAILED) {
+    uint32_t cam_count = static_cast<frameset_shm*>(buf)->cam_count;
+    size_t needed = frameset_header_size(cam_count);
+    if (needed > map_size && needed <= (size_t)st.st_size) {
+      munmap(buf, map_size);
+      map_size = needed;
+      buf = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+  }
+  close(fd);
+  if (buf == MAP_FAILED)
+    return false;
+
+  // the seq helpers only load, which a read only mapping allows
+  frameset_shm* shm = static_cast<frameset_shm*>(buf);
+  bool published = false;
+  for (uint32_t slot = 0; slot < FRAMESET_SLOTS; slot++)
+    published = published || frameset_seq(&shm->slots[slot]) > 0;
+
+  bool valid = published &&
+    shm->version == FRAMESET_SHM_VERSION &&
+    shm->cam_count > 0 &&
+    frameset_header_size(shm->cam_count) <= map_size;
+  if (valid) {
+    cams->ids.resize(shm->cam_count);
+    cams->undistorted.resize(shm->cam_count);
+    for (uint32_t i = 0; i < shm->cam_count; i++) {
+      cams->ids[i] = shm->cams[i].id;
+      cams->undistorted[i] = shm->cams[i].flags & FRAMESET_CAM_UNDISTORTED;
+    }
+  }
+
+  munmap(buf, map_size);
+  return valid;
+}
+
+FramesetLease::FramesetLease(FramesetLease&& other) noexcept :
+  slot(other.slot),
+  frames_(other.frames_),
+  timestamp_(other.timestamp_)
+{
+  other.slot = nullptr;
+  other.frames_ = nullptr;
+}
+
+FramesetLease& FramesetLease::operator=(FramesetLease&& other) noexcept {
+  if (this != &other) {
+    release();
+    slot = other.slot;
+    frames_ = other.frames_;
+    timestamp_ = other.timestamp_;
+    other.slot = nullptr;
+    other.frames_ = nullptr;
+  }
+  return *this;
+}
+
+void FramesetLease::release() {
+  if (slot == nullptr)
+    return;
+
+  frameset_set_owner(slot, FRAMESET_SLOT_FREE);
+  slot = nullptr;
+  frames_ = nullptr;
 }
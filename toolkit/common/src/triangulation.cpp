@@ -0,0 +1,521 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <opencv2/calib3d.hpp>
+#include <opencv2/core.hpp>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TRI_HAVE_AVX2 1
+#define AVX2_FN __attribute__((target("avx2")))
+#endif
+
+#include "logging.h"
+#include "triangulation.h"
+
+/**
+ * The kernels are written once against GCC vector types, 8 float lanes
+ * wide. Everything they call is always inlined, so the same source
+ * compiles to ymm registers inside the AVX2 entry point and to pairs of
+ * SSE2 or NEON registers elsewhere.
+ */
+
+#define TRI_INLINE inline __attribute__((always_inline))
+#define MIN_DEPTH 1e-4f     // normalized units in front of a camera a point must be
+#define MIN_CONDITION 1e-6f // det / trace^3 below which a 3x3 solve is degenerate
+
+// vectors never cross a call that isn't inlined, so the ABI note doesn't apply
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+namespace {
+
+typedef float lanes __attribute__((vector_size(32)));
+typedef int32_t mask_lanes __attribute__((vector_size(32)));
+constexpr int LANE_COUNT = 8;
+
+// one camera's samples for a block of points, weight 0 where unused
+struct view_block {
+  lanes u;
+  lanes v;
+  lanes w;
+};
+
+struct sym3 {
+  lanes m00, m01, m02, m11, m12, m22;
+};
+
+TRI_INLINE lanes splat(float s) {
+  return lanes{} + s;
+}
+
+TRI_INLINE lanes select(const mask_lanes& m, const lanes& a, const lanes& b) {
+  return (lanes)((m & (mask_lanes)a) | (~m & (mask_lanes)b));
+}
+
+TRI_INLINE mask_lanes select(const mask_lanes& m, const mask_lanes& a, const mask_lanes& b) {
+  return (m & a) | (~m & b);
+}
+
+TRI_INLINE bool any(const mask_lanes& m) {
+  for (int i = 0; i < LANE_COUNT; i++) {
+    if (m[i])
+      return true;
+  }
+  return false;
+}
+
+TRI_INLINE mask_lanes solve3(const sym3& m, const lanes* b, lanes* x) {
+  /**
+   * Solves m x = b by cofactors, where m is well conditioned
+   *
+   * Returns:
+   *   The lanes that were solved, x is 0 elsewhere
+   */
+  lanes c00 = m.m11 * m.m22 - m.m12 * m.m12;
+  lanes c01 = m.m02 * m.m12 - m.m01 * m.m22;
+  lanes c02 = m.m01 * m.m12 - m.m02 * m.m11;
+  lanes c11 = m.m00 * m.m22 - m.m02 * m.m02;
+  lanes c12 = m.m01 * m.m02 - m.m00 * m.m12;
+  lanes c22 = m.m00 * m.m11 - m.m01 * m.m01;
+  lanes det = m.m00 * c00 + m.m01 * c01 + m.m02 * c02;
+  lanes trace = m.m00 + m.m11 + m.m22;
+
+  mask_lanes ok = det > trace * trace * trace * MIN_CONDITION;
+  lanes inv = select(ok, splat(1.0f) / select(ok, det, splat(1.0f)), splat(0.0f));
+  x[0] = (c00 * b[0] + c01 * b[1] + c02 * b[2]) * inv;
+  x[1] = (c01 * b[0] + c11 * b[1] + c12 * b[2]) * inv;
+  x[2] = (c02 * b[0] + c12 * b[1] + c22 * b[2]) * inv;
+  return ok;
+}
+
+TRI_INLINE mask_lanes dlt(const normalized_camera* cams, int num_cams, const view_block* views, lanes* x) {
+  // the point's w is fixed at 1, leaving a 3x3 least squares system,
+  // mocap points are never near infinity
+  sym3 m = {};
+  lanes b[3] = {};
+
+  for (int c = 0; c < num_cams; c++) {
+    const float (*p)[4] = cams[c].rows;
+    for (int r = 0; r < 2; r++) {
+      lanes coord = r == 0 ? views[c].u : views[c].v;
+      lanes w = views[c].w;
+      lanes a0 = w * (coord * p[2][0] - p[r][0]);
+      lanes a1 = w * (coord * p[2][1] - p[r][1]);
+      lanes a2 = w * (coord * p[2][2] - p[r][2]);
+      lanes a3 = w * (coord * p[2][3] - p[r][3]);
+      m.m00 += a0 * a0;
+      m.m01 += a0 * a1;
+      m.m02 += a0 * a2;
+      m.m11 += a1 * a1;
+      m.m12 += a1 * a2;
+      m.m22 += a2 * a2;
+      b[0] -= a0 * a3;
+      b[1] -= a1 * a3;
+      b[2] -= a2 * a3;
+    }
+  }
+
+  return solve3(m, b, x);
+}
+
+struct projection {
+  lanes u;
+  lanes v;
+  lanes inv_z;
+  mask_lanes front;
+};
+
+TRI_INLINE projection project(const normalized_camera& cam, const lanes* x) {
+  const float (*p)[4] = cam.rows;
+  lanes pu = x[0] * p[0][0] + x[1] * p[0][1] + x[2] * p[0][2] + p[0][3];
+  lanes pv = x[0] * p[1][0] + x[1] * p[1][1] + x[2] * p[1][2] + p[1][3];
+  lanes z = x[0] * p[2][0] + x[1] * p[2][1] + x[2] * p[2][2] + p[2][3];
+
+  projection out;
+  out.front = z > MIN_DEPTH;
+  out.inv_z = splat(1.0f) / select(out.front, z, splat(1.0f));
+  out.u = pu * out.inv_z;
+  out.v = pv * out.inv_z;
+  return out;
+}
+
+TRI_INLINE void refine(
+  const normalized_camera* cams,
+  int num_cams,
+  const view_block* views,
+  int iterations,
+  lanes* x
+) {
+  for (int it = 0; it < iterations; it++) {
+    sym3 m = {};
+    lanes g[3] = {};
+
+    for (int c = 0; c < num_cams; c++) {
+      const float (*p)[4] = cams[c].rows;
+      projection proj = project(cams[c], x);
+      lanes w = select(proj.front, views[c].w, splat(0.0f));
+      lanes w2 = w * w;
+      lanes ru = proj.u - views[c].u;
+      lanes rv = proj.v - views[c].v;
+
+      lanes ju[3];
+      lanes jv[3];
+      for (int k = 0; k < 3; k++) {
+        ju[k] = (p[0][k] - proj.u * p[2][k]) * proj.inv_z;
+        jv[k] = (p[1][k] - proj.v * p[2][k]) * proj.inv_z;
+      }
+
+      m.m00 += w2 * (ju[0] * ju[0] + jv[0] * jv[0]);
+      m.m01 += w2 * (ju[0] * ju[1] + jv[0] * jv[1]);
+      m.m02 += w2 * (ju[0] * ju[2] + jv[0] * jv[2]);
+      m.m11 += w2 * (ju[1] * ju[1] + jv[1] * jv[1]);
+      m.m12 += w2 * (ju[1] * ju[2] + jv[1] * jv[2]);
+      m.m22 += w2 * (ju[2] * ju[2] + jv[2] * jv[2]);
+      for (int k = 0; k < 3; k++)
+        g[k] += w2 * (ju[k] * ru + jv[k] * rv);
+    }
+
+    lanes step[3];
+    solve3(m, g, step); // 0 where the normal equations are degenerate
+    for (int k = 0; k < 3; k++)
+      x[k] -= step[k];
+  }
+}
+
+TRI_INLINE lanes error_sq(const normalized_camera& cam, const view_block& view, const lanes* x, mask_lanes* front) {
+  // squared reprojection error in pixels
+  projection proj = project(cam, x);
+  lanes du = proj.u - view.u;
+  lanes dv = proj.v - view.v;
+  *front = proj.front;
+  return (du * du + dv * dv) * (cam.focal * cam.focal);
+}
+
+TRI_INLINE void reject_outliers(
+  const normalized_camera* cams,
+  int num_cams,
+  view_block* views,
+  float inlier_px
+) {
+  // zeroes the weight of every view outside the best pair's consensus
+  float inlier_sq = inlier_px * inlier_px;
+  mask_lanes best_count = {};
+  lanes best_error = splat(std::numeric_limits<float>::infinity());
+  mask_lanes best_set[TRIANGULATION_MAX_CAMERAS] = {};
+  view_block pair[TRIANGULATION_MAX_CAMERAS];
+  mask_lanes inliers[TRIANGULATION_MAX_CAMERAS];
+
+  for (int c = 0; c < num_cams; c++) {
+    pair[c] = views[c];
+    pair[c].w = splat(0.0f);
+  }
+
+  for (int a = 0; a < num_cams; a++) {
+    for (int b = a + 1; b < num_cams; b++) {
+      mask_lanes both = (views[a].w > 0.0f) & (views[b].w > 0.0f);
+      if (!any(both))
+        continue;
+
+      pair[a].w = views[a].w;
+      pair[b].w = views[b].w;
+      lanes x[3];
+      mask_lanes ok = dlt(cams, num_cams, pair, x) & both;
+      pair[a].w = splat(0.0f);
+      pair[b].w = splat(0.0f);
+
+      mask_lanes count = {};
+      lanes error = {};
+      for (int c = 0; c < num_cams; c++) {
+        mask_lanes front;
+        lanes e = error_sq(cams[c], views[c], x, &front);
+        inliers[c] = front & (views[c].w > 0.0f) & (e < inlier_sq);
+        count -= inliers[c];
+        error += select(inliers[c], e, splat(0.0f));
+      }
+
+      mask_lanes better = ok & (
+        (count > best_count) | ((count == best_count) & (error < best_error))
+      );
+      best_count = select(better, count, best_count);
+      best_error = select(better, error, best_error);
+      for (int c = 0; c < num_cams; c++)
+        best_set[c] = select(better, inliers[c], best_set[c]);
+    }
+  }
+
+  for (int c = 0; c < num_cams; c++)
+    views[c].w = select(best_set[c], views[c].w, splat(0.0f));
+}
+
+TRI_INLINE void load(const float* src, size_t count, lanes& dst) {
+  dst = lanes{};
+  memcpy(&dst, src, count * sizeof(float));
+}
+
+struct block_job {
+  const normalized_camera* cams;
+  int num_cams;
+  const triangulation_params* params;
+  const keypoints_2d* keypoints;
+  points_3d* points;
+  cv::Vec3d origin;
+  double scale;
+};
+
+TRI_INLINE void triangulate_blocks(const block_job& job) {
+  const triangulation_params& params = *job.params;
+  const keypoints_2d& kp = *job.keypoints;
+  size_t n = kp.num_points;
+  view_block views[TRIANGULATION_MAX_CAMERAS];
+
+  for (size_t start = 0; start < n; start += LANE_COUNT) {
+    size_t count = std::min((size_t)LANE_COUNT, n - start);
+
+    for (int c = 0; c < job.num_cams; c++) {
+      const normalized_camera& cam = job.cams[c];
+      size_t base = (size_t)c * n + start;
+      lanes x;
+      lanes y;
+      lanes conf;
+      load(kp.x + base, count, x);
+      load(kp.y + base, count, y);
+      load(kp.conf + base, count, conf);
+
+      // NaN coordinates (a missed detection) fail every comparison
+      mask_lanes usable = (conf >= params.min_confidence) & (x == x) & (y == y);
+      views[c].u = select(usable, (x - cam.cx) / cam.focal, splat(0.0f));
+      views[c].v = select(usable, (y - cam.cy) / cam.focal, splat(0.0f));
+      views[c].w = select(usable, conf, splat(0.0f));
+    }
+
+    if (params.reject_outliers)
+      reject_outliers(job.cams, job.num_cams, views, params.inlier_px);
+
+    lanes x[3];
+    mask_lanes ok = dlt(job.cams, job.num_cams, views, x);
+    refine(job.cams, job.num_cams, views, params.refine_iterations, x);
+
+    mask_lanes used[TRIANGULATION_MAX_CAMERAS];
+    mask_lanes used_count = {};
+    lanes error = {};
+    for (int c = 0; c < job.num_cams; c++) {
+      mask_lanes front;
+      lanes e = error_sq(job.cams[c], views[c], x, &front);
+      used[c] = front & (views[c].w > 0.0f);
+      used_count -= used[c];
+      error += select(used[c], e, splat(0.0f));
+    }
+    ok &= used_count >= params.min_views;
+
+    for (size_t l = 0; l < count; l++) {
+      size_t i = start + l;
+      bool valid = ok[l] && std::isfinite(x[0][l]) && std::isfinite(x[1][l]) && std::isfinite(x[2][l]);
+      if (!valid) {
+        float nan = std::numeric_limits<float>::quiet_NaN();
+        job.points->x[i] = nan;
+        job.points->y[i] = nan;
+        job.points->z[i] = nan;
+        job.points->error[i] = nan;
+        job.points->views[i] = 0;
+        continue;
+      }
+
+      uint32_t mask = 0;
+      for (int c = 0; c < job.num_cams; c++) {
+        if (used[c][l])
+          mask |= 1u << c;
+      }
+      job.points->x[i] = (float)(job.origin[0] + job.scale * x[0][l]);
+      job.points->y[i] = (float)(job.origin[1] + job.scale * x[1][l]);
+      job.points->z[i] = (float)(job.origin[2] + job.scale * x[2][l]);
+      job.points->error[i] = std::sqrt(error[l] / used_count[l]);
+      job.points->views[i] = mask;
+    }
+  }
+}
+
+struct baseline_isa {
+  static void run(const block_job& job) {
+    triangulate_blocks(job);
+  }
+};
+
+#ifdef TRI_HAVE_AVX2
+
+struct avx2_isa {
+  AVX2_FN static void run(const block_job& job) {
+    triangulate_blocks(job);
+  }
+};
+
+#endif // TRI_HAVE_AVX2
+
+enum class kernel_isa {
+  BASELINE,
+  AVX2
+};
+
+kernel_isa detect_isa() {
+#if defined(TRI_HAVE_AVX2)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return kernel_isa::AVX2;
+#endif
+  return kernel_isa::BASELINE;
+}
+
+const kernel_isa active_isa = detect_isa();
+
+} // namespace
+
+Triangulator::Triangulator(
+  const std::vector<cv::Matx34d>& projections,
+  triangulation_params params
+) : params(params) {
+  char logstr[128];
+
+  if (projections.empty() || projections.size() > TRIANGULATION_MAX_CAMERAS) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Triangulation needs 1 to %d cameras, got %zu",
+      TRIANGULATION_MAX_CAMERAS,
+      projections.size()
+    );
+    LOG(ERROR, logstr);
+    throw std::invalid_argument(logstr);
+  }
+
+  // camera centers are the projections' null spaces, their spread sets the world scale
+  std::vector<cv::Vec3d> centers;
+  origin = cv::Vec3d(0, 0, 0);
+  for (const cv::Matx34d& p : projections) {
+    cv::Matx33d m = p.get_minor<3, 3>(0, 0);
+    cv::Vec3d center = -(m.inv() * cv::Vec3d(p(0, 3), p(1, 3), p(2, 3)));
+    centers.push_back(center);
+    origin += center / (double)projections.size();
+  }
+
+  scale = 0.0;
+  for (const cv::Vec3d& center : centers)
+    scale += cv::norm(center - origin) / centers.size();
+  if (scale < 1e-9)
+    scale = 1.0;
+
+  cv::Matx44d to_world(
+    scale, 0, 0, origin[0],
+    0, scale, 0, origin[1],
+    0, 0, scale, origin[2],
+    0, 0, 0, 1
+  );
+
+  for (size_t i = 0; i < projections.size(); i++) {
+    // the third row scaled to a unit rotation row, positive in front of the camera
+    cv::Matx34d p = projections[i];
+    cv::Vec3d r2(p(2, 0), p(2, 1), p(2, 2));
+    double sign = cv::determinant(p.get_minor<3, 3>(0, 0)) < 0 ? -1.0 : 1.0;
+    p *= sign / cv::norm(r2);
+
+    r2 = cv::Vec3d(p(2, 0), p(2, 1), p(2, 2));
+    cv::Vec3d r1(p(1, 0), p(1, 1), p(1, 2));
+    double cx = cv::Vec3d(p(0, 0), p(0, 1), p(0, 2)).dot(r2);
+    double cy = r1.dot(r2);
+    double focal_sq = r1.dot(r1) - cy * cy;
+
+    if (!(focal_sq > 0.0)) {
+      snprintf(
+        logstr,
+        sizeof(logstr),
+        "Camera %zu's projection matrix is degenerate",
+        i
+      );
+      LOG(ERROR, logstr);
+      throw std::invalid_argument(logstr);
+    }
+
+    double focal = std::sqrt(focal_sq);
+    cv::Matx33d to_normalized(
+      1.0 / focal, 0, -cx / focal,
+      0, 1.0 / focal, -cy / focal,
+      0, 0, 1
+    );
+    cv::Matx34d q = to_normalized * p * to_world * (1.0 / scale);
+
+    normalized_camera cam;
+    for (int r = 0; r < 3; r++) {
+      for (int c = 0; c < 4; c++)
+        cam.rows[r][c] = (float)q(r, c);
+    }
+    cam.cx = (float)cx;
+    cam.cy = (float)cy;
+    cam.focal = (float)focal;
+    cameras.push_back(cam);
+  }
+}
+
+void Triangulator::triangulate(const keypoints_2d& keypoints, points_3d& points) const {
+  size_t n = keypoints.num_points;
+  points.x.resize(n);
+  points.y.resize(n);
+  points.z.resize(n);
+  points.error.resize(n);
+  points.views.resize(n);
+  if (n == 0)
+    return;
+
+  block_job job = {
+    cameras.data(),
+    (int)cameras.size(),
+    &params,
+    &keypoints,
+    &points,
+    origin,
+    scale
+  };
+
+  switch (active_isa) {
+#ifdef TRI_HAVE_AVX2
+    case kernel_isa::AVX2:
+      avx2_isa::run(job);
+      break;
+#endif
+    default:
+      baseline_isa::run(job);
+  }
+}
+
+void Triangulator::triangulate_framesets(const keypoints_2d* keypoints, points_3d* points, size_t count) const {
+  cv::parallel_for_(cv::Range(0, (int)count), [&](const cv::Range& range) {
+    for (int i = range.start; i < range.end; i++)
+      triangulate(keypoints[i], points[i]);
+  });
+}
+
+cv::Matx34d projection_matrix(const cv::Mat& camera_matrix, const cv::Mat& rvec, const cv::Mat& tvec) {
+  cv::Mat rotation;
+  cv::Rodrigues(rvec, rotation);
+
+  cv::Matx33d k((const double*)camera_matrix.ptr<double>());
+  cv::Matx33d r((const double*)rotation.ptr<double>());
+  const double* t = tvec.ptr<double>();
+
+  cv::Matx34d pose(
+    r(0, 0), r(0, 1), r(0, 2), t[0],
+    r(1, 0), r(1, 1), r(1, 2), t[1],
+    r(2, 0), r(2, 1), r(2, 2), t[2]
+  );
+  return k * pose;
+}
+
+const char* triangulation_kernel_isa() {
+  if (active_isa == kernel_isa::AVX2)
+    return "avx2";
+#if defined(__SSE2__)
+  return "sse2";
+#elif defined(__ARM_NEON)
+  return "neon";
+#else
+  return "scalar";
+#endif
+}
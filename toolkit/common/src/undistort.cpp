@@ -0,0 +1,538 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <opencv2/calib3d.hpp>
+#include <opencv2/core.hpp>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define REMAP_HAVE_AVX2 1
+#define AVX2_FN __attribute__((target("avx2")))
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define REMAP_HAVE_NEON 1
+#endif
+
+#include "logging.h"
+#include "undistort.h"
+
+/**
+ * Every kernel blends the same way, so SIMD and scalar paths agree
+ * exactly and the scalar path doubles as the reference:
+ *
+ *   top    = p00 (32 - fx) + p01 fx
+ *   bottom = p10 (32 - fx) + p11 fx
+ *   out    = (top (32 - fy) + bottom fy + 512) >> 10
+ *
+ * Fractions run 0 to 32 inclusive, so a sample on the last row or
+ * column is a full weight on the far neighbour of an in bounds pair.
+ * Luma reads two bytes per row, chroma two interleaved UV pairs, and
+ * the tables never point past the plane's last pair, so the 32 bit
+ * gathers only ever touch bytes of the frame.
+ */
+
+namespace {
+
+constexpr int FRAC_ONE = 1 << REMAP_FRAC_BITS;
+
+inline uint8_t blend(int p00, int p01, int p10, int p11, int fx, int fy) {
+  int top = p00 * (FRAC_ONE - fx) + p01 * fx;
+  int bottom = p10 * (FRAC_ONE - fx) + p11 * fx;
+  return (uint8_t)((top * (FRAC_ONE - fy) + bottom * fy + 512) >> 10);
+}
+
+void luma_span(
+  const uint8_t* src,
+  int stride,
+  const remap_lut& lut,
+  uint8_t* dst,
+  int start,
+  int end
+) {
+  for (int i = start; i < end; i++) {
+    const uint8_t* p = src + lut.offsets[i];
+    int fx = lut.fracs[i] & 0xff;
+    int fy = lut.fracs[i] >> 8;
+    dst[i] = blend(p[0], p[1], p[stride], p[stride + 1], fx, fy);
+  }
+}
+
+void chroma_span(
+  const uint8_t* src,
+  int stride,
+  const remap_lut& lut,
+  uint8_t* dst,
+  int start,
+  int end
+) {
+  for (int i = start; i < end; i++) {
+    const uint8_t* p = src + lut.offsets[i];
+    int fx = lut.fracs[i] & 0xff;
+    int fy = lut.fracs[i] >> 8;
+    dst[2 * i] = blend(p[0], p[2], p[stride], p[stride + 2], fx, fy);
+    dst[2 * i + 1] = blend(p[1], p[3], p[stride + 1], p[stride + 3], fx, fy);
+  }
+}
+
+// each isa remaps as many samples as its vector width allows and
+// returns where it stopped, the scalar spans finish the table
+struct scalar_isa {
+  static int luma(const uint8_t*, int, const remap_lut&, uint8_t*, int) {
+    return 0;
+  }
+
+  static int chroma(const uint8_t*, int, const remap_lut&, uint8_t*, int) {
+    return 0;
+  }
+};
+
+#ifdef REMAP_HAVE_AVX2
+
+struct avx2_weights {
+  __m256i x; // (32 - fx) in the low half of each lane, fx in the high half, for madd
+  __m256i y;
+};
+
+AVX2_FN inline avx2_weights avx2_load_weights(const uint16_t* fracs) {
+  const __m256i one = _mm256_set1_epi32(FRAC_ONE);
+  __m256i frac = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)fracs));
+  __m256i fx = _mm256_and_si256(frac, _mm256_set1_epi32(0xff));
+  __m256i fy = _mm256_srli_epi32(frac, 8);
+  return {
+    _mm256_or_si256(_mm256_sub_epi32(one, fx), _mm256_slli_epi32(fx, 16)),
+    _mm256_or_si256(_mm256_sub_epi32(one, fy), _mm256_slli_epi32(fy, 16))
+  };
+}
+
+// pairs holds (left, right) as 16 bit halves of each lane, for both rows
+AVX2_FN inline __m256i avx2_blend(__m256i top_pairs, __m256i bottom_pairs, const avx2_weights& w) {
+  __m256i top = _mm256_madd_epi16(top_pairs, w.x);
+  __m256i bottom = _mm256_madd_epi16(bottom_pairs, w.x);
+  __m256i v = _mm256_madd_epi16(_mm256_or_si256(top, _mm256_slli_epi32(bottom, 16)), w.y);
+  return _mm256_srli_epi32(_mm256_add_epi32(v, _mm256_set1_epi32(512)), 10);
+}
+
+struct avx2_isa {
+  AVX2_FN static int luma(const uint8_t* src, int stride, const remap_lut& lut, uint8_t* dst, int count) {
+    // bytes 0 and 1 of each gathered lane widened to 16 bit halves
+    const __m256i pairs = _mm256_setr_epi8(
+      0, -1, 1, -1, 4, -1, 5, -1, 8, -1, 9, -1, 12, -1, 13, -1,
+      0, -1, 1, -1, 4, -1, 5, -1, 8, -1, 9, -1, 12, -1, 13, -1
+    );
+    const int32_t* offsets = lut.offsets.data();
+
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+      __m256i off = _mm256_loadu_si256((const __m256i*)(offsets + i));
+      __m256i top = _mm256_i32gather_epi32((const int*)src, off, 1);
+      __m256i bottom = _mm256_i32gather_epi32((const int*)(src + stride), off, 1);
+      avx2_weights w = avx2_load_weights(lut.fracs.data() + i);
+
+      __m256i v = avx2_blend(
+        _mm256_shuffle_epi8(top, pairs),
+        _mm256_shuffle_epi8(bottom, pairs),
+        w
+      );
+
+      v = _mm256_packus_epi32(v, v);
+      v = _mm256_packus_epi16(v, v);
+      uint32_t lo = (uint32_t)_mm256_cvtsi256_si32(v);
+      uint32_t hi = (uint32_t)_mm256_extract_epi32(v, 4);
+      memcpy(dst + i, &lo, 4);
+      memcpy(dst + i + 4, &hi, 4);
+    }
+    return i;
+  }
+
+  AVX2_FN static int chroma(const uint8_t* src, int stride, const remap_lut& lut, uint8_t* dst, int count) {
+    // each gathered lane is u0 v0 u1 v1, so masking and shifting gives the pairs directly
+    const __m256i even = _mm256_set1_epi32(0x00ff00ff);
+    const int32_t* offsets = lut.offsets.data();
+
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+      __m256i off = _mm256_loadu_si256((const __m256i*)(offsets + i));
+      __m256i top = _mm256_i32gather_epi32((const int*)src, off, 1);
+      __m256i bottom = _mm256_i32gather_epi32((const int*)(src + stride), off, 1);
+      avx2_weights w = avx2_load_weights(lut.fracs.data() + i);
+
+      __m256i u = avx2_blend(
+        _mm256_and_si256(top, even),
+        _mm256_and_si256(bottom, even),
+        w
+      );
+      __m256i v = avx2_blend(
+        _mm256_srli_epi16(top, 8),
+        _mm256_srli_epi16(bottom, 8),
+        w
+      );
+
+      __m256i uv = _mm256_or_si256(u, _mm256_slli_epi32(v, 8));
+      uv = _mm256_packus_epi32(uv, uv);
+      uv = _mm256_permute4x64_epi64(uv, 0x08);
+      _mm_storeu_si128((__m128i*)(dst + 2 * i), _mm256_castsi256_si128(uv));
+    }
+    return i;
+  }
+};
+
+#endif // REMAP_HAVE_AVX2
+
+#ifdef REMAP_HAVE_NEON
+
+// NEON has no gather, the 8 samples' neighbours are loaded one by one
+// and blended 8 at a time
+inline uint8x8_t neon_blend(
+  const uint8_t* p00,
+  const uint8_t* p01,
+  const uint8_t* p10,
+  const uint8_t* p11,
+  uint8x8_t fx,
+  uint16x8_t fy
+) {
+  uint8x8_t ifx = vsub_u8(vdup_n_u8(FRAC_ONE), fx);
+  uint16x8_t ify = vsubq_u16(vdupq_n_u16(FRAC_ONE), fy);
+  uint16x8_t top = vmlal_u8(vmull_u8(vld1_u8(p00), ifx), vld1_u8(p01), fx);
+  uint16x8_t bottom = vmlal_u8(vmull_u8(vld1_u8(p10), ifx), vld1_u8(p11), fx);
+
+  uint32x4_t lo = vmlal_u16(
+    vmull_u16(vget_low_u16(top), vget_low_u16(ify)),
+    vget_low_u16(bottom),
+    vget_low_u16(fy)
+  );
+  uint32x4_t hi = vmlal_u16(
+    vmull_u16(vget_high_u16(top), vget_high_u16(ify)),
+    vget_high_u16(bottom),
+    vget_high_u16(fy)
+  );
+  return vmovn_u16(vcombine_u16(vrshrn_n_u32(lo, 10), vrshrn_n_u32(hi, 10)));
+}
+
+struct neon_isa {
+  static int luma(const uint8_t* src, int stride, const remap_lut& lut, uint8_t* dst, int count) {
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+      uint8_t p[4][8];
+      for (int k = 0; k < 8; k++) {
+        const uint8_t* s = src + lut.offsets[i + k];
+        p[0][k] = s[0];
+        p[1][k] = s[1];
+        p[2][k] = s[stride];
+        p[3][k] = s[stride + 1];
+      }
+
+      uint16x8_t frac = vld1q_u16(lut.fracs.data() + i);
+      vst1_u8(dst + i, neon_blend(p[0], p[1], p[2], p[3], vmovn_u16(frac), vshrq_n_u16(frac, 8)));
+    }
+    return i;
+  }
+
+  static int chroma(const uint8_t* src, int stride, const remap_lut& lut, uint8_t* dst, int count) {
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+      uint8_t p[8][8]; // u00 u01 u10 u11 v00 v01 v10 v11
+      for (int k = 0; k < 8; k++) {
+        const uint8_t* s = src + lut.offsets[i + k];
+        p[0][k] = s[0];
+        p[1][k] = s[2];
+        p[2][k] = s[stride];
+        p[3][k] = s[stride + 2];
+        p[4][k] = s[1];
+        p[5][k] = s[3];
+        p[6][k] = s[stride + 1];
+        p[7][k] = s[stride + 3];
+      }
+
+      uint16x8_t frac = vld1q_u16(lut.fracs.data() + i);
+      uint8x8_t fx = vmovn_u16(frac);
+      uint16x8_t fy = vshrq_n_u16(frac, 8);
+      uint8x8x2_t uv;
+      uv.val[0] = neon_blend(p[0], p[1], p[2], p[3], fx, fy);
+      uv.val[1] = neon_blend(p[4], p[5], p[6], p[7], fx, fy);
+      vst2_u8(dst + 2 * i, uv);
+    }
+    return i;
+  }
+};
+
+#endif // REMAP_HAVE_NEON
+
+enum class kernel_isa {
+  SCALAR,
+  AVX2,
+  NEON
+};
+
+kernel_isa detect_isa() {
+#if defined(REMAP_HAVE_AVX2)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return kernel_isa::AVX2;
+#elif defined(REMAP_HAVE_NEON)
+  return kernel_isa::NEON;
+#endif
+  return kernel_isa::SCALAR;
+}
+
+const kernel_isa active_isa = detect_isa();
+
+remap_lut build_lut(
+  const cv::Mat& map_x,
+  const cv::Mat& map_y,
+  cv::Rect roi,
+  cv::Size plane,
+  size_t base,
+  int stride,
+  int sample_bytes
+) {
+  /**
+   * Turns float maps over a plane into a table over the roi
+   *
+   * Parameters:
+   *   map_x, map_y: source coordinates per output sample, in samples
+   *   roi:          the part of the maps to keep
+   *   plane:        source plane size in samples
+   *   base:         byte offset of the plane in the frame
+   *   stride:       bytes per source row
+   *   sample_bytes: 1 for luma, 2 for interleaved chroma
+   */
+  remap_lut lut;
+  lut.width = roi.width;
+  lut.height = roi.height;
+  lut.offsets.resize((size_t)roi.area());
+  lut.fracs.resize((size_t)roi.area());
+
+  auto split = [](float coord, int limit, int* whole, int* frac) {
+    float clamped = std::min(std::max(coord, 0.0f), (float)(limit - 1));
+    int fixed = (int)std::lround(clamped * FRAC_ONE);
+    *whole = fixed >> REMAP_FRAC_BITS;
+    *frac = fixed & (FRAC_ONE - 1);
+    if (*whole >= limit - 1) { // keep the pair in bounds, all weight on the far one
+      *whole = limit - 2;
+      *frac = FRAC_ONE;
+    }
+  };
+
+  size_t i = 0;
+  for (int row = roi.y; row < roi.y + roi.height; row++) {
+    const float* mx = map_x.ptr<float>(row);
+    const float* my = map_y.ptr<float>(row);
+    for (int col = roi.x; col < roi.x + roi.width; col++, i++) {
+      int x;
+      int y;
+      int fx;
+      int fy;
+      split(mx[col], plane.width, &x, &fx);
+      split(my[col], plane.height, &y, &fy);
+      lut.offsets[i] = (int32_t)(base + (size_t)y * stride + (size_t)x * sample_bytes);
+      lut.fracs[i] = (uint16_t)(fx | fy << 8);
+    }
+  }
+
+  return lut;
+}
+
+cv::Mat half_matrix(const cv::Mat& k) {
+  // the chroma plane samples pixel centers (2x + 0.5, 2y + 0.5) of the luma plane
+  cv::Mat half = k.clone();
+  half.at<double>(0, 0) *= 0.5;
+  half.at<double>(1, 1) *= 0.5;
+  half.at<double>(0, 2) = (k.at<double>(0, 2) + 0.5) * 0.5 - 0.5;
+  half.at<double>(1, 2) = (k.at<double>(1, 2) + 0.5) * 0.5 - 0.5;
+  return half;
+}
+
+} // namespace
+
+Undistorter::Undistorter(
+  const std::vector<camera_calibration>& cams,
+  cv::Size size,
+  undistort_planes planes,
+  cv::Rect roi,
+  double alpha
+) :
+  size(size),
+  planes(planes),
+  roi(roi.area() > 0 ? roi : cv::Rect(0, 0, size.width, size.height))
+{
+  char logstr[128];
+  cv::Rect frame(0, 0, size.width, size.height);
+  bool even = this->roi.x % 2 == 0 && this->roi.y % 2 == 0
+    && this->roi.width % 2 == 0 && this->roi.height % 2 == 0;
+
+  if ((this->roi & frame) != this->roi || (planes == undistort_planes::NV12 && !even)) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Invalid undistortion roi %dx%d+%d+%d for %dx%d frames",
+      this->roi.width,
+      this->roi.height,
+      this->roi.x,
+      this->roi.y,
+      size.width,
+      size.height
+    );
+    LOG(ERROR, logstr);
+    throw std::invalid_argument(logstr);
+  }
+
+  for (size_t i = 0; i < cams.size(); i++) {
+    const camera_calibration& cam = cams[i];
+    if (cam.camera_matrix.empty()) {
+      snprintf(
+        logstr,
+        sizeof(logstr),
+        "Camera %zu has no intrinsics to undistort with",
+        i
+      );
+      LOG(ERROR, logstr);
+      throw std::invalid_argument(logstr);
+    }
+
+    cv::Mat new_matrix = cv::getOptimalNewCameraMatrix(cam.camera_matrix, cam.dist_coeffs, size, alpha, size);
+
+    cv::Mat map_x;
+    cv::Mat map_y;
+    cv::initUndistortRectifyMap(
+      cam.camera_matrix,
+      cam.dist_coeffs,
+      cv::Mat(),
+      new_matrix,
+      size,
+      CV_32FC1,
+      map_x,
+      map_y
+    );
+    luma_luts.push_back(build_lut(map_x, map_y, this->roi, size, 0, size.width, 1));
+
+    if (planes == undistort_planes::NV12) {
+      cv::Size half(size.width / 2, size.height / 2);
+      cv::initUndistortRectifyMap(
+        half_matrix(cam.camera_matrix),
+        cam.dist_coeffs,
+        cv::Mat(),
+        half_matrix(new_matrix),
+        half,
+        CV_32FC1,
+        map_x,
+        map_y
+      );
+      cv::Rect half_roi(this->roi.x / 2, this->roi.y / 2, this->roi.width / 2, this->roi.height / 2);
+      chroma_luts.push_back(build_lut(
+        map_x,
+        map_y,
+        half_roi,
+        half,
+        (size_t)size.width * size.height,
+        size.width,
+        2
+      ));
+    }
+
+    new_matrix.at<double>(0, 2) -= this->roi.x;
+    new_matrix.at<double>(1, 2) -= this->roi.y;
+    out_matrices.push_back(new_matrix);
+  }
+}
+
+void Undistorter::undistort(const cv::Mat& src, cv::Mat& dst, size_t cam) const {
+  if (
+    src.type() != CV_8UC1 ||
+    !src.isContinuous() ||
+    src.cols != size.width ||
+    src.rows != size.height * 3 / 2 ||
+    cam >= luma_luts.size()
+  ) {
+    char logstr[128];
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Expected a continuous %dx%d NV12 frame for camera %zu, got %dx%d type %d",
+      size.width,
+      size.height,
+      cam,
+      src.cols,
+      src.rows * 2 / 3,
+      src.type()
+    );
+    LOG(ERROR, logstr);
+    throw std::invalid_argument(logstr);
+  }
+
+  int rows = planes == undistort_planes::NV12 ? roi.height * 3 / 2 : roi.height;
+  dst.create(rows, roi.width, CV_8UC1);
+  if (!dst.isContinuous()) // a caller provided roi, replace it
+    dst = cv::Mat(dst.rows, dst.cols, dst.type());
+
+  remap_luma(src.ptr<uint8_t>(), size.width, luma_luts[cam], dst.ptr<uint8_t>());
+  if (planes == undistort_planes::NV12)
+    remap_chroma(src.ptr<uint8_t>(), size.width, chroma_luts[cam], dst.ptr<uint8_t>() + roi.area());
+}
+
+void Undistorter::undistort_frameset(const cv::Mat* src, cv::Mat* dst) const {
+  cv::parallel_for_(cv::Range(0, (int)luma_luts.size()), [&](const cv::Range& range) {
+    for (int i = range.start; i < range.end; i++)
+      undistort(src[i], dst[i], i);
+  });
+}
+
+size_t Undistorter::lut_bytes() const {
+  size_t bytes = 0;
+  for (const std::vector<remap_lut>* luts : {&luma_luts, &chroma_luts}) {
+    for (const remap_lut& lut : *luts)
+      bytes += lut.offsets.size() * sizeof(int32_t) + lut.fracs.size() * sizeof(uint16_t);
+  }
+  return bytes;
+}
+
+void remap_luma(const uint8_t* src, int stride, const remap_lut& lut, uint8_t* dst) {
+  int count = lut.width * lut.height;
+  int done = 0;
+  switch (active_isa) {
+#ifdef REMAP_HAVE_AVX2
+    case kernel_isa::AVX2:
+      done = avx2_isa::luma(src, stride, lut, dst, count);
+      break;
+#endif
+#ifdef REMAP_HAVE_NEON
+    case kernel_isa::NEON:
+      done = neon_isa::luma(src, stride, lut, dst, count);
+      break;
+#endif
+    default:
+      done = scalar_isa::luma(src, stride, lut, dst, count);
+  }
+  luma_span(src, stride, lut, dst, done, count);
+}
+
+void remap_chroma(const uint8_t* src, int stride, const remap_lut& lut, uint8_t* dst) {
+  int count = lut.width * lut.height;
+  int done = 0;
+  switch (active_isa) {
+#ifdef REMAP_HAVE_AVX2
+    case kernel_isa::AVX2:
+      done = avx2_isa::chroma(src, stride, lut, dst, count);
+      break;
+#endif
+#ifdef REMAP_HAVE_NEON
+    case kernel_isa::NEON:
+      done = neon_isa::chroma(src, stride, lut, dst, count);
+      break;
+#endif
+    default:
+      done = scalar_isa::chroma(src, stride, lut, dst, count);
+  }
+  chroma_span(src, stride, lut, dst, done, count);
+}
+
+const char* remap_kernel_isa() {
+  switch (active_isa) {
+    case kernel_isa::AVX2:
+      return "avx2";
+    case kernel_isa::NEON:
+      return "neon";
+    default:
+      return "scalar";
+  }
+}
@@ -0,0 +1,108 @@
+#ifndef EXTRINSIC_SOLVER_H
+#define EXTRINSIC_SOLVER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <opencv2/core.hpp>
+#include <vector>
+
+#define BA_HUBER_DELTA 2.0 // pixels, residuals past this are downweighted
+
+// maps a point x to R x + t
+struct rigid_pose {
+  cv::Matx33d R;
+  cv::Vec3d t;
+};
+
+struct ba_report {
+  int iterations;
+  double initial_rms; // pixels, over every corner of every observation
+  double final_rms;
+  uint64_t solve_ns;
+  std::vector<double> camera_rms;
+};
+
+class ExtrinsicSolver {
+  /**
+   * Joint extrinsic calibration of a camera rig from a moving board
+   *
+   * Each observation is one camera seeing one board placement (one
+   * frameset), whole or partly: corners carry their board point ids,
+   * so cameras that each see a different part of a placement still
+   * share its pose. The world frame is camera 0's, and every other camera's
+   * pose and every board placement's pose are unknowns, with the
+   * intrinsics held fixed. Corners are undistorted up front, so the
+   * model is a pinhole in normalized coordinates whose residuals are
+   * scaled back to pixels by the camera's focal lengths.
+   *
+   * initialize builds a pose graph from per observation solvePnP: the
+   * cameras are joined along the spanning tree that maximizes shared
+   * board placements, rooted at camera 0, and each placement is then
+   * seeded from its best single view.
+   *
+   * solve is a Levenberg-Marquardt bundle adjustment over the normal
+   * equations' block structure. Board placements only couple to the
+   * cameras that saw them, so their 6x6 blocks are eliminated with a
+   * Schur complement, leaving a dense system of 6 unknowns per camera
+   * that doesn't grow with the number of placements. Building it is
+   * linear in observations, and placements are back substituted after.
+   * A Huber loss keeps a misdetected board, e.g. one whose corners came
+   * back in the opposite order in one view, from skewing the rig.
+   */
+public:
+  ExtrinsicSolver(
+    const std::vector<cv::Point3f>& board_points,
+    const std::vector<cv::Matx33d>& camera_matrices
+  );
+
+  // corners are undistorted, normalized image coordinates of the board points in ids
+  void add_observation(
+    int cam,
+    int board,
+    const std::vector<cv::Point2f>& corners,
+    const std::vector<int>& ids
+  );
+
+  bool initialize();
+  ba_report solve(int max_iterations = 50);
+
+  size_t num_boards() const { return board_poses.size(); }
+  size_t num_observations() const { return observations.size(); }
+  const std::vector<rigid_pose>& camera_poses() const { return cam_poses; }
+
+private:
+  struct observation {
+    int cam;
+    int board;
+    std::vector<cv::Point2f> corners;
+    std::vector<cv::Point3f> points; // the board point of each corner
+    rigid_pose pnp;   // board to camera from solvePnP, for initialization
+    double pnp_rms;
+  };
+
+  typedef cv::Matx<double, 6, 6> mat6;
+  typedef cv::Vec<double, 6> vec6;
+
+  struct normal_equations {
+    std::vector<mat6> cam_blocks;   // per camera, camera 0's unused
+    std::vector<vec6> cam_grads;
+    std::vector<mat6> board_blocks; // per board placement
+    std::vector<vec6> board_grads;
+    std::vector<mat6> cross_blocks; // per observation, camera by board
+    double cost;
+  };
+
+  std::vector<cv::Point3f> board_points;
+  std::vector<cv::Matx33d> camera_matrices;
+  std::vector<observation> observations;
+  std::vector<std::vector<int>> board_observations; // observation indices per placement
+
+  std::vector<rigid_pose> cam_poses;   // world to camera
+  std::vector<rigid_pose> board_poses; // board to world
+
+  double evaluate(std::vector<double>* camera_rms, double* rms);
+  void build(normal_equations& eq);
+  bool step(const normal_equations& eq, double lambda);
+};
+
+#endif // EXTRINSIC_SOLVER_H
@@ -0,0 +1,510 @@
+#include <algorithm>
+#include <cmath>
+#include <opencv2/calib3d.hpp>
+#include <opencv2/core.hpp>
+#include <stdexcept>
+#include <time.h>
+
+#include "extrinsic_solver.h"
+#include "logging.h"
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static cv::Matx33d skew(const cv::Vec3d& v) {
+  return cv::Matx33d(
+    0, -v[2], v[1],
+    v[2], 0, -v[0],
+    -v[1], v[0], 0
+  );
+}
+
+static cv::Matx33d exp_so3(const cv::Vec3d& w) {
+  double theta = std::sqrt(w.dot(w));
+  if (theta < 1e-12)
+    return cv::Matx33d::eye() + skew(w);
+
+  cv::Matx33d k = skew(w * (1.0 / theta));
+  return cv::Matx33d::eye() + k * std::sin(theta) + k * k * (1.0 - std::cos(theta));
+}
+
+static rigid_pose compose(const rigid_pose& a, const rigid_pose& b) {
+  // a after b
+  return rigid_pose{a.R * b.R, a.R * b.t + a.t};
+}
+
+static rigid_pose inverse(const rigid_pose& a) {
+  cv::Matx33d rt = a.R.t();
+  return rigid_pose{rt, -(rt * a.t)};
+}
+
+static double huber(double e, double* weight) {
+  if (e <= BA_HUBER_DELTA) {
+    *weight = 1.0;
+    return e * e;
+  }
+  *weight = BA_HUBER_DELTA / e;
+  return 2 * BA_HUBER_DELTA * e - BA_HUBER_DELTA * BA_HUBER_DELTA;
+}
+
+ExtrinsicSolver::ExtrinsicSolver(
+  const std::vector<cv::Point3f>& board_points,
+  const std::vector<cv::Matx33d>& camera_matrices
+) :
+  board_points(board_points),
+  camera_matrices(camera_matrices),
+  cam_poses(camera_matrices.size(), rigid_pose{cv::Matx33d::eye(), cv::Vec3d(0, 0, 0)})
+{}
+
+void ExtrinsicSolver::add_observation(
+  int cam,
+  int board,
+  const std::vector<cv::Point2f>& corners,
+  const std::vector<int>& ids
+) {
+  bool valid = cam >= 0 && cam < (int)camera_matrices.size() && board >= 0
+    && corners.size() >= 4 && ids.size() == corners.size();
+  for (size_t i = 0; valid && i < ids.size(); i++)
+    valid = ids[i] >= 0 && ids[i] < (int)board_points.size();
+
+  if (!valid) {
+    char logstr[128];
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Invalid observation of board %d by camera %d with %zu corners",
+      board,
+      cam,
+      corners.size()
+    );
+    LOG(ERROR, logstr);
+    throw std::invalid_argument(logstr);
+  }
+
+  if (board >= (int)board_observations.size()) {
+    board_observations.resize(board + 1);
+    board_poses.resize(board + 1, rigid_pose{cv::Matx33d::eye(), cv::Vec3d(0, 0, 0)});
+  }
+
+  std::vector<cv::Point3f> points;
+  for (int id : ids)
+    points.push_back(board_points[id]);
+
+  board_observations[board].push_back((int)observations.size());
+  observations.push_back(observation{cam, board, corners, points, rigid_pose(), 0.0});
+}
+
+bool ExtrinsicSolver::initialize() {
+  /**
+   * Seeds every camera and board placement pose from solvePnP on each
+   * observation, chaining cameras along the spanning tree with the
+   * most shared placements
+   *
+   * Returns:
+   *   false if some camera never shares a placement with the rest
+   */
+  char logstr[128];
+  size_t cam_count = camera_matrices.size();
+
+  for (observation& obs : observations) {
+    cv::Mat rvec;
+    cv::Mat tvec;
+    cv::solvePnP(
+      obs.points,
+      obs.corners,
+      cv::Mat::eye(3, 3, CV_64F),
+      cv::Mat(),
+      rvec,
+      tvec,
+      false,
+      cv::SOLVEPNP_IPPE
+    );
+    obs.pnp.R = exp_so3(cv::Vec3d(rvec.at<double>(0), rvec.at<double>(1), rvec.at<double>(2)));
+    obs.pnp.t = cv::Vec3d(tvec.at<double>(0), tvec.at<double>(1), tvec.at<double>(2));
+
+    const cv::Matx33d& k = camera_matrices[obs.cam];
+    double sum = 0;
+    for (size_t i = 0; i < obs.points.size(); i++) {
+      const cv::Point3f& x = obs.points[i];
+      cv::Vec3d p = obs.pnp.R * cv::Vec3d(x.x, x.y, x.z) + obs.pnp.t;
+      double dx = k(0, 0) * (p[0] / p[2] - obs.corners[i].x);
+      double dy = k(1, 1) * (p[1] / p[2] - obs.corners[i].y);
+      sum += dx * dx + dy * dy;
+    }
+    obs.pnp_rms = std::sqrt(sum / obs.points.size());
+  }
+
+  // per camera pair, how many placements both saw and the best seen pair of views
+  struct edge {
+    int shared;
+    int a_obs;
+    int b_obs;
+    double score;
+  };
+  std::vector<std::vector<edge>> edges(cam_count, std::vector<edge>(cam_count, edge{0, -1, -1, 0}));
+  for (const std::vector<int>& seen : board_observations) {
+    for (int oa : seen) {
+      for (int ob : seen) {
+        const observation& a = observations[oa];
+        const observation& b = observations[ob];
+        if (a.cam == b.cam)
+          continue;
+
+        edge& e = edges[a.cam][b.cam];
+        double score = std::max(a.pnp_rms, b.pnp_rms);
+        if (e.shared == 0 || score < e.score) {
+          e.a_obs = oa;
+          e.b_obs = ob;
+          e.score = score;
+        }
+        e.shared++;
+      }
+    }
+  }
+
+  std::vector<bool> placed(cam_count, false);
+  placed[0] = true;
+  cam_poses[0] = rigid_pose{cv::Matx33d::eye(), cv::Vec3d(0, 0, 0)};
+
+  for (size_t n = 1; n < cam_count; n++) {
+    int from = -1;
+    int to = -1;
+    for (size_t a = 0; a < cam_count; a++) {
+      if (!placed[a])
+        continue;
+      for (size_t b = 0; b < cam_count; b++) {
+        if (placed[b] || edges[a][b].shared == 0)
+          continue;
+        if (from == -1 || edges[a][b].shared > edges[from][to].shared) {
+          from = (int)a;
+          to = (int)b;
+        }
+      }
+    }
+
+    if (from == -1) {
+      for (size_t c = 0; c < cam_count; c++) {
+        if (placed[c])
+          continue;
+        snprintf(
+          logstr,
+          sizeof(logstr),
+          "Camera %zu shares no board placement with camera 0's group",
+          c
+        );
+        LOG(ERROR, logstr);
+      }
+      return false;
+    }
+
+    // world to b is board to b, after a to board, after world to a
+    const edge& e = edges[from][to];
+    cam_poses[to] = compose(
+      observations[e.b_obs].pnp,
+      compose(inverse(observations[e.a_obs].pnp), cam_poses[from])
+    );
+    placed[to] = true;
+  }
+
+  for (size_t b = 0; b < board_observations.size(); b++) {
+    int best = -1;
+    for (int o : board_observations[b]) {
+      if (best == -1 || observations[o].pnp_rms < observations[best].pnp_rms)
+        best = o;
+    }
+    if (best == -1)
+      continue;
+
+    // board to world is camera to world after board to camera
+    board_poses[b] = compose(inverse(cam_poses[observations[best].cam]), observations[best].pnp);
+  }
+
+  return true;
+}
+
+double ExtrinsicSolver::evaluate(std::vector<double>* camera_rms, double* rms) {
+  /**
+   * Robust cost of the current poses, optionally with the plain pixel
+   * rms overall and per camera
+   */
+  double cost = 0;
+  double total = 0;
+  size_t corners = 0;
+  std::vector<double> cam_sum(camera_matrices.size(), 0.0);
+  std::vector<size_t> cam_corners(camera_matrices.size(), 0);
+
+  for (const observation& obs : observations) {
+    const rigid_pose& cam = cam_poses[obs.cam];
+    const rigid_pose& board = board_poses[obs.board];
+    const cv::Matx33d& k = camera_matrices[obs.cam];
+    rigid_pose to_cam = compose(cam, board);
+
+    for (size_t i = 0; i < obs.points.size(); i++) {
+      const cv::Point3f& x = obs.points[i];
+      cv::Vec3d p = to_cam.R * cv::Vec3d(x.x, x.y, x.z) + to_cam.t;
+      if (p[2] <= 1e-9)
+        continue;
+
+      double dx = k(0, 0) * (p[0] / p[2] - obs.corners[i].x);
+      double dy = k(1, 1) * (p[1] / p[2] - obs.corners[i].y);
+      double sq = dx * dx + dy * dy;
+      double weight;
+      cost += huber(std::sqrt(sq), &weight);
+
+      total += sq;
+      corners++;
+      cam_sum[obs.cam] += sq;
+      cam_corners[obs.cam]++;
+    }
+  }
+
+  if (rms != nullptr)
+    *rms = corners ? std::sqrt(total / corners) : 0.0;
+
+  if (camera_rms != nullptr) {
+    camera_rms->resize(camera_matrices.size());
+    for (size_t c = 0; c < camera_matrices.size(); c++)
+      (*camera_rms)[c] = cam_corners[c] ? std::sqrt(cam_sum[c] / cam_corners[c]) : 0.0;
+  }
+
+  return cost;
+}
+
+void ExtrinsicSolver::build(normal_equations& eq) {
+  /**
+   * Accumulates the Gauss-Newton normal equations in block form, with
+   * iteratively reweighted Huber weights. Camera poses and board
+   * placements are perturbed on the left, R <- exp(w) R and t <- t + d,
+   * so each corner's Jacobian is a 2x6 block per pose.
+   */
+  size_t cam_count = camera_matrices.size();
+  eq.cam_blocks.assign(cam_count, mat6::zeros());
+  eq.cam_grads.assign(cam_count, vec6::all(0));
+  eq.board_blocks.assign(board_poses.size(), mat6::zeros());
+  eq.board_grads.assign(board_poses.size(), vec6::all(0));
+  eq.cross_blocks.assign(observations.size(), mat6::zeros());
+  eq.cost = 0;
+
+  for (size_t o = 0; o < observations.size(); o++) {
+    const observation& obs = observations[o];
+    const rigid_pose& cam = cam_poses[obs.cam];
+    const rigid_pose& board = board_poses[obs.board];
+    const cv::Matx33d& k = camera_matrices[obs.cam];
+    double fx = k(0, 0);
+    double fy = k(1, 1);
+
+    mat6& jcc = eq.cam_blocks[obs.cam];
+    vec6& gc = eq.cam_grads[obs.cam];
+    mat6& jff = eq.board_blocks[obs.board];
+    vec6& gf = eq.board_grads[obs.board];
+    mat6& jcf = eq.cross_blocks[o];
+
+    for (size_t i = 0; i < obs.points.size(); i++) {
+      const cv::Point3f& x = obs.points[i];
+      cv::Vec3d rx = board.R * cv::Vec3d(x.x, x.y, x.z);
+      cv::Vec3d world = rx + board.t;
+      cv::Vec3d ry = cam.R * world;
+      cv::Vec3d p = ry + cam.t;
+      if (p[2] <= 1e-9)
+        continue;
+
+      double iz = 1.0 / p[2];
+      cv::Vec2d r(
+        fx * (p[0] * iz - obs.corners[i].x),
+        fy * (p[1] * iz - obs.corners[i].y)
+      );
+
+      double weight;
+      eq.cost += huber(std::sqrt(r.dot(r)), &weight);
+
+      cv::Matx23d dpi(
+        fx * iz, 0, -fx * p[0] * iz * iz,
+        0, fy * iz, -fy * p[1] * iz * iz
+      );
+      cv::Matx23d dc_rot = dpi * -skew(ry);
+      cv::Matx23d df_trans = dpi * cam.R;
+      cv::Matx23d df_rot = df_trans * -skew(rx);
+
+      cv::Matx<double, 2, 6> jc;
+      cv::Matx<double, 2, 6> jf;
+      for (int row = 0; row < 2; row++) {
+        for (int col = 0; col < 3; col++) {
+          jc(row, col) = dc_rot(row, col);
+          jc(row, col + 3) = dpi(row, col);
+          jf(row, col) = df_rot(row, col);
+          jf(row, col + 3) = df_trans(row, col);
+        }
+      }
+
+      cv::Matx<double, 6, 2> jct = jc.t() * weight;
+      cv::Matx<double, 6, 2> jft = jf.t() * weight;
+      jcc += jct * jc;
+      gc += jct * r;
+      jff += jft * jf;
+      gf += jft * r;
+      jcf += jct * jf;
+    }
+  }
+}
+
+bool ExtrinsicSolver::step(const normal_equations& eq, double lambda) {
+  /**
+   * Solves the damped normal equations and applies the update
+   *
+   * With H = [A B; B^T D] over (cameras, placements), D is block
+   * diagonal, so the placements are eliminated:
+   *
+   *   (A - B D^-1 B^T) dc = -gc + B D^-1 gf
+   *   df = D^-1 (-gf - B^T dc)
+   *
+   * Each placement only touches the blocks of the cameras that saw it,
+   * so forming the reduced system costs the sum over placements of
+   * their views squared. Camera 0 is the world frame and stays fixed.
+   *
+   * Returns:
+   *   false if the damped system isn't positive definite
+   */
+  size_t cam_count = camera_matrices.size();
+  int n = 6 * ((int)cam_count - 1);
+
+  auto damp = [lambda](mat6 m) {
+    for (int i = 0; i < 6; i++)
+      m(i, i) += lambda * m(i, i) + 1e-12;
+    return m;
+  };
+
+  std::vector<mat6> board_inv(board_poses.size());
+  for (size_t b = 0; b < board_poses.size(); b++) {
+    bool ok = false;
+    board_inv[b] = damp(eq.board_blocks[b]).inv(cv::DECOMP_CHOLESKY, &ok);
+    if (!ok)
+      return false;
+  }
+
+  cv::Mat cam_step = cv::Mat::zeros(std::max(n, 1), 1, CV_64F);
+  if (n > 0) {
+    cv::Mat reduced = cv::Mat::zeros(n, n, CV_64F);
+    cv::Mat rhs = cv::Mat::zeros(n, 1, CV_64F);
+
+    for (size_t c = 1; c < cam_count; c++) {
+      mat6 a = damp(eq.cam_blocks[c]);
+      int base = 6 * ((int)c - 1);
+      for (int i = 0; i < 6; i++) {
+        rhs.at<double>(base + i) -= eq.cam_grads[c][i];
+        for (int j = 0; j < 6; j++)
+          reduced.at<double>(base + i, base + j) += a(i, j);
+      }
+    }
+
+    for (size_t b = 0; b < board_poses.size(); b++) {
+      for (int o1 : board_observations[b]) {
+        int c1 = observations[o1].cam;
+        if (c1 == 0)
+          continue;
+
+        mat6 bd = eq.cross_blocks[o1] * board_inv[b];
+        vec6 bg = bd * eq.board_grads[b];
+        int base1 = 6 * (c1 - 1);
+        for (int i = 0; i < 6; i++)
+          rhs.at<double>(base1 + i) += bg[i];
+
+        for (int o2 : board_observations[b]) {
+          int c2 = observations[o2].cam;
+          if (c2 == 0)
+            continue;
+
+          mat6 fill = bd * eq.cross_blocks[o2].t();
+          int base2 = 6 * (c2 - 1);
+          for (int i = 0; i < 6; i++) {
+            for (int j = 0; j < 6; j++)
+              reduced.at<double>(base1 + i, base2 + j) -= fill(i, j);
+          }
+        }
+      }
+    }
+
+    if (!cv::solve(reduced, rhs, cam_step, cv::DECOMP_CHOLESKY))
+      return false;
+  }
+
+  auto cam_delta = [&](int c) {
+    vec6 d = vec6::all(0);
+    if (c == 0)
+      return d;
+    for (int i = 0; i < 6; i++)
+      d[i] = cam_step.at<double>(6 * (c - 1) + i);
+    return d;
+  };
+
+  for (size_t b = 0; b < board_poses.size(); b++) {
+    vec6 g = -eq.board_grads[b];
+    for (int o : board_observations[b])
+      g -= eq.cross_blocks[o].t() * cam_delta(observations[o].cam);
+
+    vec6 d = board_inv[b] * g;
+    board_poses[b].R = exp_so3(cv::Vec3d(d[0], d[1], d[2])) * board_poses[b].R;
+    board_poses[b].t += cv::Vec3d(d[3], d[4], d[5]);
+  }
+
+  for (size_t c = 1; c < cam_count; c++) {
+    vec6 d = cam_delta((int)c);
+    cam_poses[c].R = exp_so3(cv::Vec3d(d[0], d[1], d[2])) * cam_poses[c].R;
+    cam_poses[c].t += cv::Vec3d(d[3], d[4], d[5]);
+  }
+
+  return true;
+}
+
+ba_report ExtrinsicSolver::solve(int max_iterations) {
+  /**
+   * Levenberg-Marquardt from the current poses, call initialize first
+   *
+   * Parameters:
+   *   max_iterations: accepted steps to take at most
+   *
+   * Returns:
+   *   Reprojection rms before and after, overall and per camera
+   */
+  ba_report report;
+  uint64_t start = now_ns();
+  evaluate(nullptr, &report.initial_rms);
+
+  normal_equations eq;
+  double lambda = 1e-4;
+  report.iterations = 0;
+
+  while (report.iterations < max_iterations) {
+    build(eq);
+
+    std::vector<rigid_pose> saved_cams = cam_poses;
+    std::vector<rigid_pose> saved_boards = board_poses;
+    double cost = eq.cost;
+    bool improved = false;
+
+    while (lambda < 1e10) {
+      if (step(eq, lambda)) {
+        cost = evaluate(nullptr, nullptr);
+        if (cost < eq.cost) {
+          improved = true;
+          report.iterations++;
+          lambda = std::max(lambda * 0.1, 1e-9);
+          break;
+        }
+      }
+
+      cam_poses = saved_cams;
+      board_poses = saved_boards;
+      lambda *= 10;
+    }
+
+    if (!improved || eq.cost - cost < 1e-9 * eq.cost)
+      break;
+  }
+
+  evaluate(&report.camera_rms, &report.final_rms);
+  report.solve_ns = now_ns() - start;
+  return report;
+}
@@ -0,0 +1,232 @@
+#include <csignal>
+#include <errno.h>
+#include <iostream>
+#include <memory>
+#include <opencv2/calib3d.hpp>
+#include <opencv2/core.hpp>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+#include "calibration_io.h"
+#include "charuco_detector.h"
+#include "chessboard_detector.h"
+#include "extrinsic_solver.h"
+#include "logging.h"
+#include "stream_controller.h"
+
+#define LOG_PATH "/var/log/mocap-toolkit/extrinsic_calibration.log"
+
+#define FRAME_WIDTH 1280
+#define FRAME_HEIGHT 720
+#define NUM_CAMERAS 3
+#define BOARD_COLS 9 // inner corners
+#define BOARD_ROWS 6
+#define SQUARE_SIZE 25.0f // mm
+#define BOARD_CHARUCO true // false for the plain chessboard in assets/chessboard_pattern.png, print with lens_calibration --board
+                          // the board constants must match lens_calibration's
+#define MARKER_RATIO 0.75f // ChArUco marker side over square side
+#define MARKER_DICTIONARY cv::aruco::DICT_5X5_100
+#define MIN_SHARED_VIEWS 2 // cameras that must see a placement for it to be kept
+#define KEEP_INTERVAL 250000000ULL // ns between kept placements, so they aren't near copies
+#define MAX_PLACEMENTS 400
+
+static volatile sig_atomic_t running = 1;
+
+static void shutdown_handler(int signum) {
+  (void)signum;
+  running = 0;
+}
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int main() {
+  int ret = 0;
+  char logstr[128];
+
+  ret = setup_logging(LOG_PATH);
+  if (ret) {
+    std::cout << "Error opening log file: " << strerror(errno) << "\n";
+    return -errno;
+  }
+
+  // lens calibration has to have run for every camera, which are matched by id once streaming
+  std::vector<camera_calibration> saved = load_calibration(CALIBRATION_PATH);
+  if (saved.empty()) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "No cameras in %s, run lens calibration first",
+      CALIBRATION_PATH
+    );
+    LOG(ERROR, logstr);
+    cleanup_logging();
+    return -EINVAL;
+  }
+  std::vector<camera_calibration> calib;
+
+  // no SA_RESTART, so a blocked acquire_frameset returns and the loop sees running
+  struct sigaction sa = {};
+  sa.sa_handler = shutdown_handler;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, nullptr);
+  sigaction(SIGTERM, &sa, nullptr);
+
+  cv::Size board_size(BOARD_COLS, BOARD_ROWS);
+  std::vector<cv::Point3f> board_points;
+  for (int row = 0; row < BOARD_ROWS; row++) {
+    for (int col = 0; col < BOARD_COLS; col++)
+      board_points.emplace_back(col * SQUARE_SIZE, row * SQUARE_SIZE, 0.0f);
+  }
+
+  std::unique_ptr<ExtrinsicSolver> solver; // built once the camera ids pick the intrinsics
+  std::vector<uint8_t> ids;
+
+  {
+    StreamController stream_ctlr = StreamController(
+      FRAME_WIDTH,
+      FRAME_HEIGHT,
+      NUM_CAMERAS
+    );
+
+    std::unique_ptr<BoardDetector> detector;
+    if (BOARD_CHARUCO)
+      detector = std::make_unique<CharucoBoardDetector>(board_size, MARKER_RATIO, MARKER_DICTIONARY, NUM_CAMERAS);
+    else
+      detector = std::make_unique<ChessboardDetector>(board_size, NUM_CAMERAS);
+    std::vector<board_detection> detections(NUM_CAMERAS);
+    std::vector<cv::Point2f> normalized;
+    uint64_t last_kept = 0;
+    int placements = 0;
+
+    while (running && placements < MAX_PLACEMENTS) {
+      FramesetLease lease = stream_ctlr.acquire_frameset();
+      if (!lease) {
+        if (!stream_ctlr.server_alive())
+          break;
+        continue;
+      }
+
+      detector->detect_frameset(lease.frames(), detections.data());
+      lease.release();
+
+      // camera ids are only known once the server has published, matching
+      // intrinsics by id keeps each camera's own through a reordered cams.yaml
+      if (!solver) {
+        for (size_t i = 0; i < NUM_CAMERAS; i++)
+          ids.push_back(stream_ctlr.camera_id(i));
+        calib = order_calibration(saved, ids);
+
+        std::vector<cv::Matx33d> camera_matrices;
+        for (size_t i = 0; i < NUM_CAMERAS; i++) {
+          if (calib[i].camera_matrix.empty()) {
+            snprintf(
+              logstr,
+              sizeof(logstr),
+              "Camera %zu (id %u) has no intrinsics in %s, run lens calibration",
+              i,
+              ids[i],
+              CALIBRATION_PATH
+            );
+            LOG(ERROR, logstr);
+            cleanup_logging();
+            return -EINVAL;
+          }
+          camera_matrices.push_back(cv::Matx33d((double*)calib[i].camera_matrix.ptr<double>()));
+        }
+        solver = std::make_unique<ExtrinsicSolver>(board_points, camera_matrices);
+      }
+
+      int found = 0;
+      for (const board_detection& detection : detections)
+        found += detection.found;
+      if (found < MIN_SHARED_VIEWS || now_ns() - last_kept < KEEP_INTERVAL)
+        continue;
+
+      for (size_t i = 0; i < NUM_CAMERAS; i++) {
+        if (!detections[i].found)
+          continue;
+
+        cv::undistortPoints(
+          detections[i].corners,
+          normalized,
+          calib[i].camera_matrix,
+          calib[i].dist_coeffs
+        );
+        solver->add_observation(i, placements, normalized, detections[i].ids);
+      }
+
+      placements++;
+      last_kept = now_ns();
+      snprintf(
+        logstr,
+        sizeof(logstr),
+        "Kept placement %d, seen by %d cameras",
+        placements,
+        found
+      );
+      LOG(DEBUG, logstr);
+    }
+  }
+
+  if (!solver) {
+    LOG(WARNING, "No framesets received, leaving the stored calibration as it was");
+    cleanup_logging();
+    return 0;
+  }
+
+  snprintf(
+    logstr,
+    sizeof(logstr),
+    "Solving %zu placements, %zu observations",
+    solver->num_boards(),
+    solver->num_observations()
+  );
+  LOG(INFO, logstr);
+
+  if (solver->num_boards() == 0 || !solver->initialize()) {
+    LOG(ERROR, "Not enough shared placements to connect every camera");
+    cleanup_logging();
+    return -EINVAL;
+  }
+
+  ba_report report = solver->solve();
+  snprintf(
+    logstr,
+    sizeof(logstr),
+    "Bundle adjustment: %d iterations, rms %.3f -> %.3f px, %.2f ms",
+    report.iterations,
+    report.initial_rms,
+    report.final_rms,
+    report.solve_ns / 1e6
+  );
+  LOG(INFO, logstr);
+
+  const std::vector<rigid_pose>& poses = solver->camera_poses();
+  for (size_t i = 0; i < NUM_CAMERAS; i++) {
+    cv::Mat rvec;
+    cv::Rodrigues(cv::Mat(poses[i].R), rvec);
+    calib[i].rvec = rvec;
+    calib[i].tvec = cv::Mat(poses[i].t).clone();
+
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Camera %zu: t (%.1f, %.1f, %.1f) mm, rms %.3f px",
+      i,
+      poses[i].t[0],
+      poses[i].t[1],
+      poses[i].t[2],
+      report.camera_rms[i]
+    );
+    LOG(INFO, logstr);
+  }
+  save_calibration(CALIBRATION_PATH, calib);
+
+  cleanup_logging();
+  return 0;
+}
@@ -0,0 +1,104 @@
+#ifndef INTRINSIC_CALIBRATOR_H
+#define INTRINSIC_CALIBRATOR_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <opencv2/core.hpp>
+#include <thread>
+#include <vector>
+
+#define COVERAGE_COLS 8
+#define COVERAGE_ROWS 6
+#define TILT_BINS 3          // per axis, tilted one way, roughly facing, tilted the other
+#define VIEWS_PER_TILT_BIN 3 // a tilt bin keeps accepting views until it holds this many
+#define MIN_NEW_CELLS 2      // otherwise a view must reach this many uncovered cells
+#define MIN_VIEW_DISTANCE 0.03 // mean corner shift from every kept view, in image diagonals
+#define MIN_VIEW_CORNERS 6 // fewer corners of a partly seen board aren't worth a view
+#define MIN_CALIB_VIEWS 5
+#define MAX_CALIB_VIEWS 60
+
+struct intrinsics {
+  cv::Mat camera_matrix;
+  cv::Mat dist_coeffs;
+  double rms;          // over the views it was solved from, in pixels
+  size_t views;
+  uint64_t calib_ns;
+  uint64_t generation; // bumped by every solve, 0 until the first one
+};
+
+// a detected board, corners with their ids among the board's inner corners
+struct board_view {
+  std::vector<cv::Point2f> corners;
+  std::vector<int> ids;
+};
+
+struct view_verdict {
+  bool accepted;
+  int new_cells;
+  int tilt_bin;
+  double reproj_rms; // of this view against the latest intrinsics, -1 before the first solve
+};
+
+class IntrinsicCalibrator {
+  /**
+   * Coverage driven view selection and background calibration for one
+   * camera
+   *
+   * Every detected board is offered, whole or partly in view, but
+   * only views that add coverage are kept: each camera's image is split into a COVERAGE_COLS x
+   * COVERAGE_ROWS grid and boards are binned by how they're tilted
+   * about either axis. A view is kept if it lands on enough uncovered
+   * cells or fills out an underused tilt bin, and isn't a near copy of
+   * one already kept, so holding the board still adds nothing and the
+   * view set (and calibrateCamera's cost) stays bounded.
+   *
+   * Whenever the view set changes a worker thread re-solves, seeded
+   * with the previous solution, while detection carries on. Every
+   * offered view is also scored against the latest intrinsics, which
+   * gives a live reprojection error for boards that weren't kept.
+   */
+public:
+  IntrinsicCalibrator(cv::Size image_size, cv::Size board_size, float square_size);
+  ~IntrinsicCalibrator();
+
+  view_verdict offer(const std::vector<cv::Point2f>& corners, const std::vector<int>& ids);
+  intrinsics result();
+  void finish(); // waits until every kept view has been solved with, see result
+
+  size_t views() const { return kept_views.size(); }
+  double coverage() const; // fraction of grid cells covered
+  int tilt_bins_used() const;
+
+  IntrinsicCalibrator(const IntrinsicCalibrator&) = delete;
+  IntrinsicCalibrator& operator=(const IntrinsicCalibrator&) = delete;
+
+private:
+  cv::Size image_size;
+  cv::Size board_size;
+  std::vector<cv::Point3f> board_points;
+
+  // owned by the caller's thread, only offer touches these
+  std::vector<board_view> kept_views;
+  uint32_t cell_hits[COVERAGE_ROWS][COVERAGE_COLS];
+  uint32_t tilt_hits[TILT_BINS * TILT_BINS];
+
+  std::thread worker;
+  std::mutex lock;
+  std::condition_variable changed;
+  std::condition_variable idle;          // the worker has nothing left to solve
+  std::vector<board_view> pending_views; // the view set to solve next
+  bool dirty;
+  bool solving;
+  bool stop;
+  intrinsics latest;
+
+  int tilt_bin(const board_view& view);
+  bool near_kept_view(const board_view& view);
+  double reprojection_rms(const board_view& view, const intrinsics& calib);
+  void view_points(const board_view& view, std::vector<cv::Point3f>& points) const;
+  void worker_fn();
+};
+
+#endif // INTRINSIC_CALIBRATOR_H
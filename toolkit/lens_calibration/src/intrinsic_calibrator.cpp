@@ -0,0 +1,334 @@
+#include <algorithm>
+#include <cmath>
+#include <opencv2/calib3d.hpp>
+#include <opencv2/core.hpp>
+#include <string.h>
+#include <time.h>
+
+#include "intrinsic_calibrator.h"
+#include "logging.h"
+
+#define TILT_THRESHOLD 0.1 // log ratio of opposite board edges, about 10% foreshortening
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double distance(const cv::Point2f& a, const cv::Point2f& b) {
+  return std::hypot(a.x - b.x, a.y - b.y);
+}
+
+IntrinsicCalibrator::IntrinsicCalibrator(
+  cv::Size image_size,
+  cv::Size board_size,
+  float square_size
+) :
+  image_size(image_size),
+  board_size(board_size),
+  dirty(false),
+  solving(false),
+  stop(false),
+  latest{cv::Mat(), cv::Mat(), 0.0, 0, 0, 0}
+{
+  for (int row = 0; row < board_size.height; row++) {
+    for (int col = 0; col < board_size.width; col++)
+      board_points.emplace_back(col * square_size, row * square_size, 0.0f);
+  }
+
+  memset(cell_hits, 0, sizeof(cell_hits));
+  memset(tilt_hits, 0, sizeof(tilt_hits));
+
+  worker = std::thread(&IntrinsicCalibrator::worker_fn, this);
+}
+
+IntrinsicCalibrator::~IntrinsicCalibrator() {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stop = true;
+  }
+  changed.notify_one();
+  worker.join();
+}
+
+view_verdict IntrinsicCalibrator::offer(const std::vector<cv::Point2f>& corners, const std::vector<int>& ids) {
+  /**
+   * Scores a detected board and keeps it if it adds coverage
+   *
+   * Parameters:
+   *   corners: the inner corners found, as detected
+   *   ids:     each corner's index among the board's inner corners, row by row
+   *
+   * Returns:
+   *   Whether the view was kept, what it would have added, and its
+   *   reprojection error against the latest intrinsics
+   */
+  view_verdict verdict = {false, 0, -1, -1.0};
+  if (corners.size() < MIN_VIEW_CORNERS || ids.size() != corners.size())
+    return verdict;
+  for (int id : ids) {
+    if (id < 0 || id >= (int)board_points.size())
+      return verdict;
+  }
+
+  board_view view = {corners, ids};
+  verdict.tilt_bin = tilt_bin(view);
+
+  intrinsics calib = result();
+  if (calib.generation)
+    verdict.reproj_rms = reprojection_rms(view, calib);
+
+  if (kept_views.size() >= MAX_CALIB_VIEWS || near_kept_view(view))
+    return verdict;
+
+  bool touched[COVERAGE_ROWS][COVERAGE_COLS] = {};
+  for (const cv::Point2f& p : corners) {
+    int col = std::clamp((int)(p.x * COVERAGE_COLS / image_size.width), 0, COVERAGE_COLS - 1);
+    int row = std::clamp((int)(p.y * COVERAGE_ROWS / image_size.height), 0, COVERAGE_ROWS - 1);
+    if (touched[row][col])
+      continue;
+    touched[row][col] = true;
+    if (cell_hits[row][col] == 0)
+      verdict.new_cells++;
+  }
+
+  if (verdict.new_cells < MIN_NEW_CELLS && tilt_hits[verdict.tilt_bin] >= VIEWS_PER_TILT_BIN)
+    return verdict;
+
+  for (int row = 0; row < COVERAGE_ROWS; row++) {
+    for (int col = 0; col < COVERAGE_COLS; col++)
+      cell_hits[row][col] += touched[row][col];
+  }
+  tilt_hits[verdict.tilt_bin]++;
+  kept_views.push_back(view);
+  verdict.accepted = true;
+
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    pending_views = kept_views;
+    dirty = true;
+  }
+  changed.notify_one();
+
+  return verdict;
+}
+
+intrinsics IntrinsicCalibrator::result() {
+  // the worker replaces latest's Mats rather than writing into them, so sharing them is safe
+  std::lock_guard<std::mutex> guard(lock);
+  return latest;
+}
+
+void IntrinsicCalibrator::finish() {
+  /**
+   * Blocks until the worker has solved with the latest view set, so
+   * result is final rather than whatever solve last happened to
+   * finish. Views kept during the wait are solved with too.
+   */
+  std::unique_lock<std::mutex> guard(lock);
+  idle.wait(guard, [&]() { return !dirty && !solving; });
+}
+
+double IntrinsicCalibrator::coverage() const {
+  int covered = 0;
+  for (int row = 0; row < COVERAGE_ROWS; row++) {
+    for (int col = 0; col < COVERAGE_COLS; col++)
+      covered += cell_hits[row][col] > 0;
+  }
+  return (double)covered / (COVERAGE_ROWS * COVERAGE_COLS);
+}
+
+int IntrinsicCalibrator::tilt_bins_used() const {
+  int used = 0;
+  for (int i = 0; i < TILT_BINS * TILT_BINS; i++)
+    used += tilt_hits[i] > 0;
+  return used;
+}
+
+int IntrinsicCalibrator::tilt_bin(const board_view& view) {
+  /**
+   * Bins the board's tilt about each image axis from its outer
+   * corners. Under perspective the edge nearer the camera is longer,
+   * so the log ratio of opposite edges is negative when tilted one
+   * way, positive the other, and near zero facing the camera.
+   *
+   * A partial view may not show the outer corners, so they are
+   * mapped through the board to image homography of the corners
+   * that are.
+   */
+  int cols = board_size.width;
+  int rows = board_size.height;
+
+  std::vector<cv::Point2f> grid;
+  for (int id : view.ids)
+    grid.emplace_back((float)(id % cols), (float)(id / cols));
+
+  cv::Mat homography = cv::findHomography(grid, view.corners);
+  if (homography.empty())
+    return (TILT_BINS * TILT_BINS) / 2; // facing, the bin every view can fill
+
+  std::vector<cv::Point2f> outer = {
+    cv::Point2f(0, 0),
+    cv::Point2f(cols - 1, 0),
+    cv::Point2f(0, rows - 1),
+    cv::Point2f(cols - 1, rows - 1)
+  };
+  cv::perspectiveTransform(outer, outer, homography);
+  const cv::Point2f& tl = outer[0];
+  const cv::Point2f& tr = outer[1];
+  const cv::Point2f& bl = outer[2];
+  const cv::Point2f& br = outer[3];
+
+  double yaw = std::log(distance(tl, bl) / std::max(distance(tr, br), 1e-6));
+  double pitch = std::log(distance(tl, tr) / std::max(distance(bl, br), 1e-6));
+
+  auto bin = [](double ratio) {
+    return ratio < -TILT_THRESHOLD ? 0 : ratio > TILT_THRESHOLD ? 2 : 1;
+  };
+  return bin(pitch) * TILT_BINS + bin(yaw);
+}
+
+bool IntrinsicCalibrator::near_kept_view(const board_view& view) {
+  /**
+   * Whether a kept view has most of the same corners in about the
+   * same places. Views of different parts of the board share few
+   * corners, so they never count as near.
+   */
+  double diagonal = std::hypot(image_size.width, image_size.height);
+  std::vector<int> position(board_points.size(), -1);
+
+  for (const board_view& kept : kept_views) {
+    for (size_t i = 0; i < kept.ids.size(); i++)
+      position[kept.ids[i]] = (int)i;
+
+    size_t shared = 0;
+    double total = 0;
+    for (size_t i = 0; i < view.ids.size(); i++) {
+      int k = position[view.ids[i]];
+      if (k == -1)
+        continue;
+      shared++;
+      total += distance(view.corners[i], kept.corners[k]);
+    }
+
+    for (int id : kept.ids)
+      position[id] = -1;
+
+    if (2 * shared >= view.ids.size() && total < MIN_VIEW_DISTANCE * diagonal * shared)
+      return true;
+  }
+
+  return false;
+}
+
+double IntrinsicCalibrator::reprojection_rms(const board_view& view, const intrinsics& calib) {
+  std::vector<cv::Point3f> points;
+  view_points(view, points);
+
+  cv::Mat rvec;
+  cv::Mat tvec;
+  if (!cv::solvePnP(points, view.corners, calib.camera_matrix, calib.dist_coeffs, rvec, tvec))
+    return -1.0;
+
+  std::vector<cv::Point2f> projected;
+  cv::projectPoints(points, rvec, tvec, calib.camera_matrix, calib.dist_coeffs, projected);
+
+  double sum = 0;
+  for (size_t i = 0; i < view.corners.size(); i++) {
+    double d = distance(view.corners[i], projected[i]);
+    sum += d * d;
+  }
+  return std::sqrt(sum / view.corners.size());
+}
+
+void IntrinsicCalibrator::view_points(const board_view& view, std::vector<cv::Point3f>& points) const {
+  // the board points of a view's corners, in the same order
+  points.clear();
+  for (int id : view.ids)
+    points.push_back(board_points[id]);
+}
+
+void IntrinsicCalibrator::worker_fn() {
+  /**
+   * Re-solves whenever offer changes the view set. Views kept while a
+   * solve runs are picked up together by the next one, and each solve
+   * starts from the previous solution, so later ones converge in a
+   * few iterations.
+   */
+  char logstr[128];
+
+  while (true) {
+    std::vector<board_view> views;
+    cv::Mat camera_matrix;
+    cv::Mat dist_coeffs;
+    uint64_t generation;
+
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      solving = false;
+      idle.notify_all();
+
+      changed.wait(guard, [&]() { return stop || dirty; });
+      if (stop)
+        return;
+
+      dirty = false;
+      solving = true;
+      views.swap(pending_views);
+      generation = latest.generation;
+      if (generation) {
+        camera_matrix = latest.camera_matrix.clone();
+        dist_coeffs = latest.dist_coeffs.clone();
+      }
+    }
+
+    if (views.size() < MIN_CALIB_VIEWS)
+      continue;
+
+    std::vector<std::vector<cv::Point2f>> image_points(views.size());
+    std::vector<std::vector<cv::Point3f>> object_points(views.size());
+    for (size_t i = 0; i < views.size(); i++) {
+      image_points[i] = views[i].corners;
+      view_points(views[i], object_points[i]);
+    }
+    std::vector<cv::Mat> rvecs;
+    std::vector<cv::Mat> tvecs;
+
+    uint64_t start = now_ns();
+    double rms;
+    try {
+      rms = cv::calibrateCamera(
+        object_points,
+        image_points,
+        image_size,
+        camera_matrix,
+        dist_coeffs,
+        rvecs,
+        tvecs,
+        generation ? cv::CALIB_USE_INTRINSIC_GUESS : 0
+      );
+    } catch (const cv::Exception& e) {
+      snprintf(
+        logstr,
+        sizeof(logstr),
+        "Calibration with %zu views failed: %s",
+        image_points.size(),
+        e.what()
+      );
+      LOG(WARNING, logstr);
+      continue;
+    }
+    uint64_t calib_ns = now_ns() - start;
+
+    std::lock_guard<std::mutex> guard(lock);
+    latest = intrinsics{
+      camera_matrix,
+      dist_coeffs,
+      rms,
+      image_points.size(),
+      calib_ns,
+      latest.generation + 1
+    };
+  }
+}
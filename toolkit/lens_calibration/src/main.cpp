@@ -1,40 +1,263 @@
+#include <algorithm>
+#include <csignal>
 #include <errno.h>
 #include <iostream>
+#include <memory>
 #include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <string.h>
+#include <time.h>
+#include <vector>
 
+#include "calibration_io.h"
+#include "charuco_detector.h"
+#include "chessboard_detector.h"
+#include "intrinsic_calibrator.h"
 #include "logging.h"
 #include "stream_controller.h"
 
 #define LOG_PATH "/var/log/mocap-toolkit/lens_calibration.log"
 
-int main() {
+#define FRAME_WIDTH 1280
+#define FRAME_HEIGHT 720
+#define NUM_CAMERAS 3
+#define BOARD_COLS 9 // inner corners
+#define BOARD_ROWS 6
+#define SQUARE_SIZE 25.0f // mm
+#define BOARD_CHARUCO true // false for the plain chessboard in assets/chessboard_pattern.png, see write_board
+#define MARKER_RATIO 0.75f // ChArUco marker side over square side
+#define MARKER_DICTIONARY cv::aruco::DICT_5X5_100
+#define STATUS_INTERVAL 2000000000ULL // ns between calibration status logs
+
+static volatile sig_atomic_t running = 1;
+
+static void shutdown_handler(int signum) {
+  (void)signum;
+  running = 0;
+}
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int write_board(const char* path) {
+  /**
+   * Writes the ChArUco board both calibration tools look for, drawn
+   * from the constants above, so the printed board always matches the
+   * build. Print it without scaling to fit, then measure a square and
+   * set SQUARE_SIZE in both tools to it.
+   */
+  cv::Mat board = charuco_board_image(cv::Size(BOARD_COLS, BOARD_ROWS), MARKER_RATIO, MARKER_DICTIONARY);
+  if (!cv::imwrite(path, board)) {
+    std::cout << "Error writing board image " << path << "\n";
+    return -EIO;
+  }
+
+  std::cout << "Wrote a " << BOARD_COLS + 1 << "x" << BOARD_ROWS + 1 << " square ChArUco board to " << path << "\n";
+  return 0;
+}
+
+int main(int argc, char* argv[]) {
   int ret = 0;
   char logstr[128];
 
+  // lens_calibration --board board.png writes the board to print instead of calibrating
+  if (argc == 3 && strcmp(argv[1], "--board") == 0)
+    return write_board(argv[2]);
+
   ret = setup_logging(LOG_PATH);
   if (ret) {
     std::cout << "Error opening log file: " << strerror(errno) << "\n";
     return -errno;
   }
 
+  // no SA_RESTART, so a blocked acquire_frameset returns and the loop sees running
+  struct sigaction sa = {};
+  sa.sa_handler = shutdown_handler;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, nullptr);
+  sigaction(SIGTERM, &sa, nullptr);
+
   StreamController stream_ctlr = StreamController(
-    1280,
-    720,
-    3
+    FRAME_WIDTH,
+    FRAME_HEIGHT,
+    NUM_CAMERAS
   );
 
-  cv::Mat frames[3];
-  uint64_t timestamp;
-  uint32_t counter = 0;
-  while(counter++ < 10) {
-    stream_ctlr.recv_frameset(frames, &timestamp);
+  std::unique_ptr<BoardDetector> detector;
+  if (BOARD_CHARUCO) {
+    detector = std::make_unique<CharucoBoardDetector>(
+      cv::Size(BOARD_COLS, BOARD_ROWS),
+      MARKER_RATIO,
+      MARKER_DICTIONARY,
+      NUM_CAMERAS
+    );
+  } else {
+    detector = std::make_unique<ChessboardDetector>(cv::Size(BOARD_COLS, BOARD_ROWS), NUM_CAMERAS);
+  }
+  std::vector<board_detection> detections(NUM_CAMERAS);
+
+  std::vector<std::unique_ptr<IntrinsicCalibrator>> calibrators;
+  for (size_t i = 0; i < NUM_CAMERAS; i++) {
+    calibrators.push_back(std::make_unique<IntrinsicCalibrator>(
+      cv::Size(FRAME_WIDTH, FRAME_HEIGHT),
+      cv::Size(BOARD_COLS, BOARD_ROWS),
+      SQUARE_SIZE
+    ));
+  }
+  std::vector<double> live_rms(NUM_CAMERAS, -1.0);
+  uint64_t last_status = now_ns();
+  bool received = false;
+
+  while (running) {
+    // detection reads the leased frames in place, the slot is only held until it's done
+    FramesetLease lease = stream_ctlr.acquire_frameset();
+    if (!lease) {
+      if (!stream_ctlr.server_alive())
+        break;
+      continue;
+    }
+
+    uint64_t start = now_ns();
+    detector->detect_frameset(lease.frames(), detections.data());
+    uint64_t timestamp = lease.timestamp();
+    lease.release();
+    received = true;
+
+    int found = 0;
+    for (const board_detection& detection : detections)
+      found += detection.found;
+
     snprintf(
       logstr,
       sizeof(logstr),
-      "Received frameset with timestamp %lu",
-      timestamp
+      "Frameset %lu: board in %d of %d cameras, %.2f ms",
+      timestamp,
+      found,
+      NUM_CAMERAS,
+      (now_ns() - start) / 1e6
     );
     LOG(DEBUG, logstr);
+
+    for (size_t i = 0; i < NUM_CAMERAS; i++) {
+      if (!detections[i].found)
+        continue;
+
+      view_verdict verdict = calibrators[i]->offer(detections[i].corners, detections[i].ids);
+      live_rms[i] = verdict.reproj_rms;
+      if (!verdict.accepted)
+        continue;
+
+      snprintf(
+        logstr,
+        sizeof(logstr),
+        "Camera %zu: kept view %zu, %d new cells, tilt bin %d",
+        i,
+        calibrators[i]->views(),
+        verdict.new_cells,
+        verdict.tilt_bin
+      );
+      LOG(DEBUG, logstr);
+    }
+
+    if (now_ns() - last_status < STATUS_INTERVAL)
+      continue;
+    last_status = now_ns();
+
+    for (size_t i = 0; i < NUM_CAMERAS; i++) {
+      intrinsics calib = calibrators[i]->result();
+      snprintf(
+        logstr,
+        sizeof(logstr),
+        "Camera %zu: %zu views, %.0f%% coverage, %d/%d tilts, rms %.3f px (%zu views), live %.3f px",
+        i,
+        calibrators[i]->views(),
+        calibrators[i]->coverage() * 100,
+        calibrators[i]->tilt_bins_used(),
+        TILT_BINS * TILT_BINS,
+        calib.rms,
+        calib.views,
+        live_rms[i]
+      );
+      LOG(INFO, logstr);
+    }
+  }
+
+  // camera ids are only known once the server has published
+  if (!received) {
+    LOG(WARNING, "No framesets received, leaving the stored calibration as it was");
+    cleanup_logging();
+    return 0;
+  }
+
+  std::vector<uint8_t> ids(NUM_CAMERAS);
+  for (size_t i = 0; i < NUM_CAMERAS; i++)
+    ids[i] = stream_ctlr.camera_id(i);
+
+  // cameras that weren't calibrated this run keep what was stored before
+  std::vector<camera_calibration> stored = order_calibration(load_calibration(CALIBRATION_PATH), ids);
+
+  for (size_t i = 0; i < NUM_CAMERAS; i++) {
+    calibrators[i]->finish(); // the last views kept may still be solving
+    intrinsics calib = calibrators[i]->result();
+    if (calib.generation == 0) {
+      snprintf(
+        logstr,
+        sizeof(logstr),
+        "Camera %zu: not calibrated, %zu of %d views",
+        i,
+        calibrators[i]->views(),
+        MIN_CALIB_VIEWS
+      );
+      LOG(WARNING, logstr);
+      continue;
+    }
+
+    const cv::Mat& k = calib.camera_matrix;
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Camera %zu: fx %.2f fy %.2f cx %.2f cy %.2f, rms %.3f px over %zu views",
+      i,
+      k.at<double>(0, 0),
+      k.at<double>(1, 1),
+      k.at<double>(0, 2),
+      k.at<double>(1, 2),
+      calib.rms,
+      calib.views
+    );
+    LOG(INFO, logstr);
+
+    // new intrinsics invalidate the camera's pose
+    stored[i] = camera_calibration{
+      ids[i],
+      cv::Size(FRAME_WIDTH, FRAME_HEIGHT),
+      calib.camera_matrix,
+      calib.dist_coeffs,
+      calib.rms,
+      cv::Mat(),
+      cv::Mat()
+    };
+  }
+  save_calibration(CALIBRATION_PATH, stored);
+
+  for (size_t i = 0; i < NUM_CAMERAS; i++) {
+    const detector_stats& stats = detector->stats(i);
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Camera %zu: %lu frames, %lu coarse hits, %lu found (%lu refined), %.1f corners, %.2f ms avg",
+      i,
+      stats.frames,
+      stats.coarse_hits,
+      stats.found,
+      stats.fallbacks,
+      stats.found ? (double)stats.corners / stats.found : 0.0,
+      stats.frames ? stats.detect_ns / 1e6 / stats.frames : 0.0
+    );
+    LOG(INFO, logstr);
   }
 
   cleanup_logging();
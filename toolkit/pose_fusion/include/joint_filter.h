@@ -0,0 +1,44 @@
+#ifndef JOINT_FILTER_H
+#define JOINT_FILTER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+struct one_euro_params {
+  float min_cutoff = 1.5f;   // Hz, smoothing of a joint at rest
+  float beta = 0.004f;       // Hz per mm/s, how fast the cutoff opens with speed
+  float d_cutoff = 1.0f;     // Hz, smoothing of the speed estimate
+  uint64_t reset_ns = 250000000ULL; // a joint unseen this long restarts from its next sample
+};
+
+class JointFilter {
+  /**
+   * One Euro filter over every axis of every joint
+   *
+   * The cutoff rises with each axis' filtered speed, so a joint at
+   * rest is smoothed hard (triangulation jitter disappears) while a
+   * fast moving one is barely delayed. dt comes from the frameset
+   * timestamps rather than arrival times, so the scheduling jitter of
+   * the fusion loop doesn't leak into the output.
+   *
+   * A joint that wasn't triangulated (NaN) stays NaN and keeps its
+   * state, so a one frame dropout resumes smoothly, and one missing
+   * for longer than reset_ns starts over instead of being dragged in
+   * from where it was last seen.
+   */
+public:
+  JointFilter(size_t num_joints, one_euro_params params = one_euro_params());
+
+  // filters each joint's x, y and z in place
+  void filter(uint64_t timestamp, float* x, float* y, float* z);
+
+private:
+  one_euro_params params;
+  size_t num_joints;
+  std::vector<float> value; // 3 per joint
+  std::vector<float> speed;
+  std::vector<uint64_t> last_seen; // 0 until the joint's first sample
+};
+
+#endif // JOINT_FILTER_H
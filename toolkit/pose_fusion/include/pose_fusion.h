@@ -0,0 +1,119 @@
+#ifndef POSE_FUSION_H
+#define POSE_FUSION_H
+
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <opencv2/core.hpp>
+#include <vector>
+
+#include "calibration_io.h"
+#include "joint_filter.h"
+#include "pose_channels.h"
+#include "triangulation.h"
+
+#define FUSION_PENDING 8              // framesets assembling at once
+#define FUSION_WAIT_NS 30000000ULL    // longest a frameset waits for missing views after its first
+#define FUSION_IDLE_NS 100000000ULL   // longest a wait lasts, so the loop sees running
+#define FUSION_REPORT_INTERVAL 5000000000ULL // ns between stats logs
+
+// aggregate over one report interval
+struct fusion_stats {
+  uint64_t window_start_ns;
+  uint64_t fused;
+  uint64_t partial; // fused without every camera's view
+  uint64_t dropped; // fewer than min_views ever arrived
+  uint64_t late;    // views for a frameset older than one already published
+  uint64_t latency_sum_ns; // capture to pose published
+  uint64_t latency_max_ns;
+  uint64_t detect_sum_ns;  // capture to the last view used arriving
+  uint64_t detect_max_ns;
+  uint64_t solve_sum_ns;   // undistortion, triangulation and filtering
+  uint64_t solve_max_ns;
+};
+
+class PoseFusion {
+  /**
+   * Fuses detector processes' 2D joints into filtered 3D poses
+   *
+   * Views are gathered per frameset timestamp as they arrive from the
+   * keypoint ring. A frameset is fused as soon as nothing more can
+   * change it: every camera has reported it, every camera has moved
+   * past it (detectors work in order, so a camera that skipped it
+   * never will), a newer frameset is already complete, or it has
+   * waited FUSION_WAIT_NS since its first view. It is then
+   * triangulated from however many views it has (at least min_views,
+   * otherwise dropped), filtered and published to the pose ring, so
+   * output is always in timestamp order and a slow or dead detector
+   * costs at most FUSION_WAIT_NS of latency rather than stalling.
+   *
+   * calib has one entry per streaming camera, in the frameset server's
+   * frame order, which is the keypoint ring's camera order.
+   *
+   * Keypoints are in pixels of the frames the detectors received. Raw
+   * frames' keypoints are undistorted with each camera's calibration
+   * before triangulation. Cameras the server already undistorts (set
+   * in undistorted, from the frameset shm's camera flags) are
+   * triangulated through the calibration's undistorted_matrix with no
+   * distortion instead, so their keypoints are not undistorted a
+   * second time.
+   */
+public:
+  PoseFusion(
+    const std::vector<camera_calibration>& calib,
+    const std::vector<bool>& undistorted,
+    uint32_t num_joints,
+    triangulation_params tri_params = triangulation_params(),
+    one_euro_params filter_params = one_euro_params()
+  );
+
+  // fuses until running is cleared
+  void run(const volatile sig_atomic_t& running);
+
+private:
+  struct pending_frameset {
+    bool used;
+    uint64_t timestamp;
+    uint64_t first_ns;    // CLOCK_MONOTONIC when its first view arrived
+    uint64_t detected_ns; // CLOCK_REALTIME when its latest view was published
+    uint32_t views;       // bit per camera reported
+    std::vector<float> x; // camera major, num_joints per camera
+    std::vector<float> y;
+    std::vector<float> conf;
+  };
+
+  size_t num_cameras;
+  uint32_t num_joints;
+  uint32_t all_views;
+  int min_views;
+  uint32_t undistorted_views; // bit per camera whose keypoints need no undistortion
+  std::vector<cv::Mat> camera_matrices; // undistorted_matrix for those cameras
+  std::vector<cv::Mat> dist_coeffs;     // empty for those cameras
+  Triangulator triangulator;
+  JointFilter filter;
+  KeypointReceiver receiver;
+  PosePublisher publisher;
+
+  std::vector<pending_frameset> pending;
+  std::vector<uint64_t> newest; // latest timestamp each camera has reported
+  uint64_t last_published;
+  fusion_stats stats;
+
+  // scratch, sized once
+  std::vector<float> entry_x;
+  std::vector<float> entry_y;
+  std::vector<float> entry_conf;
+  std::vector<cv::Point2f> distorted;
+  std::vector<cv::Point2f> undistorted;
+  points_3d points;
+
+  void ingest(uint64_t now);
+  void store(uint32_t cam, uint64_t timestamp, uint64_t produced_ns, uint64_t now);
+  pending_frameset* oldest();
+  bool ready(const pending_frameset& set, uint64_t now) const;
+  void finish(pending_frameset& set);
+  void fuse(pending_frameset& set);
+  void report(uint64_t now);
+};
+
+#endif // POSE_FUSION_H
@@ -0,0 +1,58 @@
+#include <cmath>
+
+#include "joint_filter.h"
+
+static float smoothing(float cutoff, float dt) {
+  // exponential smoothing factor of a first order low pass at cutoff Hz
+  float tau = 1.0f / (2.0f * (float)M_PI * cutoff);
+  return 1.0f / (1.0f + tau / dt);
+}
+
+JointFilter::JointFilter(size_t num_joints, one_euro_params params) :
+  params(params),
+  num_joints(num_joints),
+  value(num_joints * 3, 0.0f),
+  speed(num_joints * 3, 0.0f),
+  last_seen(num_joints, 0)
+{}
+
+void JointFilter::filter(uint64_t timestamp, float* x, float* y, float* z) {
+  float* axes[3] = {x, y, z};
+  float a_speed = 0.0f;
+  float last_dt = -1.0f;
+
+  for (size_t j = 0; j < num_joints; j++) {
+    if (std::isnan(x[j]) || std::isnan(y[j]) || std::isnan(z[j]))
+      continue;
+
+    bool fresh = last_seen[j] == 0
+      || timestamp <= last_seen[j]
+      || timestamp - last_seen[j] > params.reset_ns;
+
+    if (fresh) {
+      for (int a = 0; a < 3; a++) {
+        value[j * 3 + a] = axes[a][j];
+        speed[j * 3 + a] = 0.0f;
+      }
+      last_seen[j] = timestamp;
+      continue;
+    }
+
+    float dt = (timestamp - last_seen[j]) / 1e9f;
+    if (dt != last_dt) { // almost always the frame interval, computed once
+      a_speed = smoothing(params.d_cutoff, dt);
+      last_dt = dt;
+    }
+
+    for (int a = 0; a < 3; a++) {
+      size_t i = j * 3 + a;
+      float raw = axes[a][j];
+      speed[i] += a_speed * ((raw - value[i]) / dt - speed[i]);
+
+      float cutoff = params.min_cutoff + params.beta * std::fabs(speed[i]);
+      value[i] += smoothing(cutoff, dt) * (raw - value[i]);
+      axes[a][j] = value[i];
+    }
+    last_seen[j] = timestamp;
+  }
+}
@@ -0,0 +1,109 @@
+#include <csignal>
+#include <errno.h>
+#include <iostream>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#include "calibration_io.h"
+#include "logging.h"
+#include "pose_fusion.h"
+#include "stream_controller.h"
+
+#define LOG_PATH "/var/log/mocap-toolkit/pose_fusion.log"
+
+#define NUM_JOINTS 59 // 17 body joints and 21 per hand, in the detectors' order
+#define MIN_VIEWS 2
+#define OUTLIER_PX 12.0f // views further than this from the others' consensus are ignored
+#define SERVER_POLL_INTERVAL std::chrono::milliseconds(200) // how often to look for the frameset server at startup
+
+static volatile sig_atomic_t running = 1;
+
+static void shutdown_handler(int signum) {
+  (void)signum;
+  running = 0;
+}
+
+int main() {
+  int ret = 0;
+  char logstr[128];
+
+  ret = setup_logging(LOG_PATH);
+  if (ret) {
+    std::cout << "Error opening log file: " << strerror(errno) << "\n";
+    return -errno;
+  }
+
+  std::vector<camera_calibration> saved = load_calibration(CALIBRATION_PATH);
+  if (saved.empty()) {
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "No cameras in %s, run lens and extrinsic calibration first",
+      CALIBRATION_PATH
+    );
+    LOG(ERROR, logstr);
+    cleanup_logging();
+    return -EINVAL;
+  }
+
+  // no SA_RESTART, so a blocked wait for keypoints returns and the loop sees running
+  struct sigaction sa = {};
+  sa.sa_handler = shutdown_handler;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, nullptr);
+  sigaction(SIGTERM, &sa, nullptr);
+
+  // detectors publish keypoints per camera in the server's frame order
+  LOG(INFO, "Waiting for the frameset server's cameras");
+  frameset_cameras cams;
+  while (running && !read_frameset_cameras(&cams))
+    std::this_thread::sleep_for(SERVER_POLL_INTERVAL);
+
+  if (!running) {
+    cleanup_logging();
+    return 0;
+  }
+
+  std::vector<camera_calibration> calib = order_calibration(saved, cams.ids);
+  calib.resize(cams.ids.size());
+  for (const camera_calibration& cam : calib) {
+    if (cam.camera_matrix.empty() || cam.rvec.empty()) {
+      snprintf(
+        logstr,
+        sizeof(logstr),
+        "Camera id %d has no %s calibration in %s, it is needed for fusion",
+        cam.id,
+        cam.camera_matrix.empty() ? "lens" : "extrinsic",
+        CALIBRATION_PATH
+      );
+      LOG(ERROR, logstr);
+      cleanup_logging();
+      return -EINVAL;
+    }
+  }
+
+  triangulation_params tri_params;
+  tri_params.min_views = MIN_VIEWS;
+  tri_params.reject_outliers = true;
+  tri_params.inlier_px = OUTLIER_PX;
+
+  {
+    PoseFusion fusion(calib, cams.undistorted, NUM_JOINTS, tri_params);
+
+    snprintf(
+      logstr,
+      sizeof(logstr),
+      "Fusing %d joints from %zu cameras, triangulation kernels: %s",
+      NUM_JOINTS,
+      calib.size(),
+      triangulation_kernel_isa()
+    );
+    LOG(INFO, logstr);
+
+    fusion.run(running);
+  }
+
+  cleanup_logging();
+  return 0;
+}
@@ -0,0 +1,320 @@
+#include <algorithm>
+#include <opencv2/calib3d.hpp>
+#include <stdexcept>
+#include <time.h>
+
+#include "logging.h"
+#include "pose_fusion.h"
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t realtime_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t since(uint64_t later, uint64_t earlier) {
+  // the cameras' timestamps and this host's realtime clock can disagree slightly
+  return later > earlier ? later - earlier : 0;
+}
+
+static std::vector<cv::Mat> fusion_matrices(
+  const std::vector<camera_calibration>& calib,
+  const std::vector<bool>& undistorted
+) {
+  std::vector<cv::Mat> matrices;
+  for (size_t i = 0; i < calib.size(); i++) {
+    if (calib[i].camera_matrix.empty() || calib[i].rvec.empty()) {
+      char logstr[128];
+      snprintf(
+        logstr,
+        sizeof(logstr),
+        "Camera id %d (position %zu) needs lens and extrinsic calibration for fusion",
+        calib[i].id,
+        i
+      );
+      LOG(ERROR, logstr);
+      throw std::invalid_argument(logstr);
+    }
+
+    // the server's undistorted frames are in pixels of undistorted_matrix, with no distortion left
+    if (i < undistorted.size() && undistorted[i])
+      matrices.push_back(undistorted_matrix(calib[i]));
+    else
+      matrices.push_back(calib[i].camera_matrix);
+  }
+  return matrices;
+}
+
+static std::vector<cv::Mat> fusion_dists(
+  const std::vector<camera_calibration>& calib,
+  const std::vector<bool>& undistorted
+) {
+  std::vector<cv::Mat> dists;
+  for (size_t i = 0; i < calib.size(); i++)
+    dists.push_back(i < undistorted.size() && undistorted[i] ? cv::Mat() : calib[i].dist_coeffs);
+  return dists;
+}
+
+static uint32_t view_mask(const std::vector<bool>& cams) {
+  uint32_t mask = 0;
+  for (size_t i = 0; i < cams.size() && i < 32; i++)
+    mask |= (uint32_t)cams[i] << i;
+  return mask;
+}
+
+static std::vector<cv::Matx34d> fusion_projections(
+  const std::vector<camera_calibration>& calib,
+  const std::vector<cv::Mat>& matrices
+) {
+  std::vector<cv::Matx34d> projections;
+  for (size_t i = 0; i < calib.size(); i++)
+    projections.push_back(projection_matrix(matrices[i], calib[i].rvec, calib[i].tvec));
+  return projections;
+}
+
+PoseFusion::PoseFusion(
+  const std::vector<camera_calibration>& calib,
+  const std::vector<bool>& undistorted,
+  uint32_t num_joints,
+  triangulation_params tri_params,
+  one_euro_params filter_params
+) :
+  num_cameras(calib.size()),
+  num_joints(num_joints),
+  all_views(calib.size() >= 32 ? 0xffffffffu : (1u << calib.size()) - 1),
+  min_views(tri_params.min_views),
+  undistorted_views(view_mask(undistorted)),
+  camera_matrices(fusion_matrices(calib, undistorted)),
+  dist_coeffs(fusion_dists(calib, undistorted)),
+  triangulator(fusion_projections(calib, camera_matrices), tri_params),
+  filter(num_joints, filter_params),
+  receiver(calib.size(), num_joints),
+  publisher(num_joints),
+  pending(FUSION_PENDING),
+  newest(calib.size(), 0),
+  last_published(0),
+  stats(),
+  entry_x(num_joints),
+  entry_y(num_joints),
+  entry_conf(num_joints),
+  distorted(num_joints),
+  undistorted(num_joints)
+{
+  for (pending_frameset& set : pending) {
+    set.used = false;
+    set.x.resize(num_cameras * num_joints);
+    set.y.resize(num_cameras * num_joints);
+    set.conf.resize(num_cameras * num_joints);
+  }
+
+  stats.window_start_ns = now_ns();
+}
+
+void PoseFusion::run(const volatile sig_atomic_t& running) {
+  while (running) {
+    // sleep until the next view arrives or the oldest frameset stops waiting for one
+    uint64_t wake = now_ns() + FUSION_IDLE_NS;
+    for (const pending_frameset& set : pending) {
+      if (set.used)
+        wake = std::min<uint64_t>(wake, set.first_ns + FUSION_WAIT_NS);
+    }
+
+    struct timespec deadline;
+    deadline.tv_sec = wake / 1000000000ULL;
+    deadline.tv_nsec = wake % 1000000000ULL;
+    receiver.wait(deadline);
+
+    uint64_t now = now_ns();
+    ingest(now);
+
+    for (pending_frameset* set = oldest(); set != nullptr && ready(*set, now); set = oldest())
+      finish(*set);
+
+    if (now - stats.window_start_ns >= FUSION_REPORT_INTERVAL)
+      report(now);
+  }
+}
+
+void PoseFusion::ingest(uint64_t now) {
+  for (uint32_t cam = 0; cam < num_cameras; cam++) {
+    uint64_t timestamp;
+    uint64_t produced_ns;
+    while (receiver.read(cam, &timestamp, &produced_ns, entry_x.data(), entry_y.data(), entry_conf.data()))
+      store(cam, timestamp, produced_ns, now);
+  }
+}
+
+void PoseFusion::store(uint32_t cam, uint64_t timestamp, uint64_t produced_ns, uint64_t now) {
+  newest[cam] = std::max(newest[cam], timestamp);
+
+  if (timestamp <= last_published) {
+    stats.late++;
+    return;
+  }
+
+  pending_frameset* set = nullptr;
+  for (pending_frameset& candidate : pending) {
+    if (candidate.used && candidate.timestamp == timestamp)
+      set = &candidate;
+  }
+
+  if (set == nullptr) {
+    for (pending_frameset& candidate : pending) {
+      if (!candidate.used)
+        set = &candidate;
+    }
+
+    if (set == nullptr) { // every slot is assembling, the oldest goes out with what it has
+      set = oldest();
+      finish(*set);
+      if (timestamp <= last_published) {
+        stats.late++;
+        return;
+      }
+    }
+
+    set->used = true;
+    set->timestamp = timestamp;
+    set->first_ns = now;
+    set->detected_ns = 0;
+    set->views = 0;
+    std::fill(set->conf.begin(), set->conf.end(), 0.0f);
+  }
+
+  size_t base = (size_t)cam * num_joints;
+  std::copy(entry_x.begin(), entry_x.end(), set->x.begin() + base);
+  std::copy(entry_y.begin(), entry_y.end(), set->y.begin() + base);
+  std::copy(entry_conf.begin(), entry_conf.end(), set->conf.begin() + base);
+  set->views |= 1u << cam;
+  set->detected_ns = std::max(set->detected_ns, produced_ns);
+}
+
+PoseFusion::pending_frameset* PoseFusion::oldest() {
+  pending_frameset* found = nullptr;
+  for (pending_frameset& set : pending) {
+    if (set.used && (found == nullptr || set.timestamp < found->timestamp))
+      found = &set;
+  }
+  return found;
+}
+
+bool PoseFusion::ready(const pending_frameset& set, uint64_t now) const {
+  if (set.views == all_views || now - set.first_ns >= FUSION_WAIT_NS)
+    return true;
+
+  bool passed = true;
+  for (size_t cam = 0; cam < num_cameras; cam++)
+    passed = passed && newest[cam] >= set.timestamp;
+  if (passed)
+    return true;
+
+  // output stays in timestamp order, so a complete newer frameset releases this one
+  for (const pending_frameset& other : pending) {
+    if (other.used && other.views == all_views && other.timestamp > set.timestamp)
+      return true;
+  }
+  return false;
+}
+
+void PoseFusion::finish(pending_frameset& set) {
+  if (__builtin_popcount(set.views) >= min_views)
+    fuse(set);
+  else
+    stats.dropped++;
+
+  last_published = std::max(last_published, set.timestamp);
+  set.used = false;
+}
+
+void PoseFusion::fuse(pending_frameset& set) {
+  uint64_t start = now_ns();
+
+  for (uint32_t cam = 0; cam < num_cameras; cam++) {
+    if (!(set.views & (1u << cam)) || (undistorted_views & (1u << cam)))
+      continue;
+
+    size_t base = (size_t)cam * num_joints;
+    for (uint32_t j = 0; j < num_joints; j++)
+      distorted[j] = cv::Point2f(set.x[base + j], set.y[base + j]);
+
+    // back to pixels of the same camera matrix, which the projections use
+    cv::undistortPoints(
+      distorted,
+      undistorted,
+      camera_matrices[cam],
+      dist_coeffs[cam],
+      cv::Mat(),
+      camera_matrices[cam]
+    );
+
+    for (uint32_t j = 0; j < num_joints; j++) {
+      set.x[base + j] = undistorted[j].x;
+      set.y[base + j] = undistorted[j].y;
+    }
+  }
+
+  keypoints_2d keypoints = {set.x.data(), set.y.data(), set.conf.data(), num_joints};
+  triangulator.triangulate(keypoints, points);
+  filter.filter(set.timestamp, points.x.data(), points.y.data(), points.z.data());
+  uint64_t solve_ns = now_ns() - start;
+
+  publisher.publish(
+    set.timestamp,
+    set.detected_ns,
+    points.x.data(),
+    points.y.data(),
+    points.z.data(),
+    points.error.data(),
+    points.views.data()
+  );
+
+  uint64_t latency_ns = since(realtime_ns(), set.timestamp);
+  uint64_t detect_ns = since(set.detected_ns, set.timestamp);
+  stats.fused++;
+  stats.partial += set.views != all_views;
+  stats.latency_sum_ns += latency_ns;
+  stats.latency_max_ns = std::max(stats.latency_max_ns, latency_ns);
+  stats.detect_sum_ns += detect_ns;
+  stats.detect_max_ns = std::max(stats.detect_max_ns, detect_ns);
+  stats.solve_sum_ns += solve_ns;
+  stats.solve_max_ns = std::max(stats.solve_max_ns, solve_ns);
+}
+
+void PoseFusion::report(uint64_t now) {
+  char logstr[128];
+  double fused = stats.fused > 0 ? (double)stats.fused : 1.0;
+
+  snprintf(
+    logstr,
+    sizeof(logstr),
+    "Fused %lu poses (%lu partial, %lu dropped, %lu late), %lu views overwritten unread in total",
+    stats.fused,
+    stats.partial,
+    stats.dropped,
+    stats.late,
+    receiver.skipped()
+  );
+  LOG(INFO, logstr);
+
+  snprintf(
+    logstr,
+    sizeof(logstr),
+    "Latency avg/max ms: capture to pose %.1f/%.1f, to detection %.1f/%.1f, fusion %.2f/%.2f",
+    stats.latency_sum_ns / fused / 1e6,
+    stats.latency_max_ns / 1e6,
+    stats.detect_sum_ns / fused / 1e6,
+    stats.detect_max_ns / 1e6,
+    stats.solve_sum_ns / fused / 1e6,
+    stats.solve_max_ns / 1e6
+  );
+  LOG(INFO, logstr);
+
+  stats = fusion_stats();
+  stats.window_start_ns = now;
+}